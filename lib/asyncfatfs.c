@@ -33,12 +33,29 @@
     #define ONLY_EXPOSE_FOR_TESTING static
 #endif
 
+// The size of the sector cache used by afatfs_init() (afatfs_initWithConfig() lets you choose the size at runtime)
 #define AFATFS_NUM_CACHE_SECTORS 8
 
+/*
+ * The largest and smallest cache that afatfs_initWithConfig() will accept. Every open file might hold a lock on the
+ * sector at its cursor and retain the sector that holds its directory entry, and we need room left over to access the
+ * FAT and one other sector. (The cache used by afatfs_init() only has to be no larger than the maximum, since
+ * applications that keep few files busy at once get by with less.)
+ */
+#define AFATFS_MAX_CACHE_SECTORS 128
+#define AFATFS_MIN_CACHE_SECTORS(maxOpenFiles) (2 * (maxOpenFiles) + 2)
+
+/*
+ * The number of buckets in the hash table that we use to find cached sectors by their sector index. Must be a power
+ * of two. Smaller caches only use as many buckets as they have sectors.
+ */
+#define AFATFS_CACHE_HASH_BUCKETS AFATFS_MAX_CACHE_SECTORS
+
 // FAT filesystems are allowed to differ from these parameters, but we choose not to support those weird filesystems:
 #define AFATFS_SECTOR_SIZE  512
-#define AFATFS_NUM_FATS     2
+#define AFATFS_MAX_NUM_FATS 2
 
+// The number of files that can be open at once when initialised with afatfs_init()
 #define AFATFS_MAX_OPEN_FILES 3
 
 #define AFATFS_DEFAULT_FILE_DATE FAT_MAKE_DATE(2015, 12, 01)
@@ -50,11 +67,87 @@
  */
 #define AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT 4
 
+/*
+ * Define AFATFS_MIN_MULTIPLE_BLOCK_READ_COUNT to the number of blocks (e.g. 2) that we must read in a row before we
+ * bother using the SDcard's multiple block read method. This needs your driver to provide sdcard_beginReadBlocks() and
+ * sdcard_endReadBlocks(), so it's left undefined by default, which disables multi-block read.
+ */
+
+/*
+ * For files opened for reading, how many of the sectors following the cursor should we try to read into the cache in
+ * advance of fread() asking for them? If this define is omitted, this disables read-ahead.
+ */
+#define AFATFS_FILE_READ_AHEAD_SECTORS 4
+
+/*
+ * Define AFATFS_USE_CACHE_CLASSES to sort the sectors in the cache into the classes of afatfsCacheClass_e, count the
+ * hits and misses of each class, and allow some sectors of each class to be reserved with afatfs_setCacheReserve().
+ */
+
+/*
+ * Count what the filesystem does (flushes, multi-block transfers, allocations, short writes and card latencies) in RAM
+ * for afatfs_getStats(). Remove this define to save the memory.
+ */
+#define AFATFS_USE_STATS
+
+/*
+ * How many runs of physically consecutive clusters should each file remember from walking its cluster chain? Later
+ * seeks into those parts of the file can then jump straight to the right cluster without reading the FAT. If this
+ * define is omitted, this disables the extent cache.
+ */
+#define AFATFS_FILE_EXTENT_CACHE_SIZE 4
+
+#define AFATFS_FAT_MIRROR_NONE     0
+#define AFATFS_FAT_MIRROR_LOCKSTEP 1
+#define AFATFS_FAT_MIRROR_DEFERRED 2
+
+/*
+ * How should we keep the second copy of the FAT up to date on volumes that have two FATs?
+ *
+ * AFATFS_FAT_MIRROR_NONE     - Only the first FAT is ever written, the second copy is left stale.
+ * AFATFS_FAT_MIRROR_LOCKSTEP - Every sector written to the first FAT is written to the second FAT at the same time.
+ * AFATFS_FAT_MIRROR_DEFERRED - Only the first FAT is written while files are being written. The regions that changed
+ *                              are copied to the second FAT in one sequential pass after afatfs_fclose(), and before
+ *                              afatfs_destroy() completes.
+ */
+#ifndef AFATFS_FAT_MIRROR_POLICY
+#define AFATFS_FAT_MIRROR_POLICY AFATFS_FAT_MIRROR_NONE
+#endif
+
+#if AFATFS_FAT_MIRROR_POLICY == AFATFS_FAT_MIRROR_DEFERRED
+/*
+ * The first FAT is divided into this many groups of sectors for the purpose of remembering which parts need to be
+ * copied to the second FAT. Must be a multiple of 8.
+ */
+#define AFATFS_FAT_MIRROR_DIRTY_GROUPS 64
+#endif
+
+/*
+ * Define AFATFS_FAT16_ONLY or AFATFS_FAT32_ONLY if your app only needs to mount one type of volume. The FAT code's
+ * checks of the volume type are then settled at compile time, and volumes of the other type fail to mount with
+ * AFATFS_ERROR_BAD_FILESYSTEM_HEADER.
+ */
+#if defined(AFATFS_FAT16_ONLY) && defined(AFATFS_FAT32_ONLY)
+    #error "Define at most one of AFATFS_FAT16_ONLY and AFATFS_FAT32_ONLY"
+#endif
+
 #define AFATFS_FILES_PER_DIRECTORY_SECTOR (AFATFS_SECTOR_SIZE / sizeof(fatDirectoryEntry_t))
 
 #define AFATFS_FAT32_FAT_ENTRIES_PER_SECTOR  (AFATFS_SECTOR_SIZE / sizeof(uint32_t))
 #define AFATFS_FAT16_FAT_ENTRIES_PER_SECTOR (AFATFS_SECTOR_SIZE / sizeof(uint16_t))
 
+// FAT sectors are scanned for free entries in words of this type (see afatfs_fatSectorFindEntry())
+#define AFATFS_FAT_WORDS_PER_SECTOR (AFATFS_SECTOR_SIZE / sizeof(uint64_t))
+
+// A one in the lowest and highest bits of every entry in a word of four FAT16 entries
+#define AFATFS_FAT16_WORD_LANE_LOW_BITS  0x0001000100010001ULL
+#define AFATFS_FAT16_WORD_LANE_HIGH_BITS 0x8000800080008000ULL
+
+// The same for a word of two FAT32 entries, whose top four bits are not part of the cluster number
+#define AFATFS_FAT32_WORD_LANE_LOW_BITS  0x0000000100000001ULL
+#define AFATFS_FAT32_WORD_LANE_HIGH_BITS 0x0800000008000000ULL
+#define AFATFS_FAT32_WORD_CLUSTER_MASK   0x0FFFFFFF0FFFFFFFULL
+
 // We will read from the file
 #define AFATFS_FILE_MODE_READ             1
 // We will write to the file
@@ -67,6 +160,8 @@
 #define AFATFS_FILE_MODE_CREATE           16
 // The file's directory entry should be locked in cache so we can read it with no latency:
 #define AFATFS_FILE_MODE_RETAIN_DIRECTORY 32
+// The file is being read straight from the card using afatfs_fgetExtents(), so don't read ahead into the cache:
+#define AFATFS_FILE_MODE_DIRECT_READ      64
 
 // Open the cache sector for read access (it will be read from disk)
 #define AFATFS_CACHE_READ         1
@@ -78,6 +173,10 @@
 #define AFATFS_CACHE_DISCARDABLE  8
 // Increase the retain counter of the cache sector to prevent it from being discarded when in the in-sync state
 #define AFATFS_CACHE_RETAIN       16
+// Only cache the sector if it can be stored in an empty or discardable cache entry (nothing else will be evicted)
+#define AFATFS_CACHE_READ_AHEAD   32
+// The sector holds the contents of a regular file, so it may be flushed out of order along with its neighbours
+#define AFATFS_CACHE_FILE_DATA    64
 
 // Turn the largest free block on the disk into one contiguous file for efficient fragment-free allocation
 #define AFATFS_USE_FREEFILE
@@ -88,11 +187,152 @@
 // Filename in 8.3 format:
 #define AFATFS_FREESPACE_FILENAME "FREESPAC.E"
 
+// The most FAT sectors that the search for the freefile's free space will examine during one call to afatfs_poll()
+#define AFATFS_FREE_SPACE_SEARCH_SECTORS_PER_POLL 32
+
+/*
+ * The most FAT sectors that freeing the cluster chain of a truncated or deleted file will sweep through during one call
+ * to afatfs_poll(), so that deleting a large fragmented file doesn't hold up the rest of the poll.
+ */
+#define AFATFS_FREE_CHAIN_SECTORS_PER_POLL 8
+
+/*
+ * Define AFATFS_USE_SDCARD_ERASE to ask the card to erase the sectors of long runs of clusters that are freed by
+ * truncating or deleting a file, using sdcard_eraseBlocks(). The card can then get the erase out of the way in the
+ * background before the space is reused, which makes the writes that reuse it faster.
+ */
+#ifdef AFATFS_USE_SDCARD_ERASE
+// Runs of freed sectors shorter than this aren't worth sending an erase command for
+#ifndef AFATFS_MIN_ERASE_BLOCK_COUNT
+#define AFATFS_MIN_ERASE_BLOCK_COUNT 64
+#endif
+#endif
+
+/*
+ * If your card driver can accept several sector writes before the earlier ones have completed (e.g. SDIO with DMA, see
+ * sdcard_writeBlock() in sdcard.h), define AFATFS_SDCARD_WRITE_QUEUE_DEPTH to the number of writes it can hold, so that
+ * afatfs_flush() keeps that many cache sectors in flight instead of waiting for the next poll to send each one.
+ */
+#ifndef AFATFS_SDCARD_WRITE_QUEUE_DEPTH
+#define AFATFS_SDCARD_WRITE_QUEUE_DEPTH 1
+#endif
+
+/*
+ * Many cards program their flash in pages of several sectors (typically 4KB), so writing one sector of a page on its
+ * own costs the card a read-modify-write of the whole page. Define AFATFS_CARD_PAGE_SECTORS to the card's page size in
+ * sectors to hold back the dirty file data sectors of a page while a file is still writing into that page, so that the
+ * page reaches the card in a single multi-block write once the file moves on. Pages are aligned to the card's sector
+ * addresses, which on a properly formatted card are also cluster boundaries.
+ *
+ * Sectors stop being held back as soon as the cache runs out of room for a new sector, so give the cache a few more
+ * sectors than a page for each file you write at once.
+ */
+#if defined(AFATFS_CARD_PAGE_SECTORS) && !defined(AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT)
+    #error "AFATFS_CARD_PAGE_SECTORS needs AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT to write the pages as one"
+#endif
+
+/*
+ * Define AFATFS_BACKGROUND_FREEFILE_SEARCH to let the filesystem become ready before the search for the freefile's
+ * free space has finished. The search then continues during afatfs_poll(), files can be opened in the regular modes
+ * right away, and opening a file in the contiguous "as" mode waits until the freefile has been allocated.
+ */
+
+/*
+ * Define AFATFS_FREEFILE_REGROWTH to look for a better home for the freefile during afatfs_poll() after the clusters of
+ * a regular (or non-adjacent contiguous) file have been freed. If the largest hole on the volume directly follows the
+ * freefile, the freefile is extended into it, or if the hole is larger than what remains of the freefile, the freefile
+ * is moved there. The search examines at most AFATFS_FREE_SPACE_SEARCH_SECTORS_PER_POLL FAT sectors per poll, and
+ * contiguous files can keep taking superclusters from the freefile until the search has finished.
+ */
+
+/*
+ * Define AFATFS_USE_JOURNAL to record each supercluster append and each truncation of a contiguous file in a journal
+ * (the first sector of a hidden file next to the freefile) before any of the FAT or directory sectors it changes can
+ * reach the card. A record is dropped once the operation has finished and those sectors have been flushed, so after a
+ * power cut the next mount only has to redo the few operations still in the journal to make the FAT chains, the
+ * freefile and the files' directory entries agree again, rather than leaving them inconsistent.
+ */
+#ifdef AFATFS_USE_JOURNAL
+#ifndef AFATFS_USE_FREEFILE
+    #error "AFATFS_USE_JOURNAL requires AFATFS_USE_FREEFILE"
+#endif
+
+#define AFATFS_JOURNAL_FILENAME "ASYNCFAT.JNL"
+#define AFATFS_JOURNAL_MAGIC 0x4C4E4A41 // "AJNL"
+#endif
+
 #define AFATFS_INTROSPEC_LOG_FILENAME "ASYNCFAT.LOG"
 
+/*
+ * Define AFATFS_USE_LOG_STREAM to provide afatfs_logStreamOpen(), which lets interrupt handlers (or another core) push
+ * log records into a lock-free ring buffer that afatfs_poll() drains into a file a sector at a time.
+ */
+#ifdef AFATFS_USE_LOG_STREAM
+// Make sure that the ring buffer's contents and its head/tail counters are seen in the right order by the other side
+#define AFATFS_LOG_STREAM_MEMORY_BARRIER() __sync_synchronize()
+#endif
+
+/*
+ * Remember which groups of FAT sectors are known to contain no free clusters, so that searches for free clusters can
+ * skip them without reading them from the card. The FAT is divided into this many groups (must be a multiple of 8).
+ * Remove this define to disable the summary.
+ */
+#define AFATFS_FREE_SPACE_SUMMARY_GROUPS 1024
+
+/*
+ * Define AFATFS_DIRECTORY_SUMMARY_SIZE to summarise the names of the files in the current directory in a Bloom filter
+ * of this many bytes (e.g. 256), along with the position of its first free entry, and keep it up to date as files are
+ * created and deleted. Once a scan of the directory has reached its end, fopen() and mkdir() of a file which doesn't
+ * exist yet can go straight to the first free entry instead of scanning the whole directory. Allow two or more bits of
+ * filter per file in the directory. This is left undefined by default to save the memory.
+ */
+
+/*
+ * Define AFATFS_USE_FSINFO to read the free cluster count and next free cluster hint from the FSInfo sector during init
+ * on FAT32, and keep them up to date on disk. While the FAT is being modified the count on disk is marked as unknown,
+ * and the real count is written back by afatfs_destroy(). This is left undefined by default, which leaves the FSInfo
+ * sector untouched.
+ */
+
+/*
+ * Define AFATFS_FAST_MOUNT to trust the FSInfo free cluster count of a volume that was cleanly unmounted when
+ * searching for space for the freefile during init. Then the search can finish as soon as it has found a gap which
+ * holds every free cluster, and is skipped entirely when there are too few free clusters to make a useful freefile.
+ *
+ * Note that other operating systems don't mark the count as unknown while they use the volume, so after an unclean
+ * shutdown on those systems the freefile can end up smaller than it could have been.
+ */
+#if defined(AFATFS_FAST_MOUNT) && !defined(AFATFS_USE_FSINFO)
+    #error "AFATFS_FAST_MOUNT requires AFATFS_USE_FSINFO"
+#endif
+
+#if defined(AFATFS_FREEFILE_REGROWTH) && !defined(AFATFS_USE_FREEFILE)
+    #error "AFATFS_FREEFILE_REGROWTH requires AFATFS_USE_FREEFILE"
+#endif
+
+// Either of these lets the search for the freefile's free space run while regular files are being written
+#if defined(AFATFS_BACKGROUND_FREEFILE_SEARCH) || defined(AFATFS_FREEFILE_REGROWTH)
+    #define AFATFS_FREE_SPACE_SEARCH_WHILE_READY
+#endif
+
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+#if (AFATFS_CACHE_HASH_BUCKETS & (AFATFS_CACHE_HASH_BUCKETS - 1)) != 0
+    #error "AFATFS_CACHE_HASH_BUCKETS must be a power of two"
+#endif
+
+#if AFATFS_NUM_CACHE_SECTORS > AFATFS_MAX_CACHE_SECTORS
+    #error "AFATFS_NUM_CACHE_SECTORS is larger than AFATFS_MAX_CACHE_SECTORS"
+#endif
+
+// The index of an entry in the cache, or -1 for none
+#if AFATFS_MAX_CACHE_SECTORS > 128
+typedef int16_t afatfsCacheIndex_t;
+#else
+typedef int8_t afatfsCacheIndex_t;
+#endif
+
 typedef enum {
     AFATFS_SAVE_DIRECTORY_NORMAL,
     AFATFS_SAVE_DIRECTORY_FOR_CLOSE,
@@ -107,6 +347,24 @@ typedef enum {
     AFATFS_CACHE_STATE_DIRTY
 } afatfsCacheBlockState_e;
 
+/*
+ * Every cache entry is a member of exactly one of these lists depending on its state, so that we can find sectors to
+ * evict or flush without scanning the whole cache.
+ */
+typedef enum {
+    // Entries in the AFATFS_CACHE_STATE_EMPTY state
+    AFATFS_CACHE_LIST_EMPTY,
+    // In-sync entries that may be evicted and are marked discardable, least-recently accessed first
+    AFATFS_CACHE_LIST_DISCARDABLE,
+    // In-sync entries that may be evicted, least-recently accessed first
+    AFATFS_CACHE_LIST_CLEAN,
+    // Entries in the AFATFS_CACHE_STATE_DIRTY state (including locked ones) in the order they were first made dirty
+    AFATFS_CACHE_LIST_DIRTY,
+    // Entries that are being read or written, or are locked or retained in the in-sync state
+    AFATFS_CACHE_LIST_PINNED,
+    AFATFS_CACHE_LIST_COUNT
+} afatfsCacheList_e;
+
 typedef enum {
     AFATFS_FILE_TYPE_NONE,
     AFATFS_FILE_TYPE_NORMAL,
@@ -123,6 +381,7 @@ typedef enum {
 enum {
     AFATFS_CREATEFILE_PHASE_INITIAL = 0,
     AFATFS_CREATEFILE_PHASE_FIND_FILE,
+    AFATFS_CREATEFILE_PHASE_FILE_NOT_FOUND,
     AFATFS_CREATEFILE_PHASE_CREATE_NEW_FILE,
     AFATFS_CREATEFILE_PHASE_SUCCESS,
     AFATFS_CREATEFILE_PHASE_FAILURE,
@@ -141,6 +400,7 @@ typedef union afatfsFATSector_t {
     uint8_t *bytes;
     uint16_t *fat16;
     uint32_t *fat32;
+    uint64_t *words;
 } afatfsFATSector_t;
 
 typedef struct afatfsCacheBlockDescriptor_t {
@@ -189,8 +449,44 @@ typedef struct afatfsCacheBlockDescriptor_t {
      * is overridden by the locked and retainCount flags.
      */
     unsigned discardable:1;
+
+    /*
+     * If this block holds data from a regular file then it doesn't matter what order it reaches the disk in relative
+     * to the other sectors, so it can be flushed early as part of a run of consecutive sectors.
+     */
+    unsigned fileData:1;
+
+#ifdef AFATFS_USE_CACHE_CLASSES
+    // The afatfsCacheClass_e of the sector, chosen when it is first cached
+    unsigned cacheClass:2;
+#endif
+
+#if AFATFS_FAT_MIRROR_POLICY == AFATFS_FAT_MIRROR_LOCKSTEP
+    // For sectors of the first FAT, this is set once the current contents have been written to the second FAT
+    unsigned mirrored:1;
+#endif
+
+#if AFATFS_SDCARD_WRITE_QUEUE_DEPTH > 1
+    /*
+     * Set while the card driver may still be reading the sector's memory for a write, even if the sector has been
+     * marked dirty again since. The sector mustn't be written again or discarded until that write completes.
+     */
+    unsigned writeInFlight:1;
+#endif
+
+    // The afatfsCacheList_e that this entry is a member of, and its neighbours on that list
+    uint8_t list;
+    afatfsCacheIndex_t listPrev, listNext;
+
+    // The next entry in the same hash bucket as this one (only entries which aren't empty are in the hash table)
+    afatfsCacheIndex_t hashNext;
 } afatfsCacheBlockDescriptor_t;
 
+typedef struct afatfsCacheList_t {
+    afatfsCacheIndex_t head, tail;
+    uint16_t count;
+} afatfsCacheList_t;
+
 typedef enum {
     AFATFS_FAT_PATTERN_UNTERMINATED_CHAIN,
     AFATFS_FAT_PATTERN_TERMINATED_CHAIN,
@@ -213,13 +509,50 @@ typedef struct afatfsFreeSpaceSearch_t {
 typedef struct afatfsFreeSpaceFAT_t {
     uint32_t startCluster;
     uint32_t endCluster;
+#ifdef AFATFS_FREEFILE_REGROWTH
+    // The clusters that the freefile has moved away from, which are freed once its new directory entry is saved
+    uint32_t releaseStartCluster;
+    uint32_t releaseEndCluster;
+#endif
 } afatfsFreeSpaceFAT_t;
 
+typedef enum {
+    AFATFS_FREEFILE_ALLOCATE_PHASE_NONE = 0,
+    AFATFS_FREEFILE_ALLOCATE_PHASE_FAT_SEARCH,
+    AFATFS_FREEFILE_ALLOCATE_PHASE_UPDATE_FAT,
+    AFATFS_FREEFILE_ALLOCATE_PHASE_SAVE_DIR_ENTRY,
+#ifdef AFATFS_FREEFILE_REGROWTH
+    AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_SEARCH,
+    AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_CLAIM,
+    AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_CHECK_GAP,
+    AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_UPDATE_FAT,
+    AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_SAVE_DIR_ENTRY,
+    AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_RELEASE,
+#endif
+} afatfsFreeFileAllocatePhase_e;
+
 typedef struct afatfsCreateFile_t {
     afatfsFileCallback_t callback;
 
     uint8_t phase;
     uint8_t filename[FAT_FILENAME_LENGTH];
+
+    /*
+     * For afatfs_createSequentialFile(), the number of digits at the end of the name part of the filename that we'll
+     * fill in, or zero to open exactly the given filename.
+     */
+    uint8_t sequenceDigits;
+    // One more than the highest number we found in the directory for a file with the same prefix and extension
+    uint32_t sequenceNumber;
+
+    /*
+     * The entry in the directory that the search for a free entry began from. While we search for the file, the number
+     * of entries at the start of the directory that our search found to be in use.
+     */
+    uint32_t firstFreeEntry;
+
+    // For afatfs_mkdirWithReserve(), the number of clusters to give the directory if we create it
+    uint32_t reserveClusters;
 } afatfsCreateFile_t;
 
 typedef struct afatfsSeek_t {
@@ -230,8 +563,12 @@ typedef struct afatfsSeek_t {
 
 typedef enum {
     AFATFS_APPEND_SUPERCLUSTER_PHASE_INIT = 0,
+#ifdef AFATFS_USE_JOURNAL
+    AFATFS_APPEND_SUPERCLUSTER_PHASE_WAIT_FOR_JOURNAL,
+#endif
     AFATFS_APPEND_SUPERCLUSTER_PHASE_UPDATE_FREEFILE_DIRECTORY,
     AFATFS_APPEND_SUPERCLUSTER_PHASE_UPDATE_FAT,
+    AFATFS_APPEND_SUPERCLUSTER_PHASE_LINK_PREVIOUS,
     AFATFS_APPEND_SUPERCLUSTER_PHASE_UPDATE_FILE_DIRECTORY,
 } afatfsAppendSuperclusterPhase_e;
 
@@ -240,6 +577,10 @@ typedef struct afatfsAppendSupercluster_t {
     uint32_t fatRewriteStartCluster;
     uint32_t fatRewriteEndCluster;
     afatfsAppendSuperclusterPhase_e phase;
+#ifdef AFATFS_USE_JOURNAL
+    // The index of our record in the journal, or -1 if we have none
+    int8_t journalRecord;
+#endif
 } afatfsAppendSupercluster_t;
 
 typedef enum {
@@ -262,6 +603,8 @@ typedef enum {
     AFATFS_EXTEND_SUBDIRECTORY_PHASE_INITIAL = 0,
     AFATFS_EXTEND_SUBDIRECTORY_PHASE_ADD_FREE_CLUSTER = 0,
     AFATFS_EXTEND_SUBDIRECTORY_PHASE_WRITE_SECTORS,
+    AFATFS_EXTEND_SUBDIRECTORY_PHASE_ZERO_SECTORS,
+    AFATFS_EXTEND_SUBDIRECTORY_PHASE_NEXT_CLUSTER,
     AFATFS_EXTEND_SUBDIRECTORY_PHASE_SUCCESS,
     AFATFS_EXTEND_SUBDIRECTORY_PHASE_FAILURE
 } afatfsExtendSubdirectoryPhase_e;
@@ -273,14 +616,29 @@ typedef struct afatfsExtendSubdirectory_t {
     afatfsExtendSubdirectoryPhase_e phase;
 
     uint32_t parentDirectoryCluster;
+
+    // The number of clusters still to be added after the one we're adding now (see afatfs_reserveSubdirectory())
+    uint32_t clustersRemaining;
+    // True if running out of free space should end the extension early rather than fail it
+    bool reserving;
+
     afatfsFileCallback_t callback;
 } afatfsExtendSubdirectory_t;
 
 typedef enum {
     AFATFS_TRUNCATE_FILE_INITIAL = 0,
+#ifdef AFATFS_USE_JOURNAL
+    AFATFS_TRUNCATE_FILE_JOURNAL = 0,
+    AFATFS_TRUNCATE_FILE_WAIT_FOR_JOURNAL,
+    AFATFS_TRUNCATE_FILE_UPDATE_DIRECTORY,
+#else
     AFATFS_TRUNCATE_FILE_UPDATE_DIRECTORY = 0,
+#endif
     AFATFS_TRUNCATE_FILE_ERASE_FAT_CHAIN_NORMAL,
 #ifdef AFATFS_USE_FREEFILE
+#ifdef AFATFS_USE_SDCARD_ERASE
+    AFATFS_TRUNCATE_FILE_ERASE_SECTORS_CONTIGUOUS,
+#endif
     AFATFS_TRUNCATE_FILE_ERASE_FAT_CHAIN_CONTIGUOUS,
     AFATFS_TRUNCATE_FILE_PREPEND_TO_FREEFILE,
 #endif
@@ -293,6 +651,10 @@ typedef struct afatfsTruncateFile_t {
     uint32_t endCluster; // Optional, for contiguous files set to 1 past the end cluster of the file, otherwise set to 0
     afatfsFileCallback_t callback;
     afatfsTruncateFilePhase_e phase;
+#ifdef AFATFS_USE_JOURNAL
+    // The index of our record in the journal, or -1 if we have none
+    int8_t journalRecord;
+#endif
 } afatfsTruncateFile_t;
 
 typedef enum {
@@ -309,6 +671,38 @@ typedef struct afatfsCloseFile_t {
     afatfsCallback_t callback;
 } afatfsCloseFile_t;
 
+typedef enum {
+    AFATFS_WRITE_DIRECT_PHASE_INITIAL = 0,
+    AFATFS_WRITE_DIRECT_PHASE_CHECK_ALLOCATION = 0,
+    AFATFS_WRITE_DIRECT_PHASE_EXTEND_FILE,
+    AFATFS_WRITE_DIRECT_PHASE_WRITE_SECTOR,
+    AFATFS_WRITE_DIRECT_PHASE_WAIT_FOR_WRITE,
+    AFATFS_WRITE_DIRECT_PHASE_ADVANCE_CURSOR,
+    AFATFS_WRITE_DIRECT_PHASE_COMPLETE,
+} afatfsWriteDirectPhase_e;
+
+typedef struct afatfsWriteDirect_t {
+    /*
+     * We may need to extend the file as a sub-operation, so we have its state as our first member to be compatible
+     * with its memory layout:
+     */
+    union {
+        afatfsAppendFreeCluster_t appendFreeCluster;
+#ifdef AFATFS_USE_FREEFILE
+        afatfsAppendSupercluster_t appendSupercluster;
+#endif
+    } appendState;
+
+    const uint8_t *buffer;
+    uint32_t bytesRemaining;
+
+    // The number of sectors left to write in the multi-block write we began on the SD card
+    uint32_t multiBlockRemaining;
+
+    afatfsFileCallback_t callback;
+    afatfsWriteDirectPhase_e phase;
+} afatfsWriteDirect_t;
+
 typedef enum {
     AFATFS_FILE_OPERATION_NONE,
     AFATFS_FILE_OPERATION_CREATE_FILE,
@@ -322,6 +716,7 @@ typedef enum {
 #endif
     AFATFS_FILE_OPERATION_APPEND_FREE_CLUSTER,
     AFATFS_FILE_OPERATION_EXTEND_SUBDIRECTORY,
+    AFATFS_FILE_OPERATION_WRITE_DIRECT,
 } afatfsFileOperation_e;
 
 typedef struct afatfsFileOperation_t {
@@ -335,9 +730,56 @@ typedef struct afatfsFileOperation_t {
         afatfsUnlinkFile_t unlinkFile;
         afatfsTruncateFile_t truncateFile;
         afatfsCloseFile_t closeFile;
+        afatfsWriteDirect_t writeDirect;
     } state;
 } afatfsFileOperation_t;
 
+#ifdef AFATFS_DIRECTORY_SUMMARY_SIZE
+/*
+ * What we know about the contents of the current directory.
+ */
+typedef struct afatfsDirectorySummary_t {
+    // Every entry before this one has been added to the name filter by a scan of the directory
+    uint32_t scannedEntries;
+
+    // Every entry before this one is in use, so the search for a free entry can begin here
+    uint32_t firstFreeEntry;
+
+    // True once a scan has reached the end of the directory, so every file in it is in the name filter
+    bool complete;
+
+    // Bloom filter of the 8.3 names of the files in the directory (names are never removed from it)
+    uint8_t nameFilter[AFATFS_DIRECTORY_SUMMARY_SIZE];
+} afatfsDirectorySummary_t;
+#endif
+
+/*
+ * The run of sectors that afatfs_zeroSectorsContinue() is writing zeros to on behalf of a directory.
+ */
+typedef struct afatfsZeroFill_t {
+    // The directory that the sectors belong to, or NULL if no zero-fill is in progress
+    afatfsFilePtr_t directory;
+
+    uint32_t nextSector;
+    uint32_t endSector;
+
+    // The number of sectors left to write in the multi-block write we began on the SD card
+    uint32_t multiBlockRemaining;
+
+    bool writeInFlight;
+} afatfsZeroFill_t;
+
+#ifdef AFATFS_FILE_EXTENT_CACHE_SIZE
+/*
+ * A run of physically consecutive clusters in a file's cluster chain.
+ */
+typedef struct afatfsFileExtent_t {
+    uint32_t fileClusterIndex; // The index of the first cluster of the run within the file
+    uint32_t physicalCluster; // The cluster number of the first cluster of the run
+    uint32_t length; // The number of clusters in the run, or 0 if this entry is unused
+} afatfsFileExtent_t;
+#endif
+
 typedef struct afatfsFile_t {
     afatfsFileType_e type;
 
@@ -386,16 +828,47 @@ typedef struct afatfsFile_t {
      * seek across a sector boundary. This allows fwrite() to complete faster because it doesn't need to check the
      * cache on every call.
      */
-    int8_t writeLockedCacheIndex;
+    afatfsCacheIndex_t writeLockedCacheIndex;
     // Ditto for fread():
-    int8_t readRetainCacheIndex;
+    afatfsCacheIndex_t readRetainCacheIndex;
+
+#ifdef AFATFS_CARD_PAGE_SECTORS
+    // The last sector we locked for writing, so that the rest of its card page can be held back until we move on from it
+    uint32_t writePageSector;
+#endif
 
     // The position of our directory entry on the disk (so we can update it without consulting a parent directory file)
     afatfsDirEntryPointer_t directoryEntryPos;
 
+    // When our directory entry is brought up to date as the file grows, see afatfs_fopenWithDurability()
+    afatfsDurability_t durability;
+    // The clusters (or superclusters) appended since the directory entry was last saved, and the time of that save
+    uint32_t unsavedAllocations;
+    uint32_t directorySaveTime;
+
+#ifdef AFATFS_DIRECTORY_SUMMARY_SIZE
+    // The first cluster of the directory that holds our directory entry, and the index of our entry within it
+    uint32_t parentDirectoryCluster;
+    uint32_t directoryEntryNumber;
+#endif
+
     // The first cluster number of the file, or 0 if this file is empty
     uint32_t firstCluster;
 
+#ifdef AFATFS_USE_FREEFILE
+    /*
+     * For contiguous files, the cluster just beyond the last supercluster we took from the freefile. Several contiguous
+     * files can be appending at once, so this needn't be the start of the freefile.
+     */
+    uint32_t superclusterEnd;
+#endif
+
+#ifdef AFATFS_FILE_EXTENT_CACHE_SIZE
+    // Parts of the cluster chain that we've already walked, and the entry to replace when we learn a new one
+    afatfsFileExtent_t extents[AFATFS_FILE_EXTENT_CACHE_SIZE];
+    uint8_t extentReplaceIndex;
+#endif
+
     // State for a queued operation on the file
     struct afatfsFileOperation_t operation;
 } afatfsFile_t;
@@ -404,13 +877,24 @@ typedef enum {
     AFATFS_INITIALIZATION_READ_MBR,
     AFATFS_INITIALIZATION_READ_VOLUME_ID,
 
+#ifdef AFATFS_USE_FSINFO
+    AFATFS_INITIALIZATION_READ_FSINFO,
+#endif
+
+#ifdef AFATFS_USE_JOURNAL
+    AFATFS_INITIALIZATION_JOURNAL_CREATE,
+    AFATFS_INITIALIZATION_JOURNAL_CREATING,
+    AFATFS_INITIALIZATION_JOURNAL_ALLOCATE,
+    AFATFS_INITIALIZATION_JOURNAL_READ,
+    AFATFS_INITIALIZATION_JOURNAL_REPLAY,
+    AFATFS_INITIALIZATION_JOURNAL_CLEAR,
+#endif
+
 #ifdef AFATFS_USE_FREEFILE
     AFATFS_INITIALIZATION_FREEFILE_CREATE,
     AFATFS_INITIALIZATION_FREEFILE_CREATING,
-    AFATFS_INITIALIZATION_FREEFILE_FAT_SEARCH,
-    AFATFS_INITIALIZATION_FREEFILE_UPDATE_FAT,
-    AFATFS_INITIALIZATION_FREEFILE_SAVE_DIR_ENTRY,
-    AFATFS_INITIALIZATION_FREEFILE_LAST = AFATFS_INITIALIZATION_FREEFILE_SAVE_DIR_ENTRY,
+    AFATFS_INITIALIZATION_FREEFILE_ALLOCATE,
+    AFATFS_INITIALIZATION_FREEFILE_LAST = AFATFS_INITIALIZATION_FREEFILE_ALLOCATE,
 #endif
 
 #ifdef AFATFS_USE_INTROSPECTIVE_LOGGING
@@ -421,37 +905,272 @@ typedef enum {
     AFATFS_INITIALIZATION_DONE
 } afatfsInitializationPhase_e;
 
+#if AFATFS_FAT_MIRROR_POLICY == AFATFS_FAT_MIRROR_DEFERRED
+typedef struct afatfsFATMirror_t {
+    // One bit per group of FAT sectors that have been modified since they were last copied to the second FAT
+    uint8_t dirtyGroups[AFATFS_FAT_MIRROR_DIRTY_GROUPS / 8];
+    uint32_t sectorsPerGroup;
+
+    // Set when somebody wants the dirty groups to be copied to the second FAT
+    bool syncRequested;
+
+    // The next FAT sector index to copy from the group being copied right now, and the end of that group (exclusive)
+    uint32_t copySector, copyEnd;
+
+    // The cache entry holding the sector being copied from the first FAT (retained so it can't be evicted)
+    afatfsCacheIndex_t sourceCacheIndex;
+} afatfsFATMirror_t;
+#endif
+
+#ifdef AFATFS_FREE_SPACE_SUMMARY_GROUPS
+typedef struct afatfsFreeSpaceSummary_t {
+    // One bit per group of FAT sectors, set if we've seen that every cluster in the group is occupied
+    uint8_t fullGroups[AFATFS_FREE_SPACE_SUMMARY_GROUPS / 8];
+    uint32_t sectorsPerGroup;
+
+    /*
+     * We can only learn that a group is full by examining all of its sectors in order. This is the index of the FAT
+     * sector that we expect to examine next, and whether the sectors of its group that we've examined so far were full.
+     */
+    uint32_t observeNextSector;
+    bool observeGroupFull;
+} afatfsFreeSpaceSummary_t;
+#endif
+
+#ifdef AFATFS_USE_FSINFO
+typedef struct afatfsFSInfo_t {
+    uint32_t sector; // The physical sector of the FSInfo structure, or zero if the volume doesn't have a valid one
+
+    // The number of free clusters on the volume, or FAT_FSINFO_UNKNOWN
+    uint32_t freeClusters;
+
+    // True once we've marked the free cluster count on disk as unknown because we've begun to modify the FAT
+    bool volumeDirty;
+} afatfsFSInfo_t;
+#endif
+
+#ifdef AFATFS_USE_JOURNAL
+typedef enum {
+    AFATFS_JOURNAL_RECORD_APPEND_SUPERCLUSTER = 1,
+    AFATFS_JOURNAL_RECORD_TRUNCATE_CONTIGUOUS
+} afatfsJournalRecordType_e;
+
+// The append gave the file its first cluster (the record's startCluster)
+#define AFATFS_JOURNAL_FLAG_FIRST_CLUSTER 1
+// The truncation was part of deleting the file
+#define AFATFS_JOURNAL_FLAG_DELETE        2
+
+/*
+ * An operation as recorded in the journal sector on disk. Replaying a record makes every change to the FAT and the
+ * directory entries that the operation would have made, so it doesn't matter how many of them had already been made.
+ */
+typedef struct afatfsJournalRecord_t {
+    // Records are replayed in increasing order of sequence number, and an unused record has a sequence number of zero
+    uint32_t sequence;
+    uint8_t type; // afatfsJournalRecordType_e
+    uint8_t flags;
+
+    // The directory entry of the file that the operation was on
+    uint16_t fileEntryIndex;
+    uint32_t fileEntrySector;
+
+    // The clusters which are chained together in the FAT (terminated for appends, linking on to the freefile otherwise)
+    uint32_t startCluster, endCluster;
+
+    // For appends, the cluster that used to end the file and must be linked to the new supercluster (or zero)
+    uint32_t linkCluster;
+
+    // The freefile's first cluster and size once the operation is complete
+    uint32_t freeFileFirstCluster;
+    uint32_t freeFileSize;
+} __attribute__((packed)) afatfsJournalRecord_t;
+
+#define AFATFS_JOURNAL_HEADER_SIZE 16
+#define AFATFS_JOURNAL_RECORDS ((AFATFS_SECTOR_SIZE - AFATFS_JOURNAL_HEADER_SIZE) / sizeof(afatfsJournalRecord_t))
+
+typedef struct afatfsJournalSector_t {
+    uint32_t magic;
+    uint32_t checksum; // See afatfs_journalChecksum()
+
+    // The directory entry of the freefile, so that it can be replayed before the freefile has been opened
+    uint32_t freeFileEntrySector;
+    uint16_t freeFileEntryIndex;
+    uint16_t reserved;
+
+    afatfsJournalRecord_t records[AFATFS_JOURNAL_RECORDS];
+} __attribute__((packed)) afatfsJournalSector_t;
+
+typedef enum {
+    AFATFS_JOURNAL_REPLAY_PHASE_FAT = 0,
+    AFATFS_JOURNAL_REPLAY_PHASE_LINK_PREVIOUS,
+    AFATFS_JOURNAL_REPLAY_PHASE_FREEFILE_DIRECTORY,
+    AFATFS_JOURNAL_REPLAY_PHASE_FILE_DIRECTORY,
+} afatfsJournalReplayPhase_e;
+
+typedef struct afatfsJournal_t {
+    // The hidden file that holds the journal (only used during init)
+    afatfsFile_t file;
+
+    // The physical sector the journal is kept in, or zero if the volume had no room for it (nothing is journaled then)
+    uint32_t sector;
+
+    // The contents of the journal sector, which mustn't be modified while it's being written
+    union {
+        afatfsJournalSector_t contents;
+        uint8_t bytes[AFATFS_SECTOR_SIZE];
+    } buffer;
+
+    /* True if the buffer has changed since its last write to the card began. afatfs_journalWrite() clears this when it
+     * starts a write, and the completion callback sets it again if that write failed.
+     */
+    bool dirty;
+    bool writeInFlight;
+
+    // The sequence number for the next record, and every record numbered below sequenceOnCard has reached the card
+    uint32_t nextSequence;
+    uint32_t sequenceOnCard;
+    uint32_t sequenceBeingWritten;
+
+    // One bit per record whose operation has finished, so it can be dropped once the changes it made have been flushed
+    uint32_t finishedRecords;
+
+    // During init, the record being replayed (or -1) and the progress of its replay
+    int8_t replayRecord;
+    afatfsJournalReplayPhase_e replayPhase;
+    uint32_t replayCluster;
+    uint32_t replayedSequence;
+} afatfsJournal_t;
+#endif
+
 typedef struct afatfs_t {
-    uint8_t cache[AFATFS_SECTOR_SIZE * AFATFS_NUM_CACHE_SECTORS];
-    afatfsCacheBlockDescriptor_t cacheDescriptor[AFATFS_NUM_CACHE_SECTORS];
+    // The sector cache and its descriptors, which live in the arena we were initialised with
+    uint8_t *cache;
+    afatfsCacheBlockDescriptor_t *cacheDescriptor;
+    int numCacheSectors;
+
+    // Chains of cache entries which aren't empty, keyed by afatfs_cacheHashBucket() of their sectorIndex
+    afatfsCacheIndex_t cacheHashBuckets[AFATFS_CACHE_HASH_BUCKETS];
+    uint32_t cacheHashBucketMask;
+    afatfsCacheList_t cacheLists[AFATFS_CACHE_LIST_COUNT];
+
+#ifdef AFATFS_USE_CACHE_CLASSES
+    /*
+     * The number of cache entries of each class which hold a sector that isn't pinned in the cache (i.e. entries on the
+     * clean, discardable and dirty lists), and how many of those the other classes must leave alone.
+     */
+    uint16_t cacheClassSectors[AFATFS_CACHE_CLASS_COUNT];
+    uint16_t cacheClassReserve[AFATFS_CACHE_CLASS_COUNT];
+    afatfsCacheClassStats_t cacheClassStats[AFATFS_CACHE_CLASS_COUNT];
+#endif
+
+#ifdef AFATFS_USE_STATS
+    afatfsStats_t stats;
+
+    // The range of blocks announced by the latest multi-block write and read, so that continuing them isn't counted again
+    uint32_t statsMultiBlockWriteStart, statsMultiBlockWriteEnd;
+    uint32_t statsMultiBlockReadStart, statsMultiBlockReadEnd;
+#endif
+
     fatFilesystemType_e filesystemType;
 
     afatfsFilesystemState_e filesystemState;
     afatfsInitializationPhase_e initPhase;
 
-    // State used during FS initialisation where only one member of the union is used at a time
+    /*
+     * State used while allocating space for the freefile where only one member of the union is used at a time. This
+     * happens during FS initialisation, or afterwards when AFATFS_BACKGROUND_FREEFILE_SEARCH is defined.
+     */
 #ifdef AFATFS_USE_FREEFILE
     union {
         afatfsFreeSpaceSearch_t freeSpaceSearch;
         afatfsFreeSpaceFAT_t freeSpaceFAT;
     } initState;
+
+    afatfsFreeFileAllocatePhase_e freeFileAllocatePhase;
+
+#ifdef AFATFS_FREEFILE_REGROWTH
+    // Clusters have been freed since the freefile was last allocated, so it might be able to grow
+    bool freeFileRegrowPending;
+#endif
 #endif
 
     uint32_t cacheTimer;
 
+    // While afatfs_pollBudget() is running, the number of sectors it may still access in the cache before it must yield
+    bool pollBudgeted;
+    uint32_t pollSectorsRemaining;
+
+    // The app's millisecond clock for the AFATFS_DURABILITY_INTERVAL policy, see afatfs_setMillisCallback()
+    afatfsMillisCallback_t millis;
+
+    // Mounted by afatfs_initReadOnly(), so files may only be opened for reading and nothing is ever written
+    bool readOnly;
+
     int cacheDirtyEntries; // The number of cache entries in the AFATFS_CACHE_STATE_DIRTY state
-    bool cacheFlushInProgress;
+    int cacheEraseHints; // The number of cache entries with a non-zero consecutiveEraseBlockCount
+    int cacheMetadataWrites; // The number of cache entries in the AFATFS_CACHE_STATE_WRITING state which aren't file data
+    uint8_t cacheFlushesInProgress; // The number of our writes which the card driver hasn't completed yet
+#if AFATFS_SDCARD_WRITE_QUEUE_DEPTH > 1
+    // A read or erase was refused while our writes were queued, so stop queueing more until the card has drained
+    bool cardCommandWaiting;
+#endif
+
+    // The run of consecutive dirty sectors that afatfs_flush() is currently writing in one multi-block write
+    uint32_t cacheFlushRunNextSector;
+    uint16_t cacheFlushRunRemaining;
+
+#ifdef AFATFS_CARD_PAGE_SECTORS
+    // The last attempt to find room in the cache for a new sector failed, so pages mustn't be held back for now
+    bool cacheAllocationFailed;
+#endif
 
-    afatfsFile_t openFiles[AFATFS_MAX_OPEN_FILES];
+#ifdef AFATFS_FILE_READ_AHEAD_SECTORS
+    // A read that somebody is actually waiting for couldn't be started because the card was busy, so hold off read-ahead
+    bool cacheReadPending;
+
+#ifdef AFATFS_MIN_MULTIPLE_BLOCK_READ_COUNT
+    // The multi-block read that read-ahead began for a file, and the sectors of it that haven't been read yet
+    struct {
+        afatfsFilePtr_t file;
+        uint32_t nextSector;
+        uint32_t remaining;
+    } readRun;
+#endif
+#endif
+
+    // The table of files that the user can open, also in the arena
+    afatfsFile_t *openFiles;
+    int maxOpenFiles;
+
+#if AFATFS_FAT_MIRROR_POLICY == AFATFS_FAT_MIRROR_DEFERRED
+    afatfsFATMirror_t fatMirror;
+#endif
+
+#ifdef AFATFS_FREE_SPACE_SUMMARY_GROUPS
+    afatfsFreeSpaceSummary_t freeSpaceSummary;
+#endif
+
+#ifdef AFATFS_USE_FSINFO
+    afatfsFSInfo_t fsInfo;
+#endif
 
 #ifdef AFATFS_USE_FREEFILE
     afatfsFile_t freeFile;
 #endif
 
+#ifdef AFATFS_USE_JOURNAL
+    afatfsJournal_t journal;
+#endif
+
 #ifdef AFATFS_USE_INTROSPECTIVE_LOGGING
     afatfsFile_t introSpecLog;
 #endif
 
+#ifdef AFATFS_USE_LOG_STREAM
+    // The log streams that afatfs_poll() should drain into their files
+    afatfsLogStream_t *logStreams;
+#endif
+
     afatfsError_e lastError;
 
     bool filesystemFull;
@@ -459,10 +1178,18 @@ typedef struct afatfs_t {
     // The current working directory:
     afatfsFile_t currentDirectory;
 
+#ifdef AFATFS_DIRECTORY_SUMMARY_SIZE
+    afatfsDirectorySummary_t directorySummary;
+#endif
+
+    // New directory clusters are zeroed one directory at a time
+    afatfsZeroFill_t zeroFill;
+
     uint32_t partitionStartSector; // The physical sector that the first partition on the device begins at
 
     uint32_t fatStartSector; // The first sector of the first FAT
     uint32_t fatSectors;     // The size in sectors of a single FAT
+    uint8_t numFATs;         // The number of copies of the FAT on the volume (1 or 2)
 
     /*
      * Number of clusters available for storing user data. Note that clusters are numbered starting from 2, so the
@@ -485,11 +1212,31 @@ typedef struct afatfs_t {
     uint32_t rootDirectorySectors; // Zero on FAT32, for FAT16 the number of sectors that the root directory occupies
 } afatfs_t;
 
+/*
+ * The arena holds the sector cache first (so it begins at the start of the arena) followed by the cache descriptors and
+ * the open files table. These are aligned to 8 bytes, which is enough for any of their members.
+ */
+#define AFATFS_ARENA_ALIGN(size) (((size) + 7) & ~((uint32_t) 7))
+#define AFATFS_ARENA_CACHE_SIZE(cacheSectors) ((uint32_t) AFATFS_SECTOR_SIZE * (cacheSectors))
+#define AFATFS_ARENA_DESCRIPTORS_SIZE(cacheSectors) AFATFS_ARENA_ALIGN(sizeof(afatfsCacheBlockDescriptor_t) * (cacheSectors))
+#define AFATFS_ARENA_FILES_SIZE(maxOpenFiles) AFATFS_ARENA_ALIGN(sizeof(afatfsFile_t) * (maxOpenFiles))
+#define AFATFS_ARENA_SIZE(cacheSectors, maxOpenFiles) \
+    (AFATFS_ARENA_CACHE_SIZE(cacheSectors) + AFATFS_ARENA_DESCRIPTORS_SIZE(cacheSectors) + AFATFS_ARENA_FILES_SIZE(maxOpenFiles))
+
 static afatfs_t afatfs;
 
+// The arena used by afatfs_init()
+static uint64_t afatfsDefaultArena[AFATFS_ARENA_SIZE(AFATFS_NUM_CACHE_SECTORS, AFATFS_MAX_OPEN_FILES) / sizeof(uint64_t)];
+
 static void afatfs_fileOperationContinue(afatfsFile_t *file);
 static uint8_t* afatfs_fileLockCursorSectorForWrite(afatfsFilePtr_t file);
 static uint8_t* afatfs_fileRetainCursorSectorForRead(afatfsFilePtr_t file);
+#ifdef AFATFS_FREE_SPACE_SEARCH_WHILE_READY
+static afatfsOperationStatus_e afatfs_allocateFreeFileContinue();
+#endif
+#ifdef AFATFS_FREEFILE_REGROWTH
+static void afatfs_freeFileRegrowBegin();
+#endif
 
 static uint32_t roundUpTo(uint32_t value, uint32_t rounding)
 {
@@ -502,6 +1249,77 @@ static uint32_t roundUpTo(uint32_t value, uint32_t rounding)
     return value;
 }
 
+#ifdef AFATFS_USE_STATS
+
+/**
+ * Count the value in the power-of-two bucket of the histogram that it falls into.
+ */
+static void afatfs_statsHistogramAdd(uint32_t *histogram, uint32_t value)
+{
+    int bucket = 0;
+
+    while (value > 1 && bucket < AFATFS_STATS_HISTOGRAM_BUCKETS - 1) {
+        value >>= 1;
+        bucket++;
+    }
+
+    histogram[bucket]++;
+}
+
+/**
+ * Count a multi-block transfer that the card accepted, unless it lies inside the range announced by the previous one
+ * (in which case the card carries on with that one).
+ */
+static void afatfs_statsMultiBlockBegun(uint32_t *histogram, uint32_t *lastStart, uint32_t *lastEnd, uint32_t blockIndex, uint32_t blockCount)
+{
+    if (blockIndex >= *lastStart && blockIndex < *lastEnd) {
+        return;
+    }
+
+    *lastStart = blockIndex;
+    *lastEnd = blockIndex + blockCount;
+
+    afatfs_statsHistogramAdd(histogram, blockCount);
+}
+
+#endif
+
+#ifdef AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT
+
+static sdcardOperationStatus_e afatfs_sdcardBeginWriteBlocks(uint32_t blockIndex, uint32_t blockCount)
+{
+    sdcardOperationStatus_e status = sdcard_beginWriteBlocks(blockIndex, blockCount);
+
+#ifdef AFATFS_USE_STATS
+    if (status == SDCARD_OPERATION_SUCCESS) {
+        afatfs_statsMultiBlockBegun(afatfs.stats.multiBlockWriteLengths, &afatfs.statsMultiBlockWriteStart,
+            &afatfs.statsMultiBlockWriteEnd, blockIndex, blockCount);
+    }
+#endif
+
+    return status;
+}
+
+#endif
+
+#ifdef AFATFS_MIN_MULTIPLE_BLOCK_READ_COUNT
+
+static sdcardOperationStatus_e afatfs_sdcardBeginReadBlocks(uint32_t blockIndex, uint32_t blockCount)
+{
+    sdcardOperationStatus_e status = sdcard_beginReadBlocks(blockIndex, blockCount);
+
+#ifdef AFATFS_USE_STATS
+    if (status == SDCARD_OPERATION_SUCCESS) {
+        afatfs_statsMultiBlockBegun(afatfs.stats.multiBlockReadLengths, &afatfs.statsMultiBlockReadStart,
+            &afatfs.statsMultiBlockReadEnd, blockIndex, blockCount);
+    }
+#endif
+
+    return status;
+}
+
+#endif
+
 static bool isPowerOfTwo(unsigned int x)
 {
     return ((x != 0) && ((x & (~x + 1)) == x));
@@ -534,6 +1352,20 @@ static bool afatfs_fileIsBusy(afatfsFilePtr_t file)
     return file->operation.operation != AFATFS_FILE_OPERATION_NONE;
 }
 
+/**
+ * Is the mounted volume FAT16 (otherwise it's FAT32)? This is a constant if the build only supports one of the two.
+ */
+static bool afatfs_isFAT16()
+{
+#if defined(AFATFS_FAT16_ONLY)
+    return true;
+#elif defined(AFATFS_FAT32_ONLY)
+    return false;
+#else
+    return afatfs.filesystemType == FAT_FILESYSTEM_TYPE_FAT16;
+#endif
+}
+
 /**
  * The number of FAT table entries that fit within one AFATFS sector size.
  *
@@ -541,7 +1373,7 @@ static bool afatfs_fileIsBusy(afatfsFilePtr_t file)
  */
 static uint32_t afatfs_fatEntriesPerSector()
 {
-    return afatfs.filesystemType == FAT_FILESYSTEM_TYPE_FAT32 ? AFATFS_FAT32_FAT_ENTRIES_PER_SECTOR : AFATFS_FAT16_FAT_ENTRIES_PER_SECTOR;
+    return afatfs_isFAT16() ? AFATFS_FAT16_FAT_ENTRIES_PER_SECTOR : AFATFS_FAT32_FAT_ENTRIES_PER_SECTOR;
 }
 
 /**
@@ -579,7 +1411,7 @@ static int afatfs_getCacheDescriptorIndexForBuffer(uint8_t *memory)
 {
     int index = (memory - afatfs.cache) / AFATFS_SECTOR_SIZE;
 
-    if (afatfs_assert(index >= 0 && index < AFATFS_NUM_CACHE_SECTORS)) {
+    if (afatfs_assert(index >= 0 && index < afatfs.numCacheSectors)) {
         return index;
     } else {
         return -1;
@@ -591,1092 +1423,2992 @@ static afatfsCacheBlockDescriptor_t* afatfs_getCacheDescriptorForBuffer(uint8_t
     return afatfs.cacheDescriptor + afatfs_getCacheDescriptorIndexForBuffer(memory);
 }
 
-static void afatfs_cacheSectorMarkDirty(afatfsCacheBlockDescriptor_t *descriptor)
+static int afatfs_cacheHashBucket(uint32_t sectorIndex)
 {
-    if (descriptor->state != AFATFS_CACHE_STATE_DIRTY) {
-        descriptor->writeTimestamp = ++afatfs.cacheTimer;
-        descriptor->state = AFATFS_CACHE_STATE_DIRTY;
-        afatfs.cacheDirtyEntries++;
-    }
+    return sectorIndex & afatfs.cacheHashBucketMask;
 }
 
-static void afatfs_cacheSectorInit(afatfsCacheBlockDescriptor_t *descriptor, uint32_t sectorIndex, bool locked)
+static void afatfs_cacheHashInsert(int cacheIndex)
 {
-    descriptor->sectorIndex = sectorIndex;
+    int bucket = afatfs_cacheHashBucket(afatfs.cacheDescriptor[cacheIndex].sectorIndex);
 
-    descriptor->accessTimestamp = descriptor->writeTimestamp = ++afatfs.cacheTimer;
+    afatfs.cacheDescriptor[cacheIndex].hashNext = afatfs.cacheHashBuckets[bucket];
+    afatfs.cacheHashBuckets[bucket] = cacheIndex;
+}
 
-    descriptor->consecutiveEraseBlockCount = 0;
+static void afatfs_cacheHashRemove(int cacheIndex)
+{
+    afatfsCacheIndex_t *link = &afatfs.cacheHashBuckets[afatfs_cacheHashBucket(afatfs.cacheDescriptor[cacheIndex].sectorIndex)];
 
-    descriptor->state = AFATFS_CACHE_STATE_EMPTY;
+    while (*link != -1) {
+        if (*link == cacheIndex) {
+            *link = afatfs.cacheDescriptor[cacheIndex].hashNext;
+            return;
+        }
 
-    descriptor->locked = locked;
-    descriptor->retainCount = 0;
-    descriptor->discardable = 0;
+        link = &afatfs.cacheDescriptor[*link].hashNext;
+    }
+
+    // Every entry that isn't empty should have been in the hash table
+    afatfs_assert(false);
 }
 
 /**
- * Called by the SD card driver when one of our read operations completes.
+ * Find the index of the cache entry which holds the given physical sector, or -1 if the sector isn't cached (empty
+ * entries are never found).
  */
-static void afatfs_sdcardReadComplete(sdcardBlockOperation_e operation, uint32_t sectorIndex, uint8_t *buffer, uint32_t callbackData)
+static int afatfs_cacheHashFind(uint32_t sectorIndex)
 {
-    (void) operation;
-    (void) callbackData;
+    int cacheIndex = afatfs.cacheHashBuckets[afatfs_cacheHashBucket(sectorIndex)];
 
-    for (int i = 0; i < AFATFS_NUM_CACHE_SECTORS; i++) {
-        if (afatfs.cacheDescriptor[i].state != AFATFS_CACHE_STATE_EMPTY
-            && afatfs.cacheDescriptor[i].sectorIndex == sectorIndex
-        ) {
-            if (buffer == NULL) {
-                // Read failed, mark the sector as empty and whoever asked for it will ask for it again later to retry
-                afatfs.cacheDescriptor[i].state = AFATFS_CACHE_STATE_EMPTY;
-            } else {
-                afatfs_assert(afatfs_cacheSectorGetMemory(i) == buffer && afatfs.cacheDescriptor[i].state == AFATFS_CACHE_STATE_READING);
+    while (cacheIndex != -1 && afatfs.cacheDescriptor[cacheIndex].sectorIndex != sectorIndex) {
+        cacheIndex = afatfs.cacheDescriptor[cacheIndex].hashNext;
+    }
 
-                afatfs.cacheDescriptor[i].state = AFATFS_CACHE_STATE_IN_SYNC;
-            }
+    return cacheIndex;
+}
 
-            break;
-        }
+/**
+ * Decide which of the afatfsCacheList_e lists the given cache entry belongs on given its current state and flags.
+ */
+static afatfsCacheList_e afatfs_cacheSectorChooseList(const afatfsCacheBlockDescriptor_t *descriptor)
+{
+    switch (descriptor->state) {
+        case AFATFS_CACHE_STATE_EMPTY:
+            return AFATFS_CACHE_LIST_EMPTY;
+        case AFATFS_CACHE_STATE_DIRTY:
+            return AFATFS_CACHE_LIST_DIRTY;
+        case AFATFS_CACHE_STATE_IN_SYNC:
+            if (!descriptor->locked && descriptor->retainCount == 0) {
+                return descriptor->discardable ? AFATFS_CACHE_LIST_DISCARDABLE : AFATFS_CACHE_LIST_CLEAN;
+            }
+            // Fall through
+        default:
+            return AFATFS_CACHE_LIST_PINNED;
     }
 }
 
 /**
- * Called by the SD card driver when one of our write operations completes.
+ * Get the value that the entries of the given list are sorted by (in ascending order from the head).
  */
-static void afatfs_sdcardWriteComplete(sdcardBlockOperation_e operation, uint32_t sectorIndex, uint8_t *buffer, uint32_t callbackData)
+static uint32_t afatfs_cacheListSortKey(afatfsCacheList_e list, const afatfsCacheBlockDescriptor_t *descriptor)
 {
-    (void) operation;
-    (void) callbackData;
+    switch (list) {
+        case AFATFS_CACHE_LIST_DIRTY:
+            return descriptor->writeTimestamp;
+        case AFATFS_CACHE_LIST_DISCARDABLE:
+        case AFATFS_CACHE_LIST_CLEAN:
+            return descriptor->accessTimestamp;
+        default:
+            // Other lists aren't ordered
+            return 0;
+    }
+}
 
-    afatfs.cacheFlushInProgress = false;
+static void afatfs_cacheListRemove(int cacheIndex)
+{
+    afatfsCacheBlockDescriptor_t *descriptor = &afatfs.cacheDescriptor[cacheIndex];
+    afatfsCacheList_t *list = &afatfs.cacheLists[descriptor->list];
 
-    for (int i = 0; i < AFATFS_NUM_CACHE_SECTORS; i++) {
-        /* Keep in mind that someone may have marked the sector as dirty after writing had already begun. In this case we must leave
-         * it marked as dirty because those modifications may have been made too late to make it to the disk!
-         */
-        if (afatfs.cacheDescriptor[i].sectorIndex == sectorIndex
-            && afatfs.cacheDescriptor[i].state == AFATFS_CACHE_STATE_WRITING
-        ) {
-            if (buffer == NULL) {
-                // Write failed, remark the sector as dirty
-                afatfs.cacheDescriptor[i].state = AFATFS_CACHE_STATE_DIRTY;
-                afatfs.cacheDirtyEntries++;
-            } else {
-                afatfs_assert(afatfs_cacheSectorGetMemory(i) == buffer);
+    if (descriptor->listPrev == -1) {
+        list->head = descriptor->listNext;
+    } else {
+        afatfs.cacheDescriptor[descriptor->listPrev].listNext = descriptor->listNext;
+    }
 
-                afatfs.cacheDescriptor[i].state = AFATFS_CACHE_STATE_IN_SYNC;
-            }
-            break;
-        }
+    if (descriptor->listNext == -1) {
+        list->tail = descriptor->listPrev;
+    } else {
+        afatfs.cacheDescriptor[descriptor->listNext].listPrev = descriptor->listPrev;
     }
+
+    list->count--;
+
+#ifdef AFATFS_USE_CACHE_CLASSES
+    if (descriptor->list != AFATFS_CACHE_LIST_EMPTY && descriptor->list != AFATFS_CACHE_LIST_PINNED) {
+        afatfs.cacheClassSectors[descriptor->cacheClass]--;
+    }
+#endif
 }
 
 /**
- * Attempt to flush the dirty cache entry with the given index to the SDcard.
+ * Insert the cache entry into its sorted position in the given list. Entries almost always arrive in the same order as
+ * their sort keys, so the search backwards from the tail normally finishes immediately.
  */
-static void afatfs_cacheFlushSector(int cacheIndex)
+static void afatfs_cacheListInsert(int cacheIndex, afatfsCacheList_e listIndex)
 {
-    afatfsCacheBlockDescriptor_t *cacheDescriptor = &afatfs.cacheDescriptor[cacheIndex];
+    afatfsCacheBlockDescriptor_t *descriptor = &afatfs.cacheDescriptor[cacheIndex];
+    afatfsCacheList_t *list = &afatfs.cacheLists[listIndex];
+    uint32_t sortKey = afatfs_cacheListSortKey(listIndex, descriptor);
+    int prev = list->tail;
 
-#ifdef AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT
-    if (cacheDescriptor->consecutiveEraseBlockCount) {
-        sdcard_beginWriteBlocks(cacheDescriptor->sectorIndex, cacheDescriptor->consecutiveEraseBlockCount);
+    while (prev != -1 && afatfs_cacheListSortKey(listIndex, &afatfs.cacheDescriptor[prev]) > sortKey) {
+        prev = afatfs.cacheDescriptor[prev].listPrev;
     }
-#endif
 
-    switch (sdcard_writeBlock(cacheDescriptor->sectorIndex, afatfs_cacheSectorGetMemory(cacheIndex), afatfs_sdcardWriteComplete, 0)) {
-        case SDCARD_OPERATION_IN_PROGRESS:
-            // The card will call us back later when the buffer transmission finishes
-            afatfs.cacheDirtyEntries--;
-            cacheDescriptor->state = AFATFS_CACHE_STATE_WRITING;
-            afatfs.cacheFlushInProgress = true;
-            break;
+    descriptor->list = listIndex;
+    descriptor->listPrev = prev;
 
-        case SDCARD_OPERATION_SUCCESS:
-            // Buffer is already transmitted
-            afatfs.cacheDirtyEntries--;
-            cacheDescriptor->state = AFATFS_CACHE_STATE_IN_SYNC;
-            break;
+    if (prev == -1) {
+        descriptor->listNext = list->head;
+        list->head = cacheIndex;
+    } else {
+        descriptor->listNext = afatfs.cacheDescriptor[prev].listNext;
+        afatfs.cacheDescriptor[prev].listNext = cacheIndex;
+    }
 
-        case SDCARD_OPERATION_BUSY:
-        case SDCARD_OPERATION_FAILURE:
-        default:
-            ;
+    if (descriptor->listNext == -1) {
+        list->tail = cacheIndex;
+    } else {
+        afatfs.cacheDescriptor[descriptor->listNext].listPrev = cacheIndex;
+    }
+
+    list->count++;
+
+#ifdef AFATFS_USE_CACHE_CLASSES
+    if (listIndex != AFATFS_CACHE_LIST_EMPTY && listIndex != AFATFS_CACHE_LIST_PINNED) {
+        afatfs.cacheClassSectors[descriptor->cacheClass]++;
     }
+#endif
 }
 
 /**
- * Find a sector in the cache which corresponds to the given physical sector index, or NULL if the sector isn't
- * cached. Note that the cached sector could be in any state including completely empty.
+ * Move the cache entry onto the list that matches its state and flags. Call this after changing its locked,
+ * retainCount or discardable fields.
  */
-static afatfsCacheBlockDescriptor_t* afatfs_findCacheSector(uint32_t sectorIndex)
+static void afatfs_cacheSectorUpdateList(afatfsCacheBlockDescriptor_t *descriptor)
 {
-    for (int i = 0; i < AFATFS_NUM_CACHE_SECTORS; i++) {
-        if (afatfs.cacheDescriptor[i].sectorIndex == sectorIndex) {
-            return &afatfs.cacheDescriptor[i];
-        }
-    }
+    int cacheIndex = descriptor - afatfs.cacheDescriptor;
+    afatfsCacheList_e list = afatfs_cacheSectorChooseList(descriptor);
 
-    return NULL;
+    if (list != descriptor->list) {
+        afatfs_cacheListRemove(cacheIndex);
+        afatfs_cacheListInsert(cacheIndex, list);
+    }
 }
 
 /**
- * Find or allocate a cache sector for the given sector index on disk. Returns a block which matches one of these
- * conditions (in descending order of preference):
- *
- * - The requested sector that already exists in the cache
- * - The index of an empty sector
- * - The index of a synced discardable sector
- * - The index of the oldest synced sector
- *
- * Otherwise it returns -1 to signal failure (cache is full!)
+ * Set the pre-erase hint of the given cache entry (zero for none), keeping count of the entries that have one.
  */
-static int afatfs_allocateCacheSector(uint32_t sectorIndex)
+static void afatfs_cacheSectorSetEraseHint(afatfsCacheBlockDescriptor_t *descriptor, uint16_t eraseBlockCount)
 {
-    int allocateIndex;
-    int emptyIndex = -1, discardableIndex = -1;
+    afatfs.cacheEraseHints += (eraseBlockCount > 0 ? 1 : 0) - (descriptor->consecutiveEraseBlockCount > 0 ? 1 : 0);
+    descriptor->consecutiveEraseBlockCount = eraseBlockCount;
+}
 
-    uint32_t oldestSyncedSectorLastUse = 0xFFFFFFFF;
-    int oldestSyncedSectorIndex = -1;
+/**
+ * Change the state of the cache entry, keeping the hash table, the cache lists and the dirty and writing sector counts
+ * up to date.
+ */
+static void afatfs_cacheSectorSetState(afatfsCacheBlockDescriptor_t *descriptor, afatfsCacheBlockState_e state)
+{
+    int cacheIndex = descriptor - afatfs.cacheDescriptor;
 
-    if (
-        !afatfs_assert(
-            afatfs.numClusters == 0 // We're unable to check sector bounds during startup since we haven't read volume label yet
-            || sectorIndex < afatfs.clusterStartSector + afatfs.numClusters * afatfs.sectorsPerCluster
-        )
-    ) {
-        return -1;
+    if (descriptor->state == state) {
+        return;
     }
 
-    for (int i = 0; i < AFATFS_NUM_CACHE_SECTORS; i++) {
-        if (afatfs.cacheDescriptor[i].sectorIndex == sectorIndex) {
-            /*
-             * If the sector is actually empty then do a complete re-init of it just like the standard
-             * empty case. (Sectors marked as empty should be treated as if they don't have a block index assigned)
-             */
-            if (afatfs.cacheDescriptor[i].state == AFATFS_CACHE_STATE_EMPTY) {
-                emptyIndex = i;
-                break;
-            }
-
-            // Bump the last access time
-            afatfs.cacheDescriptor[i].accessTimestamp = ++afatfs.cacheTimer;
-            return i;
-        }
+    if (descriptor->state == AFATFS_CACHE_STATE_DIRTY) {
+        afatfs.cacheDirtyEntries--;
+    } else if (state == AFATFS_CACHE_STATE_DIRTY) {
+        afatfs.cacheDirtyEntries++;
+    }
 
-        switch (afatfs.cacheDescriptor[i].state) {
-            case AFATFS_CACHE_STATE_EMPTY:
-                emptyIndex = i;
-            break;
-            case AFATFS_CACHE_STATE_IN_SYNC:
-                // Is this a synced sector that we could evict from the cache?
-                if (!afatfs.cacheDescriptor[i].locked && afatfs.cacheDescriptor[i].retainCount == 0) {
-                    if (afatfs.cacheDescriptor[i].discardable) {
-                        discardableIndex = i;
-                    } else if (afatfs.cacheDescriptor[i].accessTimestamp < oldestSyncedSectorLastUse) {
-                        // This is older than last block we decided to evict, so evict this one in preference
-                        oldestSyncedSectorLastUse = afatfs.cacheDescriptor[i].accessTimestamp;
-                        oldestSyncedSectorIndex = i;
-                    }
-                }
-            break;
-            default:
-                ;
+    if (!descriptor->fileData) {
+        if (descriptor->state == AFATFS_CACHE_STATE_WRITING) {
+            afatfs.cacheMetadataWrites--;
+        } else if (state == AFATFS_CACHE_STATE_WRITING) {
+            afatfs.cacheMetadataWrites++;
         }
     }
 
-    if (emptyIndex > -1) {
-        allocateIndex = emptyIndex;
-    } else if (discardableIndex > -1) {
-        allocateIndex = discardableIndex;
-    } else if (oldestSyncedSectorIndex > -1) {
-        allocateIndex = oldestSyncedSectorIndex;
-    } else {
-        allocateIndex = -1;
+    if (descriptor->state == AFATFS_CACHE_STATE_EMPTY) {
+        afatfs_cacheHashInsert(cacheIndex);
+    } else if (state == AFATFS_CACHE_STATE_EMPTY) {
+        afatfs_cacheHashRemove(cacheIndex);
+        // A discarded sector won't be written, so its pre-erase hint is no use
+        afatfs_cacheSectorSetEraseHint(descriptor, 0);
     }
 
-    if (allocateIndex > -1) {
-        afatfs_cacheSectorInit(&afatfs.cacheDescriptor[allocateIndex], sectorIndex, false);
-    }
+    descriptor->state = state;
 
-    return allocateIndex;
+    afatfs_cacheSectorUpdateList(descriptor);
 }
 
 /**
- * Attempt to flush dirty cache pages out to the sdcard, returning true if all flushable data has been flushed.
+ * Bump the last access time of the cache entry so that it becomes the last candidate for eviction.
  */
-bool afatfs_flush()
+static void afatfs_cacheSectorTouch(int cacheIndex)
 {
-    if (afatfs.cacheDirtyEntries > 0) {
-        // Flush the oldest flushable sector
-        uint32_t earliestSectorTime = 0xFFFFFFFF;
-        int earliestSectorIndex = -1;
-
-        for (int i = 0; i < AFATFS_NUM_CACHE_SECTORS; i++) {
-            if (afatfs.cacheDescriptor[i].state == AFATFS_CACHE_STATE_DIRTY && !afatfs.cacheDescriptor[i].locked
-                && (earliestSectorIndex == -1 || afatfs.cacheDescriptor[i].writeTimestamp < earliestSectorTime)
-            ) {
-                earliestSectorIndex = i;
-                earliestSectorTime = afatfs.cacheDescriptor[i].writeTimestamp;
-            }
-        }
+    afatfsCacheBlockDescriptor_t *descriptor = &afatfs.cacheDescriptor[cacheIndex];
 
-        if (earliestSectorIndex > -1) {
-            afatfs_cacheFlushSector(earliestSectorIndex);
+    descriptor->accessTimestamp = ++afatfs.cacheTimer;
 
-            // That flush will take time to complete so we may as well tell caller to come back later
-            return false;
-        }
+    if (descriptor->list == AFATFS_CACHE_LIST_CLEAN || descriptor->list == AFATFS_CACHE_LIST_DISCARDABLE) {
+        // Move to the tail of the list
+        afatfs_cacheListRemove(cacheIndex);
+        afatfs_cacheListInsert(cacheIndex, descriptor->list);
     }
-
-    return true;
 }
 
-/**
- * Returns true if either the freefile or the regular cluster pool has been exhausted during a previous write operation.
- */
-bool afatfs_isFull()
+static void afatfs_cacheInit()
 {
-    return afatfs.filesystemFull;
-}
+    // Use as many buckets as we have cache sectors (rounded up to a power of two)
+    afatfs.cacheHashBucketMask = 0;
 
-/**
- * Get the physical sector number that corresponds to the FAT sector of the given fatSectorIndex within the given
- * FAT (fatIndex may be 0 or 1). (0, 0) gives the first sector of the first FAT.
- */
-static uint32_t afatfs_fatSectorToPhysical(int fatIndex, uint32_t fatSectorIndex)
-{
-    return afatfs.fatStartSector + (fatIndex ? afatfs.fatSectors : 0) + fatSectorIndex;
+    while (afatfs.cacheHashBucketMask + 1 < (uint32_t) afatfs.numCacheSectors && afatfs.cacheHashBucketMask + 1 < AFATFS_CACHE_HASH_BUCKETS) {
+        afatfs.cacheHashBucketMask = (afatfs.cacheHashBucketMask << 1) | 1;
+    }
+
+    for (uint32_t i = 0; i <= afatfs.cacheHashBucketMask; i++) {
+        afatfs.cacheHashBuckets[i] = -1;
+    }
+
+    for (int i = 0; i < AFATFS_CACHE_LIST_COUNT; i++) {
+        afatfs.cacheLists[i].head = -1;
+        afatfs.cacheLists[i].tail = -1;
+        afatfs.cacheLists[i].count = 0;
+    }
+
+    for (int i = 0; i < afatfs.numCacheSectors; i++) {
+        afatfs.cacheDescriptor[i].state = AFATFS_CACHE_STATE_EMPTY;
+        afatfs.cacheDescriptor[i].consecutiveEraseBlockCount = 0;
+        afatfs_cacheListInsert(i, AFATFS_CACHE_LIST_EMPTY);
+    }
+
+    afatfs.cacheDirtyEntries = 0;
+    afatfs.cacheEraseHints = 0;
+    afatfs.cacheMetadataWrites = 0;
 }
 
-static uint32_t afatfs_fileClusterToPhysical(uint32_t clusterNumber, uint32_t sectorIndex)
+static void afatfs_cacheSectorMarkDirty(afatfsCacheBlockDescriptor_t *descriptor)
 {
-    return afatfs.clusterStartSector + (clusterNumber - 2) * afatfs.sectorsPerCluster + sectorIndex;
+    if (descriptor->state != AFATFS_CACHE_STATE_DIRTY) {
+        descriptor->writeTimestamp = ++afatfs.cacheTimer;
+        afatfs_cacheSectorSetState(descriptor, AFATFS_CACHE_STATE_DIRTY);
+    }
 }
 
-static uint32_t afatfs_fileGetCursorPhysicalSector(afatfsFilePtr_t file)
+static void afatfs_cacheSectorInit(afatfsCacheBlockDescriptor_t *descriptor, uint32_t sectorIndex, bool locked)
 {
-    if (file->type == AFATFS_FILE_TYPE_FAT16_ROOT_DIRECTORY) {
-        return afatfs.fatStartSector + AFATFS_NUM_FATS * afatfs.fatSectors + file->cursorOffset / AFATFS_SECTOR_SIZE;
-    } else {
-        uint32_t cursorSectorInCluster = afatfs_sectorIndexInCluster(file->cursorOffset);
-        return afatfs_fileClusterToPhysical(file->cursorCluster, cursorSectorInCluster);
-    }
+    // Evict the previous contents (this must happen before the sector index changes so it can leave the hash table)
+    afatfs_cacheSectorSetState(descriptor, AFATFS_CACHE_STATE_EMPTY);
+
+    descriptor->sectorIndex = sectorIndex;
+
+    descriptor->accessTimestamp = descriptor->writeTimestamp = ++afatfs.cacheTimer;
+
+    afatfs_cacheSectorSetEraseHint(descriptor, 0);
+
+    descriptor->locked = locked;
+    descriptor->retainCount = 0;
+    descriptor->discardable = 0;
+    descriptor->fileData = 0;
+#if AFATFS_FAT_MIRROR_POLICY == AFATFS_FAT_MIRROR_LOCKSTEP
+    descriptor->mirrored = 0;
+#endif
+#if AFATFS_SDCARD_WRITE_QUEUE_DEPTH > 1
+    descriptor->writeInFlight = 0;
+#endif
 }
 
 /**
- * Sector here is the sector index within the cluster.
+ * Called by the SD card driver when one of our read operations completes.
  */
-static void afatfs_fileGetCursorClusterAndSector(afatfsFilePtr_t file, uint32_t *cluster, uint16_t *sector)
+static void afatfs_sdcardReadComplete(sdcardBlockOperation_e operation, uint32_t sectorIndex, uint8_t *buffer, uint32_t callbackData)
 {
-    *cluster = file->cursorCluster;
+    (void) operation;
+    (void) callbackData;
 
-    if (file->type == AFATFS_FILE_TYPE_FAT16_ROOT_DIRECTORY) {
-        *sector = file->cursorOffset / AFATFS_SECTOR_SIZE;
-    } else {
-        *sector = afatfs_sectorIndexInCluster(file->cursorOffset);
+    int i = afatfs_cacheHashFind(sectorIndex);
+
+    if (i != -1) {
+        if (buffer == NULL) {
+            // Read failed, mark the sector as empty and whoever asked for it will ask for it again later to retry
+            afatfs_cacheSectorSetState(&afatfs.cacheDescriptor[i], AFATFS_CACHE_STATE_EMPTY);
+        } else {
+            afatfs_assert(afatfs_cacheSectorGetMemory(i) == buffer && afatfs.cacheDescriptor[i].state == AFATFS_CACHE_STATE_READING);
+
+            afatfs_cacheSectorSetState(&afatfs.cacheDescriptor[i], AFATFS_CACHE_STATE_IN_SYNC);
+        }
     }
 }
 
+#if AFATFS_FAT_MIRROR_POLICY == AFATFS_FAT_MIRROR_LOCKSTEP
+
 /**
- * Get a cache entry for the given sector and store a pointer to the cached memory in *buffer.
- *
- * physicalSectorIndex - The index of the sector in the SD card to cache
- * sectorflags         - A union of AFATFS_CACHE_* constants that says which operations the sector will be cached for.
- * buffer              - A pointer to the 512-byte memory buffer for the sector will be stored here upon success
- * eraseCount          - For write operations, set to a non-zero number to hint that we plan to write that many sectors
- *                       consecutively (including this sector)
- *
- * Returns:
- *     AFATFS_OPERATION_SUCCESS     - On success
- *     AFATFS_OPERATION_IN_PROGRESS - Card is busy, call again later
- *     AFATFS_OPERATION_FAILURE     - When the filesystem encounters a fatal error
+ * Called by the SD card driver when the write of a FAT sector to the second FAT completes.
  */
-static afatfsOperationStatus_e afatfs_cacheSector(uint32_t physicalSectorIndex, uint8_t **buffer, uint8_t sectorFlags, uint32_t eraseCount)
+static void afatfs_sdcardMirrorWriteComplete(sdcardBlockOperation_e operation, uint32_t sectorIndex, uint8_t *buffer, uint32_t callbackData)
 {
-    // We never write to the MBR, so any attempt to write there is an asyncfatfs bug
-    if (!afatfs_assert((sectorFlags & AFATFS_CACHE_WRITE) == 0 || physicalSectorIndex != 0)) {
-        return AFATFS_OPERATION_FAILURE;
-    }
-
-    int cacheSectorIndex = afatfs_allocateCacheSector(physicalSectorIndex);
-
-    if (cacheSectorIndex == -1) {
-        // We don't have enough free cache to service this request right now, try again later
-        return AFATFS_OPERATION_IN_PROGRESS;
-    }
-
-    switch (afatfs.cacheDescriptor[cacheSectorIndex].state) {
-        case AFATFS_CACHE_STATE_READING:
-            return AFATFS_OPERATION_IN_PROGRESS;
-        break;
-
-        case AFATFS_CACHE_STATE_EMPTY:
-            if ((sectorFlags & AFATFS_CACHE_READ) != 0) {
-                if (sdcard_readBlock(physicalSectorIndex, afatfs_cacheSectorGetMemory(cacheSectorIndex), afatfs_sdcardReadComplete, 0)) {
-                    afatfs.cacheDescriptor[cacheSectorIndex].state = AFATFS_CACHE_STATE_READING;
-                }
-                return AFATFS_OPERATION_IN_PROGRESS;
-            }
+    (void) operation;
+    (void) callbackData;
 
-            // We only get to decide these fields if we're the first ones to cache the sector:
-            afatfs.cacheDescriptor[cacheSectorIndex].discardable = (sectorFlags & AFATFS_CACHE_DISCARDABLE) != 0 ? 1 : 0;
+    afatfs.cacheFlushesInProgress--;
 
-#ifdef AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT
-            // Don't bother pre-erasing for small block sequences
-            if (eraseCount < AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT) {
-                eraseCount = 0;
-            } else {
-                eraseCount = MIN(eraseCount, UINT16_MAX); // If caller asked for a longer chain of sectors we silently truncate that here
-            }
+    int i = afatfs_cacheHashFind(sectorIndex - afatfs.fatSectors);
 
-            afatfs.cacheDescriptor[cacheSectorIndex].consecutiveEraseBlockCount = eraseCount;
+    if (i != -1) {
+#if AFATFS_SDCARD_WRITE_QUEUE_DEPTH > 1
+        afatfs.cacheDescriptor[i].writeInFlight = 0;
 #endif
 
-            // Fall through
-
-        case AFATFS_CACHE_STATE_WRITING:
-        case AFATFS_CACHE_STATE_IN_SYNC:
-            if ((sectorFlags & AFATFS_CACHE_WRITE) != 0) {
-                afatfs_cacheSectorMarkDirty(&afatfs.cacheDescriptor[cacheSectorIndex]);
-            }
-            // Fall through
-
-        case AFATFS_CACHE_STATE_DIRTY:
-            if ((sectorFlags & AFATFS_CACHE_LOCK) != 0) {
-                afatfs.cacheDescriptor[cacheSectorIndex].locked = 1;
-            }
-            if ((sectorFlags & AFATFS_CACHE_RETAIN) != 0) {
-                afatfs.cacheDescriptor[cacheSectorIndex].retainCount++;
-            }
-
-            *buffer = afatfs_cacheSectorGetMemory(cacheSectorIndex);
-
-            return AFATFS_OPERATION_SUCCESS;
-        break;
-
-        default:
-            // Cache block in unknown state, should never happen
-            afatfs_assert(false);
-            return AFATFS_OPERATION_FAILURE;
+        if (buffer == NULL) {
+            // Write failed, so the first FAT's copy of the sector will have to be mirrored again before it can be flushed
+            afatfs.cacheDescriptor[i].mirrored = 0;
+        }
     }
 }
 
+#endif
+
 /**
- * Parse the details out of the given MBR sector (512 bytes long). Return true if a compatible filesystem was found.
+ * Called by the SD card driver when one of our write operations completes.
  */
-static bool afatfs_parseMBR(const uint8_t *sector)
+static void afatfs_sdcardWriteComplete(sdcardBlockOperation_e operation, uint32_t sectorIndex, uint8_t *buffer, uint32_t callbackData)
 {
-    // Check MBR signature
-    if (sector[AFATFS_SECTOR_SIZE - 2] != 0x55 || sector[AFATFS_SECTOR_SIZE - 1] != 0xAA)
-        return false;
+    (void) operation;
+    (void) callbackData;
 
-    mbrPartitionEntry_t *partition = (mbrPartitionEntry_t *) (sector + 446);
+    afatfs.cacheFlushesInProgress--;
 
-    for (int i = 0; i < 4; i++) {
-        if (
-            partition[i].lbaBegin > 0
-            && (
-                partition[i].type == MBR_PARTITION_TYPE_FAT32
-                || partition[i].type == MBR_PARTITION_TYPE_FAT32_LBA
-                || partition[i].type == MBR_PARTITION_TYPE_FAT16
-                || partition[i].type == MBR_PARTITION_TYPE_FAT16_LBA
-            )
-        ) {
-            afatfs.partitionStartSector = partition[i].lbaBegin;
+    int i = afatfs_cacheHashFind(sectorIndex);
 
-            return true;
-        }
+#if AFATFS_SDCARD_WRITE_QUEUE_DEPTH > 1
+    if (i != -1) {
+        afatfs.cacheDescriptor[i].writeInFlight = 0;
     }
+#endif
 
-    return false;
+    /* Keep in mind that someone may have marked the sector as dirty after writing had already begun. In this case we must leave
+     * it marked as dirty because those modifications may have been made too late to make it to the disk!
+     */
+    if (i != -1 && afatfs.cacheDescriptor[i].state == AFATFS_CACHE_STATE_WRITING) {
+        if (buffer == NULL) {
+            // Write failed, remark the sector as dirty
+            afatfs_cacheSectorSetState(&afatfs.cacheDescriptor[i], AFATFS_CACHE_STATE_DIRTY);
+        } else {
+            afatfs_assert(afatfs_cacheSectorGetMemory(i) == buffer);
+
+            afatfs_cacheSectorSetState(&afatfs.cacheDescriptor[i], AFATFS_CACHE_STATE_IN_SYNC);
+        }
+    }
 }
 
-static bool afatfs_parseVolumeID(const uint8_t *sector)
+/**
+ * Attempt to flush the dirty cache entry with the given index to the SDcard. Returns true if the card accepted the
+ * write.
+ */
+static bool afatfs_cacheFlushSector(int cacheIndex)
 {
-    fatVolumeID_t *volume = (fatVolumeID_t *) sector;
+    afatfsCacheBlockDescriptor_t *cacheDescriptor = &afatfs.cacheDescriptor[cacheIndex];
 
-    afatfs.filesystemType = FAT_FILESYSTEM_TYPE_INVALID;
+#if AFATFS_FAT_MIRROR_POLICY == AFATFS_FAT_MIRROR_LOCKSTEP
+    /*
+     * Sectors of the first FAT are written to the second FAT first, while the sector is still dirty and so can't be
+     * evicted. The sector remains dirty until it has been written to the first FAT on a later call.
+     */
+    if (
+        afatfs.numFATs > 1 && !cacheDescriptor->mirrored
+        && cacheDescriptor->sectorIndex >= afatfs.fatStartSector && cacheDescriptor->sectorIndex < afatfs.fatStartSector + afatfs.fatSectors
+    ) {
+        switch (sdcard_writeBlock(cacheDescriptor->sectorIndex + afatfs.fatSectors, afatfs_cacheSectorGetMemory(cacheIndex), afatfs_sdcardMirrorWriteComplete, 0)) {
+            case SDCARD_OPERATION_IN_PROGRESS:
+                afatfs.cacheFlushesInProgress++;
+#if AFATFS_SDCARD_WRITE_QUEUE_DEPTH > 1
+                cacheDescriptor->writeInFlight = 1;
+#endif
+                // Fall through
+            case SDCARD_OPERATION_SUCCESS:
+                cacheDescriptor->mirrored = 1;
+            break;
+            default:
+                ;
+        }
 
-    if (volume->bytesPerSector != AFATFS_SECTOR_SIZE || volume->numFATs != AFATFS_NUM_FATS
-            || sector[510] != FAT_VOLUME_ID_SIGNATURE_1 || sector[511] != FAT_VOLUME_ID_SIGNATURE_2) {
         return false;
     }
+#endif
 
-    afatfs.fatStartSector = afatfs.partitionStartSector + volume->reservedSectorCount;
-
-    afatfs.sectorsPerCluster = volume->sectorsPerCluster;
-    if (afatfs.sectorsPerCluster < 1 || afatfs.sectorsPerCluster > 128 || !isPowerOfTwo(afatfs.sectorsPerCluster)) {
+#ifdef AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT
+    if (
+        cacheDescriptor->consecutiveEraseBlockCount
+        && afatfs_sdcardBeginWriteBlocks(cacheDescriptor->sectorIndex, cacheDescriptor->consecutiveEraseBlockCount) == SDCARD_OPERATION_BUSY
+        && afatfs.cacheFlushesInProgress > 0
+    ) {
+        // The card can't be told about the pre-erase until it has finished our queued writes, so wait for those first
         return false;
     }
+#endif
 
-    afatfs.byteInClusterMask = AFATFS_SECTOR_SIZE * afatfs.sectorsPerCluster - 1;
-
-    afatfs.fatSectors = volume->FATSize16 != 0 ? volume->FATSize16 : volume->fatDescriptor.fat32.FATSize32;
-
-    // Always zero on FAT32 since rootEntryCount is always zero (this is non-zero on FAT16)
-    afatfs.rootDirectorySectors = ((volume->rootEntryCount * FAT_DIRECTORY_ENTRY_SIZE) + (volume->bytesPerSector - 1)) / volume->bytesPerSector;
-    uint32_t totalSectors = volume->totalSectors16 != 0 ? volume->totalSectors16 : volume->totalSectors32;
-    uint32_t dataSectors = totalSectors - (volume->reservedSectorCount + (AFATFS_NUM_FATS * afatfs.fatSectors) + afatfs.rootDirectorySectors);
-
-    afatfs.numClusters = dataSectors / volume->sectorsPerCluster;
-
-    if (afatfs.numClusters <= FAT12_MAX_CLUSTERS) {
-        afatfs.filesystemType = FAT_FILESYSTEM_TYPE_FAT12;
+    switch (sdcard_writeBlock(cacheDescriptor->sectorIndex, afatfs_cacheSectorGetMemory(cacheIndex), afatfs_sdcardWriteComplete, 0)) {
+        case SDCARD_OPERATION_IN_PROGRESS:
+            // The card will call us back later when the buffer transmission finishes
+            afatfs_cacheSectorSetState(cacheDescriptor, AFATFS_CACHE_STATE_WRITING);
+            afatfs.cacheFlushesInProgress++;
+#if AFATFS_SDCARD_WRITE_QUEUE_DEPTH > 1
+            cacheDescriptor->writeInFlight = 1;
+#endif
+            break;
 
-        return false; // FAT12 is not a supported filesystem
-    } else if (afatfs.numClusters <= FAT16_MAX_CLUSTERS) {
-        afatfs.filesystemType = FAT_FILESYSTEM_TYPE_FAT16;
-    } else {
-        afatfs.filesystemType = FAT_FILESYSTEM_TYPE_FAT32;
-    }
+        case SDCARD_OPERATION_SUCCESS:
+            // Buffer is already transmitted
+            afatfs_cacheSectorSetState(cacheDescriptor, AFATFS_CACHE_STATE_IN_SYNC);
+            break;
 
-    if (afatfs.filesystemType == FAT_FILESYSTEM_TYPE_FAT32) {
-        afatfs.rootDirectoryCluster = volume->fatDescriptor.fat32.rootCluster;
-    } else {
-        // FAT16 doesn't store the root directory in clusters
-        afatfs.rootDirectoryCluster = 0;
+        case SDCARD_OPERATION_BUSY:
+        case SDCARD_OPERATION_FAILURE:
+        default:
+            return false;
     }
 
-    uint32_t endOfFATs = afatfs.fatStartSector + AFATFS_NUM_FATS * afatfs.fatSectors;
+#ifdef AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT
+    /*
+     * The pre-erase hint has been used up. The sectors that it covered may hold data by the time this sector is written
+     * again, so they must not be erased a second time.
+     */
+    afatfs_cacheSectorSetEraseHint(cacheDescriptor, 0);
+#endif
 
-    afatfs.clusterStartSector = endOfFATs + afatfs.rootDirectorySectors;
+#ifdef AFATFS_USE_STATS
+    afatfs.stats.dirtyFlushes++;
+#endif
 
     return true;
 }
 
 /**
- * Get the position of the FAT entry for the cluster with the given number.
+ * Find a sector in the cache which corresponds to the given physical sector index, or NULL if the sector isn't
+ * cached. The cached sector could be in any state apart from empty.
  */
-static void afatfs_getFATPositionForCluster(uint32_t cluster, uint32_t *fatSectorIndex, uint32_t *fatSectorEntryIndex)
+static afatfsCacheBlockDescriptor_t* afatfs_findCacheSector(uint32_t sectorIndex)
 {
-    if (afatfs.filesystemType == FAT_FILESYSTEM_TYPE_FAT16) {
-        uint32_t entriesPerFATSector = AFATFS_SECTOR_SIZE / sizeof(uint16_t);
-
-        *fatSectorIndex = cluster / entriesPerFATSector;
-        *fatSectorEntryIndex = cluster & (entriesPerFATSector - 1);
-    } else {
-        uint32_t entriesPerFATSector = AFATFS_SECTOR_SIZE / sizeof(uint32_t);
+    int cacheIndex = afatfs_cacheHashFind(sectorIndex);
 
-        *fatSectorIndex = fat32_decodeClusterNumber(cluster) / entriesPerFATSector;
-        *fatSectorEntryIndex = cluster & (entriesPerFATSector - 1);
+    if (cacheIndex == -1) {
+        return NULL;
     }
+
+    return &afatfs.cacheDescriptor[cacheIndex];
 }
 
-static bool afatfs_FATIsEndOfChainMarker(uint32_t clusterNumber)
+/**
+ * Is an earlier write of this sector still being sent to the card? The sector may have been dirtied again since then,
+ * but it can't be written again until that write completes.
+ */
+static bool afatfs_cacheSectorWriteInFlight(afatfsCacheBlockDescriptor_t *descriptor)
 {
-    if (afatfs.filesystemType == FAT_FILESYSTEM_TYPE_FAT32) {
-        return fat32_isEndOfChainMarker(clusterNumber);
-    } else {
-        return fat16_isEndOfChainMarker(clusterNumber);
-    }
+#if AFATFS_SDCARD_WRITE_QUEUE_DEPTH > 1
+    return descriptor->writeInFlight;
+#else
+    (void) descriptor;
+    return false;
+#endif
 }
 
 /**
- * Look up the FAT to find out which cluster follows the one with the given number and store it into *nextCluster.
- *
- * Use fat_isFreeSpace() and fat_isEndOfChainMarker() on nextCluster to distinguish those special values from regular
- * cluster numbers.
+ * Prepare the cache for the given physical sector to be overwritten in its entirety on disk by a write that doesn't go
+ * through the cache, using the 512 bytes of new content in `newContents`.
  *
- * Note that if you're trying to find the next cluster of a file, you should be calling afatfs_fileGetNextCluster()
- * instead, as that one supports contiguous freefile-based files (which needn't consult the FAT).
+ * Any cached copy of the sector is discarded (or updated with the new content if somebody is holding on to it), and any
+ * pending pre-erase hint on an earlier dirty sector that would erase the written sector is shortened to stop before it.
  *
- * Returns:
- *     AFATFS_OPERATION_IN_PROGRESS - FS is busy right now, call again later
- *     AFATFS_OPERATION_SUCCESS     - *nextCluster is set to the next cluster number
+ * Returns false if the cached copy of the sector is currently being transferred from/to the card (try again later).
  */
-static afatfsOperationStatus_e afatfs_FATGetNextCluster(int fatIndex, uint32_t cluster, uint32_t *nextCluster)
+static bool afatfs_cacheSectorPrepareForDirectWrite(uint32_t physicalSectorIndex, const uint8_t *newContents)
 {
-    uint32_t fatSectorIndex, fatSectorEntryIndex;
-    afatfsFATSector_t sector;
+    int cacheIndex = afatfs_cacheHashFind(physicalSectorIndex);
+
+    if (cacheIndex != -1) {
+        afatfsCacheBlockDescriptor_t *descriptor = &afatfs.cacheDescriptor[cacheIndex];
+
+        switch (descriptor->state) {
+            case AFATFS_CACHE_STATE_READING:
+            case AFATFS_CACHE_STATE_WRITING:
+                return false;
+            case AFATFS_CACHE_STATE_DIRTY:
+                if (afatfs_cacheSectorWriteInFlight(descriptor)) {
+                    return false;
+                }
+                // Fall through
+            case AFATFS_CACHE_STATE_IN_SYNC:
+                if (descriptor->locked || descriptor->retainCount > 0) {
+                    /*
+                     * Somebody expects this sector to stay in memory, so keep their copy up to date. If it was
+                     * dirty then it'll be flushed again later with the same contents we're about to write.
+                     */
+                    memcpy(afatfs_cacheSectorGetMemory(cacheIndex), newContents, AFATFS_SECTOR_SIZE);
+                } else {
+                    afatfs_cacheSectorSetState(descriptor, AFATFS_CACHE_STATE_EMPTY);
+                }
+            break;
+            default:
+                ;
+        }
+    }
 
-    afatfs_getFATPositionForCluster(cluster, &fatSectorIndex, &fatSectorEntryIndex);
+    /*
+     * Only dirty sectors can carry a pre-erase hint that's still to be used, and usually none of them do (so a bulk
+     * direct write doesn't have to look through the cache for every sector).
+     */
+    int hintsToCheck = afatfs.cacheEraseHints;
 
-    afatfsOperationStatus_e result = afatfs_cacheSector(afatfs_fatSectorToPhysical(fatIndex, fatSectorIndex), &sector.bytes, AFATFS_CACHE_READ, 0);
+    for (int i = afatfs.cacheLists[AFATFS_CACHE_LIST_DIRTY].head; i != -1 && hintsToCheck > 0; i = afatfs.cacheDescriptor[i].listNext) {
+        afatfsCacheBlockDescriptor_t *descriptor = &afatfs.cacheDescriptor[i];
 
-    if (result == AFATFS_OPERATION_SUCCESS) {
-        if (afatfs.filesystemType == FAT_FILESYSTEM_TYPE_FAT16) {
-            *nextCluster = sector.fat16[fatSectorEntryIndex];
-        } else {
-            *nextCluster = fat32_decodeClusterNumber(sector.fat32[fatSectorEntryIndex]);
+        if (descriptor->consecutiveEraseBlockCount == 0) {
+            continue;
+        }
+
+        hintsToCheck--;
+
+        if (
+            descriptor->sectorIndex < physicalSectorIndex
+            && physicalSectorIndex < descriptor->sectorIndex + descriptor->consecutiveEraseBlockCount
+        ) {
+            descriptor->consecutiveEraseBlockCount = physicalSectorIndex - descriptor->sectorIndex;
         }
     }
 
-    return result;
+    return true;
 }
 
+#ifdef AFATFS_USE_CACHE_CLASSES
+
 /**
- * Set the cluster number that follows the given cluster. Pass 0xFFFFFFFF for nextCluster to terminate the FAT chain.
- *
- * Returns:
- *     AFATFS_OPERATION_SUCCESS     - On success
- *     AFATFS_OPERATION_IN_PROGRESS - Card is busy, call again later
- *     AFATFS_OPERATION_FAILURE     - When the filesystem encounters a fatal error
+ * Decide which class a sector that's about to be cached with the given AFATFS_CACHE_* flags belongs to.
  */
-static afatfsOperationStatus_e afatfs_FATSetNextCluster(uint32_t startCluster, uint32_t nextCluster)
+static afatfsCacheClass_e afatfs_cacheSectorClassify(uint32_t sectorIndex, uint8_t sectorFlags)
 {
-    afatfsFATSector_t sector;
-    uint32_t fatSectorIndex, fatSectorEntryIndex, fatPhysicalSector;
-    afatfsOperationStatus_e result;
-
-    if(!afatfs_assert(startCluster >= FAT_SMALLEST_LEGAL_CLUSTER_NUMBER)){
-        return AFATFS_OPERATION_FAILURE; // startCluster is not valid;
+    if (sectorIndex >= afatfs.fatStartSector && sectorIndex < afatfs.fatStartSector + afatfs.numFATs * afatfs.fatSectors) {
+        return AFATFS_CACHE_CLASS_FAT;
     }
-
-    afatfs_getFATPositionForCluster(startCluster, &fatSectorIndex, &fatSectorEntryIndex);
-
-    fatPhysicalSector = afatfs_fatSectorToPhysical(0, fatSectorIndex);
-
-    result = afatfs_cacheSector(fatPhysicalSector, &sector.bytes, AFATFS_CACHE_READ | AFATFS_CACHE_WRITE, 0);
-
-    if (result == AFATFS_OPERATION_SUCCESS) {
-        if (afatfs.filesystemType == FAT_FILESYSTEM_TYPE_FAT16) {
-            sector.fat16[fatSectorEntryIndex] = nextCluster;
-        } else {
-            sector.fat32[fatSectorEntryIndex] = nextCluster;
-        }
+    if ((sectorFlags & AFATFS_CACHE_READ_AHEAD) != 0) {
+        return AFATFS_CACHE_CLASS_READ_AHEAD;
+    }
+    if ((sectorFlags & AFATFS_CACHE_FILE_DATA) != 0) {
+        return AFATFS_CACHE_CLASS_FILE_DATA;
     }
 
-    return result;
+    // Directories, and the other filesystem structures that we read during init
+    return AFATFS_CACHE_CLASS_DIRECTORY;
 }
 
 /**
- * Bring the logical filesize up to date with the current cursor position.
+ * May this in-sync cache entry be evicted to make room for a sector of the given class? Classes only protect their
+ * reserved entries from the other classes.
+ *
+ * Pinned sectors can't be evicted anyway, so they don't count towards the reserve of their class.
  */
-static void afatfs_fileUpdateFilesize(afatfsFile_t *file)
+static bool afatfs_cacheClassMayEvict(const afatfsCacheBlockDescriptor_t *descriptor, afatfsCacheClass_e cacheClass)
 {
-    file->logicalSize = MAX(file->logicalSize, file->cursorOffset);
+    return descriptor->cacheClass == cacheClass
+        || afatfs.cacheClassSectors[descriptor->cacheClass] > afatfs.cacheClassReserve[descriptor->cacheClass];
 }
 
-static void afatfs_fileUnlockCacheSector(afatfsFilePtr_t file)
+/**
+ * Choose the cache entry to store a new sector of the given class in, in the same order of preference as
+ * afatfs_allocateCacheSector(), but leaving enough empty entries for the other classes to fill their reserves and
+ * skipping over sectors that are protected by their class's reserve.
+ */
+static int afatfs_cacheClassChooseEntry(afatfsCacheClass_e cacheClass, bool evictSynced)
 {
-    if (file->writeLockedCacheIndex != -1) {
-        afatfs.cacheDescriptor[file->writeLockedCacheIndex].locked = 0;
-        file->writeLockedCacheIndex = -1;
+    int reservedEmptyEntries = 0;
+
+    for (int i = 0; i < AFATFS_CACHE_CLASS_COUNT; i++) {
+        if (i != (int) cacheClass && afatfs.cacheClassSectors[i] < afatfs.cacheClassReserve[i]) {
+            reservedEmptyEntries += afatfs.cacheClassReserve[i] - afatfs.cacheClassSectors[i];
+        }
     }
-    if (file->readRetainCacheIndex != -1) {
-        afatfs.cacheDescriptor[file->readRetainCacheIndex].retainCount = MAX((int) afatfs.cacheDescriptor[file->readRetainCacheIndex].retainCount - 1, 0);
-        file->readRetainCacheIndex = -1;
+
+    if (afatfs.cacheLists[AFATFS_CACHE_LIST_EMPTY].count > reservedEmptyEntries) {
+        return afatfs.cacheLists[AFATFS_CACHE_LIST_EMPTY].head;
+    }
+
+    for (int i = afatfs.cacheLists[AFATFS_CACHE_LIST_DISCARDABLE].head; i != -1; i = afatfs.cacheDescriptor[i].listNext) {
+        if (afatfs_cacheClassMayEvict(&afatfs.cacheDescriptor[i], cacheClass)) {
+            return i;
+        }
+    }
+
+    if (evictSynced) {
+        // The least-recently used synced sector that we're allowed to take
+        for (int i = afatfs.cacheLists[AFATFS_CACHE_LIST_CLEAN].head; i != -1; i = afatfs.cacheDescriptor[i].listNext) {
+            if (afatfs_cacheClassMayEvict(&afatfs.cacheDescriptor[i], cacheClass)) {
+                return i;
+            }
+        }
     }
+
+    return -1;
 }
 
+#endif
+
 /**
- * Starting from and including the given cluster number, find the number of the first cluster which matches the given
- * condition.
+ * Find or allocate a cache sector for the given sector index on disk. Returns a block which matches one of these
+ * conditions (in descending order of preference):
  *
- * searchLimit - Last cluster to examine (exclusive). To search the entire volume, pass:
- *                   afatfs.numClusters + FAT_SMALLEST_LEGAL_CLUSTER_NUMBER
+ * - The requested sector that already exists in the cache
+ * - The index of an empty sector
+ * - The index of a synced discardable sector
+ * - The index of the oldest synced sector (only if evictSynced is true)
  *
- * Condition:
- *     CLUSTER_SEARCH_FREE_AT_BEGINNING_OF_FAT_SECTOR - Find a cluster marked as free in the FAT which lies at the
- *         beginning of its FAT sector. The passed initial search 'cluster' must correspond to the first entry of a FAT sector.
- *     CLUSTER_SEARCH_FREE            - Find a cluster marked as free in the FAT
- *     CLUSTER_SEARCH_OCCUPIED        - Find a cluster marked as occupied in the FAT.
+ * When AFATFS_USE_CACHE_CLASSES is defined, the reserves of the other classes are respected while doing so (see
+ * afatfs_setCacheReserve()), and the sector is counted as a hit or miss for its class.
  *
- * Returns:
- *     AFATFS_FIND_CLUSTER_FOUND       - A cluster matching the criteria was found and stored in *cluster
- *     AFATFS_FIND_CLUSTER_IN_PROGRESS - The search is not over, call this routine again later with the updated *cluster value to resume
- *     AFATFS_FIND_CLUSTER_FATAL       - An unexpected read error occurred, the volume should be abandoned
- *     AFATFS_FIND_CLUSTER_NOT_FOUND   - The entire device was searched without finding a suitable cluster (the
- *                                       *cluster points to just beyond the final cluster).
+ * Otherwise it returns -1 to signal failure (cache is full!)
  */
-static afatfsFindClusterStatus_e afatfs_findClusterWithCondition(afatfsClusterSearchCondition_e condition, uint32_t *cluster, uint32_t searchLimit)
+static int afatfs_allocateCacheSector(uint32_t sectorIndex, bool evictSynced, uint8_t sectorFlags)
 {
-    afatfsFATSector_t sector;
-    uint32_t fatSectorIndex, fatSectorEntryIndex;
-
-    uint32_t fatEntriesPerSector = afatfs_fatEntriesPerSector();
-    bool lookingForFree = condition == CLUSTER_SEARCH_FREE_AT_BEGINNING_OF_FAT_SECTOR || condition == CLUSTER_SEARCH_FREE;
+    int allocateIndex;
 
-    int jump;
+    if (
+        !afatfs_assert(
+            afatfs.numClusters == 0 // We're unable to check sector bounds during startup since we haven't read volume label yet
+            || sectorIndex < afatfs.clusterStartSector + afatfs.numClusters * afatfs.sectorsPerCluster
+        )
+    ) {
+        return -1;
+    }
 
-    // Get the FAT entry which corresponds to this cluster so we can begin our search there
-    afatfs_getFATPositionForCluster(*cluster, &fatSectorIndex, &fatSectorEntryIndex);
+#ifdef AFATFS_USE_CACHE_CLASSES
+    afatfsCacheClass_e cacheClass = afatfs_cacheSectorClassify(sectorIndex, sectorFlags);
+#else
+    (void) sectorFlags;
+#endif
 
-    switch (condition) {
-        case CLUSTER_SEARCH_FREE_AT_BEGINNING_OF_FAT_SECTOR:
-            jump = fatEntriesPerSector;
+    allocateIndex = afatfs_cacheHashFind(sectorIndex);
 
-            // We're supposed to call this routine with the cluster properly aligned
-            if (!afatfs_assert(fatSectorEntryIndex == 0)) {
-                return AFATFS_FIND_CLUSTER_FATAL;
-            }
-        break;
-        case CLUSTER_SEARCH_OCCUPIED:
-        case CLUSTER_SEARCH_FREE:
-            jump = 1;
-        break;
-        default:
-            afatfs_assert(false);
-            return AFATFS_FIND_CLUSTER_FATAL;
-    }
+    if (allocateIndex > -1) {
+#ifdef AFATFS_USE_CACHE_CLASSES
+        afatfsCacheBlockDescriptor_t *descriptor = &afatfs.cacheDescriptor[allocateIndex];
 
-    while (*cluster < searchLimit) {
+        // Don't count our own calls while we're waiting for the sector to arrive
+        if (descriptor->state != AFATFS_CACHE_STATE_READING) {
+            afatfs.cacheClassStats[cacheClass].hits++;
+        }
 
-#ifdef AFATFS_USE_FREEFILE
-        // If we're looking inside the freefile, we won't find any free clusters! Skip it!
-        if (afatfs.freeFile.logicalSize > 0 && *cluster == afatfs.freeFile.firstCluster) {
-            *cluster += (afatfs.freeFile.logicalSize + afatfs_clusterSize() - 1) / afatfs_clusterSize();
+        // A sector that was read ahead becomes a sector of whoever ends up asking for it
+        if (descriptor->cacheClass == AFATFS_CACHE_CLASS_READ_AHEAD && cacheClass != AFATFS_CACHE_CLASS_READ_AHEAD) {
+            afatfsCacheList_e list = descriptor->list;
 
-            // Maintain alignment
-            *cluster = roundUpTo(*cluster, jump);
-            continue; // Go back to check that the new cluster number is within the volume
+            // Take it off its list while we change its class so that the counts of the classes stay correct
+            afatfs_cacheListRemove(allocateIndex);
+            descriptor->cacheClass = cacheClass;
+            afatfs_cacheListInsert(allocateIndex, list);
         }
 #endif
 
-        afatfsOperationStatus_e status = afatfs_cacheSector(afatfs_fatSectorToPhysical(0, fatSectorIndex), &sector.bytes, AFATFS_CACHE_READ | AFATFS_CACHE_DISCARDABLE, 0);
+        afatfs_cacheSectorTouch(allocateIndex);
+        return allocateIndex;
+    }
 
-        switch (status) {
-            case AFATFS_OPERATION_SUCCESS:
-                do {
-                    uint32_t clusterNumber;
+#ifdef AFATFS_USE_CACHE_CLASSES
+    allocateIndex = afatfs_cacheClassChooseEntry(cacheClass, evictSynced);
+#else
+    if (afatfs.cacheLists[AFATFS_CACHE_LIST_EMPTY].head != -1) {
+        allocateIndex = afatfs.cacheLists[AFATFS_CACHE_LIST_EMPTY].head;
+    } else if (afatfs.cacheLists[AFATFS_CACHE_LIST_DISCARDABLE].head != -1) {
+        allocateIndex = afatfs.cacheLists[AFATFS_CACHE_LIST_DISCARDABLE].head;
+    } else if (afatfs.cacheLists[AFATFS_CACHE_LIST_CLEAN].head != -1 && evictSynced) {
+        // The least-recently used synced sector
+        allocateIndex = afatfs.cacheLists[AFATFS_CACHE_LIST_CLEAN].head;
+    } else {
+        allocateIndex = -1;
+    }
+#endif
 
-                    switch (afatfs.filesystemType) {
-                        case FAT_FILESYSTEM_TYPE_FAT16:
-                            clusterNumber = sector.fat16[fatSectorEntryIndex];
-                        break;
-                        case FAT_FILESYSTEM_TYPE_FAT32:
-                            clusterNumber = fat32_decodeClusterNumber(sector.fat32[fatSectorEntryIndex]);
-                        break;
-                        default:
-                            return AFATFS_FIND_CLUSTER_FATAL;
-                    }
+    if (allocateIndex > -1) {
+#ifdef AFATFS_USE_CACHE_CLASSES
+        afatfsCacheBlockDescriptor_t *descriptor = &afatfs.cacheDescriptor[allocateIndex];
 
-                    if (fat_isFreeSpace(clusterNumber) == lookingForFree) {
-                        /*
-                         * The final FAT sector may have fewer than fatEntriesPerSector entries in it, so we need to
-                         * check the cluster number is valid here before we report a bogus success!
-                         */
-                        if (*cluster < searchLimit) {
-                            return AFATFS_FIND_CLUSTER_FOUND;
-                        } else {
-                            *cluster = searchLimit;
-                            return AFATFS_FIND_CLUSTER_NOT_FOUND;
-                        }
-                    }
+        if (descriptor->state != AFATFS_CACHE_STATE_EMPTY) {
+            afatfs.cacheClassStats[descriptor->cacheClass].evictions++;
+        }
+        afatfs.cacheClassStats[cacheClass].misses++;
+#endif
 
-                    (*cluster) += jump;
-                    fatSectorEntryIndex += jump;
-                } while (fatSectorEntryIndex < fatEntriesPerSector);
+        afatfs_cacheSectorInit(&afatfs.cacheDescriptor[allocateIndex], sectorIndex, false);
 
-                // Move on to the next FAT sector
-                fatSectorIndex++;
-                fatSectorEntryIndex = 0;
-            break;
-            case AFATFS_OPERATION_FAILURE:
-                return AFATFS_FIND_CLUSTER_FATAL;
-            break;
-            case AFATFS_OPERATION_IN_PROGRESS:
-                return AFATFS_FIND_CLUSTER_IN_PROGRESS;
-            break;
-        }
+#ifdef AFATFS_USE_CACHE_CLASSES
+        // The entry is on the empty list now, so its class can change without upsetting the counts of the classes
+        descriptor->cacheClass = cacheClass;
+#endif
     }
 
-    // We looked at every available cluster and didn't find one matching the condition
-    *cluster = searchLimit;
-    return AFATFS_FIND_CLUSTER_NOT_FOUND;
+#ifdef AFATFS_CARD_PAGE_SECTORS
+    // Read-ahead that doesn't find room is simply skipped, so it doesn't need any sectors to be released for it
+    if ((sectorFlags & AFATFS_CACHE_READ_AHEAD) == 0) {
+        afatfs.cacheAllocationFailed = allocateIndex == -1;
+    }
+#endif
+
+    return allocateIndex;
 }
 
+#ifdef AFATFS_CARD_PAGE_SECTORS
+
 /**
- * Get the cluster that follows the currentCluster in the FAT chain for the given file.
- *
- * Returns:
- *     AFATFS_OPERATION_IN_PROGRESS - FS is busy right now, call again later
- *     AFATFS_OPERATION_SUCCESS     - *nextCluster is set to the next cluster number
+ * Is an open file still writing into the card page that holds the given sector?
  */
-static afatfsOperationStatus_e afatfs_fileGetNextCluster(afatfsFilePtr_t file, uint32_t currentCluster, uint32_t *nextCluster)
+static bool afatfs_cachePageIsBeingWritten(uint32_t sectorIndex)
 {
-#ifndef AFATFS_USE_FREEFILE
-    (void) file;
-#else
-    if ((file->mode & AFATFS_FILE_MODE_CONTIGUOUS) != 0) {
-        uint32_t freeFileStart = afatfs.freeFile.firstCluster;
+    uint32_t page = sectorIndex / AFATFS_CARD_PAGE_SECTORS;
 
-        afatfs_assert(currentCluster + 1 <= freeFileStart);
+    for (int i = 0; i < afatfs.maxOpenFiles; i++) {
+        afatfsFile_t *file = &afatfs.openFiles[i];
 
-        // Would the next cluster lie outside the allocated file? (i.e. beyond the end of the file into the start of the freefile)
-        if (currentCluster + 1 == freeFileStart) {
-            *nextCluster = 0;
-        } else {
-            *nextCluster = currentCluster + 1;
+        if (file->type != AFATFS_FILE_TYPE_NONE && file->writePageSector != 0 && file->writePageSector / AFATFS_CARD_PAGE_SECTORS == page) {
+            return true;
         }
-
-        return AFATFS_OPERATION_SUCCESS;
-    } else
-#endif
-    {
-        return afatfs_FATGetNextCluster(0, currentCluster, nextCluster);
     }
+
+    return false;
 }
 
-#ifdef AFATFS_USE_FREEFILE
+#endif
 
 /**
- * Update the FAT to fill the contiguous series of clusters with indexes [*startCluster...endCluster) with the
- * specified pattern.
- *
- * AFATFS_FAT_PATTERN_TERMINATED_CHAIN - Chain the clusters together in linear sequence and terminate the final cluster
- * AFATFS_FAT_PATTERN_CHAIN            - Chain the clusters together without terminating the final entry
- * AFATFS_FAT_PATTERN_FREE             - Mark the clusters as free space
- *
- * Returns -
- *     AFATFS_OPERATION_SUCCESS        - When the entire chain has been written
- *     AFATFS_OPERATION_IN_PROGRESS    - Call again later with the updated *startCluster value in order to resume writing.
+ * Should this dirty sector wait for the rest of its card page to be written before it goes to the card? See
+ * AFATFS_CARD_PAGE_SECTORS.
  */
-static afatfsOperationStatus_e afatfs_FATFillWithPattern(afatfsFATPattern_e pattern, uint32_t *startCluster, uint32_t endCluster)
+static bool afatfs_cacheSectorAwaitsRestOfPage(int cacheIndex)
 {
-    afatfsFATSector_t sector;
-    uint32_t fatSectorIndex, firstEntryIndex, fatPhysicalSector;
-    uint8_t fatEntrySize;
-    uint32_t nextCluster;
-    afatfsOperationStatus_e result;
-    uint32_t eraseSectorCount;
-
-    // Find the position of the initial cluster to begin our fill
-    afatfs_getFATPositionForCluster(*startCluster, &fatSectorIndex, &firstEntryIndex);
+#ifdef AFATFS_CARD_PAGE_SECTORS
+    afatfsCacheBlockDescriptor_t *descriptor = &afatfs.cacheDescriptor[cacheIndex];
 
-    fatPhysicalSector = afatfs_fatSectorToPhysical(0, fatSectorIndex);
+    // Once somebody is waiting for room in the cache, sectors have to go out whether their pages are complete or not
+    return descriptor->fileData && !afatfs.cacheAllocationFailed && afatfs_cachePageIsBeingWritten(descriptor->sectorIndex);
+#else
+    (void) cacheIndex;
+    return false;
+#endif
+}
 
-    // How many consecutive FAT sectors will we be overwriting?
-    eraseSectorCount = (endCluster - *startCluster + firstEntryIndex + afatfs_fatEntriesPerSector() - 1) / afatfs_fatEntriesPerSector();
+/**
+ * May the given dirty cache entry be written to the card now, assuming that no earlier write of it is still in flight?
+ * This is false for locked sectors, and for file data that's waiting for the rest of its card page to be written.
+ */
+static bool afatfs_cacheSectorMayFlush(int cacheIndex)
+{
+    return !afatfs.cacheDescriptor[cacheIndex].locked && !afatfs_cacheSectorAwaitsRestOfPage(cacheIndex);
+}
 
-    while (*startCluster < endCluster) {
-        // The last entry we will fill inside this sector (exclusive):
-        uint32_t lastEntryIndex = MIN(firstEntryIndex + (endCluster - *startCluster), afatfs_fatEntriesPerSector());
+#ifdef AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT
 
-        uint8_t cacheFlags = AFATFS_CACHE_WRITE | AFATFS_CACHE_DISCARDABLE;
+/**
+ * Is the given cache entry dirty and allowed to be flushed right now?
+ */
+static bool afatfs_cacheSectorIsFlushable(int cacheIndex)
+{
+    return cacheIndex != -1 && afatfs.cacheDescriptor[cacheIndex].state == AFATFS_CACHE_STATE_DIRTY
+        && afatfs_cacheSectorMayFlush(cacheIndex)
+        && !afatfs_cacheSectorWriteInFlight(&afatfs.cacheDescriptor[cacheIndex]);
+}
 
-        if (firstEntryIndex > 0 || lastEntryIndex < afatfs_fatEntriesPerSector()) {
-            // We're not overwriting the entire FAT sector so we must read the existing contents
-            cacheFlags |= AFATFS_CACHE_READ;
-        }
+#if AFATFS_FAT_MIRROR_POLICY != AFATFS_FAT_MIRROR_LOCKSTEP
 
-        result = afatfs_cacheSector(fatPhysicalSector, &sector.bytes, cacheFlags, eraseSectorCount);
+/**
+ * Does the cache entry with the given index hold a sector of one of the FATs?
+ */
+static bool afatfs_cacheSectorIsFAT(int cacheIndex)
+{
+    uint32_t sectorIndex = afatfs.cacheDescriptor[cacheIndex].sectorIndex;
 
-        if (result != AFATFS_OPERATION_SUCCESS) {
-            return result;
-        }
+    return sectorIndex >= afatfs.fatStartSector && sectorIndex < afatfs.fatStartSector + afatfs.numFATs * afatfs.fatSectors;
+}
 
-#ifdef AFATFS_DEBUG_VERBOSE
-        if (pattern == AFATFS_FAT_PATTERN_FREE) {
-            fprintf(stderr, "Marking cluster %u to %u as free in FAT sector %u...\n", *startCluster, endCluster, fatPhysicalSector);
-        } else {
-            fprintf(stderr, "Writing FAT chain from cluster %u to %u in FAT sector %u...\n", *startCluster, endCluster, fatPhysicalSector);
-        }
 #endif
 
-        switch (pattern) {
-            case AFATFS_FAT_PATTERN_TERMINATED_CHAIN:
-            case AFATFS_FAT_PATTERN_UNTERMINATED_CHAIN:
-                nextCluster = *startCluster + 1;
-                // Write all the "next cluster" pointers
-                if (afatfs.filesystemType == FAT_FILESYSTEM_TYPE_FAT16) {
-                    for (uint32_t i = firstEntryIndex; i < lastEntryIndex; i++, nextCluster++) {
-                        sector.fat16[i] = nextCluster;
-                    }
-                } else {
-                    for (uint32_t i = firstEntryIndex; i < lastEntryIndex; i++, nextCluster++) {
-                        sector.fat32[i] = nextCluster;
-                    }
-                }
-
-                *startCluster += lastEntryIndex - firstEntryIndex;
-
-                if (pattern == AFATFS_FAT_PATTERN_TERMINATED_CHAIN && *startCluster == endCluster) {
-                    // We completed the chain! Overwrite the last entry we wrote with the terminator for the end of the chain
-                    if (afatfs.filesystemType == FAT_FILESYSTEM_TYPE_FAT16) {
-                        sector.fat16[lastEntryIndex - 1] = 0xFFFF;
-                    } else {
-                        sector.fat32[lastEntryIndex - 1] = 0xFFFFFFFF;
-                    }
-                    break;
-                }
-            break;
-            case AFATFS_FAT_PATTERN_FREE:
-                fatEntrySize = afatfs.filesystemType == FAT_FILESYSTEM_TYPE_FAT16 ? sizeof(uint16_t) : sizeof(uint32_t);
-
-                memset(sector.bytes + firstEntryIndex * fatEntrySize, 0, (lastEntryIndex - firstEntryIndex) * fatEntrySize);
-
-                *startCluster += lastEntryIndex - firstEntryIndex;
-            break;
+/**
+ * Get the writeTimestamp of the oldest dirty sector that must be flushed in order (one that's neither file data nor
+ * part of the FATs), or UINT32_MAX if there isn't one.
+ */
+static uint32_t afatfs_cacheOldestOrderedWriteTimestamp()
+{
+#if AFATFS_FAT_MIRROR_POLICY != AFATFS_FAT_MIRROR_LOCKSTEP
+    // The dirty list is kept in order of writeTimestamp, so the first one we find is the oldest
+    for (int i = afatfs.cacheLists[AFATFS_CACHE_LIST_DIRTY].head; i != -1; i = afatfs.cacheDescriptor[i].listNext) {
+        if (!afatfs.cacheDescriptor[i].fileData && !afatfs_cacheSectorIsFAT(i)) {
+            return afatfs.cacheDescriptor[i].writeTimestamp;
         }
-
-        fatPhysicalSector++;
-        eraseSectorCount--;
-        firstEntryIndex = 0;
     }
+#endif
 
-    return AFATFS_OPERATION_SUCCESS;
+    return UINT32_MAX;
 }
 
+/**
+ * Can the dirty cache entry with the given index be flushed ahead of older dirty sectors? This is true for sectors from
+ * regular files, and for sectors from the FATs that were dirtied before `oldestOrderedTimestamp` (see
+ * afatfs_cacheOldestOrderedWriteTimestamp()). We must never write a directory entry to disk before the FAT changes that
+ * preceded it, so directory sectors can only be flushed in order. Nor may a FAT change overtake an older directory
+ * change (e.g. freeing the clusters of a file whose entry hasn't been marked as deleted on disk yet), or losing power in
+ * between would leave a directory entry that refers to free clusters.
+ */
+static bool afatfs_cacheSectorIsReorderable(int cacheIndex, uint32_t oldestOrderedTimestamp)
+{
+    afatfsCacheBlockDescriptor_t *descriptor = &afatfs.cacheDescriptor[cacheIndex];
+
+#if AFATFS_FAT_MIRROR_POLICY != AFATFS_FAT_MIRROR_LOCKSTEP
+    // In lockstep mode each FAT sector flush is paired with a mirror write elsewhere, so FAT sectors can't form runs
+    return descriptor->fileData
+        || (afatfs_cacheSectorIsFAT(cacheIndex) && descriptor->writeTimestamp < oldestOrderedTimestamp);
+#else
+    (void) oldestOrderedTimestamp;
+
+    return descriptor->fileData;
 #endif
+}
 
 /**
- * Write the directory entry for the file into its `directoryEntryPos` position in its containing directory.
+ * Look for a run of physically consecutive flushable sectors around the oldest dirty sector in the cache (which is
+ * given by cacheIndex), and if the run is long enough, begin a multi-block write so that afatfs_flush() can send the
+ * whole run to the card back-to-back.
  *
- * mode:
- *     AFATFS_SAVE_DIRECTORY_NORMAL    - Store the file's physical size, not the logical size, in the directory entry
- *     AFATFS_SAVE_DIRECTORY_FOR_CLOSE - We're done extending the file so we can write the logical size now.
- *     AFATFS_SAVE_DIRECTORY_DELETED   - Mark the directory entry as deleted
- *
- * Returns:
- *     AFATFS_OPERATION_SUCCESS - The directory entry has been stored into the directory sector in cache.
- *     AFATFS_OPERATION_IN_PROGRESS - Cache is too busy, retry later
- *     AFATFS_OPERATION_FAILURE - If the filesystem enters the fatal state
+ * Returns false if the multi-block write can't begin until the card has finished the writes we already queued with it,
+ * in which case nothing should be flushed until then.
  */
-static afatfsOperationStatus_e afatfs_saveDirectoryEntry(afatfsFilePtr_t file, afatfsSaveDirectoryEntryMode_e mode)
+static bool afatfs_cacheFlushBeginRun(int cacheIndex)
 {
-    uint8_t *sector;
-    afatfsOperationStatus_e result;
+    uint32_t runStart = afatfs.cacheDescriptor[cacheIndex].sectorIndex;
+    uint32_t runEnd = runStart + 1;
+    int neighbourIndex;
+    uint32_t oldestOrderedTimestamp = afatfs_cacheOldestOrderedWriteTimestamp();
 
-    if (file->directoryEntryPos.sectorNumberPhysical == 0) {
-        return AFATFS_OPERATION_SUCCESS; // Root directories don't have a directory entry
+    // Neighbours are newer than the oldest sector, so they're only allowed to be written first if they don't care about ordering
+    if (afatfs_cacheSectorIsReorderable(cacheIndex, oldestOrderedTimestamp)) {
+        while (runStart > 0) {
+            neighbourIndex = afatfs_cacheHashFind(runStart - 1);
+
+            if (!afatfs_cacheSectorIsFlushable(neighbourIndex) || !afatfs_cacheSectorIsReorderable(neighbourIndex, oldestOrderedTimestamp)) {
+                break;
+            }
+
+            runStart--;
+        }
     }
 
-    result = afatfs_cacheSector(file->directoryEntryPos.sectorNumberPhysical, &sector, AFATFS_CACHE_READ | AFATFS_CACHE_WRITE, 0);
+    while (runEnd - runStart < UINT16_MAX) {
+        neighbourIndex = afatfs_cacheHashFind(runEnd);
 
-#ifdef AFATFS_DEBUG_VERBOSE
-    fprintf(stderr, "Saving directory entry to sector %u...\n", file->directoryEntryPos.sectorNumberPhysical);
-#endif
+        if (!afatfs_cacheSectorIsFlushable(neighbourIndex) || !afatfs_cacheSectorIsReorderable(neighbourIndex, oldestOrderedTimestamp)) {
+            break;
+        }
 
-    if (result == AFATFS_OPERATION_SUCCESS) {
-        if (afatfs_assert(file->directoryEntryPos.entryIndex >= 0)) {
-            fatDirectoryEntry_t *entry = (fatDirectoryEntry_t *) sector + file->directoryEntryPos.entryIndex;
+        runEnd++;
+    }
 
-            switch (mode) {
-               case AFATFS_SAVE_DIRECTORY_NORMAL:
-                   /* We exaggerate the length of the written file so that if power is lost, the end of the file will
-                    * still be readable (though the very tail of the file will be uninitialized data).
-                    *
-                    * This way we can avoid updating the directory entry too many times during fwrites() on the file.
-                    */
-                   entry->fileSize = file->physicalSize;
-               break;
-               case AFATFS_SAVE_DIRECTORY_DELETED:
-                   entry->filename[0] = FAT_DELETED_FILE_MARKER;
-                   //Fall through
+#ifdef AFATFS_CARD_PAGE_SECTORS
+    /*
+     * If the run has to include part of a page that a file is still writing (because the cache is short of room), end
+     * it at the start of that page instead if it covers anything before it.
+     */
+    uint32_t lastPageStart = (runEnd - 1) - (runEnd - 1) % AFATFS_CARD_PAGE_SECTORS;
 
-               case AFATFS_SAVE_DIRECTORY_FOR_CLOSE:
-                   // We write the true length of the file on close.
-                   entry->fileSize = file->logicalSize;
-            }
+    if (lastPageStart > runStart && afatfs_cachePageIsBeingWritten(lastPageStart)) {
+        runEnd = lastPageStart;
+    }
+#endif
 
-            // (sub)directories don't store a filesize in their directory entry:
-            if (file->type == AFATFS_FILE_TYPE_DIRECTORY) {
-                entry->fileSize = 0;
-            }
+    if (runEnd - runStart < AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT) {
+        return true;
+    }
 
-            entry->firstClusterHigh = file->firstCluster >> 16;
-            entry->firstClusterLow = file->firstCluster & 0xFFFF;
-        } else {
-            return AFATFS_OPERATION_FAILURE;
+    afatfsCacheBlockDescriptor_t *runStartDescriptor = &afatfs.cacheDescriptor[afatfs_cacheHashFind(runStart)];
+
+    // If there's already a longer pre-erase hint on the first sector then we don't need to start the write ourselves
+    if (runStartDescriptor->consecutiveEraseBlockCount < runEnd - runStart) {
+        if (afatfs_sdcardBeginWriteBlocks(runStart, runEnd - runStart) != SDCARD_OPERATION_SUCCESS) {
+            return afatfs.cacheFlushesInProgress == 0;
         }
+
+        afatfs_cacheSectorSetEraseHint(runStartDescriptor, 0);
     }
 
-    return result;
+    afatfs.cacheFlushRunNextSector = runStart;
+    afatfs.cacheFlushRunRemaining = runEnd - runStart;
+
+    return true;
 }
 
+#endif
+
 /**
- * Attempt to add a free cluster to the end of the given file. If the file was previously empty, the directory entry
- * is updated to point to the new cluster.
- *
- * Returns:
- *     AFATFS_OPERATION_SUCCESS     - The cluster has been appended
- *     AFATFS_OPERATION_IN_PROGRESS - Cache was busy, so call again later to continue
- *     AFATFS_OPERATION_FAILURE     - Cluster could not be appended because the filesystem ran out of space
- *                                    (afatfs.filesystemFull is set to true)
- *
- * If the file's operation was AFATFS_FILE_OPERATION_APPEND_FREE_CLUSTER, the file operation is cleared upon completion,
- * otherwise it is left alone so that this operation can be called as a sub-operation of some other operation on the
- * file.
+ * Begin writing the next dirty sector to the card, returning true if nothing is left to flush.
  */
-static afatfsOperationStatus_e afatfs_appendRegularFreeClusterContinue(afatfsFile_t *file)
+static bool afatfs_flushNextSector()
 {
-    afatfsAppendFreeCluster_t *opState = &file->operation.state.appendFreeCluster;
-    afatfsOperationStatus_e status;
-
-    doMore:
-
-    switch (opState->phase) {
-        case AFATFS_APPEND_FREE_CLUSTER_PHASE_FIND_FREESPACE:
-            switch (afatfs_findClusterWithCondition(CLUSTER_SEARCH_FREE, &opState->searchCluster, afatfs.numClusters + FAT_SMALLEST_LEGAL_CLUSTER_NUMBER)) {
-                case AFATFS_FIND_CLUSTER_FOUND:
-                    afatfs.lastClusterAllocated = opState->searchCluster;
-
-                    // Make the cluster available for us to write in
-                    file->cursorCluster = opState->searchCluster;
-                    file->physicalSize += afatfs_clusterSize();
-
-                    if (opState->previousCluster == 0) {
-                        // This is the new first cluster in the file
-                        file->firstCluster = opState->searchCluster;
+    if (afatfs.cacheDirtyEntries > 0) {
+#ifdef AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT
+        if (afatfs.cacheFlushRunRemaining == 0) {
+            for (int i = afatfs.cacheLists[AFATFS_CACHE_LIST_DIRTY].head; i != -1; i = afatfs.cacheDescriptor[i].listNext) {
+                if (afatfs_cacheSectorWriteInFlight(&afatfs.cacheDescriptor[i])) {
+                    break;
+                }
+                if (afatfs_cacheSectorMayFlush(i)) {
+                    if (!afatfs_cacheFlushBeginRun(i)) {
+                        return false;
                     }
-
-                    opState->phase = AFATFS_APPEND_FREE_CLUSTER_PHASE_UPDATE_FAT1;
-                    goto doMore;
-                break;
-                case AFATFS_FIND_CLUSTER_FATAL:
-                case AFATFS_FIND_CLUSTER_NOT_FOUND:
-                    // We couldn't find an empty cluster to append to the file
-                    opState->phase = AFATFS_APPEND_FREE_CLUSTER_PHASE_FAILURE;
-                    goto doMore;
-                break;
-                case AFATFS_FIND_CLUSTER_IN_PROGRESS:
-                break;
+                    break;
+                }
             }
-        break;
-        case AFATFS_APPEND_FREE_CLUSTER_PHASE_UPDATE_FAT1:
-            // Terminate the new cluster
-            status = afatfs_FATSetNextCluster(opState->searchCluster, 0xFFFFFFFF);
+        }
 
-            if (status == AFATFS_OPERATION_SUCCESS) {
-                if (opState->previousCluster) {
-                    opState->phase = AFATFS_APPEND_FREE_CLUSTER_PHASE_UPDATE_FAT2;
-                } else {
-                    opState->phase = AFATFS_APPEND_FREE_CLUSTER_PHASE_UPDATE_FILE_DIRECTORY;
+        if (afatfs.cacheFlushRunRemaining > 0) {
+            int cacheIndex = afatfs_cacheHashFind(afatfs.cacheFlushRunNextSector);
+
+            if (afatfs_cacheSectorIsFlushable(cacheIndex)) {
+                if (afatfs_cacheFlushSector(cacheIndex)) {
+                    afatfs.cacheFlushRunNextSector++;
+                    afatfs.cacheFlushRunRemaining--;
                 }
 
-                goto doMore;
+                return false;
             }
-        break;
-        case AFATFS_APPEND_FREE_CLUSTER_PHASE_UPDATE_FAT2:
-            // Add the new cluster to the pre-existing chain
-            status = afatfs_FATSetNextCluster(opState->previousCluster, opState->searchCluster);
 
-            if (status == AFATFS_OPERATION_SUCCESS) {
-                opState->phase = AFATFS_APPEND_FREE_CLUSTER_PHASE_UPDATE_FILE_DIRECTORY;
-                goto doMore;
-            }
-        break;
-        case AFATFS_APPEND_FREE_CLUSTER_PHASE_UPDATE_FILE_DIRECTORY:
-            if (afatfs_saveDirectoryEntry(file, AFATFS_SAVE_DIRECTORY_NORMAL) == AFATFS_OPERATION_SUCCESS) {
-                opState->phase = AFATFS_APPEND_FREE_CLUSTER_PHASE_COMPLETE;
-                goto doMore;
-            }
-        break;
-        case AFATFS_APPEND_FREE_CLUSTER_PHASE_COMPLETE:
-            if (file->operation.operation == AFATFS_FILE_OPERATION_APPEND_FREE_CLUSTER) {
-                file->operation.operation = AFATFS_FILE_OPERATION_NONE;
-            }
+            // Somebody locked or rewrote the rest of the run in the meantime, so fall back to flushing the oldest sector
+            afatfs.cacheFlushRunRemaining = 0;
+        }
+#endif
 
-            return AFATFS_OPERATION_SUCCESS;
-        break;
-        case AFATFS_APPEND_FREE_CLUSTER_PHASE_FAILURE:
-            if (file->operation.operation == AFATFS_FILE_OPERATION_APPEND_FREE_CLUSTER) {
-                file->operation.operation = AFATFS_FILE_OPERATION_NONE;
+        // Flush the oldest flushable sector (the dirty list is kept in order of writeTimestamp)
+        for (int i = afatfs.cacheLists[AFATFS_CACHE_LIST_DIRTY].head; i != -1; i = afatfs.cacheDescriptor[i].listNext) {
+            /*
+             * Don't overtake a sector whose newer contents are waiting for its earlier write to complete, since the
+             * sectors that follow it (e.g. directory entries) may depend on those contents reaching the disk first.
+             */
+            if (afatfs_cacheSectorWriteInFlight(&afatfs.cacheDescriptor[i])) {
+                return false;
             }
 
-            afatfs.filesystemFull = true;
-            return AFATFS_OPERATION_FAILURE;
-        break;
+            if (afatfs_cacheSectorMayFlush(i)) {
+                afatfs_cacheFlushSector(i);
+
+                // That flush will take time to complete so we may as well tell caller to come back later
+                return false;
+            }
+        }
     }
 
-    return AFATFS_OPERATION_IN_PROGRESS;
-}
+#ifdef AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT
+    // Nothing is left to flush, so the run is over
+    afatfs.cacheFlushRunRemaining = 0;
+#endif
 
-static void afatfs_appendRegularFreeClusterInitOperationState(afatfsAppendFreeCluster_t *state, uint32_t previousCluster)
-{
-    state->phase = AFATFS_APPEND_FREE_CLUSTER_PHASE_INITIAL;
-    state->previousCluster = previousCluster;
-    state->searchCluster = afatfs.lastClusterAllocated;
+    return true;
 }
 
 /**
- * Queue up an operation to append a free cluster to the file and update the file's cursorCluster to point to it.
- *
- * You must seek to the end of the file first, so file.cursorCluster will be 0 for the first call, and
- * `file.cursorPreviousCluster` will be the cluster to append after.
- *
- * Note that the cursorCluster will be updated before this operation is completely finished (i.e. before the FAT is
- * updated) but you can go ahead and write to it before the operation succeeds.
+ * Attempt to flush dirty cache pages out to the sdcard, returning true if all flushable data has been flushed.
  *
- * Returns:
- *     AFATFS_OPERATION_SUCCESS     - The append completed successfully
- *     AFATFS_OPERATION_IN_PROGRESS - The operation was queued on the file and will complete later
- *     AFATFS_OPERATION_FAILURE     - Operation could not be queued or append failed, check afatfs.fileSystemFull
+ * Dirty sectors are flushed oldest-first, except that runs of consecutive sectors are written together using a
+ * multi-block write. Locked sectors, and file data waiting for the rest of its card page (see AFATFS_CARD_PAGE_SECTORS),
+ * aren't flushable until they're released. If the card driver can queue writes, sectors are handed to it until AFATFS_SDCARD_WRITE_QUEUE_DEPTH
+ * writes are in flight or it refuses one.
  */
-static afatfsOperationStatus_e afatfs_appendRegularFreeCluster(afatfsFilePtr_t file)
+bool afatfs_flush()
 {
-    if (file->operation.operation == AFATFS_FILE_OPERATION_APPEND_FREE_CLUSTER)
-        return AFATFS_OPERATION_IN_PROGRESS;
+#if AFATFS_SDCARD_WRITE_QUEUE_DEPTH > 1
+    /*
+     * Let the card finish the writes it already has, then skip this flush so that the command we're waiting to send
+     * gets a turn before we queue any more.
+     */
+    if (afatfs.cardCommandWaiting) {
+        if (afatfs.cacheFlushesInProgress == 0) {
+            afatfs.cardCommandWaiting = false;
+        }
 
-    if (afatfs.filesystemFull || afatfs_fileIsBusy(file)) {
-        return AFATFS_OPERATION_FAILURE;
+        return false;
     }
+#endif
 
-    file->operation.operation = AFATFS_FILE_OPERATION_APPEND_FREE_CLUSTER;
+    for (int i = 0; i < AFATFS_SDCARD_WRITE_QUEUE_DEPTH; i++) {
+        uint8_t flushesInProgress = afatfs.cacheFlushesInProgress;
 
-    afatfs_appendRegularFreeClusterInitOperationState(&file->operation.state.appendFreeCluster, file->cursorPreviousCluster);
+        if (afatfs_flushNextSector()) {
+            return true;
+        }
 
-    return afatfs_appendRegularFreeClusterContinue(file);
+        // Stop if the card didn't accept another write or its queue is now full
+        if (afatfs.cacheFlushesInProgress <= flushesInProgress || afatfs.cacheFlushesInProgress >= AFATFS_SDCARD_WRITE_QUEUE_DEPTH) {
+            break;
+        }
+    }
+
+    return false;
 }
 
 /**
- * Size of a AFATFS supercluster in bytes
+ * Returns true if either the freefile or the regular cluster pool has been exhausted during a previous write operation.
  */
-ONLY_EXPOSE_FOR_TESTING
-uint32_t afatfs_superClusterSize()
+bool afatfs_isFull()
 {
-    return afatfs_fatEntriesPerSector() * afatfs_clusterSize();
+    return afatfs.filesystemFull;
 }
 
-#ifdef AFATFS_USE_FREEFILE
 /**
- * Continue to attempt to add a supercluster to the end of the given file.
- *
- * If the file operation was set to AFATFS_FILE_OPERATION_APPEND_SUPERCLUSTER and the operation completes, the file's
- * operation is cleared.
+ * Get the physical sector number that corresponds to the FAT sector of the given fatSectorIndex within the given
+ * FAT (fatIndex may be 0 or 1). (0, 0) gives the first sector of the first FAT.
  *
- * Returns:
- *     AFATFS_OPERATION_SUCCESS     - On completion
- *     AFATFS_OPERATION_IN_PROGRESS - Operation still in progress
+ * Only pass 1 for fatIndex if the volume has two FATs.
  */
-static afatfsOperationStatus_e afatfs_appendSuperclusterContinue(afatfsFile_t *file)
+static uint32_t afatfs_fatSectorToPhysical(int fatIndex, uint32_t fatSectorIndex)
 {
-    afatfsAppendSupercluster_t *opState = &file->operation.state.appendSupercluster;
-
-    afatfsOperationStatus_e status;
+    return afatfs.fatStartSector + (fatIndex ? afatfs.fatSectors : 0) + fatSectorIndex;
+}
 
-    doMore:
-    switch (opState->phase) {
-        case AFATFS_APPEND_SUPERCLUSTER_PHASE_INIT:
-            // Our file steals the first cluster of the freefile
+/**
+ * Call after modifying the cached copy of the sector with the given fatSectorIndex in the first FAT, so that the
+ * change can be mirrored to the second FAT.
+ */
+static void afatfs_fatSectorModified(uint32_t fatSectorIndex, uint8_t *sectorMemory)
+{
+#if AFATFS_FAT_MIRROR_POLICY == AFATFS_FAT_MIRROR_LOCKSTEP
+    (void) fatSectorIndex;
 
-            // We can go ahead and write to that space before the FAT and directory are updated
-            file->cursorCluster = afatfs.freeFile.firstCluster;
-            file->physicalSize += afatfs_superClusterSize();
+    afatfs_getCacheDescriptorForBuffer(sectorMemory)->mirrored = 0;
+#elif AFATFS_FAT_MIRROR_POLICY == AFATFS_FAT_MIRROR_DEFERRED
+    (void) sectorMemory;
 
-            /* Remove the first supercluster from the freefile
-             *
-             * Even if the freefile becomes empty, we still don't set its first cluster to zero. This is so that
-             * afatfs_fileGetNextCluster() can tell where a contiguous file ends (at the start of the freefile).
-             *
-             * Note that normally the freefile can't become empty because it is allocated as a non-integer number
-             * of superclusters to avoid precisely this situation.
-             */
-            afatfs.freeFile.firstCluster += afatfs_fatEntriesPerSector();
-            afatfs.freeFile.logicalSize -= afatfs_superClusterSize();
-            afatfs.freeFile.physicalSize -= afatfs_superClusterSize();
+    if (afatfs.numFATs > 1) {
+        uint32_t group = fatSectorIndex / afatfs.fatMirror.sectorsPerGroup;
 
-            // The new supercluster needs to have its clusters chained contiguously and marked with a terminator at the end
-            opState->fatRewriteStartCluster = file->cursorCluster;
-            opState->fatRewriteEndCluster = opState->fatRewriteStartCluster + afatfs_fatEntriesPerSector();
+        afatfs.fatMirror.dirtyGroups[group / 8] |= 1 << (group % 8);
+    }
+#else
+    (void) fatSectorIndex;
+    (void) sectorMemory;
+#endif
+}
 
-            if (opState->previousCluster == 0) {
-                // This is the new first cluster in the file so we need to update the directory entry
+static uint32_t afatfs_fileClusterToPhysical(uint32_t clusterNumber, uint32_t sectorIndex)
+{
+    return afatfs.clusterStartSector + (clusterNumber - 2) * afatfs.sectorsPerCluster + sectorIndex;
+}
+
+static uint32_t afatfs_fileGetCursorPhysicalSector(afatfsFilePtr_t file)
+{
+    if (file->type == AFATFS_FILE_TYPE_FAT16_ROOT_DIRECTORY) {
+        return afatfs.fatStartSector + afatfs.numFATs * afatfs.fatSectors + file->cursorOffset / AFATFS_SECTOR_SIZE;
+    } else {
+        uint32_t cursorSectorInCluster = afatfs_sectorIndexInCluster(file->cursorOffset);
+        return afatfs_fileClusterToPhysical(file->cursorCluster, cursorSectorInCluster);
+    }
+}
+
+/**
+ * Get a cache entry for the given sector and store a pointer to the cached memory in *buffer.
+ *
+ * physicalSectorIndex - The index of the sector in the SD card to cache
+ * sectorflags         - A union of AFATFS_CACHE_* constants that says which operations the sector will be cached for.
+ * buffer              - A pointer to the 512-byte memory buffer for the sector will be stored here upon success
+ * eraseCount          - For write operations, set to a non-zero number to hint that we plan to write that many sectors
+ *                       consecutively (including this sector)
+ *
+ * Returns:
+ *     AFATFS_OPERATION_SUCCESS     - On success
+ *     AFATFS_OPERATION_IN_PROGRESS - Card is busy, call again later
+ *     AFATFS_OPERATION_FAILURE     - When the filesystem encounters a fatal error
+ */
+static afatfsOperationStatus_e afatfs_cacheSector(uint32_t physicalSectorIndex, uint8_t **buffer, uint8_t sectorFlags, uint32_t eraseCount)
+{
+    // We never write to the MBR, so any attempt to write there is an asyncfatfs bug
+    if (!afatfs_assert((sectorFlags & AFATFS_CACHE_WRITE) == 0 || physicalSectorIndex != 0)) {
+        return AFATFS_OPERATION_FAILURE;
+    }
+
+    // Nor do we ever write on a read-only mount
+    if (!afatfs_assert((sectorFlags & AFATFS_CACHE_WRITE) == 0 || !afatfs.readOnly)) {
+        return AFATFS_OPERATION_FAILURE;
+    }
+
+    if (afatfs.pollBudgeted) {
+        if (afatfs.pollSectorsRemaining == 0) {
+            // This poll has done all the work it's allowed to, so the caller will continue on the next one
+            return AFATFS_OPERATION_IN_PROGRESS;
+        }
+
+        afatfs.pollSectorsRemaining--;
+    }
+
+    // On a read-only mount every clean sector can be read again cheaply, so read-ahead may evict them too
+    int cacheSectorIndex = afatfs_allocateCacheSector(physicalSectorIndex, (sectorFlags & AFATFS_CACHE_READ_AHEAD) == 0 || afatfs.readOnly, sectorFlags);
+
+    if (cacheSectorIndex == -1) {
+        // We don't have enough free cache to service this request right now, try again later
+        return AFATFS_OPERATION_IN_PROGRESS;
+    }
+
+    switch (afatfs.cacheDescriptor[cacheSectorIndex].state) {
+        case AFATFS_CACHE_STATE_READING:
+            return AFATFS_OPERATION_IN_PROGRESS;
+        break;
+
+        case AFATFS_CACHE_STATE_EMPTY:
+            // We only get to decide these fields if we're the first ones to cache the sector:
+            afatfs.cacheDescriptor[cacheSectorIndex].discardable = (sectorFlags & AFATFS_CACHE_DISCARDABLE) != 0 ? 1 : 0;
+
+            if ((sectorFlags & AFATFS_CACHE_READ) != 0) {
+                bool readStarted = sdcard_readBlock(physicalSectorIndex, afatfs_cacheSectorGetMemory(cacheSectorIndex), afatfs_sdcardReadComplete, 0);
+
+                if (readStarted) {
+                    afatfs_cacheSectorSetState(&afatfs.cacheDescriptor[cacheSectorIndex], AFATFS_CACHE_STATE_READING);
+
+#if defined(AFATFS_FILE_READ_AHEAD_SECTORS) && defined(AFATFS_MIN_MULTIPLE_BLOCK_READ_COUNT)
+                    if (afatfs.readRun.remaining > 0) {
+                        if (physicalSectorIndex == afatfs.readRun.nextSector) {
+                            afatfs.readRun.nextSector++;
+                            afatfs.readRun.remaining--;
+                        } else {
+                            // The card driver ends the multi-block read by itself when we read from somewhere else
+                            afatfs.readRun.remaining = 0;
+                        }
+                    }
+#endif
+                }
+
+#if AFATFS_SDCARD_WRITE_QUEUE_DEPTH > 1
+                if ((sectorFlags & AFATFS_CACHE_READ_AHEAD) == 0) {
+                    afatfs.cardCommandWaiting = !readStarted && afatfs.cacheFlushesInProgress > 0;
+                }
+#endif
+
+#ifdef AFATFS_FILE_READ_AHEAD_SECTORS
+                if ((sectorFlags & AFATFS_CACHE_READ_AHEAD) == 0) {
+                    afatfs.cacheReadPending = !readStarted;
+                }
+#endif
+                return AFATFS_OPERATION_IN_PROGRESS;
+            }
+
+#ifdef AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT
+            // Don't bother pre-erasing for small block sequences
+            if (eraseCount < AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT) {
+                eraseCount = 0;
+            } else {
+                eraseCount = MIN(eraseCount, UINT16_MAX); // If caller asked for a longer chain of sectors we silently truncate that here
+            }
+
+            afatfs_cacheSectorSetEraseHint(&afatfs.cacheDescriptor[cacheSectorIndex], eraseCount);
+#endif
+
+            // Fall through
+
+        case AFATFS_CACHE_STATE_WRITING:
+        case AFATFS_CACHE_STATE_IN_SYNC:
+            if ((sectorFlags & AFATFS_CACHE_WRITE) != 0) {
+                afatfs_cacheSectorMarkDirty(&afatfs.cacheDescriptor[cacheSectorIndex]);
+            }
+            // Fall through
+
+        case AFATFS_CACHE_STATE_DIRTY:
+            if ((sectorFlags & AFATFS_CACHE_LOCK) != 0) {
+                afatfs.cacheDescriptor[cacheSectorIndex].locked = 1;
+            }
+            if ((sectorFlags & AFATFS_CACHE_RETAIN) != 0) {
+                afatfs.cacheDescriptor[cacheSectorIndex].retainCount++;
+            }
+            if ((sectorFlags & AFATFS_CACHE_FILE_DATA) != 0 && !afatfs.cacheDescriptor[cacheSectorIndex].fileData) {
+                // The sector no longer counts as metadata, even if a write of it is still in progress
+                if (afatfs.cacheDescriptor[cacheSectorIndex].state == AFATFS_CACHE_STATE_WRITING) {
+                    afatfs.cacheMetadataWrites--;
+                }
+                afatfs.cacheDescriptor[cacheSectorIndex].fileData = 1;
+            }
+
+            afatfs_cacheSectorUpdateList(&afatfs.cacheDescriptor[cacheSectorIndex]);
+
+            *buffer = afatfs_cacheSectorGetMemory(cacheSectorIndex);
+
+            return AFATFS_OPERATION_SUCCESS;
+        break;
+
+        default:
+            // Cache block in unknown state, should never happen
+            afatfs_assert(false);
+            return AFATFS_OPERATION_FAILURE;
+    }
+}
+
+/**
+ * Parse the details out of the given MBR sector (512 bytes long). Return true if a compatible filesystem was found.
+ */
+static bool afatfs_parseMBR(const uint8_t *sector)
+{
+    // Check MBR signature
+    if (sector[AFATFS_SECTOR_SIZE - 2] != 0x55 || sector[AFATFS_SECTOR_SIZE - 1] != 0xAA)
+        return false;
+
+    mbrPartitionEntry_t *partition = (mbrPartitionEntry_t *) (sector + 446);
+
+    for (int i = 0; i < 4; i++) {
+        if (
+            partition[i].lbaBegin > 0
+            && (
+                partition[i].type == MBR_PARTITION_TYPE_FAT32
+                || partition[i].type == MBR_PARTITION_TYPE_FAT32_LBA
+                || partition[i].type == MBR_PARTITION_TYPE_FAT16
+                || partition[i].type == MBR_PARTITION_TYPE_FAT16_LBA
+            )
+        ) {
+            afatfs.partitionStartSector = partition[i].lbaBegin;
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool afatfs_parseVolumeID(const uint8_t *sector)
+{
+    fatVolumeID_t *volume = (fatVolumeID_t *) sector;
+
+    afatfs.filesystemType = FAT_FILESYSTEM_TYPE_INVALID;
+
+    if (volume->bytesPerSector != AFATFS_SECTOR_SIZE || volume->numFATs < 1 || volume->numFATs > AFATFS_MAX_NUM_FATS
+            || sector[510] != FAT_VOLUME_ID_SIGNATURE_1 || sector[511] != FAT_VOLUME_ID_SIGNATURE_2) {
+        return false;
+    }
+
+    afatfs.fatStartSector = afatfs.partitionStartSector + volume->reservedSectorCount;
+
+    afatfs.sectorsPerCluster = volume->sectorsPerCluster;
+    if (afatfs.sectorsPerCluster < 1 || afatfs.sectorsPerCluster > 128 || !isPowerOfTwo(afatfs.sectorsPerCluster)) {
+        return false;
+    }
+
+    afatfs.byteInClusterMask = AFATFS_SECTOR_SIZE * afatfs.sectorsPerCluster - 1;
+
+    afatfs.fatSectors = volume->FATSize16 != 0 ? volume->FATSize16 : volume->fatDescriptor.fat32.FATSize32;
+    afatfs.numFATs = volume->numFATs;
+
+#if AFATFS_FAT_MIRROR_POLICY == AFATFS_FAT_MIRROR_DEFERRED
+    afatfs.fatMirror.sectorsPerGroup = (afatfs.fatSectors + AFATFS_FAT_MIRROR_DIRTY_GROUPS - 1) / AFATFS_FAT_MIRROR_DIRTY_GROUPS;
+#endif
+
+#ifdef AFATFS_FREE_SPACE_SUMMARY_GROUPS
+    afatfs.freeSpaceSummary.sectorsPerGroup = (afatfs.fatSectors + AFATFS_FREE_SPACE_SUMMARY_GROUPS - 1) / AFATFS_FREE_SPACE_SUMMARY_GROUPS;
+#endif
+
+    // Always zero on FAT32 since rootEntryCount is always zero (this is non-zero on FAT16)
+    afatfs.rootDirectorySectors = ((volume->rootEntryCount * FAT_DIRECTORY_ENTRY_SIZE) + (volume->bytesPerSector - 1)) / volume->bytesPerSector;
+    uint32_t totalSectors = volume->totalSectors16 != 0 ? volume->totalSectors16 : volume->totalSectors32;
+    uint32_t dataSectors = totalSectors - (volume->reservedSectorCount + (afatfs.numFATs * afatfs.fatSectors) + afatfs.rootDirectorySectors);
+
+    afatfs.numClusters = dataSectors / volume->sectorsPerCluster;
+
+    if (afatfs.numClusters <= FAT12_MAX_CLUSTERS) {
+        afatfs.filesystemType = FAT_FILESYSTEM_TYPE_FAT12;
+
+        return false; // FAT12 is not a supported filesystem
+    } else if (afatfs.numClusters <= FAT16_MAX_CLUSTERS) {
+        afatfs.filesystemType = FAT_FILESYSTEM_TYPE_FAT16;
+    } else {
+        afatfs.filesystemType = FAT_FILESYSTEM_TYPE_FAT32;
+    }
+
+#if defined(AFATFS_FAT16_ONLY)
+    if (afatfs.filesystemType != FAT_FILESYSTEM_TYPE_FAT16) {
+        return false; // This build only supports FAT16
+    }
+#elif defined(AFATFS_FAT32_ONLY)
+    if (afatfs.filesystemType != FAT_FILESYSTEM_TYPE_FAT32) {
+        return false; // This build only supports FAT32
+    }
+#endif
+
+    if (afatfs.filesystemType == FAT_FILESYSTEM_TYPE_FAT32) {
+        afatfs.rootDirectoryCluster = volume->fatDescriptor.fat32.rootCluster;
+
+#ifdef AFATFS_USE_FSINFO
+        // An FSInfo sector number of zero or 0xFFFF means that the volume doesn't have one
+        if (volume->fatDescriptor.fat32.fsInfo > 0 && volume->fatDescriptor.fat32.fsInfo < volume->reservedSectorCount) {
+            afatfs.fsInfo.sector = afatfs.partitionStartSector + volume->fatDescriptor.fat32.fsInfo;
+        }
+#endif
+    } else {
+        // FAT16 doesn't store the root directory in clusters
+        afatfs.rootDirectoryCluster = 0;
+    }
+
+    uint32_t endOfFATs = afatfs.fatStartSector + afatfs.numFATs * afatfs.fatSectors;
+
+    afatfs.clusterStartSector = endOfFATs + afatfs.rootDirectorySectors;
+
+    return true;
+}
+
+#ifdef AFATFS_USE_FSINFO
+
+static void afatfs_parseFSInfo(const uint8_t *sector)
+{
+    fatFSInfo_t *fsInfo = (fatFSInfo_t *) sector;
+
+    if (fsInfo->leadSignature != FAT_FSINFO_LEAD_SIGNATURE || fsInfo->structSignature != FAT_FSINFO_STRUCT_SIGNATURE
+            || fsInfo->trailSignature != FAT_FSINFO_TRAIL_SIGNATURE) {
+        // Don't write to a sector that doesn't look like FSInfo
+        afatfs.fsInfo.sector = 0;
+        return;
+    }
+
+    if (fsInfo->freeClusterCount <= afatfs.numClusters) {
+        afatfs.fsInfo.freeClusters = fsInfo->freeClusterCount;
+    }
+
+    /*
+     * This is only a hint, there may be free clusters before it. Searches for free clusters start over from the
+     * beginning of the volume if they don't find one after it.
+     */
+    if (fsInfo->nextFreeCluster >= FAT_SMALLEST_LEGAL_CLUSTER_NUMBER
+            && fsInfo->nextFreeCluster < afatfs.numClusters + FAT_SMALLEST_LEGAL_CLUSTER_NUMBER) {
+        afatfs.lastClusterAllocated = fsInfo->nextFreeCluster;
+    }
+}
+
+/**
+ * Update the FSInfo sector in the cache with our free cluster count and next free cluster hint (the cache will write
+ * it to the disk later).
+ *
+ * countValid - Set to false to mark the free cluster count on disk as unknown instead
+ */
+static afatfsOperationStatus_e afatfs_saveFSInfo(bool countValid)
+{
+    uint8_t *sector;
+    afatfsOperationStatus_e result = afatfs_cacheSector(afatfs.fsInfo.sector, &sector, AFATFS_CACHE_READ | AFATFS_CACHE_WRITE, 0);
+
+    if (result == AFATFS_OPERATION_SUCCESS) {
+        fatFSInfo_t *fsInfo = (fatFSInfo_t *) sector;
+
+        fsInfo->freeClusterCount = countValid ? afatfs.fsInfo.freeClusters : FAT_FSINFO_UNKNOWN;
+        fsInfo->nextFreeCluster = afatfs.lastClusterAllocated;
+    }
+
+    return result;
+}
+
+/**
+ * Call before modifying the FAT. The first time this is called, the free cluster count on disk is marked as unknown,
+ * so that it won't be trusted if we lose power before afatfs_destroy() writes the correct count.
+ *
+ * Since the FSInfo sector becomes dirty in the cache before the FAT sector does, it'll be written to disk first.
+ */
+static afatfsOperationStatus_e afatfs_fsInfoBeginModification()
+{
+    afatfsOperationStatus_e result;
+
+    if (afatfs.fsInfo.sector == 0 || afatfs.fsInfo.volumeDirty) {
+        return AFATFS_OPERATION_SUCCESS;
+    }
+
+    if (afatfs.fsInfo.freeClusters == FAT_FSINFO_UNKNOWN) {
+        // The count on disk is already unknown, so there's nothing to write until afatfs_destroy()
+        result = AFATFS_OPERATION_SUCCESS;
+    } else {
+        result = afatfs_saveFSInfo(false);
+    }
+
+    if (result == AFATFS_OPERATION_SUCCESS) {
+        afatfs.fsInfo.volumeDirty = true;
+    }
+
+    return result;
+}
+
+/**
+ * Add the given (possibly negative) number of clusters to our count of free clusters, if the count is known.
+ */
+static void afatfs_fsInfoAdjustFreeClusters(int32_t delta)
+{
+    if (afatfs.fsInfo.freeClusters != FAT_FSINFO_UNKNOWN) {
+        afatfs.fsInfo.freeClusters += delta;
+    }
+}
+
+#endif
+
+/**
+ * Get the position of the FAT entry for the cluster with the given number.
+ */
+static void afatfs_getFATPositionForCluster(uint32_t cluster, uint32_t *fatSectorIndex, uint32_t *fatSectorEntryIndex)
+{
+    if (afatfs_isFAT16()) {
+        uint32_t entriesPerFATSector = AFATFS_SECTOR_SIZE / sizeof(uint16_t);
+
+        *fatSectorIndex = cluster / entriesPerFATSector;
+        *fatSectorEntryIndex = cluster & (entriesPerFATSector - 1);
+    } else {
+        uint32_t entriesPerFATSector = AFATFS_SECTOR_SIZE / sizeof(uint32_t);
+
+        *fatSectorIndex = (cluster & FAT32_CLUSTER_NUMBER_MASK) / entriesPerFATSector;
+        *fatSectorEntryIndex = cluster & (entriesPerFATSector - 1);
+    }
+}
+
+static bool afatfs_FATIsEndOfChainMarker(uint32_t clusterNumber)
+{
+    if (afatfs_isFAT16()) {
+        return fat16_isEndOfChainMarker(clusterNumber);
+    } else {
+        return fat32_isEndOfChainMarker(clusterNumber);
+    }
+}
+
+/**
+ * Is the entry with the given index in the FAT sector marked as free?
+ */
+static bool afatfs_fatSectorEntryIsFree(afatfsFATSector_t sector, uint32_t entryIndex)
+{
+    if (afatfs_isFAT16()) {
+        return sector.fat16[entryIndex] == 0;
+    } else {
+        return (sector.fat32[entryIndex] & FAT32_CLUSTER_NUMBER_MASK) == 0;
+    }
+}
+
+/**
+ * Find the first entry at or after `entryIndex` in the FAT sector which is free (or if `lookingForFree` is false, the
+ * first which is occupied).
+ *
+ * The sector is tested a 64-bit word (four FAT16 or two FAT32 entries) at a time, and only the entries of a word which
+ * can contain a match are examined one by one, so runs of allocated or free entries are skipped quickly.
+ *
+ * Returns the index of the entry, or the number of entries in a FAT sector if none match.
+ */
+static uint32_t afatfs_fatSectorFindEntry(afatfsFATSector_t sector, uint32_t entryIndex, bool lookingForFree)
+{
+    const uint32_t fatEntriesPerSector = afatfs_fatEntriesPerSector();
+    const uint32_t entriesPerWord = fatEntriesPerSector / AFATFS_FAT_WORDS_PER_SECTOR;
+    uint64_t clusterMask, laneLowBits, laneHighBits;
+
+    if (afatfs_isFAT16()) {
+        clusterMask = ~0ULL;
+        laneLowBits = AFATFS_FAT16_WORD_LANE_LOW_BITS;
+        laneHighBits = AFATFS_FAT16_WORD_LANE_HIGH_BITS;
+    } else {
+        clusterMask = AFATFS_FAT32_WORD_CLUSTER_MASK;
+        laneLowBits = AFATFS_FAT32_WORD_LANE_LOW_BITS;
+        laneHighBits = AFATFS_FAT32_WORD_LANE_HIGH_BITS;
+    }
+
+    while (entryIndex < fatEntriesPerSector) {
+        if (entryIndex % entriesPerWord == 0) {
+            uint64_t word = sector.words[entryIndex / entriesPerWord] & clusterMask;
+            bool mayMatch;
+
+            if (lookingForFree) {
+                /*
+                 * Only an entry of zero can borrow out of its top bit when we subtract one from it without already
+                 * having that bit set. The borrow can carry into the entries above it, but those are only examined
+                 * after the zero entry has matched.
+                 */
+                mayMatch = ((word - laneLowBits) & ~word & laneHighBits) != 0;
+            } else {
+                mayMatch = word != 0;
+            }
+
+            if (!mayMatch) {
+                entryIndex += entriesPerWord;
+                continue;
+            }
+        }
+
+        if (afatfs_fatSectorEntryIsFree(sector, entryIndex) == lookingForFree) {
+            return entryIndex;
+        }
+
+        entryIndex++;
+    }
+
+    return fatEntriesPerSector;
+}
+
+/**
+ * Look up the FAT to find out which cluster follows the one with the given number and store it into *nextCluster.
+ *
+ * Use fat_isFreeSpace() and fat_isEndOfChainMarker() on nextCluster to distinguish those special values from regular
+ * cluster numbers.
+ *
+ * Note that if you're trying to find the next cluster of a file, you should be calling afatfs_fileGetNextCluster()
+ * instead, as that one supports contiguous freefile-based files (which needn't consult the FAT).
+ *
+ * sectorFlags - The AFATFS_CACHE_* flags to read the FAT sector with (AFATFS_CACHE_READ plus any hints)
+ *
+ * Returns:
+ *     AFATFS_OPERATION_IN_PROGRESS - FS is busy right now, call again later
+ *     AFATFS_OPERATION_SUCCESS     - *nextCluster is set to the next cluster number
+ */
+static afatfsOperationStatus_e afatfs_FATGetNextCluster(int fatIndex, uint32_t cluster, uint32_t *nextCluster, uint8_t sectorFlags)
+{
+    uint32_t fatSectorIndex, fatSectorEntryIndex;
+    afatfsFATSector_t sector;
+
+    afatfs_getFATPositionForCluster(cluster, &fatSectorIndex, &fatSectorEntryIndex);
+
+    afatfsOperationStatus_e result = afatfs_cacheSector(afatfs_fatSectorToPhysical(fatIndex, fatSectorIndex), &sector.bytes, sectorFlags, 0);
+
+    if (result == AFATFS_OPERATION_SUCCESS) {
+        if (afatfs_isFAT16()) {
+            *nextCluster = sector.fat16[fatSectorEntryIndex];
+        } else {
+            *nextCluster = sector.fat32[fatSectorEntryIndex] & FAT32_CLUSTER_NUMBER_MASK;
+        }
+    }
+
+    return result;
+}
+
+#ifdef AFATFS_FREE_SPACE_SUMMARY_GROUPS
+
+static bool afatfs_freeSpaceSummaryGroupIsFull(uint32_t group)
+{
+    return (afatfs.freeSpaceSummary.fullGroups[group / 8] & (1 << (group % 8))) != 0;
+}
+
+/**
+ * Call when a cluster belonging to the given FAT sector has been marked as free.
+ */
+static void afatfs_freeSpaceSummaryMarkFree(uint32_t fatSectorIndex)
+{
+    uint32_t group = fatSectorIndex / afatfs.freeSpaceSummary.sectorsPerGroup;
+
+    afatfs.freeSpaceSummary.fullGroups[group / 8] &= ~(1 << (group % 8));
+}
+
+/**
+ * Call whenever a FAT sector has been examined to find out if it contains any free clusters.
+ */
+static void afatfs_freeSpaceSummaryObserveSector(uint32_t fatSectorIndex, bool hasFreeCluster)
+{
+    afatfsFreeSpaceSummary_t *summary = &afatfs.freeSpaceSummary;
+    uint32_t group = fatSectorIndex / summary->sectorsPerGroup;
+
+    if (hasFreeCluster) {
+        afatfs_freeSpaceSummaryMarkFree(fatSectorIndex);
+        summary->observeGroupFull = false;
+    } else if (fatSectorIndex % summary->sectorsPerGroup == 0) {
+        // Start examining a new group
+        summary->observeGroupFull = true;
+    } else if (fatSectorIndex + 1 == summary->observeNextSector) {
+        // We've already seen this sector
+        return;
+    } else if (fatSectorIndex != summary->observeNextSector) {
+        // We skipped some sectors of this group so we can't tell if it's full
+        summary->observeGroupFull = false;
+    }
+
+    summary->observeNextSector = fatSectorIndex + 1;
+
+    if (
+        summary->observeGroupFull
+        && (summary->observeNextSector % summary->sectorsPerGroup == 0 || summary->observeNextSector == afatfs.fatSectors)
+    ) {
+        summary->fullGroups[group / 8] |= 1 << (group % 8);
+    }
+}
+
+static bool afatfs_fatSectorHasFreeCluster(afatfsFATSector_t sector)
+{
+    return afatfs_fatSectorFindEntry(sector, 0, true) < afatfs_fatEntriesPerSector();
+}
+
+#endif
+
+#ifdef AFATFS_FREE_SPACE_SEARCH_WHILE_READY
+
+/**
+ * Call when the given cluster has just been allocated to a regular file. If the search for the freefile's free space
+ * is in progress and has already examined this cluster, the hole it was part of is split around it.
+ */
+static void afatfs_freeSpaceSearchClusterAllocated(uint32_t cluster)
+{
+    afatfsFreeSpaceSearch_t *opState = &afatfs.initState.freeSpaceSearch;
+    uint32_t fatEntriesPerSector = afatfs_fatEntriesPerSector();
+    // Holes must begin at the start of a FAT sector
+    uint32_t nextHoleStart = roundUpTo(cluster + 1, fatEntriesPerSector);
+
+    if (afatfs.freeFileAllocatePhase != AFATFS_FREEFILE_ALLOCATE_PHASE_FAT_SEARCH
+#ifdef AFATFS_FREEFILE_REGROWTH
+            && afatfs.freeFileAllocatePhase != AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_SEARCH
+            && afatfs.freeFileAllocatePhase != AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_CLAIM
+#endif
+    ) {
+        return;
+    }
+
+    if (cluster >= opState->bestGapStart && cluster < opState->bestGapStart + opState->bestGapLength) {
+        uint32_t bestGapEnd = opState->bestGapStart + opState->bestGapLength;
+
+        // Keep the larger of the two pieces of the best hole
+        if (bestGapEnd > nextHoleStart && bestGapEnd - nextHoleStart > cluster - opState->bestGapStart) {
+            opState->bestGapStart = nextHoleStart;
+            opState->bestGapLength = bestGapEnd - nextHoleStart;
+        } else {
+            opState->bestGapLength = cluster - opState->bestGapStart;
+        }
+    }
+
+    if (opState->phase == AFATFS_FREE_SPACE_SEARCH_PHASE_GROW_HOLE && cluster >= opState->candidateStart && cluster < opState->candidateEnd) {
+        // The part of the hole we're growing before this cluster is finished
+        if (cluster - opState->candidateStart > opState->bestGapLength) {
+            opState->bestGapStart = opState->candidateStart;
+            opState->bestGapLength = cluster - opState->candidateStart;
+        }
+
+        // And the part after it can keep growing, if it's big enough to hold any whole FAT sectors
+        opState->candidateStart = nextHoleStart;
+
+        if (nextHoleStart >= opState->candidateEnd) {
+            opState->phase = AFATFS_FREE_SPACE_SEARCH_PHASE_FIND_HOLE;
+        }
+    }
+}
+
+#endif
+
+/**
+ * Set the cluster number that follows the given cluster. Pass 0xFFFFFFFF for nextCluster to terminate the FAT chain.
+ *
+ * Returns:
+ *     AFATFS_OPERATION_SUCCESS     - On success
+ *     AFATFS_OPERATION_IN_PROGRESS - Card is busy, call again later
+ *     AFATFS_OPERATION_FAILURE     - When the filesystem encounters a fatal error
+ */
+static afatfsOperationStatus_e afatfs_FATSetNextCluster(uint32_t startCluster, uint32_t nextCluster)
+{
+    afatfsFATSector_t sector;
+    uint32_t fatSectorIndex, fatSectorEntryIndex, fatPhysicalSector;
+    afatfsOperationStatus_e result;
+
+    if(!afatfs_assert(startCluster >= FAT_SMALLEST_LEGAL_CLUSTER_NUMBER)){
+        return AFATFS_OPERATION_FAILURE; // startCluster is not valid;
+    }
+
+#ifdef AFATFS_USE_FSINFO
+    result = afatfs_fsInfoBeginModification();
+
+    if (result != AFATFS_OPERATION_SUCCESS) {
+        return result;
+    }
+#endif
+
+    afatfs_getFATPositionForCluster(startCluster, &fatSectorIndex, &fatSectorEntryIndex);
+
+    fatPhysicalSector = afatfs_fatSectorToPhysical(0, fatSectorIndex);
+
+    result = afatfs_cacheSector(fatPhysicalSector, &sector.bytes, AFATFS_CACHE_READ | AFATFS_CACHE_WRITE, 0);
+
+    if (result == AFATFS_OPERATION_SUCCESS) {
+        uint32_t oldNextCluster;
+
+        if (afatfs_isFAT16()) {
+            oldNextCluster = sector.fat16[fatSectorEntryIndex];
+            sector.fat16[fatSectorEntryIndex] = nextCluster;
+        } else {
+            oldNextCluster = sector.fat32[fatSectorEntryIndex] & FAT32_CLUSTER_NUMBER_MASK;
+            sector.fat32[fatSectorEntryIndex] = nextCluster;
+        }
+
+#ifdef AFATFS_USE_FSINFO
+        afatfs_fsInfoAdjustFreeClusters((int32_t) fat_isFreeSpace(nextCluster) - (int32_t) fat_isFreeSpace(oldNextCluster));
+#endif
+
+#ifdef AFATFS_FREE_SPACE_SEARCH_WHILE_READY
+        if (fat_isFreeSpace(oldNextCluster) && !fat_isFreeSpace(nextCluster)) {
+            afatfs_freeSpaceSearchClusterAllocated(startCluster);
+        }
+#endif
+
+#if !defined(AFATFS_USE_FSINFO) && !defined(AFATFS_FREE_SPACE_SEARCH_WHILE_READY)
+        (void) oldNextCluster;
+#endif
+
+        afatfs_fatSectorModified(fatSectorIndex, sector.bytes);
+
+#ifdef AFATFS_FREE_SPACE_SUMMARY_GROUPS
+        if (fat_isFreeSpace(nextCluster)) {
+            afatfs_freeSpaceSummaryMarkFree(fatSectorIndex);
+        }
+#endif
+    }
+
+    return result;
+}
+
+/**
+ * Bring the logical filesize up to date with the current cursor position.
+ */
+static void afatfs_fileUpdateFilesize(afatfsFile_t *file)
+{
+    file->logicalSize = MAX(file->logicalSize, file->cursorOffset);
+}
+
+static void afatfs_fileUnlockCacheSector(afatfsFilePtr_t file)
+{
+    if (file->writeLockedCacheIndex != -1) {
+        afatfs.cacheDescriptor[file->writeLockedCacheIndex].locked = 0;
+        afatfs_cacheSectorUpdateList(&afatfs.cacheDescriptor[file->writeLockedCacheIndex]);
+        file->writeLockedCacheIndex = -1;
+    }
+    if (file->readRetainCacheIndex != -1) {
+        afatfsCacheBlockDescriptor_t *descriptor = &afatfs.cacheDescriptor[file->readRetainCacheIndex];
+
+        descriptor->retainCount = MAX((int) descriptor->retainCount - 1, 0);
+
+        /*
+         * Regular files are usually read sequentially so we don't expect to need this sector again. Letting it be
+         * discarded early leaves room for read-ahead without having to evict anything else.
+         */
+        if (file->type == AFATFS_FILE_TYPE_NORMAL && descriptor->retainCount == 0) {
+            descriptor->discardable = 1;
+        }
+
+        afatfs_cacheSectorUpdateList(descriptor);
+
+        file->readRetainCacheIndex = -1;
+    }
+}
+
+/**
+ * Starting from and including the given cluster number, find the number of the first cluster which matches the given
+ * condition.
+ *
+ * searchLimit - Last cluster to examine (exclusive). To search the entire volume, pass:
+ *                   afatfs.numClusters + FAT_SMALLEST_LEGAL_CLUSTER_NUMBER
+ *
+ * Condition:
+ *     CLUSTER_SEARCH_FREE_AT_BEGINNING_OF_FAT_SECTOR - Find a cluster marked as free in the FAT which lies at the
+ *         beginning of its FAT sector. The passed initial search 'cluster' must correspond to the first entry of a FAT sector.
+ *     CLUSTER_SEARCH_FREE            - Find a cluster marked as free in the FAT
+ *     CLUSTER_SEARCH_OCCUPIED        - Find a cluster marked as occupied in the FAT.
+ *
+ * Returns:
+ *     AFATFS_FIND_CLUSTER_FOUND       - A cluster matching the criteria was found and stored in *cluster
+ *     AFATFS_FIND_CLUSTER_IN_PROGRESS - The search is not over, call this routine again later with the updated *cluster value to resume
+ *     AFATFS_FIND_CLUSTER_FATAL       - An unexpected read error occurred, the volume should be abandoned
+ *     AFATFS_FIND_CLUSTER_NOT_FOUND   - The entire device was searched without finding a suitable cluster (the
+ *                                       *cluster points to just beyond the final cluster).
+ */
+static afatfsFindClusterStatus_e afatfs_findClusterWithCondition(afatfsClusterSearchCondition_e condition, uint32_t *cluster, uint32_t searchLimit)
+{
+    afatfsFATSector_t sector;
+    uint32_t fatSectorIndex, fatSectorEntryIndex, foundEntryIndex;
+
+    uint32_t fatEntriesPerSector = afatfs_fatEntriesPerSector();
+    bool lookingForFree = condition == CLUSTER_SEARCH_FREE_AT_BEGINNING_OF_FAT_SECTOR || condition == CLUSTER_SEARCH_FREE;
+
+    int jump;
+
+    // Get the FAT entry which corresponds to this cluster so we can begin our search there
+    afatfs_getFATPositionForCluster(*cluster, &fatSectorIndex, &fatSectorEntryIndex);
+
+    switch (condition) {
+        case CLUSTER_SEARCH_FREE_AT_BEGINNING_OF_FAT_SECTOR:
+            jump = fatEntriesPerSector;
+
+            // We're supposed to call this routine with the cluster properly aligned
+            if (!afatfs_assert(fatSectorEntryIndex == 0)) {
+                return AFATFS_FIND_CLUSTER_FATAL;
+            }
+        break;
+        case CLUSTER_SEARCH_OCCUPIED:
+        case CLUSTER_SEARCH_FREE:
+            jump = 1;
+        break;
+        default:
+            afatfs_assert(false);
+            return AFATFS_FIND_CLUSTER_FATAL;
+    }
+
+    while (*cluster < searchLimit) {
+
+#ifdef AFATFS_USE_FREEFILE
+        // If we're looking inside the freefile, we won't find any free clusters! Skip it!
+        if (lookingForFree && afatfs.freeFile.logicalSize > 0 && *cluster >= afatfs.freeFile.firstCluster
+                && *cluster < afatfs.freeFile.firstCluster + (afatfs.freeFile.logicalSize + afatfs_clusterSize() - 1) / afatfs_clusterSize()) {
+            *cluster = afatfs.freeFile.firstCluster + (afatfs.freeFile.logicalSize + afatfs_clusterSize() - 1) / afatfs_clusterSize();
+
+            // Maintain alignment
+            *cluster = roundUpTo(*cluster, jump);
+
+            afatfs_getFATPositionForCluster(*cluster, &fatSectorIndex, &fatSectorEntryIndex);
+            continue; // Go back to check that the new cluster number is within the volume
+        }
+#endif
+
+#ifdef AFATFS_FREE_SPACE_SUMMARY_GROUPS
+        // Skip over groups of FAT sectors which we already know don't have any free clusters
+        if (lookingForFree && afatfs_freeSpaceSummaryGroupIsFull(fatSectorIndex / afatfs.freeSpaceSummary.sectorsPerGroup)) {
+            fatSectorIndex = (fatSectorIndex / afatfs.freeSpaceSummary.sectorsPerGroup + 1) * afatfs.freeSpaceSummary.sectorsPerGroup;
+            fatSectorEntryIndex = 0;
+            *cluster = fatSectorIndex * fatEntriesPerSector;
+            continue;
+        }
+#endif
+
+        afatfsOperationStatus_e status = afatfs_cacheSector(afatfs_fatSectorToPhysical(0, fatSectorIndex), &sector.bytes, AFATFS_CACHE_READ | AFATFS_CACHE_DISCARDABLE, 0);
+
+        switch (status) {
+            case AFATFS_OPERATION_SUCCESS:
+#ifdef AFATFS_USE_STATS
+                // Only the allocation of clusters for regular files searches for single free clusters
+                if (condition == CLUSTER_SEARCH_FREE) {
+                    afatfs.stats.clusterAllocationFATSectors++;
+                }
+#endif
+
+#ifdef AFATFS_FREE_SPACE_SUMMARY_GROUPS
+                afatfs_freeSpaceSummaryObserveSector(fatSectorIndex, afatfs_fatSectorHasFreeCluster(sector));
+#endif
+
+                if (jump == 1) {
+                    foundEntryIndex = afatfs_fatSectorFindEntry(sector, fatSectorEntryIndex, lookingForFree);
+                } else {
+                    // Only the first entry of the sector is a candidate
+                    foundEntryIndex = afatfs_fatSectorEntryIsFree(sector, 0) ? 0 : fatEntriesPerSector;
+                }
+
+                (*cluster) += foundEntryIndex - fatSectorEntryIndex;
+
+                if (foundEntryIndex < fatEntriesPerSector) {
+                    /*
+                     * The final FAT sector may have fewer than fatEntriesPerSector entries in it, so we need to
+                     * check the cluster number is valid here before we report a bogus success!
+                     */
+                    if (*cluster < searchLimit) {
+                        return AFATFS_FIND_CLUSTER_FOUND;
+                    } else {
+                        *cluster = searchLimit;
+                        return AFATFS_FIND_CLUSTER_NOT_FOUND;
+                    }
+                }
+
+                // Move on to the next FAT sector
+                fatSectorIndex++;
+                fatSectorEntryIndex = 0;
+            break;
+            case AFATFS_OPERATION_FAILURE:
+                return AFATFS_FIND_CLUSTER_FATAL;
+            break;
+            case AFATFS_OPERATION_IN_PROGRESS:
+                return AFATFS_FIND_CLUSTER_IN_PROGRESS;
+            break;
+        }
+    }
+
+    // We looked at every available cluster and didn't find one matching the condition
+    *cluster = searchLimit;
+    return AFATFS_FIND_CLUSTER_NOT_FOUND;
+}
+
+/**
+ * Get the cluster that follows the currentCluster in the FAT chain for the given file. If the FAT needs to be read,
+ * its sector is cached with the given sectorFlags.
+ *
+ * Returns:
+ *     AFATFS_OPERATION_IN_PROGRESS - FS is busy right now, call again later
+ *     AFATFS_OPERATION_SUCCESS     - *nextCluster is set to the next cluster number
+ */
+static afatfsOperationStatus_e afatfs_fileGetNextCluster(afatfsFilePtr_t file, uint32_t currentCluster, uint32_t *nextCluster, uint8_t sectorFlags)
+{
+#ifndef AFATFS_USE_FREEFILE
+    (void) file;
+#else
+    if ((file->mode & AFATFS_FILE_MODE_CONTIGUOUS) != 0) {
+        afatfs_assert(currentCluster + 1 <= file->superclusterEnd);
+
+        // Would the next cluster lie outside the allocated file? (i.e. beyond the end of its last supercluster)
+        if (currentCluster + 1 == file->superclusterEnd) {
+            *nextCluster = 0;
+
+            return AFATFS_OPERATION_SUCCESS;
+        }
+
+        /*
+         * Every supercluster we hand out starts a whole number of superclusters away from the start of the freefile.
+         * Within a supercluster the file is contiguous, but the next supercluster might have been given to another
+         * contiguous file in the meantime, so only then do we need to consult the FAT.
+         */
+        if (((currentCluster + 1 - afatfs.freeFile.firstCluster) & (afatfs_fatEntriesPerSector() - 1)) != 0) {
+            *nextCluster = currentCluster + 1;
+
+            return AFATFS_OPERATION_SUCCESS;
+        }
+    }
+#endif
+
+    return afatfs_FATGetNextCluster(0, currentCluster, nextCluster, sectorFlags);
+}
+
+#ifdef AFATFS_USE_FREEFILE
+
+/**
+ * Update the FAT to fill the contiguous series of clusters with indexes [*startCluster...endCluster) with the
+ * specified pattern.
+ *
+ * AFATFS_FAT_PATTERN_TERMINATED_CHAIN - Chain the clusters together in linear sequence and terminate the final cluster
+ * AFATFS_FAT_PATTERN_CHAIN            - Chain the clusters together without terminating the final entry
+ * AFATFS_FAT_PATTERN_FREE             - Mark the clusters as free space
+ *
+ * The clusters being marked free must have been occupied. The chain patterns don't change our count of free clusters,
+ * so if the clusters being chained were free, the caller must adjust the count.
+ *
+ * Returns -
+ *     AFATFS_OPERATION_SUCCESS        - When the entire chain has been written
+ *     AFATFS_OPERATION_IN_PROGRESS    - Call again later with the updated *startCluster value in order to resume writing.
+ */
+static afatfsOperationStatus_e afatfs_FATFillWithPattern(afatfsFATPattern_e pattern, uint32_t *startCluster, uint32_t endCluster)
+{
+    afatfsFATSector_t sector;
+    uint32_t fatSectorIndex, firstEntryIndex, fatPhysicalSector;
+    uint8_t fatEntrySize;
+    uint32_t nextCluster;
+    afatfsOperationStatus_e result;
+    uint32_t eraseSectorCount;
+
+#ifdef AFATFS_USE_FSINFO
+    result = afatfs_fsInfoBeginModification();
+
+    if (result != AFATFS_OPERATION_SUCCESS) {
+        return result;
+    }
+#endif
+
+    // Find the position of the initial cluster to begin our fill
+    afatfs_getFATPositionForCluster(*startCluster, &fatSectorIndex, &firstEntryIndex);
+
+    fatPhysicalSector = afatfs_fatSectorToPhysical(0, fatSectorIndex);
+
+    // How many consecutive FAT sectors will we be overwriting?
+    eraseSectorCount = (endCluster - *startCluster + firstEntryIndex + afatfs_fatEntriesPerSector() - 1) / afatfs_fatEntriesPerSector();
+
+    /*
+     * If we only overwrite part of the final sector then we'll need to read its existing contents, so it mustn't be
+     * pre-erased along with the others.
+     */
+    if ((endCluster - *startCluster + firstEntryIndex) % afatfs_fatEntriesPerSector() != 0) {
+        eraseSectorCount--;
+    }
+
+    while (*startCluster < endCluster) {
+        // The last entry we will fill inside this sector (exclusive):
+        uint32_t lastEntryIndex = MIN(firstEntryIndex + (endCluster - *startCluster), afatfs_fatEntriesPerSector());
+
+        uint8_t cacheFlags = AFATFS_CACHE_WRITE | AFATFS_CACHE_DISCARDABLE;
+
+        if (firstEntryIndex > 0 || lastEntryIndex < afatfs_fatEntriesPerSector()) {
+            // We're not overwriting the entire FAT sector so we must read the existing contents
+            cacheFlags |= AFATFS_CACHE_READ;
+        }
+
+        result = afatfs_cacheSector(fatPhysicalSector, &sector.bytes, cacheFlags, eraseSectorCount);
+
+        if (result != AFATFS_OPERATION_SUCCESS) {
+            return result;
+        }
+
+#ifdef AFATFS_DEBUG_VERBOSE
+        if (pattern == AFATFS_FAT_PATTERN_FREE) {
+            fprintf(stderr, "Marking cluster %u to %u as free in FAT sector %u...\n", *startCluster, endCluster, fatPhysicalSector);
+        } else {
+            fprintf(stderr, "Writing FAT chain from cluster %u to %u in FAT sector %u...\n", *startCluster, endCluster, fatPhysicalSector);
+        }
+#endif
+
+        switch (pattern) {
+            case AFATFS_FAT_PATTERN_TERMINATED_CHAIN:
+            case AFATFS_FAT_PATTERN_UNTERMINATED_CHAIN:
+                nextCluster = *startCluster + 1;
+                // Write all the "next cluster" pointers
+                if (afatfs_isFAT16()) {
+                    for (uint32_t i = firstEntryIndex; i < lastEntryIndex; i++, nextCluster++) {
+                        sector.fat16[i] = nextCluster;
+                    }
+                } else {
+                    for (uint32_t i = firstEntryIndex; i < lastEntryIndex; i++, nextCluster++) {
+                        sector.fat32[i] = nextCluster;
+                    }
+                }
+
+                *startCluster += lastEntryIndex - firstEntryIndex;
+
+                if (pattern == AFATFS_FAT_PATTERN_TERMINATED_CHAIN && *startCluster == endCluster) {
+                    // We completed the chain! Overwrite the last entry we wrote with the terminator for the end of the chain
+                    if (afatfs_isFAT16()) {
+                        sector.fat16[lastEntryIndex - 1] = 0xFFFF;
+                    } else {
+                        sector.fat32[lastEntryIndex - 1] = 0xFFFFFFFF;
+                    }
+                    break;
+                }
+            break;
+            case AFATFS_FAT_PATTERN_FREE:
+                fatEntrySize = afatfs_isFAT16() ? sizeof(uint16_t) : sizeof(uint32_t);
+
+                memset(sector.bytes + firstEntryIndex * fatEntrySize, 0, (lastEntryIndex - firstEntryIndex) * fatEntrySize);
+
+#ifdef AFATFS_FREE_SPACE_SUMMARY_GROUPS
+                afatfs_freeSpaceSummaryMarkFree(fatSectorIndex);
+#endif
+
+#ifdef AFATFS_USE_FSINFO
+                afatfs_fsInfoAdjustFreeClusters(lastEntryIndex - firstEntryIndex);
+#endif
+
+                *startCluster += lastEntryIndex - firstEntryIndex;
+            break;
+        }
+
+        afatfs_fatSectorModified(fatSectorIndex, sector.bytes);
+
+        fatSectorIndex++;
+        fatPhysicalSector++;
+        if (eraseSectorCount > 0) {
+            eraseSectorCount--;
+        }
+        firstEntryIndex = 0;
+    }
+
+    return AFATFS_OPERATION_SUCCESS;
+}
+
+#ifdef AFATFS_USE_SDCARD_ERASE
+
+/**
+ * Count how many clusters of the chain that passes through `cluster` follow on consecutively from it (including
+ * `cluster` itself) without leaving the given FAT sector. `entryIndex` is the index of `cluster`'s entry in the sector.
+ */
+static uint32_t afatfs_FATSectorCountConsecutiveClusters(afatfsFATSector_t sector, uint32_t entryIndex, uint32_t cluster)
+{
+    uint32_t entriesPerSector = afatfs_fatEntriesPerSector();
+    uint32_t count = 1;
+    uint32_t nextCluster;
+
+    while (entryIndex + count < entriesPerSector) {
+        if (afatfs_isFAT16()) {
+            nextCluster = sector.fat16[entryIndex + count - 1];
+        } else {
+            nextCluster = sector.fat32[entryIndex + count - 1] & FAT32_CLUSTER_NUMBER_MASK;
+        }
+
+        if (nextCluster != cluster + count) {
+            break;
+        }
+
+        count++;
+    }
+
+    return count;
+}
+
+/**
+ * Ask the card to erase the sectors of the given run of clusters, which are about to be freed, if the run is long
+ * enough to be worth the erase command.
+ *
+ * Returns false if the card was too busy to accept the erase, so call again later to retry.
+ */
+static bool afatfs_eraseClusters(uint32_t firstCluster, uint32_t clusterCount)
+{
+    uint32_t sectorCount = clusterCount * afatfs.sectorsPerCluster;
+
+    if (sectorCount < AFATFS_MIN_ERASE_BLOCK_COUNT) {
+        return true;
+    }
+
+#ifdef AFATFS_DEBUG_VERBOSE
+    fprintf(stderr, "Erasing %u sectors of clusters %u to %u...\n", sectorCount, firstCluster, firstCluster + clusterCount - 1);
+#endif
+
+    // The erase is only an optimisation, so if the card refuses it there's nothing more for us to do
+    bool eraseAccepted = sdcard_eraseBlocks(afatfs_fileClusterToPhysical(firstCluster, 0), sectorCount) != SDCARD_OPERATION_BUSY;
+
+#if AFATFS_SDCARD_WRITE_QUEUE_DEPTH > 1
+    afatfs.cardCommandWaiting = !eraseAccepted && afatfs.cacheFlushesInProgress > 0;
+#endif
+
+    return eraseAccepted;
+}
+
+#endif
+
+/**
+ * Free the FAT chain that begins at *cluster (as in a file that is being truncated or deleted).
+ *
+ * The chain is swept one FAT sector at a time: once a FAT sector is in the cache, every following link of the chain
+ * that lies in that same sector is read and freed before we let go of it, so a fragmented chain costs one cache access
+ * (and marks its sector dirty once) for each run of links that passes through a sector, instead of two accesses for
+ * every cluster. At most AFATFS_FREE_CHAIN_SECTORS_PER_POLL FAT sectors are swept per call.
+ *
+ * With AFATFS_USE_SDCARD_ERASE, each long run of consecutive clusters in the chain is erased just before it is freed.
+ *
+ * *cluster is updated to mark our progress, so call again with the same argument to continue.
+ *
+ * Returns:
+ *     AFATFS_OPERATION_SUCCESS     - The whole chain has been freed
+ *     AFATFS_OPERATION_IN_PROGRESS - Card is busy or we've done enough work for now, call again later to resume
+ *     AFATFS_OPERATION_FAILURE     - When the filesystem encounters a fatal error
+ */
+static afatfsOperationStatus_e afatfs_FATFreeChain(uint32_t *cluster)
+{
+    afatfsFATSector_t sector;
+    uint32_t fatSectorIndex, fatSectorEntryIndex, nextCluster, nextFatSectorIndex;
+    uint32_t sectorBudget = AFATFS_FREE_CHAIN_SECTORS_PER_POLL;
+    uint32_t freedClusters;
+    afatfsOperationStatus_e result;
+#ifdef AFATFS_USE_SDCARD_ERASE
+    uint32_t eraseRunRemaining;
+    bool eraseBusy = false;
+#endif
+
+#ifdef AFATFS_USE_FSINFO
+    result = afatfs_fsInfoBeginModification();
+
+    if (result != AFATFS_OPERATION_SUCCESS) {
+        return result;
+    }
+#endif
+
+    while (!afatfs_FATIsEndOfChainMarker(*cluster)) {
+        if (sectorBudget == 0) {
+            return AFATFS_OPERATION_IN_PROGRESS;
+        }
+
+        if (!afatfs_assert(*cluster >= FAT_SMALLEST_LEGAL_CLUSTER_NUMBER)) {
+            return AFATFS_OPERATION_FAILURE; // The chain is broken
+        }
+
+        afatfs_getFATPositionForCluster(*cluster, &fatSectorIndex, &fatSectorEntryIndex);
+
+        result = afatfs_cacheSector(afatfs_fatSectorToPhysical(0, fatSectorIndex), &sector.bytes, AFATFS_CACHE_READ | AFATFS_CACHE_WRITE, 0);
+
+        if (result != AFATFS_OPERATION_SUCCESS) {
+            return result;
+        }
+
+        sectorBudget--;
+        freedClusters = 0;
+
+#ifdef AFATFS_USE_SDCARD_ERASE
+        eraseRunRemaining = 0;
+#endif
+
+        // Follow the chain for as long as it stays inside this FAT sector
+        while (1) {
+#ifdef AFATFS_USE_SDCARD_ERASE
+            if (eraseRunRemaining == 0) {
+                /*
+                 * Ask for the next run of consecutive clusters to be erased before we free it, so that the erase can't
+                 * reach the card after somebody else has been given the clusters and written to them.
+                 */
+                eraseRunRemaining = afatfs_FATSectorCountConsecutiveClusters(sector, fatSectorEntryIndex, *cluster);
+
+                if (!afatfs_eraseClusters(*cluster, eraseRunRemaining)) {
+                    // The card is busy, so leave the rest of the chain for later
+                    eraseBusy = true;
+                    break;
+                }
+            }
+
+            eraseRunRemaining--;
+#endif
+
+            if (afatfs_isFAT16()) {
+                nextCluster = sector.fat16[fatSectorEntryIndex];
+                sector.fat16[fatSectorEntryIndex] = 0;
+            } else {
+                nextCluster = sector.fat32[fatSectorEntryIndex] & FAT32_CLUSTER_NUMBER_MASK;
+                sector.fat32[fatSectorEntryIndex] = 0;
+            }
+
+            freedClusters++;
+
+            // Searches for unallocated regular clusters should be told about this free cluster now
+            afatfs.lastClusterAllocated = MIN(afatfs.lastClusterAllocated, *cluster);
+
+            *cluster = nextCluster;
+
+            if (afatfs_FATIsEndOfChainMarker(nextCluster) || nextCluster < FAT_SMALLEST_LEGAL_CLUSTER_NUMBER) {
+                break;
+            }
+
+            afatfs_getFATPositionForCluster(nextCluster, &nextFatSectorIndex, &fatSectorEntryIndex);
+
+            if (nextFatSectorIndex != fatSectorIndex) {
+                break;
+            }
+        }
+
+#ifdef AFATFS_DEBUG_VERBOSE
+        fprintf(stderr, "Freed %u clusters of a chain in FAT sector %u\n", freedClusters, fatSectorIndex);
+#endif
+
+#ifdef AFATFS_USE_FSINFO
+        afatfs_fsInfoAdjustFreeClusters(freedClusters);
+#else
+        (void) freedClusters;
+#endif
+
+#ifdef AFATFS_FREE_SPACE_SUMMARY_GROUPS
+        afatfs_freeSpaceSummaryMarkFree(fatSectorIndex);
+#endif
+
+        afatfs_fatSectorModified(fatSectorIndex, sector.bytes);
+
+#ifdef AFATFS_USE_SDCARD_ERASE
+        if (eraseBusy) {
+            return AFATFS_OPERATION_IN_PROGRESS;
+        }
+#endif
+    }
+
+    return AFATFS_OPERATION_SUCCESS;
+}
+
+#if AFATFS_FAT_MIRROR_POLICY == AFATFS_FAT_MIRROR_DEFERRED
+
+/**
+ * Returns true if there are changes to the first FAT which haven't been copied to the second FAT yet.
+ */
+static bool afatfs_fatMirrorIsPending()
+{
+    if (afatfs.fatMirror.copySector != afatfs.fatMirror.copyEnd) {
+        return true;
+    }
+
+    for (int i = 0; i < AFATFS_FAT_MIRROR_DIRTY_GROUPS / 8; i++) {
+        if (afatfs.fatMirror.dirtyGroups[i]) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * If a sync was requested, copy the dirty groups of the first FAT into the second FAT. The destination sectors are
+ * written through the cache in ascending order so that afatfs_flush() can send them using multi-block writes.
+ */
+static void afatfs_fatMirrorContinue()
+{
+    uint8_t *sourceSector, *destSector;
+
+    while (1) {
+        if (afatfs.fatMirror.copySector == afatfs.fatMirror.copyEnd) {
+            int group = -1;
+
+            if (!afatfs.fatMirror.syncRequested) {
+                return;
+            }
+
+            for (int i = 0; i < AFATFS_FAT_MIRROR_DIRTY_GROUPS; i++) {
+                if ((afatfs.fatMirror.dirtyGroups[i / 8] & (1 << (i % 8))) != 0) {
+                    group = i;
+                    break;
+                }
+            }
+
+            if (group == -1) {
+                afatfs.fatMirror.syncRequested = false;
+                return;
+            }
+
+            // If the group is modified again while we're copying it, it'll get copied again afterwards
+            afatfs.fatMirror.dirtyGroups[group / 8] &= ~(1 << (group % 8));
+
+            afatfs.fatMirror.copySector = group * afatfs.fatMirror.sectorsPerGroup;
+            afatfs.fatMirror.copyEnd = MIN(afatfs.fatMirror.copySector + afatfs.fatMirror.sectorsPerGroup, afatfs.fatSectors);
+
+            if (afatfs.fatMirror.copySector >= afatfs.fatMirror.copyEnd) {
+                // Empty group past the end of the FAT
+                afatfs.fatMirror.copySector = afatfs.fatMirror.copyEnd = 0;
+                continue;
+            }
+        }
+
+        if (afatfs.fatMirror.sourceCacheIndex == -1) {
+            if (afatfs_cacheSector(afatfs_fatSectorToPhysical(0, afatfs.fatMirror.copySector), &sourceSector, AFATFS_CACHE_READ | AFATFS_CACHE_RETAIN | AFATFS_CACHE_DISCARDABLE, 0) != AFATFS_OPERATION_SUCCESS) {
+                return;
+            }
+
+            afatfs.fatMirror.sourceCacheIndex = afatfs_getCacheDescriptorIndexForBuffer(sourceSector);
+        }
+
+        if (
+            afatfs_cacheSector(
+                afatfs_fatSectorToPhysical(1, afatfs.fatMirror.copySector),
+                &destSector,
+                AFATFS_CACHE_WRITE | AFATFS_CACHE_DISCARDABLE,
+                afatfs.fatMirror.copyEnd - afatfs.fatMirror.copySector
+            ) != AFATFS_OPERATION_SUCCESS
+        ) {
+            return;
+        }
+
+        memcpy(destSector, afatfs_cacheSectorGetMemory(afatfs.fatMirror.sourceCacheIndex), AFATFS_SECTOR_SIZE);
+
+        afatfsCacheBlockDescriptor_t *sourceDescriptor = &afatfs.cacheDescriptor[afatfs.fatMirror.sourceCacheIndex];
+
+        sourceDescriptor->retainCount = MAX((int) sourceDescriptor->retainCount - 1, 0);
+        afatfs_cacheSectorUpdateList(sourceDescriptor);
+
+        afatfs.fatMirror.sourceCacheIndex = -1;
+        afatfs.fatMirror.copySector++;
+    }
+}
+
+#endif
+
+#endif
+
+/**
+ * Read the app's millisecond clock, or return zero if it hasn't given us one with afatfs_setMillisCallback().
+ */
+static uint32_t afatfs_millis()
+{
+    return afatfs.millis ? afatfs.millis() : 0;
+}
+
+/**
+ * Returns true if clusters have been added to the file since its directory entry was last saved, and its durability
+ * policy says the entry should be brought up to date now.
+ *
+ * A subdirectory's entry records no size, so it's only saved when the directory is given its first cluster. The
+ * freefile (which is never opened with a policy) always saves its entry right away.
+ */
+static bool afatfs_fileDirectoryEntryIsDue(afatfsFilePtr_t file)
+{
+    if (file->type == AFATFS_FILE_TYPE_DIRECTORY) {
+        return file->cursorCluster == file->firstCluster;
+    }
+
+    if (file->type != AFATFS_FILE_TYPE_NORMAL) {
+        return true;
+    }
+
+    switch (file->durability.policy) {
+        case AFATFS_DURABILITY_EVERY_N_ALLOCATIONS:
+            return file->unsavedAllocations >= file->durability.interval;
+        case AFATFS_DURABILITY_INTERVAL:
+            return file->unsavedAllocations > 0 && afatfs.millis
+                && afatfs_millis() - file->directorySaveTime >= file->durability.interval;
+        case AFATFS_DURABILITY_ON_CLOSE:
+            return false;
+        case AFATFS_DURABILITY_EVERY_ALLOCATION:
+        default:
+            return true;
+    }
+}
+
+/**
+ * Write the directory entry for the file into its `directoryEntryPos` position in its containing directory.
+ *
+ * mode:
+ *     AFATFS_SAVE_DIRECTORY_NORMAL    - Store the file's physical size, not the logical size, in the directory entry
+ *     AFATFS_SAVE_DIRECTORY_FOR_CLOSE - We're done extending the file so we can write the logical size now.
+ *     AFATFS_SAVE_DIRECTORY_DELETED   - Mark the directory entry as deleted
+ *
+ * Returns:
+ *     AFATFS_OPERATION_SUCCESS - The directory entry has been stored into the directory sector in cache.
+ *     AFATFS_OPERATION_IN_PROGRESS - Cache is too busy, retry later
+ *     AFATFS_OPERATION_FAILURE - If the filesystem enters the fatal state
+ */
+static afatfsOperationStatus_e afatfs_saveDirectoryEntry(afatfsFilePtr_t file, afatfsSaveDirectoryEntryMode_e mode)
+{
+    uint8_t *sector;
+    afatfsOperationStatus_e result;
+
+    if (file->directoryEntryPos.sectorNumberPhysical == 0) {
+        return AFATFS_OPERATION_SUCCESS; // Root directories don't have a directory entry
+    }
+
+    result = afatfs_cacheSector(file->directoryEntryPos.sectorNumberPhysical, &sector, AFATFS_CACHE_READ | AFATFS_CACHE_WRITE, 0);
+
+#ifdef AFATFS_DEBUG_VERBOSE
+    fprintf(stderr, "Saving directory entry to sector %u...\n", file->directoryEntryPos.sectorNumberPhysical);
+#endif
+
+    if (result == AFATFS_OPERATION_SUCCESS) {
+        if (afatfs_assert(file->directoryEntryPos.entryIndex >= 0)) {
+            fatDirectoryEntry_t *entry = (fatDirectoryEntry_t *) sector + file->directoryEntryPos.entryIndex;
+
+            switch (mode) {
+               case AFATFS_SAVE_DIRECTORY_NORMAL:
+                   /* We exaggerate the length of the written file so that if power is lost, the end of the file will
+                    * still be readable (though the very tail of the file will be uninitialized data).
+                    *
+                    * This way we can avoid updating the directory entry too many times during fwrites() on the file.
+                    */
+                   entry->fileSize = file->physicalSize;
+               break;
+               case AFATFS_SAVE_DIRECTORY_DELETED:
+                   entry->filename[0] = FAT_DELETED_FILE_MARKER;
+                   //Fall through
+
+               case AFATFS_SAVE_DIRECTORY_FOR_CLOSE:
+                   // We write the true length of the file on close.
+                   entry->fileSize = file->logicalSize;
+            }
+
+            // (sub)directories don't store a filesize in their directory entry:
+            if (file->type == AFATFS_FILE_TYPE_DIRECTORY) {
+                entry->fileSize = 0;
+            }
+
+            entry->firstClusterHigh = file->firstCluster >> 16;
+            entry->firstClusterLow = file->firstCluster & 0xFFFF;
+
+            file->unsavedAllocations = 0;
+            file->directorySaveTime = afatfs_millis();
+        } else {
+            return AFATFS_OPERATION_FAILURE;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Attempt to add a free cluster to the end of the given file. If the file was previously empty, the directory entry
+ * is updated to point to the new cluster.
+ *
+ * Returns:
+ *     AFATFS_OPERATION_SUCCESS     - The cluster has been appended
+ *     AFATFS_OPERATION_IN_PROGRESS - Cache was busy, so call again later to continue
+ *     AFATFS_OPERATION_FAILURE     - Cluster could not be appended because the filesystem ran out of space
+ *                                    (afatfs.filesystemFull is set to true)
+ *
+ * If the file's operation was AFATFS_FILE_OPERATION_APPEND_FREE_CLUSTER, the file operation is cleared upon completion,
+ * otherwise it is left alone so that this operation can be called as a sub-operation of some other operation on the
+ * file.
+ */
+static afatfsOperationStatus_e afatfs_appendRegularFreeClusterContinue(afatfsFile_t *file)
+{
+    afatfsAppendFreeCluster_t *opState = &file->operation.state.appendFreeCluster;
+    afatfsOperationStatus_e status;
+
+    doMore:
+
+    switch (opState->phase) {
+        case AFATFS_APPEND_FREE_CLUSTER_PHASE_FIND_FREESPACE:
+            switch (afatfs_findClusterWithCondition(CLUSTER_SEARCH_FREE, &opState->searchCluster, afatfs.numClusters + FAT_SMALLEST_LEGAL_CLUSTER_NUMBER)) {
+                case AFATFS_FIND_CLUSTER_FOUND:
+                    afatfs.lastClusterAllocated = opState->searchCluster;
+
+#ifdef AFATFS_USE_STATS
+                    afatfs.stats.clusterAllocations++;
+#endif
+
+                    // Make the cluster available for us to write in
+                    file->cursorCluster = opState->searchCluster;
+                    file->physicalSize += afatfs_clusterSize();
+                    file->unsavedAllocations++;
+
+                    if (opState->previousCluster == 0) {
+                        // This is the new first cluster in the file
+                        file->firstCluster = opState->searchCluster;
+                    }
+
+                    opState->phase = AFATFS_APPEND_FREE_CLUSTER_PHASE_UPDATE_FAT1;
+                    goto doMore;
+                break;
+                case AFATFS_FIND_CLUSTER_NOT_FOUND:
+                    /*
+                     * The search began from lastClusterAllocated, which might have come from the FSInfo next free
+                     * cluster hint, so there could still be free clusters before it. Search again from the start.
+                     */
+                    if (afatfs.lastClusterAllocated != FAT_SMALLEST_LEGAL_CLUSTER_NUMBER) {
+                        afatfs.lastClusterAllocated = FAT_SMALLEST_LEGAL_CLUSTER_NUMBER;
+                        opState->searchCluster = FAT_SMALLEST_LEGAL_CLUSTER_NUMBER;
+                        goto doMore;
+                    }
+                    // Fall through
+                case AFATFS_FIND_CLUSTER_FATAL:
+                    // We couldn't find an empty cluster to append to the file
+                    opState->phase = AFATFS_APPEND_FREE_CLUSTER_PHASE_FAILURE;
+                    goto doMore;
+                break;
+                case AFATFS_FIND_CLUSTER_IN_PROGRESS:
+                break;
+            }
+        break;
+        case AFATFS_APPEND_FREE_CLUSTER_PHASE_UPDATE_FAT1:
+            // Terminate the new cluster
+            status = afatfs_FATSetNextCluster(opState->searchCluster, 0xFFFFFFFF);
+
+            if (status == AFATFS_OPERATION_SUCCESS) {
+                if (opState->previousCluster) {
+                    opState->phase = AFATFS_APPEND_FREE_CLUSTER_PHASE_UPDATE_FAT2;
+                } else {
+                    opState->phase = AFATFS_APPEND_FREE_CLUSTER_PHASE_UPDATE_FILE_DIRECTORY;
+                }
+
+                goto doMore;
+            }
+        break;
+        case AFATFS_APPEND_FREE_CLUSTER_PHASE_UPDATE_FAT2:
+            // Add the new cluster to the pre-existing chain
+            status = afatfs_FATSetNextCluster(opState->previousCluster, opState->searchCluster);
+
+            if (status == AFATFS_OPERATION_SUCCESS) {
+                opState->phase = AFATFS_APPEND_FREE_CLUSTER_PHASE_UPDATE_FILE_DIRECTORY;
+                goto doMore;
+            }
+        break;
+        case AFATFS_APPEND_FREE_CLUSTER_PHASE_UPDATE_FILE_DIRECTORY:
+            if (
+                !afatfs_fileDirectoryEntryIsDue(file)
+                || afatfs_saveDirectoryEntry(file, AFATFS_SAVE_DIRECTORY_NORMAL) == AFATFS_OPERATION_SUCCESS
+            ) {
+                opState->phase = AFATFS_APPEND_FREE_CLUSTER_PHASE_COMPLETE;
+                goto doMore;
+            }
+        break;
+        case AFATFS_APPEND_FREE_CLUSTER_PHASE_COMPLETE:
+            if (file->operation.operation == AFATFS_FILE_OPERATION_APPEND_FREE_CLUSTER) {
+                file->operation.operation = AFATFS_FILE_OPERATION_NONE;
+            }
+
+            return AFATFS_OPERATION_SUCCESS;
+        break;
+        case AFATFS_APPEND_FREE_CLUSTER_PHASE_FAILURE:
+            if (file->operation.operation == AFATFS_FILE_OPERATION_APPEND_FREE_CLUSTER) {
+                file->operation.operation = AFATFS_FILE_OPERATION_NONE;
+            }
+
+            afatfs.filesystemFull = true;
+            return AFATFS_OPERATION_FAILURE;
+        break;
+    }
+
+    return AFATFS_OPERATION_IN_PROGRESS;
+}
+
+static void afatfs_appendRegularFreeClusterInitOperationState(afatfsAppendFreeCluster_t *state, uint32_t previousCluster)
+{
+    state->phase = AFATFS_APPEND_FREE_CLUSTER_PHASE_INITIAL;
+    state->previousCluster = previousCluster;
+    state->searchCluster = afatfs.lastClusterAllocated;
+}
+
+/**
+ * Queue up an operation to append a free cluster to the file and update the file's cursorCluster to point to it.
+ *
+ * You must seek to the end of the file first, so file.cursorCluster will be 0 for the first call, and
+ * `file.cursorPreviousCluster` will be the cluster to append after.
+ *
+ * Note that the cursorCluster will be updated before this operation is completely finished (i.e. before the FAT is
+ * updated) but you can go ahead and write to it before the operation succeeds.
+ *
+ * Returns:
+ *     AFATFS_OPERATION_SUCCESS     - The append completed successfully
+ *     AFATFS_OPERATION_IN_PROGRESS - The operation was queued on the file and will complete later
+ *     AFATFS_OPERATION_FAILURE     - Operation could not be queued or append failed, check afatfs.fileSystemFull
+ */
+static afatfsOperationStatus_e afatfs_appendRegularFreeCluster(afatfsFilePtr_t file)
+{
+    if (file->operation.operation == AFATFS_FILE_OPERATION_APPEND_FREE_CLUSTER)
+        return AFATFS_OPERATION_IN_PROGRESS;
+
+    if (afatfs.filesystemFull || afatfs_fileIsBusy(file)) {
+        return AFATFS_OPERATION_FAILURE;
+    }
+
+    file->operation.operation = AFATFS_FILE_OPERATION_APPEND_FREE_CLUSTER;
+
+    afatfs_appendRegularFreeClusterInitOperationState(&file->operation.state.appendFreeCluster, file->cursorPreviousCluster);
+
+    return afatfs_appendRegularFreeClusterContinue(file);
+}
+
+/**
+ * Size of a AFATFS supercluster in bytes
+ */
+ONLY_EXPOSE_FOR_TESTING
+uint32_t afatfs_superClusterSize()
+{
+    return afatfs_fatEntriesPerSector() * afatfs_clusterSize();
+}
+
+#ifdef AFATFS_USE_JOURNAL
+
+/**
+ * A checksum of everything in the journal sector that follows the checksum field, so that a stale sector left over
+ * from some other file isn't mistaken for a journal.
+ */
+static uint32_t afatfs_journalChecksum(const afatfsJournalSector_t *contents)
+{
+    const uint8_t *bytes = (const uint8_t *) &contents->freeFileEntrySector;
+    uint32_t length = sizeof(*contents) - sizeof(contents->magic) - sizeof(contents->checksum);
+    uint32_t checksum = AFATFS_JOURNAL_MAGIC;
+
+    for (uint32_t i = 0; i < length; i++) {
+        checksum = ((checksum << 5) | (checksum >> 27)) + bytes[i];
+    }
+
+    return checksum;
+}
+
+/**
+ * Called by the SD card driver when a write of the journal sector completes.
+ */
+static void afatfs_sdcardJournalWriteComplete(sdcardBlockOperation_e operation, uint32_t sectorIndex, uint8_t *buffer, uint32_t callbackData)
+{
+    (void) operation;
+    (void) sectorIndex;
+    (void) callbackData;
+
+    afatfs.journal.writeInFlight = false;
+
+    if (buffer == NULL) {
+        // Write failed, so try it again
+        afatfs.journal.dirty = true;
+    } else {
+        afatfs.journal.sequenceOnCard = afatfs.journal.sequenceBeingWritten;
+    }
+}
+
+/**
+ * If the journal buffer has changed, begin writing it to the card. It's written directly from the buffer rather than
+ * through the cache, so that it can overtake the dirty sectors in the cache whose changes it describes.
+ */
+static void afatfs_journalWrite()
+{
+    afatfsJournal_t *journal = &afatfs.journal;
+
+    if (!journal->dirty || journal->writeInFlight) {
+        return;
+    }
+
+    journal->buffer.contents.magic = AFATFS_JOURNAL_MAGIC;
+    journal->buffer.contents.freeFileEntrySector = afatfs.freeFile.directoryEntryPos.sectorNumberPhysical;
+    journal->buffer.contents.freeFileEntryIndex = afatfs.freeFile.directoryEntryPos.entryIndex;
+    journal->buffer.contents.checksum = afatfs_journalChecksum(&journal->buffer.contents);
+
+    if (!afatfs_cacheSectorPrepareForDirectWrite(journal->sector, journal->buffer.bytes)) {
+        return;
+    }
+
+    switch (sdcard_writeBlock(journal->sector, journal->buffer.bytes, afatfs_sdcardJournalWriteComplete, 0)) {
+        case SDCARD_OPERATION_IN_PROGRESS:
+            journal->writeInFlight = true;
+            journal->sequenceBeingWritten = journal->nextSequence;
+            journal->dirty = false;
+        break;
+        case SDCARD_OPERATION_SUCCESS:
+            journal->sequenceOnCard = journal->nextSequence;
+            journal->dirty = false;
+        break;
+        case SDCARD_OPERATION_BUSY:
+        case SDCARD_OPERATION_FAILURE:
+        default:
+            // Try again later
+            ;
+    }
+}
+
+/**
+ * Returns the index of the record with the lowest sequence number greater than `afterSequence`, or -1 if there is none.
+ */
+static int afatfs_journalFindRecord(uint32_t afterSequence)
+{
+    afatfsJournalRecord_t *records = afatfs.journal.buffer.contents.records;
+    int result = -1;
+
+    for (int i = 0; i < (int) AFATFS_JOURNAL_RECORDS; i++) {
+        if (records[i].sequence > afterSequence && (result == -1 || records[i].sequence < records[result].sequence)) {
+            result = i;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Is there room to add a record to the journal right now? (There's always room if the volume has no journal).
+ */
+static bool afatfs_journalHasRoom()
+{
+    afatfsJournal_t *journal = &afatfs.journal;
+
+    if (journal->sector == 0) {
+        return true;
+    }
+
+    if (journal->writeInFlight) {
+        return false;
+    }
+
+    for (int i = 0; i < (int) AFATFS_JOURNAL_RECORDS; i++) {
+        if (journal->buffer.contents.records[i].sequence == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Are there no records in the journal (not even ones waiting to be dropped), and no write of it that could still be
+ * adding one?
+ */
+static bool afatfs_journalIsEmpty()
+{
+    return afatfs.journal.sector == 0 || (!afatfs.journal.writeInFlight && afatfs_journalFindRecord(0) == -1);
+}
+
+/**
+ * Does the journal still hold a record of a file being deleted? Until it's dropped, the next mount might mark that
+ * file's directory entry as deleted again, so the entry mustn't be reused.
+ */
+static bool afatfs_journalHasDeletion()
+{
+    afatfsJournalRecord_t *records = afatfs.journal.buffer.contents.records;
+
+    for (int i = 0; i < (int) AFATFS_JOURNAL_RECORDS; i++) {
+        if (records[i].sequence != 0 && (records[i].flags & AFATFS_JOURNAL_FLAG_DELETE) != 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Record an operation on the given file in the journal (call afatfs_journalHasRoom() first). `startCluster` and
+ * `endCluster` are the range of clusters that the operation chains together in the FAT. For an append the freefile
+ * must have already given up the new supercluster, and for a truncation it must not have taken the clusters back yet.
+ *
+ * Returns the index of the new record, or -1 if the volume has no journal.
+ */
+static int afatfs_journalAdd(afatfsJournalRecordType_e type, afatfsFilePtr_t file, uint32_t startCluster, uint32_t endCluster, uint32_t linkCluster, bool deleting)
+{
+    afatfsJournal_t *journal = &afatfs.journal;
+    afatfsJournalRecord_t *record;
+    int recordIndex;
+
+    if (journal->sector == 0) {
+        return -1;
+    }
+
+    for (recordIndex = 0; journal->buffer.contents.records[recordIndex].sequence != 0; recordIndex++) {
+    }
+
+    record = &journal->buffer.contents.records[recordIndex];
+
+    record->sequence = journal->nextSequence++;
+    record->type = type;
+    record->flags = 0;
+    record->fileEntrySector = file->directoryEntryPos.sectorNumberPhysical;
+    record->fileEntryIndex = file->directoryEntryPos.entryIndex;
+    record->startCluster = startCluster;
+    record->endCluster = endCluster;
+    record->linkCluster = linkCluster;
+    record->freeFileFirstCluster = afatfs.freeFile.firstCluster;
+    record->freeFileSize = afatfs.freeFile.logicalSize;
+
+    if (type == AFATFS_JOURNAL_RECORD_TRUNCATE_CONTIGUOUS) {
+        // The clusters will be put back on the start of the freefile
+        record->freeFileFirstCluster = startCluster;
+        record->freeFileSize += (afatfs.freeFile.firstCluster - startCluster) * afatfs_clusterSize();
+
+        if (deleting) {
+            record->flags |= AFATFS_JOURNAL_FLAG_DELETE;
+        }
+    } else if (file->firstCluster == startCluster) {
+        record->flags |= AFATFS_JOURNAL_FLAG_FIRST_CLUSTER;
+    }
+
+    journal->finishedRecords &= ~(1 << recordIndex);
+    journal->dirty = true;
+
+    afatfs_journalWrite();
+
+    return recordIndex;
+}
+
+/**
+ * Has the given journal record (from afatfs_journalAdd()) reached the card yet?
+ */
+static bool afatfs_journalRecordIsOnCard(int recordIndex)
+{
+    return recordIndex == -1 || afatfs.journal.buffer.contents.records[recordIndex].sequence < afatfs.journal.sequenceOnCard;
+}
+
+/**
+ * Call once the operation of the record at *recordIndex has made all of its changes in the cache. *recordIndex is set to
+ * -1 so that the record can't be finished twice.
+ */
+static void afatfs_journalRecordFinished(int8_t *recordIndex)
+{
+    if (*recordIndex != -1) {
+        afatfs.journal.finishedRecords |= 1 << *recordIndex;
+        *recordIndex = -1;
+    }
+}
+
+/**
+ * Are any FAT or directory sectors waiting to be written to the card, or being written right now?
+ */
+static bool afatfs_cacheHasUnwrittenMetadata()
+{
+    if (afatfs.cacheMetadataWrites > 0) {
+        return true;
+    }
+
+    for (int i = afatfs.cacheLists[AFATFS_CACHE_LIST_DIRTY].head; i != -1; i = afatfs.cacheDescriptor[i].listNext) {
+        if (!afatfs.cacheDescriptor[i].fileData) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Drop the oldest records from the journal for as long as their operations have finished and the sectors they changed
+ * have been flushed, then write the journal out if it has changed. Called during afatfs_poll().
+ *
+ * Records are only ever dropped oldest-first, so a record that's replayed at mount never undoes a later operation that
+ * is no longer in the journal.
+ */
+static void afatfs_journalPoll()
+{
+    afatfsJournal_t *journal = &afatfs.journal;
+    int recordIndex;
+
+    if (journal->sector == 0) {
+        return;
+    }
+
+    if (journal->finishedRecords != 0 && !journal->writeInFlight && !afatfs_cacheHasUnwrittenMetadata()) {
+        while ((recordIndex = afatfs_journalFindRecord(0)) != -1 && (journal->finishedRecords & (1 << recordIndex)) != 0) {
+            memset(&journal->buffer.contents.records[recordIndex], 0, sizeof(journal->buffer.contents.records[recordIndex]));
+
+            journal->finishedRecords &= ~(1 << recordIndex);
+            journal->dirty = true;
+        }
+    }
+
+    afatfs_journalWrite();
+}
+
+#ifdef AFATFS_DEBUG
+/**
+ * Get the number of records in the journal which have reached the card and haven't been dropped yet.
+ */
+ONLY_EXPOSE_FOR_TESTING
+uint32_t afatfs_journalRecordsOnCard()
+{
+    uint32_t count = 0;
+
+    for (int i = 0; afatfs.journal.sector != 0 && i < (int) AFATFS_JOURNAL_RECORDS; i++) {
+        if (afatfs.journal.buffer.contents.records[i].sequence != 0 && afatfs_journalRecordIsOnCard(i)) {
+            count++;
+        }
+    }
+
+    return count;
+}
+#endif
+
+#endif
+
+#ifdef AFATFS_USE_FREEFILE
+/**
+ * Continue to attempt to add a supercluster to the end of the given file.
+ *
+ * If the file operation was set to AFATFS_FILE_OPERATION_APPEND_SUPERCLUSTER and the operation completes, the file's
+ * operation is cleared.
+ *
+ * Returns:
+ *     AFATFS_OPERATION_SUCCESS     - On completion
+ *     AFATFS_OPERATION_IN_PROGRESS - Operation still in progress
+ */
+static afatfsOperationStatus_e afatfs_appendSuperclusterContinue(afatfsFile_t *file)
+{
+    afatfsAppendSupercluster_t *opState = &file->operation.state.appendSupercluster;
+
+    afatfsOperationStatus_e status;
+
+    doMore:
+    switch (opState->phase) {
+        case AFATFS_APPEND_SUPERCLUSTER_PHASE_INIT:
+            // A contiguous file that's being truncated might be handing its clusters back to the start of the freefile
+            if (afatfs_fileIsBusy(&afatfs.freeFile)) {
+                status = AFATFS_OPERATION_IN_PROGRESS;
+                break;
+            }
+
+#ifdef AFATFS_USE_JOURNAL
+            if (!afatfs_journalHasRoom()) {
+                status = AFATFS_OPERATION_IN_PROGRESS;
+                break;
+            }
+#endif
+
+            // Our file steals the first cluster of the freefile
+
+            // We can go ahead and write to that space before the FAT and directory are updated
+            file->cursorCluster = afatfs.freeFile.firstCluster;
+            file->physicalSize += afatfs_superClusterSize();
+            file->unsavedAllocations++;
+
+            /* Remove the first supercluster from the freefile
+             *
+             * Even if the freefile becomes empty, we still don't set its first cluster to zero. This is so that
+             * afatfs_fileGetNextCluster() can find the supercluster boundaries in contiguous files (which are whole
+             * superclusters away from the start of the freefile).
+             *
+             * Note that normally the freefile can't become empty because it is allocated as a non-integer number
+             * of superclusters to avoid precisely this situation.
+             */
+            afatfs.freeFile.firstCluster += afatfs_fatEntriesPerSector();
+            afatfs.freeFile.logicalSize -= afatfs_superClusterSize();
+            afatfs.freeFile.physicalSize -= afatfs_superClusterSize();
+
+            // The new supercluster needs to have its clusters chained contiguously and marked with a terminator at the end
+            opState->fatRewriteStartCluster = file->cursorCluster;
+            opState->fatRewriteEndCluster = opState->fatRewriteStartCluster + afatfs_fatEntriesPerSector();
+
+            file->superclusterEnd = opState->fatRewriteEndCluster;
+
+            if (opState->previousCluster == 0) {
+                // This is the new first cluster in the file so we need to update the directory entry
                 file->firstCluster = file->cursorCluster;
-            } else {
+            } else if (opState->previousCluster + 1 == file->cursorCluster) {
                 /*
                  * We also need to update the FAT of the supercluster that used to end the file so that it no longer
                  * terminates there
                  */
                 opState->fatRewriteStartCluster -= afatfs_fatEntriesPerSector();
+
+                // That rewrite links the old supercluster to the new one for us
+                opState->previousCluster = 0;
             }
 
+#ifdef AFATFS_USE_JOURNAL
+            opState->journalRecord = afatfs_journalAdd(AFATFS_JOURNAL_RECORD_APPEND_SUPERCLUSTER, file,
+                opState->fatRewriteStartCluster, opState->fatRewriteEndCluster, opState->previousCluster, false);
+
+            opState->phase = AFATFS_APPEND_SUPERCLUSTER_PHASE_WAIT_FOR_JOURNAL;
+#else
             opState->phase = AFATFS_APPEND_SUPERCLUSTER_PHASE_UPDATE_FREEFILE_DIRECTORY;
+#endif
             goto doMore;
         break;
+#ifdef AFATFS_USE_JOURNAL
+        case AFATFS_APPEND_SUPERCLUSTER_PHASE_WAIT_FOR_JOURNAL:
+            // None of our changes to the FAT or directory may reach the card before our journal record does
+            if (afatfs_journalRecordIsOnCard(opState->journalRecord)) {
+                opState->phase = AFATFS_APPEND_SUPERCLUSTER_PHASE_UPDATE_FREEFILE_DIRECTORY;
+                goto doMore;
+            }
+
+            status = AFATFS_OPERATION_IN_PROGRESS;
+        break;
+#endif
         case AFATFS_APPEND_SUPERCLUSTER_PHASE_UPDATE_FREEFILE_DIRECTORY:
             // First update the freefile's directory entry to remove the first supercluster so we don't risk cross-linking the file
             status = afatfs_saveDirectoryEntry(&afatfs.freeFile, AFATFS_SAVE_DIRECTORY_NORMAL);
@@ -1689,17 +4421,43 @@ static afatfsOperationStatus_e afatfs_appendSuperclusterContinue(afatfsFile_t *f
         case AFATFS_APPEND_SUPERCLUSTER_PHASE_UPDATE_FAT:
             status = afatfs_FATFillWithPattern(AFATFS_FAT_PATTERN_TERMINATED_CHAIN, &opState->fatRewriteStartCluster, opState->fatRewriteEndCluster);
 
+            if (status == AFATFS_OPERATION_SUCCESS) {
+                if (opState->previousCluster == 0) {
+                    opState->phase = AFATFS_APPEND_SUPERCLUSTER_PHASE_UPDATE_FILE_DIRECTORY;
+                } else {
+                    opState->phase = AFATFS_APPEND_SUPERCLUSTER_PHASE_LINK_PREVIOUS;
+                }
+                goto doMore;
+            }
+        break;
+        case AFATFS_APPEND_SUPERCLUSTER_PHASE_LINK_PREVIOUS:
+            /*
+             * Another contiguous file took the superclusters that followed our last one, so now that the new supercluster
+             * is chained and terminated, point the old end of our file at it.
+             */
+            status = afatfs_FATSetNextCluster(opState->previousCluster, opState->fatRewriteEndCluster - afatfs_fatEntriesPerSector());
+
             if (status == AFATFS_OPERATION_SUCCESS) {
                 opState->phase = AFATFS_APPEND_SUPERCLUSTER_PHASE_UPDATE_FILE_DIRECTORY;
                 goto doMore;
             }
         break;
         case AFATFS_APPEND_SUPERCLUSTER_PHASE_UPDATE_FILE_DIRECTORY:
-            // Update the fileSize/firstCluster in the directory entry for the file
-            status = afatfs_saveDirectoryEntry(file, AFATFS_SAVE_DIRECTORY_NORMAL);
+            // Update the fileSize/firstCluster in the directory entry for the file (if its durability policy asks for it)
+            if (afatfs_fileDirectoryEntryIsDue(file)) {
+                status = afatfs_saveDirectoryEntry(file, AFATFS_SAVE_DIRECTORY_NORMAL);
+            } else {
+                status = AFATFS_OPERATION_SUCCESS;
+            }
         break;
     }
 
+#ifdef AFATFS_USE_JOURNAL
+    if (status == AFATFS_OPERATION_FAILURE || status == AFATFS_OPERATION_SUCCESS) {
+        afatfs_journalRecordFinished(&opState->journalRecord);
+    }
+#endif
+
     if ((status == AFATFS_OPERATION_FAILURE || status == AFATFS_OPERATION_SUCCESS) && file->operation.operation == AFATFS_FILE_OPERATION_APPEND_SUPERCLUSTER) {
         file->operation.operation = AFATFS_FILE_OPERATION_NONE;
     }
@@ -1812,7 +4570,7 @@ static uint8_t* afatfs_fileRetainCursorSectorForRead(afatfsFilePtr_t file)
         afatfsOperationStatus_e status = afatfs_cacheSector(
             physicalSector,
             &result,
-            AFATFS_CACHE_READ | AFATFS_CACHE_RETAIN,
+            AFATFS_CACHE_READ | AFATFS_CACHE_RETAIN | (file->type == AFATFS_FILE_TYPE_NORMAL ? AFATFS_CACHE_FILE_DATA : 0),
             0
         );
 
@@ -1873,11 +4631,18 @@ static uint8_t* afatfs_fileLockCursorSectorForWrite(afatfsFilePtr_t file)
             cacheFlags |= AFATFS_CACHE_READ;
         }
 
+        if (file->type == AFATFS_FILE_TYPE_NORMAL) {
+            cacheFlags |= AFATFS_CACHE_FILE_DATA;
+        }
+
         // In contiguous append mode, we'll pre-erase the whole supercluster
         if ((file->mode & (AFATFS_FILE_MODE_APPEND | AFATFS_FILE_MODE_CONTIGUOUS)) == (AFATFS_FILE_MODE_APPEND | AFATFS_FILE_MODE_CONTIGUOUS)) {
             uint32_t cursorOffsetInSupercluster = file->cursorOffset & (afatfs_superClusterSize() - 1);
 
             eraseBlockCount = afatfs_fatEntriesPerSector() * afatfs.sectorsPerCluster - cursorOffsetInSupercluster / AFATFS_SECTOR_SIZE;
+        } else if ((file->mode & AFATFS_FILE_MODE_APPEND) != 0 && file->type == AFATFS_FILE_TYPE_NORMAL) {
+            // Appends fill the rest of the cluster (which has usually just been allocated) sector by sector, so pre-erase that
+            eraseBlockCount = afatfs.sectorsPerCluster - afatfs_sectorIndexInCluster(file->cursorOffset);
         } else {
             eraseBlockCount = 0;
         }
@@ -1895,11 +4660,146 @@ static uint8_t* afatfs_fileLockCursorSectorForWrite(afatfsFilePtr_t file)
         }
 
         file->writeLockedCacheIndex = afatfs_getCacheDescriptorIndexForBuffer(result);
+#ifdef AFATFS_CARD_PAGE_SECTORS
+        file->writePageSector = physicalSector;
+#endif
     }
 
     return result;
 }
 
+#ifdef AFATFS_FILE_EXTENT_CACHE_SIZE
+
+static bool afatfs_fileUsesExtentCache(afatfsFilePtr_t file)
+{
+    // The freefile's chain gets shortened from the front, so the clusters we'd remember for it wouldn't stay valid
+    return file->type == AFATFS_FILE_TYPE_NORMAL
+#ifdef AFATFS_USE_FREEFILE
+        && file != &afatfs.freeFile
+#endif
+        ;
+}
+
+static void afatfs_fileExtentsClear(afatfsFilePtr_t file)
+{
+    for (int i = 0; i < AFATFS_FILE_EXTENT_CACHE_SIZE; i++) {
+        file->extents[i].length = 0;
+    }
+
+    file->extentReplaceIndex = 0;
+}
+
+/**
+ * Look up the physical cluster for the cluster with the given index within the file. Returns true and stores the cluster
+ * in *cluster if it lies in one of the cached extents.
+ */
+static bool afatfs_fileExtentLookup(afatfsFilePtr_t file, uint32_t fileClusterIndex, uint32_t *cluster)
+{
+    for (int i = 0; i < AFATFS_FILE_EXTENT_CACHE_SIZE; i++) {
+        afatfsFileExtent_t *extent = &file->extents[i];
+
+        if (fileClusterIndex >= extent->fileClusterIndex && fileClusterIndex - extent->fileClusterIndex < extent->length) {
+            *cluster = extent->physicalCluster + (fileClusterIndex - extent->fileClusterIndex);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Remember that the cluster with the given index in the file is the physical cluster `cluster`. This either grows the
+ * extent that it follows on from, or replaces the oldest extent.
+ */
+static void afatfs_fileExtentRecord(afatfsFilePtr_t file, uint32_t fileClusterIndex, uint32_t cluster)
+{
+    uint32_t knownCluster;
+
+    if (!afatfs_fileUsesExtentCache(file) || afatfs_fileExtentLookup(file, fileClusterIndex, &knownCluster)) {
+        return;
+    }
+
+    for (int i = 0; i < AFATFS_FILE_EXTENT_CACHE_SIZE; i++) {
+        afatfsFileExtent_t *extent = &file->extents[i];
+
+        if (
+            extent->length > 0
+            && extent->fileClusterIndex + extent->length == fileClusterIndex
+            && extent->physicalCluster + extent->length == cluster
+        ) {
+            extent->length++;
+            return;
+        }
+    }
+
+    afatfsFileExtent_t *extent = &file->extents[file->extentReplaceIndex];
+
+    extent->fileClusterIndex = fileClusterIndex;
+    extent->physicalCluster = cluster;
+    extent->length = 1;
+
+    file->extentReplaceIndex = (file->extentReplaceIndex + 1) % AFATFS_FILE_EXTENT_CACHE_SIZE;
+}
+
+/**
+ * Move the cursor as far forwards towards the cursor position + *offset as the cached extents allow, and subtract the
+ * distance moved from *offset.
+ *
+ * We only move to a cluster that we know the predecessor of, so that cursorPreviousCluster remains correct.
+ */
+static void afatfs_fileExtentSeek(afatfsFilePtr_t file, uint32_t *offset)
+{
+    uint32_t clusterSizeBytes = afatfs_clusterSize();
+    uint32_t currentIndex = file->cursorOffset / clusterSizeBytes;
+    uint32_t targetIndex = (file->cursorOffset + *offset) / clusterSizeBytes;
+    uint32_t bestIndex = currentIndex;
+    uint32_t bestCluster = 0, bestPreviousCluster = 0;
+
+    if (!afatfs_fileUsesExtentCache(file) || targetIndex <= currentIndex + 1 || afatfs_isEndOfAllocatedFile(file)) {
+        // The normal seek will get there with at most one FAT lookup
+        return;
+    }
+
+    for (int i = 0; i < AFATFS_FILE_EXTENT_CACHE_SIZE; i++) {
+        afatfsFileExtent_t *extent = &file->extents[i];
+        uint32_t index, previousCluster;
+
+        if (extent->length == 0 || extent->fileClusterIndex > targetIndex) {
+            continue;
+        }
+
+        index = MIN(targetIndex, extent->fileClusterIndex + extent->length - 1);
+
+        if (index <= bestIndex) {
+            continue;
+        }
+
+        if (index > extent->fileClusterIndex) {
+            previousCluster = extent->physicalCluster + (index - extent->fileClusterIndex) - 1;
+        } else if (!afatfs_fileExtentLookup(file, index - 1, &previousCluster)) {
+            continue;
+        }
+
+        bestIndex = index;
+        bestCluster = extent->physicalCluster + (index - extent->fileClusterIndex);
+        bestPreviousCluster = previousCluster;
+    }
+
+    if (bestIndex > currentIndex) {
+        uint32_t bytesToSeek = bestIndex * clusterSizeBytes - file->cursorOffset;
+
+        afatfs_fileUnlockCacheSector(file);
+
+        file->cursorPreviousCluster = bestPreviousCluster;
+        file->cursorCluster = bestCluster;
+        file->cursorOffset += bytesToSeek;
+
+        *offset -= bytesToSeek;
+    }
+}
+
+#endif
+
 /**
  * Attempt to seek the file pointer by the offset, relative to the current position.
  *
@@ -1947,7 +4847,7 @@ static bool afatfs_fseekAtomic(afatfsFilePtr_t file, int32_t offset)
     if (newOffsetInCluster >= clusterSizeBytes) {
         uint32_t nextCluster;
 
-        status = afatfs_fileGetNextCluster(file, file->cursorCluster, &nextCluster);
+        status = afatfs_fileGetNextCluster(file, file->cursorCluster, &nextCluster, AFATFS_CACHE_READ);
 
         if (status == AFATFS_OPERATION_SUCCESS) {
             // Seek to the beginning of the next cluster
@@ -1958,6 +4858,12 @@ static bool afatfs_fseekAtomic(afatfsFilePtr_t file, int32_t offset)
             file->cursorOffset += bytesToSeek;
 
             offset -= bytesToSeek;
+
+#ifdef AFATFS_FILE_EXTENT_CACHE_SIZE
+            if (!afatfs_isEndOfAllocatedFile(file)) {
+                afatfs_fileExtentRecord(file, file->cursorOffset / clusterSizeBytes, nextCluster);
+            }
+#endif
         } else {
             // Try again later
             return false;
@@ -1987,7 +4893,7 @@ static bool afatfs_fseekInternalContinue(afatfsFile_t *file)
     while (offsetInCluster + opState->seekOffset >= clusterSizeBytes && !afatfs_isEndOfAllocatedFile(file)) {
         uint32_t nextCluster;
 
-        status = afatfs_fileGetNextCluster(file, file->cursorCluster, &nextCluster);
+        status = afatfs_fileGetNextCluster(file, file->cursorCluster, &nextCluster, AFATFS_CACHE_READ);
 
         if (status == AFATFS_OPERATION_SUCCESS) {
             // Seek to the beginning of the next cluster
@@ -1999,6 +4905,12 @@ static bool afatfs_fseekInternalContinue(afatfsFile_t *file)
             file->cursorOffset += bytesToSeek;
             opState->seekOffset -= bytesToSeek;
             offsetInCluster = 0;
+
+#ifdef AFATFS_FILE_EXTENT_CACHE_SIZE
+            if (!afatfs_isEndOfAllocatedFile(file)) {
+                afatfs_fileExtentRecord(file, file->cursorOffset / clusterSizeBytes, nextCluster);
+            }
+#endif
         } else {
             // Try again later
             return false;
@@ -2034,6 +4946,11 @@ static bool afatfs_fseekInternalContinue(afatfsFile_t *file)
  */
 static afatfsOperationStatus_e afatfs_fseekInternal(afatfsFilePtr_t file, uint32_t offset, afatfsFileCallback_t callback)
 {
+#ifdef AFATFS_FILE_EXTENT_CACHE_SIZE
+    // Skip over the parts of the chain that we already know
+    afatfs_fileExtentSeek(file, &offset);
+#endif
+
     // See if we can seek without queuing an operation
     if (afatfs_fseekAtomic(file, offset)) {
         if (callback) {
@@ -2057,6 +4974,24 @@ static afatfsOperationStatus_e afatfs_fseekInternal(afatfsFilePtr_t file, uint32
     }
 }
 
+/**
+ * Move the file's cursor back to the start of the file.
+ */
+static void afatfs_fileRewind(afatfsFilePtr_t file)
+{
+    afatfs_fileUnlockCacheSector(file);
+
+    file->cursorPreviousCluster = 0;
+    file->cursorCluster = file->firstCluster;
+    file->cursorOffset = 0;
+
+#ifdef AFATFS_FILE_EXTENT_CACHE_SIZE
+    if (file->firstCluster != 0) {
+        afatfs_fileExtentRecord(file, 0, file->firstCluster);
+    }
+#endif
+}
+
 /**
  * Attempt to seek the file cursor from the given point (`whence`) by the given offset, just like C's fseek().
  *
@@ -2078,7 +5013,7 @@ afatfsOperationStatus_e afatfs_fseek(afatfsFilePtr_t file, int32_t offset, afatf
         case AFATFS_SEEK_CUR:
             if (offset >= 0) {
                 // Only forwards seeks are supported by this routine:
-                return afatfs_fseekInternal(file, MIN(file->cursorOffset + offset, file->logicalSize), NULL);
+                return afatfs_fseekInternal(file, MIN(file->cursorOffset + offset, file->logicalSize) - file->cursorOffset, NULL);
             }
 
             // Convert a backwards relative seek into a SEEK_SET. TODO considerable room for improvement if within the same cluster
@@ -2101,11 +5036,7 @@ afatfsOperationStatus_e afatfs_fseek(afatfsFilePtr_t file, int32_t offset, afatf
     }
 
     // Now we have a SEEK_SET with a positive offset. Begin by seeking to the start of the file
-    afatfs_fileUnlockCacheSector(file);
-
-    file->cursorPreviousCluster = 0;
-    file->cursorCluster = file->firstCluster;
-    file->cursorOffset = 0;
+    afatfs_fileRewind(file);
 
     // Then seek forwards by the offset
     return afatfs_fseekInternal(file, MIN((uint32_t) offset, file->logicalSize), NULL);
@@ -2186,15 +5117,282 @@ void afatfs_findFirst(afatfsFilePtr_t directory, afatfsFinder_t *finder)
     finder->entryIndex = -1;
 }
 
+/**
+ * Get the index within the directory of the entry that the finder most recently returned from afatfs_findNext().
+ */
+static uint32_t afatfs_findGetEntryNumber(afatfsFilePtr_t directory, afatfsFinder_t *finder)
+{
+    return (directory->cursorOffset / AFATFS_SECTOR_SIZE) * AFATFS_FILES_PER_DIRECTORY_SECTOR + finder->entryIndex;
+}
+
+/**
+ * Initialise the finder so that the next call with the directory to findNext() will return the entry with the given
+ * index within the directory. The directory must not be busy.
+ *
+ * Returns:
+ *     AFATFS_OPERATION_SUCCESS     - The directory cursor is already in position
+ *     AFATFS_OPERATION_IN_PROGRESS - A seek on the directory was queued, findNext() will return IN_PROGRESS until it
+ *                                    completes.
+ */
+static afatfsOperationStatus_e afatfs_findAt(afatfsFilePtr_t directory, afatfsFinder_t *finder, uint32_t entryNumber)
+{
+    afatfs_findFirst(directory, finder);
+
+    finder->entryIndex = (int16_t) (entryNumber % AFATFS_FILES_PER_DIRECTORY_SECTOR) - 1;
+
+    // Directories have no logical size to clip our seek to, so seek from the start of the directory ourselves
+    return afatfs_fseekInternal(directory, (entryNumber / AFATFS_FILES_PER_DIRECTORY_SECTOR) * AFATFS_SECTOR_SIZE, NULL);
+}
+
+#ifdef AFATFS_DIRECTORY_SUMMARY_SIZE
+
+/**
+ * Forget everything we knew about the current directory, because we're changing to a different one.
+ */
+static void afatfs_directorySummaryReset()
+{
+    memset(&afatfs.directorySummary, 0, sizeof(afatfs.directorySummary));
+}
+
+/**
+ * Hash the given 8.3 filename (FNV-1a).
+ */
+static uint32_t afatfs_directorySummaryHash(const uint8_t *filename)
+{
+    uint32_t hash = 2166136261U;
+
+    for (int i = 0; i < FAT_FILENAME_LENGTH; i++) {
+        hash = (hash ^ filename[i]) * 16777619U;
+    }
+
+    return hash;
+}
+
+/**
+ * Get the two bits in the name filter that represent the given hash.
+ */
+static void afatfs_directorySummaryGetBits(uint32_t hash, uint32_t *bit1, uint32_t *bit2)
+{
+    const uint32_t filterBits = AFATFS_DIRECTORY_SUMMARY_SIZE * 8;
+
+    *bit1 = hash % filterBits;
+    *bit2 = ((hash >> 16) | (hash << 16)) % filterBits;
+}
+
+static void afatfs_directorySummaryAddName(const uint8_t *filename)
+{
+    uint32_t bit1, bit2;
+
+    afatfs_directorySummaryGetBits(afatfs_directorySummaryHash(filename), &bit1, &bit2);
+
+    afatfs.directorySummary.nameFilter[bit1 / 8] |= 1 << (bit1 % 8);
+    afatfs.directorySummary.nameFilter[bit2 / 8] |= 1 << (bit2 % 8);
+}
+
+/**
+ * Returns false if the current directory is known not to contain a file with the given 8.3 filename, or true if it
+ * might have one (so the directory must be searched to find out).
+ */
+static bool afatfs_directorySummaryMayContain(const uint8_t *filename)
+{
+    uint32_t bit1, bit2;
+
+    if (!afatfs.directorySummary.complete) {
+        return true;
+    }
+
+    afatfs_directorySummaryGetBits(afatfs_directorySummaryHash(filename), &bit1, &bit2);
+
+    return (afatfs.directorySummary.nameFilter[bit1 / 8] & (1 << (bit1 % 8))) != 0
+        && (afatfs.directorySummary.nameFilter[bit2 / 8] & (1 << (bit2 % 8))) != 0;
+}
+
+/**
+ * Call for each entry that a search of the current directory visits (in order from the start of the directory), with
+ * a NULL entry if the search reached the end of the directory. Searches which stop early still add the entries they
+ * did see, and the next search will carry on the job from where they stopped.
+ */
+static void afatfs_directorySummaryEntryScanned(uint32_t entryNumber, fatDirectoryEntry_t *entry)
+{
+    afatfsDirectorySummary_t *summary = &afatfs.directorySummary;
+
+    // We can only add entries in order, otherwise we wouldn't know which ones we'd skipped
+    if (summary->complete || entryNumber != summary->scannedEntries) {
+        return;
+    }
+
+    if (entry == NULL || fat_isDirectoryEntryTerminator(entry)) {
+        summary->complete = true;
+    } else {
+        if (!fat_isDirectoryEntryEmpty(entry)) {
+            afatfs_directorySummaryAddName((uint8_t*) entry->filename);
+
+            if (summary->firstFreeEntry == entryNumber) {
+                summary->firstFreeEntry++;
+            }
+        }
+
+        summary->scannedEntries++;
+    }
+}
+
+/**
+ * Call when a new file has been given the entry with the given index in the current directory, after a search for a
+ * free entry that began at `searchStart`.
+ */
+static void afatfs_directorySummaryEntryAllocated(uint32_t entryNumber, uint32_t searchStart, const uint8_t *filename)
+{
+    afatfsDirectorySummary_t *summary = &afatfs.directorySummary;
+
+    afatfs_directorySummaryAddName(filename);
+
+    // The search passed over entries that were all in use (unless an entry before them was freed in the meantime)
+    if (summary->firstFreeEntry == searchStart) {
+        summary->firstFreeEntry = entryNumber + 1;
+    }
+}
+
+/**
+ * Call when the directory entry of the given file has been marked as deleted.
+ */
+static void afatfs_directorySummaryEntryFreed(afatfsFilePtr_t file)
+{
+    afatfsDirectorySummary_t *summary = &afatfs.directorySummary;
+
+    /*
+     * The filter can't forget the name, but we can at least reuse the entry. (A new subdirectory has no cluster until
+     * its first entry is added, so we might mistake another empty directory for it, but that only costs us a longer
+     * search for a free entry later).
+     */
+    if (file->parentDirectoryCluster == afatfs.currentDirectory.firstCluster && file->directoryEntryNumber < summary->firstFreeEntry) {
+        summary->firstFreeEntry = file->directoryEntryNumber;
+    }
+}
+
+#endif
+
+// Written to the card to zero-fill new directory clusters
+static const uint8_t afatfs_zeroSector[AFATFS_SECTOR_SIZE];
+
+/**
+ * Called by the SD card driver when one of the writes issued by afatfs_zeroSectorsContinue() completes.
+ */
+static void afatfs_sdcardZeroFillWriteComplete(sdcardBlockOperation_e operation, uint32_t sectorIndex, uint8_t *buffer, uint32_t callbackData)
+{
+    (void) operation;
+    (void) sectorIndex;
+    (void) callbackData;
+
+    afatfsZeroFill_t *zeroFill = &afatfs.zeroFill;
+
+    zeroFill->writeInFlight = false;
+
+    if (buffer == NULL) {
+        // Write failed, so send that sector again (the card will have abandoned any multi-block write too)
+        zeroFill->multiBlockRemaining = 0;
+    } else {
+        zeroFill->nextSector++;
+
+        if (zeroFill->multiBlockRemaining > 0) {
+            zeroFill->multiBlockRemaining--;
+        }
+    }
+}
+
+/**
+ * Write zeros to the `sectorCount` sectors that begin at `startSector` on behalf of the given directory. The sectors are
+ * streamed to the card in a multi-block write from a shared sector of zeros rather than passing through the cache, so
+ * this doesn't push any sectors out of the cache or wait for them to be flushed.
+ *
+ * Only one directory can be zero-filled at a time, so this waits for any other directory's zero-fill to finish first.
+ * Call again with the same arguments until it succeeds.
+ *
+ * Returns:
+ *     AFATFS_OPERATION_SUCCESS     - The sectors have all been written
+ *     AFATFS_OPERATION_IN_PROGRESS - The card is busy, call again later to continue
+ */
+static afatfsOperationStatus_e afatfs_zeroSectorsContinue(afatfsFilePtr_t directory, uint32_t startSector, uint32_t sectorCount)
+{
+    afatfsZeroFill_t *zeroFill = &afatfs.zeroFill;
+
+    if (zeroFill->directory == NULL) {
+        if (sectorCount == 0) {
+            return AFATFS_OPERATION_SUCCESS;
+        }
+
+        zeroFill->directory = directory;
+        zeroFill->nextSector = startSector;
+        zeroFill->endSector = startSector + sectorCount;
+        zeroFill->multiBlockRemaining = 0;
+        zeroFill->writeInFlight = false;
+    } else if (zeroFill->directory != directory) {
+        return AFATFS_OPERATION_IN_PROGRESS;
+    }
+
+    while (!zeroFill->writeInFlight) {
+        if (zeroFill->nextSector == zeroFill->endSector) {
+            zeroFill->directory = NULL;
+
+            return AFATFS_OPERATION_SUCCESS;
+        }
+
+        if (!afatfs_cacheSectorPrepareForDirectWrite(zeroFill->nextSector, afatfs_zeroSector)) {
+            break;
+        }
+
+#ifdef AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT
+        if (zeroFill->multiBlockRemaining == 0) {
+            uint32_t remainingSectors = zeroFill->endSector - zeroFill->nextSector;
+
+            if (remainingSectors >= AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT) {
+                switch (afatfs_sdcardBeginWriteBlocks(zeroFill->nextSector, remainingSectors)) {
+                    case SDCARD_OPERATION_SUCCESS:
+                        zeroFill->multiBlockRemaining = remainingSectors;
+                    break;
+                    case SDCARD_OPERATION_BUSY:
+                        return AFATFS_OPERATION_IN_PROGRESS;
+                    default:
+                        // Just write the sectors individually instead
+                        ;
+                }
+            }
+        }
+#endif
+
+        switch (sdcard_writeBlock(zeroFill->nextSector, (uint8_t*) afatfs_zeroSector, afatfs_sdcardZeroFillWriteComplete, 0)) {
+            case SDCARD_OPERATION_IN_PROGRESS:
+                zeroFill->writeInFlight = true;
+            break;
+            case SDCARD_OPERATION_SUCCESS:
+                zeroFill->nextSector++;
+
+                if (zeroFill->multiBlockRemaining > 0) {
+                    zeroFill->multiBlockRemaining--;
+                }
+            break;
+            case SDCARD_OPERATION_BUSY:
+            case SDCARD_OPERATION_FAILURE:
+            default:
+                // Try again later
+                return AFATFS_OPERATION_IN_PROGRESS;
+        }
+    }
+
+    return AFATFS_OPERATION_IN_PROGRESS;
+}
+
 static afatfsOperationStatus_e afatfs_extendSubdirectoryContinue(afatfsFile_t *directory)
 {
     afatfsExtendSubdirectory_t *opState = &directory->operation.state.extendSubdirectory;
     afatfsOperationStatus_e status;
     uint8_t *sectorBuffer;
-    uint32_t clusterNumber, physicalSector;
-    uint16_t sectorInCluster;
+    uint32_t physicalSector;
+    bool firstCluster;
 
     doMore:
+    // The first cluster of a non-root directory begins with the "." and ".." entries
+    firstCluster = directory->directoryEntryPos.sectorNumberPhysical != 0 && directory->cursorOffset == 0;
+
     switch (opState->phase) {
         case AFATFS_EXTEND_SUBDIRECTORY_PHASE_ADD_FREE_CLUSTER:
             status = afatfs_appendRegularFreeClusterContinue(directory);
@@ -2203,16 +5401,20 @@ static afatfsOperationStatus_e afatfs_extendSubdirectoryContinue(afatfsFile_t *d
                 opState->phase = AFATFS_EXTEND_SUBDIRECTORY_PHASE_WRITE_SECTORS;
                 goto doMore;
             } else if (status == AFATFS_OPERATION_FAILURE) {
-                opState->phase = AFATFS_EXTEND_SUBDIRECTORY_PHASE_FAILURE;
+                // A reservation just ends early if it runs out of space, the directory can still grow later
+                if (opState->reserving) {
+                    opState->phase = AFATFS_EXTEND_SUBDIRECTORY_PHASE_SUCCESS;
+                } else {
+                    opState->phase = AFATFS_EXTEND_SUBDIRECTORY_PHASE_FAILURE;
+                }
                 goto doMore;
             }
         break;
         case AFATFS_EXTEND_SUBDIRECTORY_PHASE_WRITE_SECTORS:
-            // Now, zero out that cluster
-            afatfs_fileGetCursorClusterAndSector(directory, &clusterNumber, &sectorInCluster);
-            physicalSector = afatfs_fileGetCursorPhysicalSector(directory);
+            // The cursor is at the start of the new cluster. In a new subdirectory, create the "." and ".." entries
+            if (firstCluster) {
+                physicalSector = afatfs_fileGetCursorPhysicalSector(directory);
 
-            while (1) {
                 status = afatfs_cacheSector(physicalSector, &sectorBuffer, AFATFS_CACHE_WRITE, 0);
 
                 if (status != AFATFS_OPERATION_SUCCESS) {
@@ -2221,37 +5423,50 @@ static afatfsOperationStatus_e afatfs_extendSubdirectoryContinue(afatfsFile_t *d
 
                 memset(sectorBuffer, 0, AFATFS_SECTOR_SIZE);
 
-                // If this is the first sector of a non-root directory, create the "." and ".." entries
-                if (directory->directoryEntryPos.sectorNumberPhysical != 0 && directory->cursorOffset == 0) {
-                    fatDirectoryEntry_t *dirEntries = (fatDirectoryEntry_t *) sectorBuffer;
-
-                    memset(dirEntries[0].filename, ' ', sizeof(dirEntries[0].filename));
-                    dirEntries[0].filename[0] = '.';
-                    dirEntries[0].firstClusterHigh = directory->firstCluster >> 16;
-                    dirEntries[0].firstClusterLow = directory->firstCluster & 0xFFFF;
-                    dirEntries[0].attrib = FAT_FILE_ATTRIBUTE_DIRECTORY;
-
-                    memset(dirEntries[1].filename, ' ', sizeof(dirEntries[1].filename));
-                    dirEntries[1].filename[0] = '.';
-                    dirEntries[1].filename[1] = '.';
-                    dirEntries[1].firstClusterHigh = opState->parentDirectoryCluster >> 16;
-                    dirEntries[1].firstClusterLow = opState->parentDirectoryCluster & 0xFFFF;
-                    dirEntries[1].attrib = FAT_FILE_ATTRIBUTE_DIRECTORY;
-                }
+                fatDirectoryEntry_t *dirEntries = (fatDirectoryEntry_t *) sectorBuffer;
+
+                memset(dirEntries[0].filename, ' ', sizeof(dirEntries[0].filename));
+                dirEntries[0].filename[0] = '.';
+                dirEntries[0].firstClusterHigh = directory->firstCluster >> 16;
+                dirEntries[0].firstClusterLow = directory->firstCluster & 0xFFFF;
+                dirEntries[0].attrib = FAT_FILE_ATTRIBUTE_DIRECTORY;
 
-                if (sectorInCluster < afatfs.sectorsPerCluster - 1) {
-                    // Move to next sector
-                    afatfs_assert(afatfs_fseekAtomic(directory, AFATFS_SECTOR_SIZE));
-                    sectorInCluster++;
-                    physicalSector++;
+                memset(dirEntries[1].filename, ' ', sizeof(dirEntries[1].filename));
+                dirEntries[1].filename[0] = '.';
+                dirEntries[1].filename[1] = '.';
+                dirEntries[1].firstClusterHigh = opState->parentDirectoryCluster >> 16;
+                dirEntries[1].firstClusterLow = opState->parentDirectoryCluster & 0xFFFF;
+                dirEntries[1].attrib = FAT_FILE_ATTRIBUTE_DIRECTORY;
+            }
+
+            opState->phase = AFATFS_EXTEND_SUBDIRECTORY_PHASE_ZERO_SECTORS;
+            goto doMore;
+        break;
+        case AFATFS_EXTEND_SUBDIRECTORY_PHASE_ZERO_SECTORS:
+            // Now zero out the rest of that cluster
+            physicalSector = afatfs_fileGetCursorPhysicalSector(directory) + (firstCluster ? 1 : 0);
+
+            status = afatfs_zeroSectorsContinue(directory, physicalSector, afatfs.sectorsPerCluster - (firstCluster ? 1 : 0));
+
+            if (status == AFATFS_OPERATION_SUCCESS) {
+                if (opState->clustersRemaining > 0) {
+                    opState->phase = AFATFS_EXTEND_SUBDIRECTORY_PHASE_NEXT_CLUSTER;
                 } else {
-                    break;
+                    opState->phase = AFATFS_EXTEND_SUBDIRECTORY_PHASE_SUCCESS;
                 }
+                goto doMore;
+            }
+        break;
+        case AFATFS_EXTEND_SUBDIRECTORY_PHASE_NEXT_CLUSTER:
+            // Step over the cluster we just added to reach the end of the directory again (this only reads the FAT)
+            if (!afatfs_fseekAtomic(directory, afatfs_clusterSize())) {
+                break;
             }
 
-            // Seek back to the beginning of the cluster
-            afatfs_assert(afatfs_fseekAtomic(directory, -AFATFS_SECTOR_SIZE * (afatfs.sectorsPerCluster - 1)));
-            opState->phase = AFATFS_EXTEND_SUBDIRECTORY_PHASE_SUCCESS;
+            opState->clustersRemaining--;
+            afatfs_appendRegularFreeClusterInitOperationState(&opState->appendFreeCluster, directory->cursorPreviousCluster);
+
+            opState->phase = AFATFS_EXTEND_SUBDIRECTORY_PHASE_ADD_FREE_CLUSTER;
             goto doMore;
         break;
         case AFATFS_EXTEND_SUBDIRECTORY_PHASE_SUCCESS:
@@ -2277,20 +5492,17 @@ static afatfsOperationStatus_e afatfs_extendSubdirectoryContinue(afatfsFile_t *d
 }
 
 /**
- * Queue an operation to add a cluster to a sub-directory.
- *
- * Tthe new cluster is zero-filled. "." and ".." entries are added if it is the first cluster of a new subdirectory.
- *
- * The directory must not be busy, otherwise AFATFS_OPERATION_FAILURE is returned immediately.
- *
- * The directory's cursor must lie at the end of the directory file (i.e. isEndOfAllocatedFile() would return true).
+ * Queue an operation to add `clusterCount` clusters to a sub-directory, with the same arguments and requirements as
+ * afatfs_extendSubdirectory(). The directory's cursor is left at the start of the last cluster added.
  *
- * You must provide parentDirectory if this is the first extension to the subdirectory, otherwise pass NULL for that argument.
+ * If `reserving` is true and the volume runs out of free space, the operation succeeds with the clusters added so far
+ * rather than failing.
  */
-static afatfsOperationStatus_e afatfs_extendSubdirectory(afatfsFile_t *directory, afatfsFilePtr_t parentDirectory, afatfsFileCallback_t callback)
+static afatfsOperationStatus_e afatfs_extendSubdirectoryBy(afatfsFile_t *directory, afatfsFilePtr_t parentDirectory,
+    uint32_t clusterCount, bool reserving, afatfsFileCallback_t callback)
 {
     // FAT16 root directories cannot be extended
-    if (directory->type == AFATFS_FILE_TYPE_FAT16_ROOT_DIRECTORY || afatfs_fileIsBusy(directory)) {
+    if (directory->type == AFATFS_FILE_TYPE_FAT16_ROOT_DIRECTORY || afatfs_fileIsBusy(directory) || clusterCount == 0) {
         return AFATFS_OPERATION_FAILURE;
     }
 
@@ -2304,6 +5516,8 @@ static afatfsOperationStatus_e afatfs_extendSubdirectory(afatfsFile_t *directory
 
     opState->phase = AFATFS_EXTEND_SUBDIRECTORY_PHASE_INITIAL;
     opState->parentDirectoryCluster = parentDirectory ? parentDirectory->firstCluster : 0;
+    opState->clustersRemaining = clusterCount - 1;
+    opState->reserving = reserving;
     opState->callback = callback;
 
     afatfs_appendRegularFreeClusterInitOperationState(&opState->appendFreeCluster, directory->cursorPreviousCluster);
@@ -2311,12 +5525,29 @@ static afatfsOperationStatus_e afatfs_extendSubdirectory(afatfsFile_t *directory
     return afatfs_extendSubdirectoryContinue(directory);
 }
 
+/**
+ * Queue an operation to add a cluster to a sub-directory.
+ *
+ * The new cluster is zero-filled. "." and ".." entries are added if it is the first cluster of a new subdirectory.
+ *
+ * The directory must not be busy, otherwise AFATFS_OPERATION_FAILURE is returned immediately.
+ *
+ * The directory's cursor must lie at the end of the directory file (i.e. isEndOfAllocatedFile() would return true).
+ *
+ * You must provide parentDirectory if this is the first extension to the subdirectory, otherwise pass NULL for that argument.
+ */
+static afatfsOperationStatus_e afatfs_extendSubdirectory(afatfsFile_t *directory, afatfsFilePtr_t parentDirectory, afatfsFileCallback_t callback)
+{
+    return afatfs_extendSubdirectoryBy(directory, parentDirectory, 1, false, callback);
+}
+
 /**
  * Allocate space for a new directory entry to be written, store the position of that entry in the finder, and set
  * the *dirEntry pointer to point to the entry within the cached FAT sector. This pointer's lifetime is only as good
  * as the life of the cache, so don't dawdle.
  *
- * Before the first call to this function, call afatfs_findFirst() on the directory.
+ * Before the first call to this function, call afatfs_findFirst() (or afatfs_findAt()) on the directory, which must be
+ * the current directory.
  *
  * The directory sector in the cache is marked as dirty, so any changes written through to the entry will be flushed out
  * in a subsequent poll cycle.
@@ -2342,6 +5573,14 @@ static afatfsOperationStatus_e afatfs_allocateDirectoryEntry(afatfsFilePtr_t dir
                 afatfs_findLast(directory);
                 return AFATFS_OPERATION_SUCCESS;
             }
+
+#ifdef AFATFS_DIRECTORY_SUMMARY_SIZE
+            /*
+             * Extending a new subdirectory adds its "." and ".." entries beyond the end that our scan found, so note
+             * down the names of any entries we pass over.
+             */
+            afatfs_directorySummaryAddName((uint8_t*) (*dirEntry)->filename);
+#endif
         } else {
             // Need to extend directory size by adding a cluster
             result = afatfs_extendSubdirectory(directory, NULL, NULL);
@@ -2365,7 +5604,7 @@ static afatfsOperationStatus_e afatfs_allocateDirectoryEntry(afatfsFilePtr_t dir
  */
 static afatfsFilePtr_t afatfs_allocateFileHandle()
 {
-    for (int i = 0; i < AFATFS_MAX_OPEN_FILES; i++) {
+    for (int i = 0; i < afatfs.maxOpenFiles; i++) {
         if (afatfs.openFiles[i].type == AFATFS_FILE_TYPE_NONE) {
             return &afatfs.openFiles[i];
         }
@@ -2393,17 +5632,58 @@ static afatfsOperationStatus_e afatfs_ftruncateContinue(afatfsFilePtr_t file, bo
     doMore:
 
     switch (opState->phase) {
+#ifdef AFATFS_USE_JOURNAL
+        case AFATFS_TRUNCATE_FILE_JOURNAL:
+            /*
+             * Wait for every earlier record to be dropped, since replaying one of those might otherwise hand the
+             * clusters we're about to free back to the file they used to belong to.
+             */
+            if (!afatfs_journalIsEmpty()) {
+                status = AFATFS_OPERATION_IN_PROGRESS;
+                break;
+            }
+
+            if (opState->endCluster) {
+                opState->journalRecord = afatfs_journalAdd(AFATFS_JOURNAL_RECORD_TRUNCATE_CONTIGUOUS, file,
+                    opState->startCluster, opState->endCluster, 0, markDeleted);
+            } else {
+                // The freed clusters don't go back to the freefile, so there's nothing for a replay to redo
+                opState->journalRecord = -1;
+            }
+
+            opState->phase = AFATFS_TRUNCATE_FILE_WAIT_FOR_JOURNAL;
+            goto doMore;
+        break;
+        case AFATFS_TRUNCATE_FILE_WAIT_FOR_JOURNAL:
+            if (afatfs_journalRecordIsOnCard(opState->journalRecord)) {
+                opState->phase = AFATFS_TRUNCATE_FILE_UPDATE_DIRECTORY;
+                goto doMore;
+            }
+
+            status = AFATFS_OPERATION_IN_PROGRESS;
+        break;
+#endif
         case AFATFS_TRUNCATE_FILE_UPDATE_DIRECTORY:
             status = afatfs_saveDirectoryEntry(file, markDeleted ? AFATFS_SAVE_DIRECTORY_DELETED : AFATFS_SAVE_DIRECTORY_NORMAL);
 
             if (status == AFATFS_OPERATION_SUCCESS) {
+#ifdef AFATFS_DIRECTORY_SUMMARY_SIZE
+                if (markDeleted) {
+                    afatfs_directorySummaryEntryFreed(file);
+                }
+#endif
+
                 if(opState->currentCluster == 0x0){ //current cluster 0 at this phase means it is an empty file 
                     opState->phase = AFATFS_TRUNCATE_FILE_SUCCESS; 
                     goto doMore;
                 }
 #ifdef AFATFS_USE_FREEFILE
                 if (opState->endCluster) {
+#ifdef AFATFS_USE_SDCARD_ERASE
+                    opState->phase = AFATFS_TRUNCATE_FILE_ERASE_SECTORS_CONTIGUOUS;
+#else
                     opState->phase = AFATFS_TRUNCATE_FILE_ERASE_FAT_CHAIN_CONTIGUOUS;
+#endif
                 } else
 #endif
                 {
@@ -2413,6 +5693,17 @@ static afatfsOperationStatus_e afatfs_ftruncateContinue(afatfsFilePtr_t file, bo
             }
         break;
 #ifdef AFATFS_USE_FREEFILE
+#ifdef AFATFS_USE_SDCARD_ERASE
+        case AFATFS_TRUNCATE_FILE_ERASE_SECTORS_CONTIGUOUS:
+            // The freefile is locked, so nobody can be given these clusters before the card has been told to erase them
+            if (afatfs_eraseClusters(opState->startCluster, opState->endCluster - opState->startCluster)) {
+                opState->phase = AFATFS_TRUNCATE_FILE_ERASE_FAT_CHAIN_CONTIGUOUS;
+                goto doMore;
+            }
+
+            status = AFATFS_OPERATION_IN_PROGRESS;
+        break;
+#endif
         case AFATFS_TRUNCATE_FILE_ERASE_FAT_CHAIN_CONTIGUOUS:
             // Prepare the clusters to be added back on to the beginning of the freefile
             status = afatfs_FATFillWithPattern(AFATFS_FAT_PATTERN_UNTERMINATED_CHAIN, &opState->currentCluster, opState->endCluster);
@@ -2435,37 +5726,29 @@ static afatfsOperationStatus_e afatfs_ftruncateContinue(afatfsFilePtr_t file, bo
 
             status = afatfs_saveDirectoryEntry(&afatfs.freeFile, AFATFS_SAVE_DIRECTORY_NORMAL);
             if (status == AFATFS_OPERATION_SUCCESS) {
+                afatfs.freeFile.operation.operation = AFATFS_FILE_OPERATION_NONE;
+
                 opState->phase = AFATFS_TRUNCATE_FILE_SUCCESS;
                 goto doMore;
             }
         break;
 #endif
         case AFATFS_TRUNCATE_FILE_ERASE_FAT_CHAIN_NORMAL:
-            while (!afatfs_FATIsEndOfChainMarker(opState->currentCluster)) {
-                uint32_t nextCluster;
-
-                status = afatfs_FATGetNextCluster(0, opState->currentCluster, &nextCluster);
-
-                if (status != AFATFS_OPERATION_SUCCESS) {
-                    return status;
-                }
-
-                status = afatfs_FATSetNextCluster(opState->currentCluster, 0);
-
-                if (status != AFATFS_OPERATION_SUCCESS) {
-                    return status;
-                }
-
-                opState->currentCluster = nextCluster;
+            status = afatfs_FATFreeChain(&opState->currentCluster);
 
-                // Searches for unallocated regular clusters should be told about this free cluster now
-                afatfs.lastClusterAllocated = MIN(afatfs.lastClusterAllocated, opState->currentCluster - 1);
+            if (status == AFATFS_OPERATION_SUCCESS) {
+#ifdef AFATFS_FREEFILE_REGROWTH
+                afatfs.freeFileRegrowPending = true;
+#endif
+                opState->phase = AFATFS_TRUNCATE_FILE_SUCCESS;
+                goto doMore;
             }
-
-            opState->phase = AFATFS_TRUNCATE_FILE_SUCCESS;
-            goto doMore;
         break;
         case AFATFS_TRUNCATE_FILE_SUCCESS:
+#ifdef AFATFS_USE_JOURNAL
+            afatfs_journalRecordFinished(&opState->journalRecord);
+#endif
+
             if (file->operation.operation == AFATFS_FILE_OPERATION_TRUNCATE) {
                 file->operation.operation = AFATFS_FILE_OPERATION_NONE;
             }
@@ -2478,7 +5761,18 @@ static afatfsOperationStatus_e afatfs_ftruncateContinue(afatfsFilePtr_t file, bo
         break;
     }
 
+#ifdef AFATFS_USE_JOURNAL
+    if (status == AFATFS_OPERATION_FAILURE) {
+        afatfs_journalRecordFinished(&opState->journalRecord);
+    }
+#endif
+
     if (status == AFATFS_OPERATION_FAILURE && file->operation.operation == AFATFS_FILE_OPERATION_TRUNCATE) {
+#ifdef AFATFS_USE_FREEFILE
+        if (opState->endCluster) {
+            afatfs.freeFile.operation.operation = AFATFS_FILE_OPERATION_NONE;
+        }
+#endif
         file->operation.operation = AFATFS_FILE_OPERATION_NONE;
     }
 
@@ -2488,7 +5782,8 @@ static afatfsOperationStatus_e afatfs_ftruncateContinue(afatfsFilePtr_t file, bo
 /**
  * Queue an operation to truncate the file to zero bytes in length.
  *
- * Returns true if the operation was successfully queued or false if the file is busy (try again later).
+ * Returns true if the operation was successfully queued or false if the file is busy (try again later). Files can never
+ * be truncated on a read-only mount (see afatfs_initReadOnly()), so this always returns false then.
  *
  * The callback is called once the file has been truncated (some time after this routine returns).
  */
@@ -2496,7 +5791,7 @@ bool afatfs_ftruncate(afatfsFilePtr_t file, afatfsFileCallback_t callback)
 {
     afatfsTruncateFile_t *opState;
 
-    if (afatfs_fileIsBusy(file))
+    if (afatfs_fileIsBusy(file) || afatfs.readOnly)
         return false;
 
     file->operation.operation = AFATFS_FILE_OPERATION_TRUNCATE;
@@ -2508,9 +5803,19 @@ bool afatfs_ftruncate(afatfsFilePtr_t file, afatfsFileCallback_t callback)
     opState->currentCluster = opState->startCluster;
 
 #ifdef AFATFS_USE_FREEFILE
-    if ((file->mode & AFATFS_FILE_MODE_CONTIGUOUS) != 0) {
-        // The file is contiguous and ends where the freefile begins
+    if (
+        (file->mode & AFATFS_FILE_MODE_CONTIGUOUS) != 0 && file->firstCluster != 0
+        && file->superclusterEnd == afatfs.freeFile.firstCluster
+        && (file->superclusterEnd - file->firstCluster) * afatfs_clusterSize() == file->physicalSize
+        && !afatfs_fileIsBusy(&afatfs.freeFile)
+    ) {
+        /*
+         * The file is contiguous (no other contiguous file took superclusters in the middle of it) and ends where the
+         * freefile begins, so it can be handed back to the freefile. Lock the freefile so that no other contiguous file
+         * can take its first supercluster until we're done.
+         */
         opState->endCluster = afatfs.freeFile.firstCluster;
+        afatfs.freeFile.operation.operation = AFATFS_FILE_OPERATION_LOCKED;
     } else
 #endif
     {
@@ -2523,6 +5828,10 @@ bool afatfs_ftruncate(afatfsFilePtr_t file, afatfsFileCallback_t callback)
     file->logicalSize = 0;
     file->physicalSize = 0;
 
+#ifdef AFATFS_FILE_EXTENT_CACHE_SIZE
+    afatfs_fileExtentsClear(file);
+#endif
+
     afatfs_fseek(file, 0, AFATFS_SEEK_SET);
 
     return true;
@@ -2539,6 +5848,50 @@ static void afatfs_fileLoadDirectoryEntry(afatfsFile_t *file, fatDirectoryEntry_
     file->attrib = entry->attrib;
 }
 
+/**
+ * If the directory entry's name has the prefix and extension of the sequential file being created, make sure that the
+ * number we'll give that file is higher than the entry's.
+ */
+static void afatfs_createFileNoteSequenceNumber(afatfsCreateFile_t *opState, fatDirectoryEntry_t *entry)
+{
+    const int digitsStart = 8 - opState->sequenceDigits;
+    uint32_t number = 0;
+
+    // Skip volume labels and long filename entries
+    if ((entry->attrib & FAT_FILE_ATTRIBUTE_VOLUME_ID) != 0
+        || memcmp(entry->filename, opState->filename, digitsStart) != 0
+        || memcmp(entry->filename + 8, opState->filename + 8, FAT_FILENAME_LENGTH - 8) != 0) {
+        return;
+    }
+
+    for (int i = digitsStart; i < 8; i++) {
+        if (entry->filename[i] < '0' || entry->filename[i] > '9') {
+            return;
+        }
+
+        number = number * 10 + (entry->filename[i] - '0');
+    }
+
+    if (number >= opState->sequenceNumber) {
+        opState->sequenceNumber = number + 1;
+    }
+}
+
+/**
+ * Write the digits of the sequence number into the sequential file's name. Returns false if the number doesn't fit.
+ */
+static bool afatfs_createFileApplySequenceNumber(afatfsCreateFile_t *opState)
+{
+    uint32_t number = opState->sequenceNumber;
+
+    for (int i = 7; i >= 8 - opState->sequenceDigits; i--) {
+        opState->filename[i] = '0' + number % 10;
+        number /= 10;
+    }
+
+    return number == 0;
+}
+
 static void afatfs_createFileContinue(afatfsFile_t *file)
 {
     afatfsCreateFile_t *opState = &file->operation.state.createFile;
@@ -2549,7 +5902,22 @@ static void afatfs_createFileContinue(afatfsFile_t *file)
 
     switch (opState->phase) {
         case AFATFS_CREATEFILE_PHASE_INITIAL:
+#ifdef AFATFS_DIRECTORY_SUMMARY_SIZE
+            // Wait for any seek that another file queued on the directory to find a free entry
+            if (afatfs_fileIsBusy(&afatfs.currentDirectory)) {
+                break;
+            }
+
+            // (Sequential files always have to search the whole directory to find the highest number)
+            if (opState->sequenceDigits == 0 && !afatfs_directorySummaryMayContain(opState->filename)) {
+                // The file definitely doesn't exist, so we don't need to search for it
+                opState->phase = AFATFS_CREATEFILE_PHASE_FILE_NOT_FOUND;
+                goto doMore;
+            }
+#endif
+
             afatfs_findFirst(&afatfs.currentDirectory, &file->directoryEntryPos);
+            opState->firstFreeEntry = 0;
             opState->phase = AFATFS_CREATEFILE_PHASE_FIND_FILE;
             goto doMore;
         break;
@@ -2559,26 +5927,47 @@ static void afatfs_createFileContinue(afatfsFile_t *file)
 
                 switch (status) {
                     case AFATFS_OPERATION_SUCCESS:
+#ifdef AFATFS_DIRECTORY_SUMMARY_SIZE
+                        // At the end of the directory, the finder is left on the entry before the one we asked for
+                        afatfs_directorySummaryEntryScanned(
+                            afatfs_findGetEntryNumber(&afatfs.currentDirectory, &file->directoryEntryPos) + (entry == NULL ? 1 : 0),
+                            entry
+                        );
+#endif
+
                         // Is this the last entry in the directory?
                         if (entry == NULL || fat_isDirectoryEntryTerminator(entry)) {
+                            /*
+                             * If every entry is in use, start the search for a free entry from the last one (we can't
+                             * position the finder beyond the end of the directory).
+                             */
+                            if (entry == NULL) {
+                                opState->firstFreeEntry = MIN(opState->firstFreeEntry, afatfs_findGetEntryNumber(&afatfs.currentDirectory, &file->directoryEntryPos));
+                            }
+
                             afatfs_findLast(&afatfs.currentDirectory);
 
-                            if ((file->mode & AFATFS_FILE_MODE_CREATE) != 0) {
-                                // The file didn't already exist, so we can create it. Allocate a new directory entry
-                                afatfs_findFirst(&afatfs.currentDirectory, &file->directoryEntryPos);
+                            opState->phase = AFATFS_CREATEFILE_PHASE_FILE_NOT_FOUND;
+                            goto doMore;
+                        }
 
-                                opState->phase = AFATFS_CREATEFILE_PHASE_CREATE_NEW_FILE;
-                                goto doMore;
-                            } else {
-                                // File not found.
+                        // Note where the first free entry is, so we won't have to search the directory again to create the file
+                        if (!fat_isDirectoryEntryEmpty(entry)
+                                && afatfs_findGetEntryNumber(&afatfs.currentDirectory, &file->directoryEntryPos) == opState->firstFreeEntry) {
+                            opState->firstFreeEntry++;
+                        }
 
-                                opState->phase = AFATFS_CREATEFILE_PHASE_FAILURE;
-                                goto doMore;
-                            }
+                        if (opState->sequenceDigits > 0) {
+                            afatfs_createFileNoteSequenceNumber(opState, entry);
                         } else if (strncmp(entry->filename, (char*) opState->filename, FAT_FILENAME_LENGTH) == 0) {
                             // We found a file with this name!
                             afatfs_fileLoadDirectoryEntry(file, entry);
 
+#ifdef AFATFS_DIRECTORY_SUMMARY_SIZE
+                            file->parentDirectoryCluster = afatfs.currentDirectory.firstCluster;
+                            file->directoryEntryNumber = afatfs_findGetEntryNumber(&afatfs.currentDirectory, &file->directoryEntryPos);
+#endif
+
                             afatfs_findLast(&afatfs.currentDirectory);
 
                             opState->phase = AFATFS_CREATEFILE_PHASE_SUCCESS;
@@ -2595,7 +5984,34 @@ static void afatfs_createFileContinue(afatfsFile_t *file)
                 }
             } while (status == AFATFS_OPERATION_SUCCESS);
         break;
+        case AFATFS_CREATEFILE_PHASE_FILE_NOT_FOUND:
+            if (opState->sequenceDigits > 0 && !afatfs_createFileApplySequenceNumber(opState)) {
+                // We've run out of numbers
+                opState->phase = AFATFS_CREATEFILE_PHASE_FAILURE;
+            } else if ((file->mode & AFATFS_FILE_MODE_CREATE) != 0) {
+                // The file didn't already exist, so we can create it. Allocate a new directory entry
+#ifdef AFATFS_DIRECTORY_SUMMARY_SIZE
+                // (We might not have searched the directory at all)
+                opState->firstFreeEntry = afatfs.directorySummary.firstFreeEntry;
+#endif
+
+                // Every entry before the first free one is in use, so start looking from there
+                afatfs_findAt(&afatfs.currentDirectory, &file->directoryEntryPos, opState->firstFreeEntry);
+
+                opState->phase = AFATFS_CREATEFILE_PHASE_CREATE_NEW_FILE;
+            } else {
+                opState->phase = AFATFS_CREATEFILE_PHASE_FAILURE;
+            }
+            goto doMore;
+        break;
         case AFATFS_CREATEFILE_PHASE_CREATE_NEW_FILE:
+#ifdef AFATFS_USE_JOURNAL
+            // We might be given the entry of a deleted file that the next mount would delete again
+            if (afatfs_journalHasDeletion()) {
+                break;
+            }
+#endif
+
             status = afatfs_allocateDirectoryEntry(&afatfs.currentDirectory, &entry, &file->directoryEntryPos);
 
             if (status == AFATFS_OPERATION_SUCCESS) {
@@ -2608,6 +6024,13 @@ static void afatfs_createFileContinue(afatfsFile_t *file)
                 entry->lastWriteDate = AFATFS_DEFAULT_FILE_DATE;
                 entry->lastWriteTime = AFATFS_DEFAULT_FILE_TIME;
 
+#ifdef AFATFS_DIRECTORY_SUMMARY_SIZE
+                file->parentDirectoryCluster = afatfs.currentDirectory.firstCluster;
+                file->directoryEntryNumber = afatfs_findGetEntryNumber(&afatfs.currentDirectory, &file->directoryEntryPos);
+
+                afatfs_directorySummaryEntryAllocated(file->directoryEntryNumber, opState->firstFreeEntry, opState->filename);
+#endif
+
 #ifdef AFATFS_DEBUG_VERBOSE
                 fprintf(stderr, "Adding directory entry for %.*s to sector %u\n", FAT_FILENAME_LENGTH, opState->filename, file->directoryEntryPos.sectorNumberPhysical);
 #endif
@@ -2620,6 +6043,18 @@ static void afatfs_createFileContinue(afatfsFile_t *file)
             }
         break;
         case AFATFS_CREATEFILE_PHASE_SUCCESS:
+#ifdef AFATFS_USE_FREEFILE
+            /*
+             * An empty contiguous file will be allocated from the freefile, so wait for any operation on that to finish
+             * (e.g. it's still being allocated) before we retain the directory sector below (since that retain must only
+             * be taken once).
+             */
+            if ((file->mode & AFATFS_FILE_MODE_CONTIGUOUS) != 0 && file->firstCluster == 0 && afatfs_fileIsBusy(&afatfs.freeFile)) {
+                // Someone else's using the freefile, come back later.
+                break;
+            }
+#endif
+
             if ((file->mode & AFATFS_FILE_MODE_RETAIN_DIRECTORY) != 0) {
                 /*
                  * For this high performance file type, we require the directory entry for the file to be retained
@@ -2643,19 +6078,7 @@ static void afatfs_createFileContinue(afatfsFile_t *file)
             afatfs_fseek(file, 0, AFATFS_SEEK_SET);
 
             // Is file empty?
-            if (file->cursorCluster == 0) {
-#ifdef AFATFS_USE_FREEFILE
-                if ((file->mode & AFATFS_FILE_MODE_CONTIGUOUS) != 0) {
-                    if (afatfs_fileIsBusy(&afatfs.freeFile)) {
-                        // Someone else's using the freefile, come back later.
-                        break;
-                    } else {
-                        // Lock the freefile for our exclusive access
-                        afatfs.freeFile.operation.operation = AFATFS_FILE_OPERATION_LOCKED;
-                    }
-                }
-#endif
-            } else {
+            if (file->cursorCluster != 0) {
                 // We can't guarantee that the existing file contents are contiguous
                 file->mode &= ~AFATFS_FILE_MODE_CONTIGUOUS;
 
@@ -2677,6 +6100,17 @@ static void afatfs_createFileContinue(afatfsFile_t *file)
             }
 
             file->operation.operation = AFATFS_FILE_OPERATION_NONE;
+
+            // A directory we've just created has no clusters yet, so give it the ones it asked to reserve
+            if (file->type == AFATFS_FILE_TYPE_DIRECTORY && file->firstCluster == 0 && opState->reserveClusters > 0) {
+                // The ".." entry of a directory in the root refers to cluster 0
+                afatfsFilePtr_t parentDirectory = afatfs.currentDirectory.firstCluster == afatfs.rootDirectoryCluster ? NULL : &afatfs.currentDirectory;
+
+                // This replaces our open file operation
+                afatfs_extendSubdirectoryBy(file, parentDirectory, opState->reserveClusters, true, opState->callback);
+                break;
+            }
+
             opState->callback(file);
         break;
         case AFATFS_CREATEFILE_PHASE_FAILURE:
@@ -2745,16 +6179,10 @@ bool afatfs_funlink(afatfsFilePtr_t file, afatfsCallback_t callback)
 }
 
 /**
- * Open (or create) a file in the CWD with the given filename.
- *
- * file             - Memory location to store the newly opened file details
- * name             - Filename in "name.ext" format. No path.
- * attrib           - FAT file attributes to give the file (if created)
- * fileMode         - Bitset of AFATFS_FILE_MODE_* constants. Include AFATFS_FILE_MODE_CREATE to create the file if
- *                    it does not exist.
- * callback         - Called when the operation is complete
+ * Prepare the file handle for an operation to open (or create) a file in the CWD with the given filename, but don't
+ * begin the operation yet. The arguments are the same as for afatfs_createFile().
  */
-static afatfsFilePtr_t afatfs_createFile(afatfsFilePtr_t file, const char *name, uint8_t attrib, uint8_t fileMode,
+static void afatfs_createFileInit(afatfsFilePtr_t file, const char *name, uint8_t attrib, uint8_t fileMode,
         afatfsFileCallback_t callback)
 {
     afatfsCreateFile_t *opState = &file->operation.state.createFile;
@@ -2791,6 +6219,22 @@ static afatfsFilePtr_t afatfs_createFile(afatfsFilePtr_t file, const char *name,
     } else {
         opState->phase = AFATFS_CREATEFILE_PHASE_INITIAL;
     }
+}
+
+/**
+ * Open (or create) a file in the CWD with the given filename.
+ *
+ * file             - Memory location to store the newly opened file details
+ * name             - Filename in "name.ext" format. No path.
+ * attrib           - FAT file attributes to give the file (if created)
+ * fileMode         - Bitset of AFATFS_FILE_MODE_* constants. Include AFATFS_FILE_MODE_CREATE to create the file if
+ *                    it does not exist.
+ * callback         - Called when the operation is complete
+ */
+static afatfsFilePtr_t afatfs_createFile(afatfsFilePtr_t file, const char *name, uint8_t attrib, uint8_t fileMode,
+        afatfsFileCallback_t callback)
+{
+    afatfs_createFileInit(file, name, attrib, fileMode, callback);
 
     afatfs_createFileContinue(file);
 
@@ -2822,23 +6266,20 @@ static void afatfs_fcloseContinue(afatfsFilePtr_t file)
 
         if (descriptor) {
             descriptor->retainCount = MAX((int) descriptor->retainCount - 1, 0);
+            afatfs_cacheSectorUpdateList(descriptor);
         }
     }
 
     // Release locks on the sector at the file cursor position
     afatfs_fileUnlockCacheSector(file);
 
-#ifdef AFATFS_USE_FREEFILE
-    // Release our exclusive lock on the freefile if needed
-    if ((file->mode & AFATFS_FILE_MODE_CONTIGUOUS) != 0) {
-        afatfs_assert(afatfs.freeFile.operation.operation == AFATFS_FILE_OPERATION_LOCKED);
-        afatfs.freeFile.operation.operation = AFATFS_FILE_OPERATION_NONE;
-    }
-#endif
-
     file->type = AFATFS_FILE_TYPE_NONE;
     file->operation.operation = AFATFS_FILE_OPERATION_NONE;
 
+#if AFATFS_FAT_MIRROR_POLICY == AFATFS_FAT_MIRROR_DEFERRED
+    afatfs.fatMirror.syncRequested = true;
+#endif
+
     if (opState->callback) {
         opState->callback();
     }
@@ -2862,6 +6303,11 @@ bool afatfs_fclose(afatfsFilePtr_t file, afatfsCallback_t callback)
     } else {
         afatfs_fileUpdateFilesize(file);
 
+#ifdef AFATFS_CARD_PAGE_SECTORS
+        // Nothing more will be written to our last page, so it can go to the card as it is
+        file->writePageSector = 0;
+#endif
+
         file->operation.operation = AFATFS_FILE_OPERATION_CLOSE;
         file->operation.state.closeFile.callback = callback;
         afatfs_fcloseContinue(file);
@@ -2874,11 +6320,12 @@ bool afatfs_fclose(afatfsFilePtr_t file, afatfsCallback_t callback)
  *
  * The directory will be passed to the callback, or NULL if the creation failed.
  *
- * Returns true if the directory creation was begun, or false if there are too many open files.
+ * Returns true if the directory creation was begun, or false if there are too many open files or the filesystem was
+ * mounted read-only.
  */
 bool afatfs_mkdir(const char *filename, afatfsFileCallback_t callback)
 {
-    afatfsFilePtr_t file = afatfs_allocateFileHandle();
+    afatfsFilePtr_t file = afatfs.readOnly ? NULL : afatfs_allocateFileHandle();
 
     if (file) {
         afatfs_createFile(file, filename, FAT_FILE_ATTRIBUTE_DIRECTORY, AFATFS_FILE_MODE_CREATE | AFATFS_FILE_MODE_READ | AFATFS_FILE_MODE_WRITE, callback);
@@ -2889,6 +6336,33 @@ bool afatfs_mkdir(const char *filename, afatfsFileCallback_t callback)
     return file != NULL;
 }
 
+/**
+ * Create a new directory with the given name like afatfs_mkdir(), but give it `reserveClusters` clusters straight away
+ * (zero-filled with streamed multi-block writes), so that files created in it later don't have to wait for it to grow
+ * until that space is used up. If the volume runs out of space first, the directory gets the clusters that were free.
+ *
+ * An existing directory is opened as it is, without reserving anything.
+ *
+ * Returns true if the directory creation was begun, or false if there are too many open files or the filesystem was
+ * mounted read-only.
+ */
+bool afatfs_mkdirWithReserve(const char *filename, uint32_t reserveClusters, afatfsFileCallback_t callback)
+{
+    afatfsFilePtr_t file = afatfs.readOnly ? NULL : afatfs_allocateFileHandle();
+
+    if (file) {
+        afatfs_createFileInit(file, filename, FAT_FILE_ATTRIBUTE_DIRECTORY, AFATFS_FILE_MODE_CREATE | AFATFS_FILE_MODE_READ | AFATFS_FILE_MODE_WRITE, callback);
+
+        file->operation.state.createFile.reserveClusters = reserveClusters;
+
+        afatfs_createFileContinue(file);
+    } else if (callback) {
+        callback(NULL);
+    }
+
+    return file != NULL;
+}
+
 /**
  * Change the working directory to the directory with the given handle (use fopen). Pass NULL for `directory` in order to
  * change to the root directory.
@@ -2907,14 +6381,22 @@ bool afatfs_chdir(afatfsFilePtr_t directory)
             return false;
         }
 
+#ifdef AFATFS_DIRECTORY_SUMMARY_SIZE
+        afatfs_directorySummaryReset();
+#endif
+
         memcpy(&afatfs.currentDirectory, directory, sizeof(*directory));
         return true;
     } else {
+#ifdef AFATFS_DIRECTORY_SUMMARY_SIZE
+        afatfs_directorySummaryReset();
+#endif
+
         afatfs_initFileHandle(&afatfs.currentDirectory);
 
         afatfs.currentDirectory.mode = AFATFS_FILE_MODE_READ | AFATFS_FILE_MODE_WRITE;
         
-        if (afatfs.filesystemType == FAT_FILESYSTEM_TYPE_FAT16)
+        if (afatfs_isFAT16())
             afatfs.currentDirectory.type = AFATFS_FILE_TYPE_FAT16_ROOT_DIRECTORY;
         else
             afatfs.currentDirectory.type = AFATFS_FILE_TYPE_DIRECTORY;
@@ -2925,10 +6407,56 @@ bool afatfs_chdir(afatfsFilePtr_t directory)
         // Root directories don't have a directory entry to represent themselves:
         afatfs.currentDirectory.directoryEntryPos.sectorNumberPhysical = 0;
 
-        afatfs_fseek(&afatfs.currentDirectory, 0, AFATFS_SEEK_SET);
+        afatfs_fseek(&afatfs.currentDirectory, 0, AFATFS_SEEK_SET);
+
+        return true;
+    }
+}
+
+/**
+ * Returns true if a file may be opened with the given AFATFS_FILE_MODE_* flags (on a read-only mount, files may only be
+ * read).
+ */
+static bool afatfs_fileModeIsAllowed(uint8_t fileMode)
+{
+    return !afatfs.readOnly || (fileMode & (AFATFS_FILE_MODE_WRITE | AFATFS_FILE_MODE_APPEND | AFATFS_FILE_MODE_CREATE)) == 0;
+}
+
+/**
+ * Convert an fopen() mode string (see afatfs_fopen()) into a bitset of AFATFS_FILE_MODE_* flags.
+ */
+static uint8_t afatfs_parseFileMode(const char *mode)
+{
+    uint8_t fileMode = 0;
+
+    switch (mode[0]) {
+        case 'r':
+            fileMode = AFATFS_FILE_MODE_READ;
+        break;
+        case 'w':
+            fileMode = AFATFS_FILE_MODE_WRITE | AFATFS_FILE_MODE_CREATE;
+        break;
+        case 'a':
+            fileMode = AFATFS_FILE_MODE_APPEND | AFATFS_FILE_MODE_CREATE;
+        break;
+    }
+
+    switch (mode[1]) {
+        case '+':
+            fileMode |= AFATFS_FILE_MODE_READ;
 
-        return true;
+            if (fileMode == AFATFS_FILE_MODE_READ) {
+                fileMode |= AFATFS_FILE_MODE_WRITE;
+            }
+        break;
+        case 's':
+#ifdef AFATFS_USE_FREEFILE
+            fileMode |= AFATFS_FILE_MODE_CONTIGUOUS | AFATFS_FILE_MODE_RETAIN_DIRECTORY;
+#endif
+        break;
     }
+
+    return fileMode;
 }
 
 /**
@@ -2955,44 +6483,45 @@ bool afatfs_chdir(afatfsFilePtr_t directory)
  *
  * All other mode strings are illegal. In particular, don't add "b" to the end of the mode string.
  *
- * Returns false if the the open failed really early (out of file handles).
+ * Returns false if the the open failed really early (out of file handles, or a mode other than "r" on a read-only mount).
  */
 bool afatfs_fopen(const char *filename, const char *mode, afatfsFileCallback_t complete)
 {
-    uint8_t fileMode = 0;
-    afatfsFilePtr_t file;
+    return afatfs_fopenWithDurability(filename, mode, NULL, complete);
+}
 
-    switch (mode[0]) {
-        case 'r':
-            fileMode = AFATFS_FILE_MODE_READ;
-        break;
-        case 'w':
-            fileMode = AFATFS_FILE_MODE_WRITE | AFATFS_FILE_MODE_CREATE;
-        break;
-        case 'a':
-            fileMode = AFATFS_FILE_MODE_APPEND | AFATFS_FILE_MODE_CREATE;
-        break;
-    }
+/**
+ * Like afatfs_fopen(), but choose how often the file's directory entry is brought up to date while the file is being
+ * extended (pass NULL for the default policy of afatfs_fopen(), AFATFS_DURABILITY_EVERY_ALLOCATION).
+ *
+ * The entry records the file's first cluster and (exaggerated up to the end of its last allocated cluster) its size,
+ * so after a power cut, only the data that was written before the last update of the entry can be read back. Clusters
+ * added since then are left allocated but don't belong to any file. Updating the entry less often saves rewriting its
+ * directory sector, and for contiguous files opened with any policy other than the default, that sector is no longer
+ * kept retained in the cache for the whole time that the file is open.
+ *
+ * durability->interval is the number of clusters (superclusters for contiguous files) for
+ * AFATFS_DURABILITY_EVERY_N_ALLOCATIONS, or the number of milliseconds for AFATFS_DURABILITY_INTERVAL. The interval
+ * policy uses the clock given to afatfs_setMillisCallback(), without one the entry is only updated by afatfs_fclose().
+ */
+bool afatfs_fopenWithDurability(const char *filename, const char *mode, const afatfsDurability_t *durability, afatfsFileCallback_t complete)
+{
+    uint8_t fileMode = afatfs_parseFileMode(mode);
+    afatfsFilePtr_t file = afatfs_fileModeIsAllowed(fileMode) ? afatfs_allocateFileHandle() : NULL;
 
-    switch (mode[1]) {
-        case '+':
-            fileMode |= AFATFS_FILE_MODE_READ;
+    if (file) {
+        if (durability && durability->policy != AFATFS_DURABILITY_EVERY_ALLOCATION) {
+            fileMode &= ~AFATFS_FILE_MODE_RETAIN_DIRECTORY;
+        }
 
-            if (fileMode == AFATFS_FILE_MODE_READ) {
-                fileMode |= AFATFS_FILE_MODE_WRITE;
-            }
-        break;
-        case 's':
-#ifdef AFATFS_USE_FREEFILE
-            fileMode |= AFATFS_FILE_MODE_CONTIGUOUS | AFATFS_FILE_MODE_RETAIN_DIRECTORY;
-#endif
-        break;
-    }
+        afatfs_createFileInit(file, filename, FAT_FILE_ATTRIBUTE_ARCHIVE, fileMode, complete);
 
-    file = afatfs_allocateFileHandle();
+        if (durability) {
+            file->durability = *durability;
+        }
+        file->directorySaveTime = afatfs_millis();
 
-    if (file) {
-        afatfs_createFile(file, filename, FAT_FILE_ATTRIBUTE_ARCHIVE, fileMode, complete);
+        afatfs_createFileContinue(file);
     } else if (complete) {
         complete(NULL);
     }
@@ -3001,40 +6530,59 @@ bool afatfs_fopen(const char *filename, const char *mode, afatfsFileCallback_t c
 }
 
 /**
- * Write a single character to the file at the current cursor position. If the cache is too busy to accept the write,
- * it is silently dropped.
+ * Create a new file in the current working directory, named with the given prefix followed by a number which is one
+ * higher than that of any file in the directory with the same prefix and extension (or 1 if there are none), padded
+ * with zeros to fill the 8 characters of the name. e.g. with a prefix of "LOG" and an extension of "TXT", if the
+ * directory holds LOG00001.TXT and LOG00007.TXT, LOG00008.TXT will be created.
+ *
+ * This finds the number and creates the file in a single pass over the directory, so you don't need to search the
+ * directory with afatfs_findNext() yourself beforehand.
+ *
+ * prefix    - Between 1 and 7 characters for the start of the name.
+ * extension - Up to 3 characters for the extension (may be empty).
+ * mode      - One of the fopen() mode strings that creates a file ("w", "a", "ws" or "as").
+ *
+ * The complete() callback is called when finished with either a file handle (file was created) or NULL upon failure
+ * (including when the highest number has already been used).
+ *
+ * Returns false if the the open failed really early (out of file handles, a bad prefix or extension, or a read-only
+ * mount).
  */
-void afatfs_fputc(afatfsFilePtr_t file, uint8_t c)
+bool afatfs_createSequentialFile(const char *prefix, const char *extension, const char *mode, afatfsFileCallback_t complete)
 {
-    uint32_t cursorOffsetInSector = file->cursorOffset % AFATFS_SECTOR_SIZE;
+    char pattern[FAT_FILENAME_LENGTH + 2]; // "prefix.ext" and a null terminator
+    size_t prefixLength = strlen(prefix);
+    afatfsFilePtr_t file = NULL;
 
-    int cacheIndex = file->writeLockedCacheIndex;
+    if (prefixLength > 0 && prefixLength < 8 && strlen(extension) <= 3 && strchr(prefix, '.') == NULL && !afatfs.readOnly) {
+        file = afatfs_allocateFileHandle();
+    }
 
-    /* If we've already locked the current sector in the cache, and we won't be completing the sector, we won't
-     * be caching/uncaching/seeking, so we can just run this simpler fast case.
-     */
-    if (cacheIndex != -1 && cursorOffsetInSector != AFATFS_SECTOR_SIZE - 1) {
-        afatfs_cacheSectorGetMemory(cacheIndex)[cursorOffsetInSector] = c;
-        file->cursorOffset++;
-    } else {
-        // Slow path
-        afatfs_fwrite(file, &c, sizeof(c));
+    if (file) {
+        afatfsCreateFile_t *opState = &file->operation.state.createFile;
+
+        // The digits are filled in once we know the number to use
+        memcpy(pattern, prefix, prefixLength);
+        pattern[prefixLength] = '.';
+        strcpy(pattern + prefixLength + 1, extension);
+
+        afatfs_createFileInit(file, pattern, FAT_FILE_ATTRIBUTE_ARCHIVE, afatfs_parseFileMode(mode) | AFATFS_FILE_MODE_CREATE, complete);
+
+        opState->sequenceDigits = 8 - prefixLength;
+        opState->sequenceNumber = 1;
+
+        afatfs_createFileContinue(file);
+    } else if (complete) {
+        complete(NULL);
     }
+
+    return file != NULL;
 }
 
 /**
- * Attempt to write `len` bytes from `buffer` into the `file`.
- *
- * Returns the number of bytes actually written.
- *
- * 0 will be returned when:
- *     The filesystem is busy (try again later)
- *
- * Fewer bytes will be written than requested when:
- *     The write spanned a sector boundary and the next sector's contents/location was not yet available in the cache.
- *     Or you tried to extend the length of the file but the filesystem is full (check afatfs_isFull()).
+ * Write to the file like afatfs_fwrite(), but without counting short writes in the stats.
  */
-uint32_t afatfs_fwrite(afatfsFilePtr_t file, const uint8_t *buffer, uint32_t len)
+static uint32_t afatfs_fwriteInternal(afatfsFilePtr_t file, const uint8_t *buffer, uint32_t len)
 {
     if ((file->mode & (AFATFS_FILE_MODE_APPEND | AFATFS_FILE_MODE_WRITE)) == 0) {
         return 0;
@@ -3086,7 +6634,289 @@ uint32_t afatfs_fwrite(afatfsFilePtr_t file, const uint8_t *buffer, uint32_t len
         cursorOffsetInSector = 0;
     }
 
-    return writtenBytes;
+    return writtenBytes;
+}
+
+/**
+ * Attempt to write `len` bytes from `buffer` into the `file`.
+ *
+ * Returns the number of bytes actually written.
+ *
+ * 0 will be returned when:
+ *     The filesystem is busy (try again later)
+ *
+ * Fewer bytes will be written than requested when:
+ *     The write spanned a sector boundary and the next sector's contents/location was not yet available in the cache.
+ *     Or you tried to extend the length of the file but the filesystem is full (check afatfs_isFull()).
+ */
+uint32_t afatfs_fwrite(afatfsFilePtr_t file, const uint8_t *buffer, uint32_t len)
+{
+#ifdef AFATFS_USE_STATS
+    uint32_t writtenBytes = afatfs_fwriteInternal(file, buffer, len);
+
+    // (A file that isn't open for writing is refused rather than short-written)
+    if (writtenBytes < len && (file->mode & (AFATFS_FILE_MODE_APPEND | AFATFS_FILE_MODE_WRITE)) != 0) {
+        afatfs.stats.fwriteShortWrites++;
+    }
+
+    return writtenBytes;
+#else
+    return afatfs_fwriteInternal(file, buffer, len);
+#endif
+}
+
+/**
+ * Write a single character to the file at the current cursor position. If the cache is too busy to accept the write,
+ * it is silently dropped.
+ */
+void afatfs_fputc(afatfsFilePtr_t file, uint8_t c)
+{
+    uint32_t cursorOffsetInSector = file->cursorOffset % AFATFS_SECTOR_SIZE;
+
+    int cacheIndex = file->writeLockedCacheIndex;
+
+    /* If we've already locked the current sector in the cache, and we won't be completing the sector, we won't
+     * be caching/uncaching/seeking, so we can just run this simpler fast case.
+     */
+    if (cacheIndex != -1 && cursorOffsetInSector != AFATFS_SECTOR_SIZE - 1) {
+        afatfs_cacheSectorGetMemory(cacheIndex)[cursorOffsetInSector] = c;
+        file->cursorOffset++;
+    } else {
+        // Slow path (a dropped character only counts as an fputc drop, not as a short write too)
+#ifdef AFATFS_USE_STATS
+        if (afatfs_fwriteInternal(file, &c, sizeof(c)) == 0) {
+            afatfs.stats.fputcDrops++;
+        }
+#else
+        afatfs_fwriteInternal(file, &c, sizeof(c));
+#endif
+    }
+}
+
+/**
+ * Called by the SD card driver when one of the writes issued by afatfs_fwriteDirect() completes.
+ *
+ * callbackData is the index of the file in afatfs.openFiles.
+ */
+static void afatfs_sdcardDirectWriteComplete(sdcardBlockOperation_e operation, uint32_t sectorIndex, uint8_t *buffer, uint32_t callbackData)
+{
+    (void) operation;
+    (void) sectorIndex;
+
+    afatfsFilePtr_t file = &afatfs.openFiles[callbackData];
+    afatfsWriteDirect_t *opState = &file->operation.state.writeDirect;
+
+    if (file->operation.operation == AFATFS_FILE_OPERATION_WRITE_DIRECT && opState->phase == AFATFS_WRITE_DIRECT_PHASE_WAIT_FOR_WRITE) {
+        if (buffer == NULL) {
+            // Write failed, so send that sector again (the card will have abandoned any multi-block write too)
+            opState->multiBlockRemaining = 0;
+            opState->phase = AFATFS_WRITE_DIRECT_PHASE_WRITE_SECTOR;
+        } else {
+            opState->phase = AFATFS_WRITE_DIRECT_PHASE_ADVANCE_CURSOR;
+        }
+    }
+}
+
+/**
+ * The number of sectors we can write consecutively on the disk starting from the file's cursor without having to
+ * consult the FAT (the cursor must be inside an allocated cluster).
+ */
+static uint32_t afatfs_fileConsecutiveSectorsAtCursor(afatfsFilePtr_t file)
+{
+#ifdef AFATFS_USE_FREEFILE
+    if ((file->mode & AFATFS_FILE_MODE_CONTIGUOUS) != 0) {
+        // Contiguous files are allocated a whole supercluster at a time
+        uint32_t cursorOffsetInSupercluster = file->cursorOffset & (afatfs_superClusterSize() - 1);
+
+        return afatfs_fatEntriesPerSector() * afatfs.sectorsPerCluster - cursorOffsetInSupercluster / AFATFS_SECTOR_SIZE;
+    }
+#endif
+
+    return afatfs.sectorsPerCluster - afatfs_sectorIndexInCluster(file->cursorOffset);
+}
+
+static void afatfs_fwriteDirectContinue(afatfsFile_t *file)
+{
+    afatfsWriteDirect_t *opState = &file->operation.state.writeDirect;
+    afatfsOperationStatus_e status;
+    uint32_t physicalSector;
+
+    doMore:
+    switch (opState->phase) {
+        case AFATFS_WRITE_DIRECT_PHASE_CHECK_ALLOCATION:
+            if (afatfs_isEndOfAllocatedFile(file)) {
+                // We're about to write into the first sector of a new cluster, so we need to add that to the file first
+#ifdef AFATFS_USE_FREEFILE
+                if ((file->mode & AFATFS_FILE_MODE_CONTIGUOUS) != 0) {
+                    if (afatfs.freeFile.logicalSize < afatfs_superClusterSize()) {
+                        afatfs.filesystemFull = true;
+                    }
+
+                    opState->appendState.appendSupercluster.phase = AFATFS_APPEND_SUPERCLUSTER_PHASE_INIT;
+                    opState->appendState.appendSupercluster.previousCluster = file->cursorPreviousCluster;
+                } else
+#endif
+                {
+                    afatfs_appendRegularFreeClusterInitOperationState(&opState->appendState.appendFreeCluster, file->cursorPreviousCluster);
+                }
+
+                if (afatfs.filesystemFull) {
+                    // Stop short, the caller can see how much we wrote from the file cursor position
+                    opState->phase = AFATFS_WRITE_DIRECT_PHASE_COMPLETE;
+                } else {
+                    opState->phase = AFATFS_WRITE_DIRECT_PHASE_EXTEND_FILE;
+                }
+            } else {
+                opState->phase = AFATFS_WRITE_DIRECT_PHASE_WRITE_SECTOR;
+            }
+            goto doMore;
+        break;
+        case AFATFS_WRITE_DIRECT_PHASE_EXTEND_FILE:
+#ifdef AFATFS_USE_FREEFILE
+            if ((file->mode & AFATFS_FILE_MODE_CONTIGUOUS) != 0) {
+                status = afatfs_appendSuperclusterContinue(file);
+            } else
+#endif
+            {
+                status = afatfs_appendRegularFreeClusterContinue(file);
+            }
+
+            if (status == AFATFS_OPERATION_SUCCESS) {
+                opState->phase = AFATFS_WRITE_DIRECT_PHASE_WRITE_SECTOR;
+                goto doMore;
+            } else if (status == AFATFS_OPERATION_FAILURE) {
+                opState->phase = AFATFS_WRITE_DIRECT_PHASE_COMPLETE;
+                goto doMore;
+            }
+        break;
+        case AFATFS_WRITE_DIRECT_PHASE_WRITE_SECTOR:
+            physicalSector = afatfs_fileGetCursorPhysicalSector(file);
+
+            if (!afatfs_cacheSectorPrepareForDirectWrite(physicalSector, opState->buffer)) {
+                break;
+            }
+
+#ifdef AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT
+            if (opState->multiBlockRemaining == 0) {
+                /*
+                 * Only ask the card to pre-erase sectors that we're definitely going to overwrite, since the cursor
+                 * might not be at the end of the file.
+                 */
+                uint32_t sectorCount = MIN(opState->bytesRemaining / AFATFS_SECTOR_SIZE, afatfs_fileConsecutiveSectorsAtCursor(file));
+
+                if (sectorCount >= AFATFS_MIN_MULTIPLE_BLOCK_WRITE_COUNT) {
+                    switch (afatfs_sdcardBeginWriteBlocks(physicalSector, sectorCount)) {
+                        case SDCARD_OPERATION_SUCCESS:
+                            opState->multiBlockRemaining = sectorCount;
+                        break;
+                        case SDCARD_OPERATION_BUSY:
+                            return;
+                        default:
+                            // Just write the sectors individually instead
+                            ;
+                    }
+                }
+            }
+#endif
+
+            switch (sdcard_writeBlock(physicalSector, (uint8_t*) opState->buffer, afatfs_sdcardDirectWriteComplete, file - afatfs.openFiles)) {
+                case SDCARD_OPERATION_IN_PROGRESS:
+                    opState->phase = AFATFS_WRITE_DIRECT_PHASE_WAIT_FOR_WRITE;
+                break;
+                case SDCARD_OPERATION_SUCCESS:
+                    opState->phase = AFATFS_WRITE_DIRECT_PHASE_ADVANCE_CURSOR;
+                    goto doMore;
+                break;
+                case SDCARD_OPERATION_BUSY:
+                case SDCARD_OPERATION_FAILURE:
+                default:
+                    // Try again later
+                    ;
+            }
+        break;
+        case AFATFS_WRITE_DIRECT_PHASE_WAIT_FOR_WRITE:
+            // Waiting for afatfs_sdcardDirectWriteComplete() to be called
+        break;
+        case AFATFS_WRITE_DIRECT_PHASE_ADVANCE_CURSOR:
+            // This seek stays within the cluster or steps into the next one, so it'll only need to wait for a FAT read
+            if (!afatfs_fseekAtomic(file, AFATFS_SECTOR_SIZE)) {
+                break;
+            }
+
+            if (opState->multiBlockRemaining > 0) {
+                opState->multiBlockRemaining--;
+            }
+
+            opState->buffer += AFATFS_SECTOR_SIZE;
+            opState->bytesRemaining -= AFATFS_SECTOR_SIZE;
+
+            if (opState->bytesRemaining == 0) {
+                opState->phase = AFATFS_WRITE_DIRECT_PHASE_COMPLETE;
+            } else {
+                opState->phase = AFATFS_WRITE_DIRECT_PHASE_CHECK_ALLOCATION;
+            }
+            goto doMore;
+        break;
+        case AFATFS_WRITE_DIRECT_PHASE_COMPLETE:
+            file->operation.operation = AFATFS_FILE_OPERATION_NONE;
+
+            if (opState->callback) {
+                opState->callback(file);
+            }
+        break;
+    }
+}
+
+/**
+ * Queue up an operation to write `len` bytes from `buffer` to the file at the current cursor position, without
+ * copying them through the cache. The buffer is handed to the SD card driver directly, using multi-block writes where
+ * possible, so this is much cheaper than afatfs_fwrite() for large blocks of data.
+ *
+ * Both the cursor position and `len` must be a multiple of the sector size (512 bytes).
+ *
+ * The buffer must remain valid and unmodified until the callback is called. When the callback is called, check the
+ * file position with afatfs_ftell() to see how much was written, this will only be short if the filesystem became full
+ * (check afatfs_isFull()).
+ *
+ * Returns false if the write could not be queued because the file is busy (try again later), or because the file mode
+ * or cursor alignment doesn't allow a direct write (use afatfs_fwrite() instead).
+ */
+bool afatfs_fwriteDirect(afatfsFilePtr_t file, const uint8_t *buffer, uint32_t len, afatfsFileCallback_t callback)
+{
+    if (
+        file->type != AFATFS_FILE_TYPE_NORMAL
+        || (file->mode & (AFATFS_FILE_MODE_APPEND | AFATFS_FILE_MODE_WRITE)) == 0
+        || file < afatfs.openFiles || file >= afatfs.openFiles + afatfs.maxOpenFiles
+        || file->cursorOffset % AFATFS_SECTOR_SIZE != 0
+        || len % AFATFS_SECTOR_SIZE != 0
+        || afatfs_fileIsBusy(file)
+    ) {
+        return false;
+    }
+
+    if (len == 0) {
+        if (callback) {
+            callback(file);
+        }
+        return true;
+    }
+
+    // We're not going to write to the sector at the cursor through the cache, so don't hold on to it
+    afatfs_fileUnlockCacheSector(file);
+
+    afatfsWriteDirect_t *opState = &file->operation.state.writeDirect;
+
+    file->operation.operation = AFATFS_FILE_OPERATION_WRITE_DIRECT;
+
+    opState->phase = AFATFS_WRITE_DIRECT_PHASE_INITIAL;
+    opState->buffer = buffer;
+    opState->bytesRemaining = len;
+    opState->multiBlockRemaining = 0;
+    opState->callback = callback;
+
+    afatfs_fwriteDirectContinue(file);
+
+    return true;
 }
 
 /**
@@ -3122,6 +6952,9 @@ uint32_t afatfs_fread(afatfsFilePtr_t file, uint8_t *buffer, uint32_t len)
 
     len = MIN(file->logicalSize - file->cursorOffset, len);
 
+    // We're reading through the cache again, so it's worth reading ahead of the cursor
+    file->mode &= ~AFATFS_FILE_MODE_DIRECT_READ;
+
     uint32_t readBytes = 0;
     uint32_t cursorOffsetInSector = file->cursorOffset % AFATFS_SECTOR_SIZE;
 
@@ -3158,6 +6991,158 @@ uint32_t afatfs_fread(afatfsFilePtr_t file, uint8_t *buffer, uint32_t len)
     return readBytes;
 }
 
+/**
+ * Find out where the file's data from byte `offset` up to `offset + len` is stored on the card, so that it can be read
+ * with your own sdcard_readBlock() or multi-block read calls straight into your buffers, rather than being copied
+ * through the cache by afatfs_fread().
+ *
+ * The data is described by runs of physically consecutive sectors (in file order) which are stored in `extents`, and
+ * the number of runs used is stored in *extentCount. The runs cover whole sectors, so the last one may extend beyond
+ * the end of the file. The range is clipped to the end of the file, and `offset` must be a multiple of the sector size.
+ *
+ * Fewer sectors than requested will be described when the range needs more than `maxExtents` runs, or when a FAT
+ * sector that's needed to follow the cluster chain isn't cached yet. Call again with `offset` advanced past the sectors
+ * you were given to get the rest. *extentCount is set to zero once `offset` reaches the end of the file.
+ *
+ * Any sectors of the range that are waiting in the cache to be written are flushed first, so the card holds the current
+ * contents of the file once this succeeds. The cached copies of the range, and any FAT sectors that we had to read in
+ * to find it, are marked as discardable so that a bulk export doesn't push more useful sectors out of the cache. The
+ * extents remain valid until the file is next written to, truncated or deleted.
+ *
+ * The file's cursor is moved to `offset`, and sectors aren't read ahead of it into the cache until you next call
+ * afatfs_fread() on the file.
+ *
+ * Returns:
+ *     AFATFS_OPERATION_SUCCESS     - The extents have been stored
+ *     AFATFS_OPERATION_IN_PROGRESS - The filesystem is busy, call again later
+ *     AFATFS_OPERATION_FAILURE     - The file isn't open for reading or the offset isn't aligned to a sector
+ */
+afatfsOperationStatus_e afatfs_fgetExtents(afatfsFilePtr_t file, uint32_t offset, uint32_t len, afatfsExtent_t *extents, int maxExtents, int *extentCount)
+{
+    if (
+        file->type != AFATFS_FILE_TYPE_NORMAL
+        || (file->mode & AFATFS_FILE_MODE_READ) == 0
+        || offset % AFATFS_SECTOR_SIZE != 0
+        || maxExtents < 1
+    ) {
+        return AFATFS_OPERATION_FAILURE;
+    }
+
+    *extentCount = 0;
+
+    if (afatfs_fileIsBusy(file)) {
+        // There might be a seek pending
+        return AFATFS_OPERATION_IN_PROGRESS;
+    }
+
+    afatfs_fileUpdateFilesize(file);
+
+    if (offset >= file->logicalSize) {
+        return AFATFS_OPERATION_SUCCESS;
+    }
+
+    // The caller is going to read the sectors around the cursor from the card themselves, so don't cache them for fread()
+    afatfs_fileUnlockCacheSector(file);
+    file->mode |= AFATFS_FILE_MODE_DIRECT_READ;
+
+    if (file->cursorOffset != offset) {
+        if (offset < file->cursorOffset) {
+            afatfs_fileRewind(file);
+        }
+
+        if (afatfs_fseekInternal(file, offset - file->cursorOffset, NULL) != AFATFS_OPERATION_SUCCESS) {
+            // Wait for the seek to complete
+            return AFATFS_OPERATION_IN_PROGRESS;
+        }
+    }
+
+    if (afatfs_isEndOfAllocatedFile(file)) {
+        // The cluster chain is shorter than the file's size
+        return AFATFS_OPERATION_SUCCESS;
+    }
+
+    uint32_t sectorsRemaining = (MIN(len, file->logicalSize - offset) + AFATFS_SECTOR_SIZE - 1) / AFATFS_SECTOR_SIZE;
+    uint32_t fileClusterIndex = offset / afatfs_clusterSize();
+    uint32_t cluster = file->cursorCluster;
+    uint32_t sectorIndexInCluster = afatfs_sectorIndexInCluster(offset);
+    int count = 0;
+
+    while (sectorsRemaining > 0) {
+        uint32_t physicalSector = afatfs_fileClusterToPhysical(cluster, sectorIndexInCluster);
+        uint32_t sectorCount = MIN(afatfs.sectorsPerCluster - sectorIndexInCluster, sectorsRemaining);
+
+        if (count > 0 && extents[count - 1].sectorIndex + extents[count - 1].sectorCount == physicalSector) {
+            extents[count - 1].sectorCount += sectorCount;
+        } else if (count < maxExtents) {
+            extents[count].sectorIndex = physicalSector;
+            extents[count].sectorCount = sectorCount;
+            count++;
+        } else {
+            break;
+        }
+
+        sectorsRemaining -= sectorCount;
+
+        if (sectorsRemaining == 0) {
+            break;
+        }
+
+        uint32_t nextCluster;
+
+#ifdef AFATFS_FILE_EXTENT_CACHE_SIZE
+        if (!afatfs_fileExtentLookup(file, fileClusterIndex + 1, &nextCluster))
+#endif
+        {
+            // We're not going to stay in this part of the file, so prefer to evict the FAT sector over anything else
+            if (afatfs_fileGetNextCluster(file, cluster, &nextCluster, AFATFS_CACHE_READ | AFATFS_CACHE_DISCARDABLE) != AFATFS_OPERATION_SUCCESS) {
+                // Hand over what we've found so far, the next call will carry on from there when the FAT is ready
+                break;
+            }
+
+            if (nextCluster == 0 || afatfs_FATIsEndOfChainMarker(nextCluster)) {
+                break;
+            }
+
+#ifdef AFATFS_FILE_EXTENT_CACHE_SIZE
+            afatfs_fileExtentRecord(file, fileClusterIndex + 1, nextCluster);
+#endif
+        }
+
+        cluster = nextCluster;
+        fileClusterIndex++;
+        sectorIndexInCluster = 0;
+    }
+
+    // Make sure that the card has the latest copy of every sector in the range before we hand it over
+    for (int i = 0; i < afatfs.numCacheSectors; i++) {
+        afatfsCacheBlockDescriptor_t *descriptor = &afatfs.cacheDescriptor[i];
+
+        if (descriptor->state == AFATFS_CACHE_STATE_EMPTY) {
+            continue;
+        }
+
+        for (int j = 0; j < count; j++) {
+            if (descriptor->sectorIndex >= extents[j].sectorIndex && descriptor->sectorIndex - extents[j].sectorIndex < extents[j].sectorCount) {
+                switch (descriptor->state) {
+                    case AFATFS_CACHE_STATE_DIRTY:
+                        afatfs_flush();
+                        // Fall through
+                    case AFATFS_CACHE_STATE_WRITING:
+                        return AFATFS_OPERATION_IN_PROGRESS;
+                    default:
+                        descriptor->discardable = 1;
+                        afatfs_cacheSectorUpdateList(descriptor);
+                }
+                break;
+            }
+        }
+    }
+
+    *extentCount = count;
+
+    return AFATFS_OPERATION_SUCCESS;
+}
+
 /**
  * Returns true if the file's pointer position currently lies at the end-of-file point (i.e. one byte beyond the last
  * byte in the file).
@@ -3205,26 +7190,352 @@ static void afatfs_fileOperationContinue(afatfsFile_t *file)
         case AFATFS_FILE_OPERATION_EXTEND_SUBDIRECTORY:
             afatfs_extendSubdirectoryContinue(file);
         break;
+        case AFATFS_FILE_OPERATION_WRITE_DIRECT:
+            afatfs_fwriteDirectContinue(file);
+        break;
         case AFATFS_FILE_OPERATION_NONE:
             ;
         break;
     }
 }
 
+#ifdef AFATFS_FILE_READ_AHEAD_SECTORS
+
+/**
+ * The number of sectors after its cursor that each file should read ahead. On a read-only mount no cache entries are
+ * needed for writing, so the cache is shared between the open files instead.
+ */
+static uint32_t afatfs_fileReadAheadSectors()
+{
+    if (afatfs.readOnly) {
+        return MAX(AFATFS_FILE_READ_AHEAD_SECTORS, (afatfs.numCacheSectors - 2) / afatfs.maxOpenFiles - 1);
+    }
+
+    return AFATFS_FILE_READ_AHEAD_SECTORS;
+}
+
+#ifdef AFATFS_MIN_MULTIPLE_BLOCK_READ_COUNT
+
+/**
+ * Will read-ahead on the given file go on to read the rest of the multi-block read that it began? If not (e.g. the file
+ * has been closed, or its cursor has been moved away), the read has been abandoned.
+ */
+static bool afatfs_fileReadAheadContinuesRun(afatfsFilePtr_t file)
+{
+    if (
+        file->type != AFATFS_FILE_TYPE_NORMAL
+        || (file->mode & (AFATFS_FILE_MODE_READ | AFATFS_FILE_MODE_DIRECT_READ)) != AFATFS_FILE_MODE_READ
+        || afatfs_fileIsBusy(file)
+        || file->cursorOffset >= file->logicalSize
+        || afatfs_isEndOfAllocatedFile(file)
+    ) {
+        return false;
+    }
+
+    uint32_t cursorPhysicalSector = afatfs_fileGetCursorPhysicalSector(file);
+    uint32_t sectorsLeftInCluster = afatfs.sectorsPerCluster - 1 - afatfs_sectorIndexInCluster(file->cursorOffset);
+
+    // (The sector at the cursor might be about to be read by fread())
+    return afatfs.readRun.nextSector >= cursorPhysicalSector && afatfs.readRun.nextSector <= cursorPhysicalSector + sectorsLeftInCluster;
+}
+
+#endif
+
+/**
+ * If the file is open for reading, begin reading the next sector following the cursor that isn't in the cache yet, so
+ * that it's ready by the time that fread() asks for it.
+ *
+ * We only read ahead within the cursor's cluster (so we don't have to consult the FAT), and only into empty or
+ * discardable cache sectors, so that read-ahead never evicts anything more useful from the cache.
+ *
+ * Read-ahead also waits while any other read is waiting for the card, otherwise two files being read at once could keep
+ * the card busy reading ahead for each other forever.
+ */
+static void afatfs_fileReadAhead(afatfsFilePtr_t file)
+{
+#ifdef AFATFS_MIN_MULTIPLE_BLOCK_READ_COUNT
+    if (afatfs.readRun.remaining > 0 && afatfs.readRun.file == file && !afatfs_fileReadAheadContinuesRun(file)) {
+        // Don't leave the card in the middle of a multi-block read that nobody is going to finish
+        if (sdcard_endReadBlocks() == SDCARD_OPERATION_SUCCESS) {
+            afatfs.readRun.remaining = 0;
+        }
+    }
+#endif
+
+    if (
+        afatfs.cacheReadPending
+        || file->type != AFATFS_FILE_TYPE_NORMAL
+        || (file->mode & (AFATFS_FILE_MODE_READ | AFATFS_FILE_MODE_DIRECT_READ)) != AFATFS_FILE_MODE_READ
+        || afatfs_fileIsBusy(file)
+        || file->cursorOffset >= file->logicalSize
+        || afatfs_isEndOfAllocatedFile(file)
+    ) {
+        return;
+    }
+
+    uint32_t cursorPhysicalSector = afatfs_fileGetCursorPhysicalSector(file);
+    uint32_t sectorsLeftInCluster = afatfs.sectorsPerCluster - 1 - afatfs_sectorIndexInCluster(file->cursorOffset);
+    uint32_t sectorsLeftInFile = (file->logicalSize - 1) / AFATFS_SECTOR_SIZE - file->cursorOffset / AFATFS_SECTOR_SIZE;
+    uint32_t readAheadCount = MIN(MIN(sectorsLeftInCluster, sectorsLeftInFile), afatfs_fileReadAheadSectors());
+
+    for (uint32_t i = 1; i <= readAheadCount; i++) {
+        uint32_t physicalSector = cursorPhysicalSector + i;
+        uint8_t *sectorBuffer;
+
+        if (afatfs_findCacheSector(physicalSector)) {
+            continue;
+        }
+
+#ifdef AFATFS_MIN_MULTIPLE_BLOCK_READ_COUNT
+        // Ask the card to stream the rest of the read-ahead window to us
+        if (readAheadCount - i + 1 >= AFATFS_MIN_MULTIPLE_BLOCK_READ_COUNT) {
+            if (afatfs_sdcardBeginReadBlocks(physicalSector, readAheadCount - i + 1) != SDCARD_OPERATION_SUCCESS) {
+                return;
+            }
+
+            afatfs.readRun.file = file;
+            afatfs.readRun.nextSector = physicalSector;
+            afatfs.readRun.remaining = readAheadCount - i + 1;
+        }
+#endif
+
+        // The card can only perform one read at a time, so we'll continue with the next sector on a later poll
+        afatfs_cacheSector(physicalSector, &sectorBuffer, AFATFS_CACHE_READ | AFATFS_CACHE_READ_AHEAD, 0);
+        return;
+    }
+}
+
+#endif
+
+#ifdef AFATFS_USE_LOG_STREAM
+
+/**
+ * Begin draining a ring buffer of log records into the given file (which must be open for writing or appending) during
+ * afatfs_poll(). The buffer's size must be a power of two, and the stream and buffer must stay valid until
+ * afatfs_logStreamClose() returns true.
+ *
+ * Returns false if the stream couldn't be set up with those arguments, or if the stream is already open.
+ */
+bool afatfs_logStreamOpen(afatfsLogStream_t *stream, afatfsFilePtr_t file, uint8_t *buffer, uint32_t bufferSize)
+{
+    if (file == NULL || buffer == NULL || bufferSize == 0 || (bufferSize & (bufferSize - 1)) != 0
+            || (file->mode & (AFATFS_FILE_MODE_APPEND | AFATFS_FILE_MODE_WRITE)) == 0) {
+        return false;
+    }
+
+    // Re-initialising a stream that's on the list would lose the rest of the list (or link the stream to itself)
+    for (afatfsLogStream_t *other = afatfs.logStreams; other != NULL; other = other->next) {
+        if (other == stream) {
+            return false;
+        }
+    }
+
+    memset(stream, 0, sizeof(*stream));
+
+    stream->file = file;
+    stream->buffer = buffer;
+    stream->bufferSize = bufferSize;
+
+    stream->next = afatfs.logStreams;
+    afatfs.logStreams = stream;
+
+    return true;
+}
+
+/**
+ * Add a record of `len` bytes to the stream. This is the producer side of the stream, which may be called from an
+ * interrupt handler or another core (but only one producer may write to each stream).
+ *
+ * The record is either added in its entirety or, if there isn't enough room in the buffer for it (or the stream is
+ * closing), it is dropped and counted in the stream's droppedWrites/droppedBytes. Returns true if the record was added.
+ */
+bool afatfs_logStreamWrite(afatfsLogStream_t *stream, const uint8_t *data, uint32_t len)
+{
+    uint32_t head = stream->head;
+    uint32_t waiting = head - stream->tail;
+
+    // Don't touch the buffer until we've seen that the consumer has finished with that part of it
+    AFATFS_LOG_STREAM_MEMORY_BARRIER();
+
+    if (stream->closing || len > stream->bufferSize - waiting) {
+        stream->droppedWrites++;
+        stream->droppedBytes += len;
+        return false;
+    }
+
+    uint32_t headIndex = head & (stream->bufferSize - 1);
+    uint32_t lenBeforeWrap = MIN(len, stream->bufferSize - headIndex);
+
+    memcpy(stream->buffer + headIndex, data, lenBeforeWrap);
+    memcpy(stream->buffer, data + lenBeforeWrap, len - lenBeforeWrap);
+
+    // The record must be in the buffer before the consumer can see the new head
+    AFATFS_LOG_STREAM_MEMORY_BARRIER();
+
+    stream->head = head + len;
+
+    stream->highWatermark = MAX(stream->highWatermark, waiting + len);
+
+    return true;
+}
+
+/**
+ * Write as much of the stream's buffered data to its file as we can. Only whole sectors of the file are written, unless
+ * the stream is closing, in which case the final partial sector is written too.
+ */
+static void afatfs_logStreamDrain(afatfsLogStream_t *stream)
+{
+    uint32_t head = stream->head;
+
+    // Don't read the buffer until we've seen the head that says the records are in there
+    AFATFS_LOG_STREAM_MEMORY_BARRIER();
+
+    while (head != stream->tail) {
+        uint32_t waiting = head - stream->tail;
+        uint32_t tailIndex = stream->tail & (stream->bufferSize - 1);
+        // Fill up the rest of the sector at the file's cursor
+        uint32_t chunk = AFATFS_SECTOR_SIZE - stream->file->cursorOffset % AFATFS_SECTOR_SIZE;
+
+        if (waiting < chunk && !stream->closing) {
+            break;
+        }
+
+        chunk = MIN(MIN(chunk, waiting), stream->bufferSize - tailIndex);
+
+        uint32_t written = afatfs_fwrite(stream->file, stream->buffer + tailIndex, chunk);
+
+        // We must be finished with that part of the buffer before the producer can see it's free
+        AFATFS_LOG_STREAM_MEMORY_BARRIER();
+
+        stream->tail += written;
+
+        if (written < chunk) {
+            // The cache is busy or the filesystem is full, come back later
+            break;
+        }
+    }
+}
+
+static void afatfs_logStreamsDrain()
+{
+    for (afatfsLogStream_t *stream = afatfs.logStreams; stream != NULL; stream = stream->next) {
+        afatfs_logStreamDrain(stream);
+    }
+}
+
+/**
+ * Remove the stream from the list of streams that afatfs_poll() drains.
+ */
+static void afatfs_logStreamUnlink(afatfsLogStream_t *stream)
+{
+    for (afatfsLogStream_t **link = &afatfs.logStreams; *link != NULL; link = &(*link)->next) {
+        if (*link == stream) {
+            *link = stream->next;
+            break;
+        }
+    }
+}
+
+/**
+ * Stop accepting records into the stream and write everything remaining in its buffer to the file. Keep calling until it
+ * returns true, after which the stream is no longer used by the filesystem (you still need to close the file yourself).
+ *
+ * If the filesystem isn't ready (e.g. it has suffered a fatal error), whatever is left in the buffer can't be written,
+ * so it's discarded and counted in droppedBytes.
+ */
+bool afatfs_logStreamClose(afatfsLogStream_t *stream)
+{
+    stream->closing = true;
+
+    // The producer must see that we're closing before we decide whether its last record has arrived
+    AFATFS_LOG_STREAM_MEMORY_BARRIER();
+
+    if (afatfs.filesystemState == AFATFS_FILESYSTEM_STATE_READY) {
+        afatfs_logStreamDrain(stream);
+
+        if (stream->head != stream->tail) {
+            return false;
+        }
+    } else {
+        stream->droppedBytes += stream->head - stream->tail;
+        stream->tail = stream->head;
+    }
+
+    afatfs_logStreamUnlink(stream);
+
+    // A producer that saw closing == false just before we set it may have added a record since we looked at the head
+    AFATFS_LOG_STREAM_MEMORY_BARRIER();
+
+    if (stream->head != stream->tail) {
+        // Drain that record too on the next poll
+        stream->next = afatfs.logStreams;
+        afatfs.logStreams = stream;
+
+        return false;
+    }
+
+    return true;
+}
+
+#endif
+
+/**
+ * Bring the directory entry of a file using the AFATFS_DURABILITY_INTERVAL policy up to date once its interval has
+ * passed (the other policies only save the entry when a cluster is appended).
+ */
+static void afatfs_fileSaveDirectoryEntryIfDue(afatfsFilePtr_t file)
+{
+    if (
+        file->type != AFATFS_FILE_TYPE_NONE && file->durability.policy == AFATFS_DURABILITY_INTERVAL
+        && !afatfs_fileIsBusy(file) && afatfs_fileDirectoryEntryIsDue(file)
+    ) {
+        // If the cache is busy we'll try again on the next poll
+        afatfs_saveDirectoryEntry(file, AFATFS_SAVE_DIRECTORY_NORMAL);
+    }
+}
+
 /**
  * Check files for pending operations and execute them.
  */
 static void afatfs_fileOperationsPoll()
 {
+#ifdef AFATFS_USE_LOG_STREAM
+    afatfs_logStreamsDrain();
+#endif
+
     afatfs_fileOperationContinue(&afatfs.currentDirectory);
 
 #ifdef AFATFS_USE_INTROSPECTIVE_LOGGING
     afatfs_fileOperationContinue(&afatfs.introSpecLog);
 #endif
 
-    for (int i = 0; i < AFATFS_MAX_OPEN_FILES; i++) {
+    for (int i = 0; i < afatfs.maxOpenFiles; i++) {
         afatfs_fileOperationContinue(&afatfs.openFiles[i]);
+        afatfs_fileSaveDirectoryEntryIfDue(&afatfs.openFiles[i]);
+
+#ifdef AFATFS_FILE_READ_AHEAD_SECTORS
+        afatfs_fileReadAhead(&afatfs.openFiles[i]);
+#endif
+    }
+
+#if AFATFS_FAT_MIRROR_POLICY == AFATFS_FAT_MIRROR_DEFERRED
+    afatfs_fatMirrorContinue();
+#endif
+
+#ifdef AFATFS_USE_JOURNAL
+    afatfs_journalPoll();
+#endif
+
+#ifdef AFATFS_FREE_SPACE_SEARCH_WHILE_READY
+#ifdef AFATFS_FREEFILE_REGROWTH
+    afatfs_freeFileRegrowBegin();
+#endif
+
+    if (afatfs_allocateFreeFileContinue() == AFATFS_OPERATION_FAILURE) {
+        afatfs.lastError = AFATFS_ERROR_GENERIC;
+        afatfs.filesystemState = AFATFS_FILESYSTEM_STATE_FATAL;
     }
+#endif
 }
 
 #ifdef AFATFS_USE_FREEFILE
@@ -3252,10 +7563,34 @@ static void afatfs_findLargestContiguousFreeBlockBegin()
 }
 
 /**
- * Call to continue the search for the largest contiguous block of free space on the device.
+ * Call afatfs_findClusterWithCondition(), but don't let it examine more than *sectorBudget FAT sectors. The number of
+ * sectors examined is subtracted from *sectorBudget.
+ *
+ * Returns the status of the search, except that AFATFS_FIND_CLUSTER_IN_PROGRESS is returned if the search ran out of
+ * budget before reaching the searchLimit (*cluster is updated so the search can be resumed later).
+ */
+static afatfsFindClusterStatus_e afatfs_findClusterWithConditionBudgeted(afatfsClusterSearchCondition_e condition, uint32_t *cluster, uint32_t searchLimit, uint32_t *sectorBudget)
+{
+    uint32_t fatEntriesPerSector = afatfs_fatEntriesPerSector();
+    uint32_t searchStart = *cluster;
+    uint32_t budgetLimit = MIN((uint64_t) *cluster + *sectorBudget * fatEntriesPerSector, searchLimit);
+    afatfsFindClusterStatus_e status = afatfs_findClusterWithCondition(condition, cluster, budgetLimit);
+
+    *sectorBudget -= MIN((*cluster - searchStart + fatEntriesPerSector - 1) / fatEntriesPerSector, *sectorBudget);
+
+    if (status == AFATFS_FIND_CLUSTER_NOT_FOUND && budgetLimit < searchLimit) {
+        return AFATFS_FIND_CLUSTER_IN_PROGRESS;
+    }
+
+    return status;
+}
+
+/**
+ * Call to continue the search for the largest contiguous block of free space on the device. At most
+ * AFATFS_FREE_SPACE_SEARCH_SECTORS_PER_POLL FAT sectors are examined per call.
  *
  * Returns:
- *     AFATFS_OPERATION_IN_PROGRESS - SD card is busy, call again later to resume
+ *     AFATFS_OPERATION_IN_PROGRESS - SD card is busy or we've done enough work for now, call again later to resume
  *     AFATFS_OPERATION_SUCCESS - When the search has finished and afatfs.initState.freeSpaceSearch has been updated with the details of the best gap.
  *     AFATFS_OPERATION_FAILURE - When a read error occured
  */
@@ -3264,13 +7599,25 @@ static afatfsOperationStatus_e afatfs_findLargestContiguousFreeBlockContinue()
     afatfsFreeSpaceSearch_t *opState = &afatfs.initState.freeSpaceSearch;
     uint32_t fatEntriesPerSector = afatfs_fatEntriesPerSector();
     uint32_t candidateGapLength, searchLimit;
+    uint32_t sectorBudget = AFATFS_FREE_SPACE_SEARCH_SECTORS_PER_POLL;
     afatfsFindClusterStatus_e searchStatus;
 
     while (1) {
+        if (sectorBudget == 0) {
+            return AFATFS_OPERATION_IN_PROGRESS;
+        }
+
         switch (opState->phase) {
             case AFATFS_FREE_SPACE_SEARCH_PHASE_FIND_HOLE:
+#ifdef AFATFS_FAST_MOUNT
+                // No other hole can be bigger than this one if it already contains every free cluster on the volume
+                if (afatfs.fsInfo.freeClusters != FAT_FSINFO_UNKNOWN && opState->bestGapLength >= afatfs.fsInfo.freeClusters) {
+                    return AFATFS_OPERATION_SUCCESS;
+                }
+#endif
+
                 // Find the first free cluster
-                switch (afatfs_findClusterWithCondition(CLUSTER_SEARCH_FREE_AT_BEGINNING_OF_FAT_SECTOR, &opState->candidateStart, afatfs.numClusters + FAT_SMALLEST_LEGAL_CLUSTER_NUMBER)) {
+                switch (afatfs_findClusterWithConditionBudgeted(CLUSTER_SEARCH_FREE_AT_BEGINNING_OF_FAT_SECTOR, &opState->candidateStart, afatfs.numClusters + FAT_SMALLEST_LEGAL_CLUSTER_NUMBER, &sectorBudget)) {
                     case AFATFS_FIND_CLUSTER_FOUND:
                         opState->candidateEnd = opState->candidateStart + 1;
                         opState->phase = AFATFS_FREE_SPACE_SEARCH_PHASE_GROW_HOLE;
@@ -3294,7 +7641,14 @@ static afatfsOperationStatus_e afatfs_findLargestContiguousFreeBlockContinue()
                 // Don't search beyond the end of the volume, or such that the freefile size would exceed the max filesize
                 searchLimit = MIN((uint64_t) opState->candidateStart + FAT_MAXIMUM_FILESIZE / afatfs_clusterSize(), afatfs.numClusters + FAT_SMALLEST_LEGAL_CLUSTER_NUMBER);
 
-                searchStatus = afatfs_findClusterWithCondition(CLUSTER_SEARCH_OCCUPIED, &opState->candidateEnd, searchLimit);
+#ifdef AFATFS_FAST_MOUNT
+                // Nor can the hole be larger than the number of free clusters on the volume
+                if (afatfs.fsInfo.freeClusters != FAT_FSINFO_UNKNOWN) {
+                    searchLimit = MIN((uint64_t) opState->candidateStart + afatfs.fsInfo.freeClusters, searchLimit);
+                }
+#endif
+
+                searchStatus = afatfs_findClusterWithConditionBudgeted(CLUSTER_SEARCH_OCCUPIED, &opState->candidateEnd, searchLimit, &sectorBudget);
 
                 switch (searchStatus) {
                     case AFATFS_FIND_CLUSTER_NOT_FOUND:
@@ -3321,28 +7675,488 @@ static afatfsOperationStatus_e afatfs_findLargestContiguousFreeBlockContinue()
                         // Some sort of read error occured
                         return AFATFS_OPERATION_FAILURE;
 
-                    case AFATFS_FIND_CLUSTER_IN_PROGRESS:
-                        return AFATFS_OPERATION_IN_PROGRESS;
-                }
-            break;
-        }
+                    case AFATFS_FIND_CLUSTER_IN_PROGRESS:
+                        return AFATFS_OPERATION_IN_PROGRESS;
+                }
+            break;
+        }
+    }
+}
+
+#ifdef AFATFS_FREEFILE_REGROWTH
+
+/**
+ * If clusters have been freed since the freefile was allocated, and no file operations are waiting, begin a search for
+ * a larger hole for the freefile. afatfs_allocateFreeFileContinue() carries it on a few FAT sectors per poll.
+ */
+static void afatfs_freeFileRegrowBegin()
+{
+    if (!afatfs.freeFileRegrowPending || afatfs.freeFileAllocatePhase != AFATFS_FREEFILE_ALLOCATE_PHASE_NONE) {
+        return;
+    }
+
+    for (int i = 0; i < afatfs.maxOpenFiles; i++) {
+        if (afatfs_fileIsBusy(&afatfs.openFiles[i])) {
+            return;
+        }
+    }
+
+    afatfs.freeFileRegrowPending = false;
+
+    // The freefile isn't locked during the search, since its clusters are already marked as occupied in the FAT
+    afatfs_findLargestContiguousFreeBlockBegin();
+    afatfs.freeFileAllocatePhase = AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_SEARCH;
+}
+
+/**
+ * Once the search for the largest hole on the volume has finished, decide whether the freefile should grow into the
+ * hole (when the hole directly follows it) or move to it (when the hole is larger than what remains of the freefile).
+ * If so, claim the hole's clusters for the freefile right away so that searches for regular free clusters skip over
+ * them while we're writing its FAT chain.
+ *
+ * Returns true if the freefile has claimed new clusters, or false if it should stay as it is.
+ */
+static bool afatfs_freeFileRegrowClaim()
+{
+    afatfsFreeSpaceSearch_t *searchState = &afatfs.initState.freeSpaceSearch;
+    uint32_t fatEntriesPerSector = afatfs_fatEntriesPerSector();
+    uint32_t freeFileClusters = afatfs.freeFile.logicalSize / afatfs_clusterSize();
+    uint32_t freeFileEnd = afatfs.freeFile.firstCluster + freeFileClusters;
+    uint32_t holeStart = searchState->bestGapStart;
+    uint32_t holeLength = searchState->bestGapLength;
+    uint32_t newClusters;
+
+    afatfs.freeFileAllocatePhase = AFATFS_FREEFILE_ALLOCATE_PHASE_NONE;
+
+    if (holeLength <= AFATFS_FREEFILE_LEAVE_CLUSTERS + 1) {
+        return false;
+    }
+
+    if (freeFileClusters > 0 && holeStart == roundUpTo(freeFileEnd, fatEntriesPerSector)) {
+        /*
+         * Grow by whole superclusters (so the freefile's size stays one more than a multiple of the supercluster size),
+         * taking the rest of the FAT sector that holds the freefile's final cluster along with the hole.
+         */
+        newClusters = (holeStart - freeFileEnd + holeLength - AFATFS_FREEFILE_LEAVE_CLUSTERS) & ~(fatEntriesPerSector - 1);
+        newClusters = MIN(newClusters, (FAT_MAXIMUM_FILESIZE / afatfs_clusterSize() - freeFileClusters) & ~(fatEntriesPerSector - 1));
+
+        if (newClusters == 0) {
+            return false;
+        }
+
+        // Rewrite the old terminator of the freefile's chain so that it links on to the new clusters
+        afatfs.initState.freeSpaceFAT.startCluster = freeFileEnd - 1;
+        afatfs.initState.freeSpaceFAT.endCluster = freeFileEnd + newClusters;
+        afatfs.initState.freeSpaceFAT.releaseStartCluster = 0;
+        afatfs.initState.freeSpaceFAT.releaseEndCluster = 0;
+
+        afatfs.freeFileAllocatePhase = AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_CHECK_GAP;
+    } else {
+        // Size the freefile to suit the hole the same way as we did when we first allocated it
+        newClusters = ((holeLength - AFATFS_FREEFILE_LEAVE_CLUSTERS - 1) & ~(fatEntriesPerSector - 1)) + 1;
+
+        if (newClusters <= fatEntriesPerSector || newClusters <= freeFileClusters) {
+            return false;
+        }
+
+        afatfs.initState.freeSpaceFAT.startCluster = holeStart;
+        afatfs.initState.freeSpaceFAT.endCluster = holeStart + newClusters;
+        afatfs.initState.freeSpaceFAT.releaseStartCluster = afatfs.freeFile.firstCluster;
+        afatfs.initState.freeSpaceFAT.releaseEndCluster = freeFileClusters > 0 ? freeFileEnd : afatfs.freeFile.firstCluster;
+
+        // Searches for unallocated regular clusters should be told about the clusters we'll be leaving behind
+        if (freeFileClusters > 0) {
+            afatfs.lastClusterAllocated = MIN(afatfs.lastClusterAllocated, afatfs.freeFile.firstCluster);
+        }
+
+        afatfs.freeFile.firstCluster = holeStart;
+        afatfs.freeFile.logicalSize = 0;
+        afatfs.freeFile.physicalSize = 0;
+
+        afatfs.freeFileAllocatePhase = AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_UPDATE_FAT;
+    }
+
+#ifdef AFATFS_USE_FSINFO
+    // These clusters were free, but the FAT pattern fill doesn't count the ones it allocates
+    afatfs_fsInfoAdjustFreeClusters(-(int32_t) newClusters);
+#endif
+
+    afatfs.freeFile.logicalSize += newClusters * afatfs_clusterSize();
+    afatfs.freeFile.physicalSize += newClusters * afatfs_clusterSize();
+
+    return true;
+}
+
+/**
+ * Give back the clusters claimed by afatfs_freeFileRegrowClaim() to extend the freefile, before anything was written.
+ */
+static void afatfs_freeFileRegrowCancel()
+{
+    uint32_t newClusters = afatfs.initState.freeSpaceFAT.endCluster - afatfs.initState.freeSpaceFAT.startCluster - 1;
+
+#ifdef AFATFS_USE_FSINFO
+    afatfs_fsInfoAdjustFreeClusters(newClusters);
+#endif
+
+    afatfs.freeFile.logicalSize -= newClusters * afatfs_clusterSize();
+    afatfs.freeFile.physicalSize -= newClusters * afatfs_clusterSize();
+
+    afatfs.freeFileAllocatePhase = AFATFS_FREEFILE_ALLOCATE_PHASE_NONE;
+    afatfs.freeFile.operation.operation = AFATFS_FILE_OPERATION_NONE;
+}
+
+#endif
+
+/**
+ * Continue to find the largest contiguous free block on the volume, make the freefile occupy it, and save the
+ * freefile's directory entry. Begin by setting afatfs.freeFileAllocatePhase.
+ *
+ * While this is in progress the freefile is locked, so contiguous files can't be created.
+ *
+ * Returns:
+ *     AFATFS_OPERATION_IN_PROGRESS - The card is busy or we've done enough work for now, call again later to resume
+ *     AFATFS_OPERATION_SUCCESS     - The freefile has been allocated (it may be empty if there wasn't enough space)
+ *     AFATFS_OPERATION_FAILURE     - When a read error occured
+ */
+static afatfsOperationStatus_e afatfs_allocateFreeFileContinue()
+{
+    afatfsFreeSpaceSearch_t *searchState = &afatfs.initState.freeSpaceSearch;
+    afatfsOperationStatus_e status;
+#ifdef AFATFS_FREEFILE_REGROWTH
+    uint32_t gapCluster;
+#endif
+
+    doMore:
+
+    switch (afatfs.freeFileAllocatePhase) {
+        case AFATFS_FREEFILE_ALLOCATE_PHASE_FAT_SEARCH:
+            status = afatfs_findLargestContiguousFreeBlockContinue();
+
+            if (status == AFATFS_OPERATION_SUCCESS) {
+                // If the freefile ends up being empty then we only have to save its directory entry:
+                afatfs.freeFileAllocatePhase = AFATFS_FREEFILE_ALLOCATE_PHASE_SAVE_DIR_ENTRY;
+
+                if (searchState->bestGapLength > AFATFS_FREEFILE_LEAVE_CLUSTERS + 1) {
+                    searchState->bestGapLength -= AFATFS_FREEFILE_LEAVE_CLUSTERS;
+
+                    /* So that the freefile never becomes empty, we want it to occupy a non-integer number of
+                     * superclusters. So its size mod the number of clusters in a supercluster should be 1.
+                     */
+                    searchState->bestGapLength = ((searchState->bestGapLength - 1) & ~(afatfs_fatEntriesPerSector() - 1)) + 1;
+
+                    // Anything useful left over?
+                    if (searchState->bestGapLength > afatfs_fatEntriesPerSector()) {
+                        uint32_t startCluster = searchState->bestGapStart;
+                        // Points 1-beyond the final cluster of the freefile:
+                        uint32_t endCluster = searchState->bestGapStart + searchState->bestGapLength;
+
+                        afatfs_assert(endCluster < afatfs.numClusters + FAT_SMALLEST_LEGAL_CLUSTER_NUMBER);
+
+#ifdef AFATFS_USE_FSINFO
+                        // These clusters were free, but the FAT pattern fill doesn't count the ones it allocates
+                        afatfs_fsInfoAdjustFreeClusters(-(int32_t) searchState->bestGapLength);
+#endif
+
+                        /*
+                         * Claim the space for the freefile right away so that searches for regular free clusters skip
+                         * over it while we're writing its FAT chain.
+                         */
+                        afatfs.freeFile.firstCluster = startCluster;
+
+                        afatfs.freeFile.logicalSize = searchState->bestGapLength * afatfs_clusterSize();
+                        afatfs.freeFile.physicalSize = afatfs.freeFile.logicalSize;
+
+                        // This replaces the search state in the union:
+                        afatfs.initState.freeSpaceFAT.startCluster = startCluster;
+                        afatfs.initState.freeSpaceFAT.endCluster = endCluster;
+
+                        // We can write the FAT table for the freefile now
+                        afatfs.freeFileAllocatePhase = AFATFS_FREEFILE_ALLOCATE_PHASE_UPDATE_FAT;
+                    } // Else the freefile's FAT chain and filesize remains the default (empty)
+                }
+
+                goto doMore;
+            }
+        break;
+        case AFATFS_FREEFILE_ALLOCATE_PHASE_UPDATE_FAT:
+            status = afatfs_FATFillWithPattern(AFATFS_FAT_PATTERN_TERMINATED_CHAIN, &afatfs.initState.freeSpaceFAT.startCluster, afatfs.initState.freeSpaceFAT.endCluster);
+
+            if (status == AFATFS_OPERATION_SUCCESS) {
+                afatfs.freeFileAllocatePhase = AFATFS_FREEFILE_ALLOCATE_PHASE_SAVE_DIR_ENTRY;
+                goto doMore;
+            }
+        break;
+        case AFATFS_FREEFILE_ALLOCATE_PHASE_SAVE_DIR_ENTRY:
+            status = afatfs_saveDirectoryEntry(&afatfs.freeFile, AFATFS_SAVE_DIRECTORY_NORMAL);
+
+            if (status == AFATFS_OPERATION_SUCCESS) {
+                afatfs.freeFileAllocatePhase = AFATFS_FREEFILE_ALLOCATE_PHASE_NONE;
+
+                // Contiguous files can use the freefile now
+                afatfs.freeFile.operation.operation = AFATFS_FILE_OPERATION_NONE;
+            }
+        break;
+#ifdef AFATFS_FREEFILE_REGROWTH
+        case AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_SEARCH:
+            status = afatfs_findLargestContiguousFreeBlockContinue();
+
+            if (status == AFATFS_OPERATION_SUCCESS) {
+                afatfs.freeFileAllocatePhase = AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_CLAIM;
+                goto doMore;
+            }
+        break;
+        case AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_CLAIM:
+            // A contiguous file might be taking a supercluster from the freefile or handing its clusters back
+            if (afatfs_fileIsBusy(&afatfs.freeFile)) {
+                status = AFATFS_OPERATION_IN_PROGRESS;
+                break;
+            }
+
+#ifdef AFATFS_USE_JOURNAL
+            // Replaying an older record would put the freefile back where it used to be
+            if (!afatfs_journalIsEmpty()) {
+                status = AFATFS_OPERATION_IN_PROGRESS;
+                break;
+            }
+#endif
+
+            if (afatfs_freeFileRegrowClaim()) {
+                // Nobody else may use the freefile until we've finished moving it
+                afatfs.freeFile.operation.operation = AFATFS_FILE_OPERATION_LOCKED;
+                goto doMore;
+            }
+
+            // The freefile stays where it is
+            status = AFATFS_OPERATION_SUCCESS;
+        break;
+        case AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_CHECK_GAP:
+            // The clusters between the old end of the freefile and the end of its FAT sector must be free too
+            gapCluster = afatfs.initState.freeSpaceFAT.startCluster + 1;
+
+            switch (afatfs_findClusterWithCondition(CLUSTER_SEARCH_OCCUPIED, &gapCluster, roundUpTo(gapCluster, afatfs_fatEntriesPerSector()))) {
+                case AFATFS_FIND_CLUSTER_NOT_FOUND:
+                    afatfs.freeFileAllocatePhase = AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_UPDATE_FAT;
+                    goto doMore;
+                case AFATFS_FIND_CLUSTER_FOUND:
+                    // A regular file got there first, so hand back the clusters we claimed
+                    afatfs_freeFileRegrowCancel();
+                    status = AFATFS_OPERATION_SUCCESS;
+                break;
+                case AFATFS_FIND_CLUSTER_FATAL:
+                    status = AFATFS_OPERATION_FAILURE;
+                break;
+                case AFATFS_FIND_CLUSTER_IN_PROGRESS:
+                default:
+                    status = AFATFS_OPERATION_IN_PROGRESS;
+            }
+        break;
+        case AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_UPDATE_FAT:
+            status = afatfs_FATFillWithPattern(AFATFS_FAT_PATTERN_TERMINATED_CHAIN, &afatfs.initState.freeSpaceFAT.startCluster, afatfs.initState.freeSpaceFAT.endCluster);
+
+            if (status == AFATFS_OPERATION_SUCCESS) {
+                afatfs.freeFileAllocatePhase = AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_SAVE_DIR_ENTRY;
+                goto doMore;
+            }
+        break;
+        case AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_SAVE_DIR_ENTRY:
+            status = afatfs_saveDirectoryEntry(&afatfs.freeFile, AFATFS_SAVE_DIRECTORY_NORMAL);
+
+            if (status == AFATFS_OPERATION_SUCCESS) {
+                // Only now that the directory entry no longer points at the old clusters can they be freed
+                afatfs.freeFileAllocatePhase = AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_RELEASE;
+                goto doMore;
+            }
+        break;
+        case AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_RELEASE:
+            if (afatfs.initState.freeSpaceFAT.releaseStartCluster < afatfs.initState.freeSpaceFAT.releaseEndCluster) {
+                status = afatfs_FATFillWithPattern(AFATFS_FAT_PATTERN_FREE, &afatfs.initState.freeSpaceFAT.releaseStartCluster, afatfs.initState.freeSpaceFAT.releaseEndCluster);
+            } else {
+                status = AFATFS_OPERATION_SUCCESS;
+            }
+
+            if (status == AFATFS_OPERATION_SUCCESS) {
+                afatfs.freeFileAllocatePhase = AFATFS_FREEFILE_ALLOCATE_PHASE_NONE;
+
+                afatfs.freeFile.operation.operation = AFATFS_FILE_OPERATION_NONE;
+            }
+        break;
+#endif
+        case AFATFS_FREEFILE_ALLOCATE_PHASE_NONE:
+        default:
+            status = AFATFS_OPERATION_SUCCESS;
+    }
+
+    return status;
+}
+
+static void afatfs_freeFileCreated(afatfsFile_t *file)
+{
+    if (file) {
+        // Did the freefile already have allocated space?
+        if (file->logicalSize > 0) {
+            // We've completed freefile init, move on to the next init phase
+            afatfs.initPhase = AFATFS_INITIALIZATION_FREEFILE_LAST + 1;
+            return;
+        }
+#ifdef AFATFS_FAST_MOUNT
+        else if (afatfs.fsInfo.freeClusters != FAT_FSINFO_UNKNOWN
+                && afatfs.fsInfo.freeClusters <= AFATFS_FREEFILE_LEAVE_CLUSTERS + afatfs_fatEntriesPerSector()) {
+            // There isn't enough free space on the volume for the search to find a useful freefile, so leave it empty
+            afatfs.freeFileAllocatePhase = AFATFS_FREEFILE_ALLOCATE_PHASE_SAVE_DIR_ENTRY;
+        }
+#endif
+        else {
+            // Allocate clusters for the freefile
+            afatfs_findLargestContiguousFreeBlockBegin();
+            afatfs.freeFileAllocatePhase = AFATFS_FREEFILE_ALLOCATE_PHASE_FAT_SEARCH;
+        }
+
+        // Nobody else may use the freefile until we've finished allocating it
+        afatfs.freeFile.operation.operation = AFATFS_FILE_OPERATION_LOCKED;
+        afatfs.initPhase = AFATFS_INITIALIZATION_FREEFILE_ALLOCATE;
+    } else {
+        // Failed to allocate an entry
+        afatfs.lastError = AFATFS_ERROR_GENERIC;
+        afatfs.filesystemState = AFATFS_FILESYSTEM_STATE_FATAL;
+    }
+}
+
+#endif
+
+#ifdef AFATFS_USE_JOURNAL
+
+/**
+ * Make the changes to the given directory entry that the journal record describes. The entry is the freefile's if
+ * `freeFile` is true, otherwise it belongs to the file the record's operation was on.
+ */
+static afatfsOperationStatus_e afatfs_journalReplayDirectoryEntry(afatfsJournalSector_t *journal, afatfsJournalRecord_t *record, bool freeFile)
+{
+    uint32_t entrySector = freeFile ? journal->freeFileEntrySector : record->fileEntrySector;
+    uint16_t entryIndex = freeFile ? journal->freeFileEntryIndex : record->fileEntryIndex;
+    fatDirectoryEntry_t *entry;
+    uint32_t firstCluster;
+    uint8_t *sector;
+    afatfsOperationStatus_e status;
+
+    if (entrySector == 0 || entryIndex >= AFATFS_FILES_PER_DIRECTORY_SECTOR) {
+        return AFATFS_OPERATION_SUCCESS;
+    }
+
+    status = afatfs_cacheSector(entrySector, &sector, AFATFS_CACHE_READ | AFATFS_CACHE_WRITE, 0);
+
+    if (status != AFATFS_OPERATION_SUCCESS) {
+        return status;
+    }
+
+    entry = (fatDirectoryEntry_t *) sector + entryIndex;
+    firstCluster = (uint32_t) (entry->firstClusterHigh << 16) | entry->firstClusterLow;
+
+    if (freeFile) {
+        firstCluster = record->freeFileFirstCluster;
+        entry->fileSize = record->freeFileSize;
+    } else if (fat_isDirectoryEntryEmpty(entry) || fat_isDirectoryEntryTerminator(entry)) {
+        // The file has since been deleted for good (its entry could even belong to another file by now)
+    } else if (record->type == AFATFS_JOURNAL_RECORD_APPEND_SUPERCLUSTER) {
+        if ((record->flags & AFATFS_JOURNAL_FLAG_FIRST_CLUSTER) != 0 && firstCluster == 0) {
+            firstCluster = record->startCluster;
+        }
+    } else if (firstCluster == record->startCluster) {
+        firstCluster = 0;
+        entry->fileSize = 0;
+
+        if ((record->flags & AFATFS_JOURNAL_FLAG_DELETE) != 0) {
+            entry->filename[0] = FAT_DELETED_FILE_MARKER;
+        }
+    }
+
+    entry->firstClusterHigh = firstCluster >> 16;
+    entry->firstClusterLow = firstCluster & 0xFFFF;
+
+    return AFATFS_OPERATION_SUCCESS;
+}
+
+/**
+ * Replay every record in the journal that was read at mount, oldest first.
+ *
+ * Returns AFATFS_OPERATION_SUCCESS once they've all been replayed into the cache.
+ */
+static afatfsOperationStatus_e afatfs_journalReplayContinue()
+{
+    afatfsJournal_t *journal = &afatfs.journal;
+    afatfsJournalRecord_t *record;
+    afatfsOperationStatus_e status;
+
+    doMore:
+
+    if (journal->replayRecord == -1) {
+        journal->replayRecord = afatfs_journalFindRecord(journal->replayedSequence);
+
+        if (journal->replayRecord == -1) {
+            return AFATFS_OPERATION_SUCCESS;
+        }
+
+        record = &journal->buffer.contents.records[journal->replayRecord];
+
+        journal->replayPhase = AFATFS_JOURNAL_REPLAY_PHASE_FAT;
+        journal->replayCluster = record->startCluster;
+    }
+
+    record = &journal->buffer.contents.records[journal->replayRecord];
+
+    switch (journal->replayPhase) {
+        case AFATFS_JOURNAL_REPLAY_PHASE_FAT:
+            status = afatfs_FATFillWithPattern(
+                record->type == AFATFS_JOURNAL_RECORD_APPEND_SUPERCLUSTER ? AFATFS_FAT_PATTERN_TERMINATED_CHAIN : AFATFS_FAT_PATTERN_UNTERMINATED_CHAIN,
+                &journal->replayCluster, record->endCluster
+            );
+
+            if (status == AFATFS_OPERATION_SUCCESS) {
+                journal->replayPhase = AFATFS_JOURNAL_REPLAY_PHASE_LINK_PREVIOUS;
+                goto doMore;
+            }
+        break;
+        case AFATFS_JOURNAL_REPLAY_PHASE_LINK_PREVIOUS:
+            if (record->linkCluster) {
+                status = afatfs_FATSetNextCluster(record->linkCluster, record->endCluster - afatfs_fatEntriesPerSector());
+            } else {
+                status = AFATFS_OPERATION_SUCCESS;
+            }
+
+            if (status == AFATFS_OPERATION_SUCCESS) {
+                journal->replayPhase = AFATFS_JOURNAL_REPLAY_PHASE_FREEFILE_DIRECTORY;
+                goto doMore;
+            }
+        break;
+        case AFATFS_JOURNAL_REPLAY_PHASE_FREEFILE_DIRECTORY:
+            status = afatfs_journalReplayDirectoryEntry(&journal->buffer.contents, record, true);
+
+            if (status == AFATFS_OPERATION_SUCCESS) {
+                journal->replayPhase = AFATFS_JOURNAL_REPLAY_PHASE_FILE_DIRECTORY;
+                goto doMore;
+            }
+        break;
+        case AFATFS_JOURNAL_REPLAY_PHASE_FILE_DIRECTORY:
+            status = afatfs_journalReplayDirectoryEntry(&journal->buffer.contents, record, false);
+
+            if (status == AFATFS_OPERATION_SUCCESS) {
+                journal->replayedSequence = record->sequence;
+                journal->replayRecord = -1;
+                goto doMore;
+            }
+        break;
+        default:
+            status = AFATFS_OPERATION_FAILURE;
     }
+
+    return status;
 }
 
-static void afatfs_freeFileCreated(afatfsFile_t *file)
+static void afatfs_journalFileCreated(afatfsFile_t *file)
 {
     if (file) {
-        // Did the freefile already have allocated space?
-        if (file->logicalSize > 0) {
-            // We've completed freefile init, move on to the next init phase
-            afatfs.initPhase = AFATFS_INITIALIZATION_FREEFILE_LAST + 1;
-        } else {
-            // Allocate clusters for the freefile
-            afatfs_findLargestContiguousFreeBlockBegin();
-            afatfs.initPhase = AFATFS_INITIALIZATION_FREEFILE_FAT_SEARCH;
-        }
+        // A new journal needs a cluster to live in first
+        afatfs.initPhase = file->firstCluster == 0 ? AFATFS_INITIALIZATION_JOURNAL_ALLOCATE : AFATFS_INITIALIZATION_JOURNAL_READ;
     } else {
-        // Failed to allocate an entry
         afatfs.lastError = AFATFS_ERROR_GENERIC;
         afatfs.filesystemState = AFATFS_FILESYSTEM_STATE_FATAL;
     }
@@ -3366,7 +8180,7 @@ static void afatfs_introspecLogCreated(afatfsFile_t *file)
 
 static void afatfs_initContinue()
 {
-#ifdef AFATFS_USE_FREEFILE
+#if (defined(AFATFS_USE_FREEFILE) && !defined(AFATFS_BACKGROUND_FREEFILE_SEARCH)) || defined(AFATFS_USE_JOURNAL)
     afatfsOperationStatus_e status;
 #endif
 
@@ -3392,6 +8206,12 @@ static void afatfs_initContinue()
                     // Open the root directory
                     afatfs_chdir(NULL);
 
+                    if (afatfs.readOnly) {
+                        // The rest of the phases only prepare for writing (or write to the volume themselves)
+                        afatfs.initPhase = AFATFS_INITIALIZATION_DONE;
+                        goto doMore;
+                    }
+
                     afatfs.initPhase++;
                 } else {
                     afatfs.lastError = AFATFS_ERROR_BAD_FILESYSTEM_HEADER;
@@ -3400,67 +8220,166 @@ static void afatfs_initContinue()
             }
         break;
 
-#ifdef AFATFS_USE_FREEFILE
-        case AFATFS_INITIALIZATION_FREEFILE_CREATE:
-            afatfs.initPhase = AFATFS_INITIALIZATION_FREEFILE_CREATING;
+#ifdef AFATFS_USE_FSINFO
+        case AFATFS_INITIALIZATION_READ_FSINFO:
+            if (afatfs.fsInfo.sector == 0) {
+                // FAT16 volumes don't have an FSInfo sector
+                afatfs.initPhase++;
+                goto doMore;
+            }
 
-            afatfs_createFile(&afatfs.freeFile, AFATFS_FREESPACE_FILENAME, FAT_FILE_ATTRIBUTE_SYSTEM | FAT_FILE_ATTRIBUTE_READ_ONLY,
-                AFATFS_FILE_MODE_CREATE | AFATFS_FILE_MODE_RETAIN_DIRECTORY, afatfs_freeFileCreated);
+            if (afatfs_cacheSector(afatfs.fsInfo.sector, &sector, AFATFS_CACHE_READ | AFATFS_CACHE_DISCARDABLE, 0) == AFATFS_OPERATION_SUCCESS) {
+                afatfs_parseFSInfo(sector);
+
+                afatfs.initPhase++;
+                goto doMore;
+            }
         break;
-        case AFATFS_INITIALIZATION_FREEFILE_CREATING:
-            afatfs_fileOperationContinue(&afatfs.freeFile);
+#endif
+
+#ifdef AFATFS_USE_JOURNAL
+        case AFATFS_INITIALIZATION_JOURNAL_CREATE:
+            afatfs.initPhase = AFATFS_INITIALIZATION_JOURNAL_CREATING;
+
+            afatfs_createFile(&afatfs.journal.file, AFATFS_JOURNAL_FILENAME, FAT_FILE_ATTRIBUTE_SYSTEM | FAT_FILE_ATTRIBUTE_HIDDEN | FAT_FILE_ATTRIBUTE_READ_ONLY,
+                AFATFS_FILE_MODE_CREATE, afatfs_journalFileCreated);
         break;
-        case AFATFS_INITIALIZATION_FREEFILE_FAT_SEARCH:
-            if (afatfs_findLargestContiguousFreeBlockContinue() == AFATFS_OPERATION_SUCCESS) {
-                // If the freefile ends up being empty then we only have to save its directory entry:
-                afatfs.initPhase = AFATFS_INITIALIZATION_FREEFILE_SAVE_DIR_ENTRY;
+        case AFATFS_INITIALIZATION_JOURNAL_CREATING:
+            afatfs_fileOperationContinue(&afatfs.journal.file);
+        break;
+        case AFATFS_INITIALIZATION_JOURNAL_ALLOCATE:
+            if (afatfs_fileIsBusy(&afatfs.journal.file)) {
+                afatfs_fileOperationContinue(&afatfs.journal.file);
+                break;
+            }
 
-                if (afatfs.initState.freeSpaceSearch.bestGapLength > AFATFS_FREEFILE_LEAVE_CLUSTERS + 1) {
-                    afatfs.initState.freeSpaceSearch.bestGapLength -= AFATFS_FREEFILE_LEAVE_CLUSTERS;
+            if (afatfs.journal.file.firstCluster == 0) {
+                if (afatfs_appendRegularFreeCluster(&afatfs.journal.file) == AFATFS_OPERATION_FAILURE) {
+                    // The volume is full, so carry on without a journal
+                    afatfs.journal.sector = 0;
+                    afatfs.initPhase = AFATFS_INITIALIZATION_JOURNAL_CLEAR + 1;
+                    goto doMore;
+                }
+                break;
+            }
 
-                    /* So that the freefile never becomes empty, we want it to occupy a non-integer number of
-                     * superclusters. So its size mod the number of clusters in a supercluster should be 1.
-                     */
-                    afatfs.initState.freeSpaceSearch.bestGapLength = ((afatfs.initState.freeSpaceSearch.bestGapLength - 1) & ~(afatfs_fatEntriesPerSector() - 1)) + 1;
+            // The file's size must cover its cluster, or a disk checker would free the cluster and lose the journal
+            afatfs.journal.file.logicalSize = afatfs_clusterSize();
+            afatfs.journal.file.physicalSize = afatfs_clusterSize();
 
-                    // Anything useful left over?
-                    if (afatfs.initState.freeSpaceSearch.bestGapLength > afatfs_fatEntriesPerSector()) {
-                        uint32_t startCluster = afatfs.initState.freeSpaceSearch.bestGapStart;
-                        // Points 1-beyond the final cluster of the freefile:
-                        uint32_t endCluster = afatfs.initState.freeSpaceSearch.bestGapStart + afatfs.initState.freeSpaceSearch.bestGapLength;
+            if (afatfs_saveDirectoryEntry(&afatfs.journal.file, AFATFS_SAVE_DIRECTORY_FOR_CLOSE) == AFATFS_OPERATION_SUCCESS) {
+                afatfs.journal.sector = afatfs_fileClusterToPhysical(afatfs.journal.file.firstCluster, 0);
 
-                        afatfs_assert(endCluster < afatfs.numClusters + FAT_SMALLEST_LEGAL_CLUSTER_NUMBER);
+                memset(&afatfs.journal.buffer, 0, sizeof(afatfs.journal.buffer));
+                afatfs.journal.dirty = true;
+                afatfs.journal.nextSequence = 1;
+                afatfs.journal.sequenceOnCard = 1;
 
-                        afatfs.initState.freeSpaceFAT.startCluster = startCluster;
-                        afatfs.initState.freeSpaceFAT.endCluster = endCluster;
+                afatfs.initPhase = AFATFS_INITIALIZATION_JOURNAL_CLEAR;
+                goto doMore;
+            }
+        break;
+        case AFATFS_INITIALIZATION_JOURNAL_READ:
+            if (afatfs.journal.file.logicalSize == 0) {
+                // An empty file owning a cluster would be truncated by a disk checker, so give it the size it should have
+                afatfs.journal.file.logicalSize = afatfs_clusterSize();
+                afatfs.journal.file.physicalSize = afatfs_clusterSize();
+
+                if (afatfs_saveDirectoryEntry(&afatfs.journal.file, AFATFS_SAVE_DIRECTORY_FOR_CLOSE) != AFATFS_OPERATION_SUCCESS) {
+                    afatfs.journal.file.logicalSize = 0;
+                    break;
+                }
+            }
 
-                        afatfs.freeFile.firstCluster = startCluster;
+            afatfs.journal.sector = afatfs_fileClusterToPhysical(afatfs.journal.file.firstCluster, 0);
 
-                        afatfs.freeFile.logicalSize = afatfs.initState.freeSpaceSearch.bestGapLength * afatfs_clusterSize();
-                        afatfs.freeFile.physicalSize = afatfs.freeFile.logicalSize;
+            if (afatfs_cacheSector(afatfs.journal.sector, &sector, AFATFS_CACHE_READ | AFATFS_CACHE_DISCARDABLE, 0) == AFATFS_OPERATION_SUCCESS) {
+                memcpy(afatfs.journal.buffer.bytes, sector, AFATFS_SECTOR_SIZE);
 
-                        // We can write the FAT table for the freefile now
-                        afatfs.initPhase = AFATFS_INITIALIZATION_FREEFILE_UPDATE_FAT;
-                    } // Else the freefile's FAT chain and filesize remains the default (empty)
+                afatfs.journal.nextSequence = 1;
+
+                if (
+                    afatfs.journal.buffer.contents.magic != AFATFS_JOURNAL_MAGIC
+                    || afatfs.journal.buffer.contents.checksum != afatfs_journalChecksum(&afatfs.journal.buffer.contents)
+                ) {
+                    // The write of the journal was torn by a power cut, and so none of the records in it took effect
+                    memset(&afatfs.journal.buffer, 0, sizeof(afatfs.journal.buffer));
+                    afatfs.journal.sequenceOnCard = afatfs.journal.nextSequence;
+                    afatfs.journal.dirty = true;
+
+                    afatfs.initPhase = AFATFS_INITIALIZATION_JOURNAL_CLEAR;
+                    goto doMore;
+                }
+
+                for (int i = 0; i < (int) AFATFS_JOURNAL_RECORDS; i++) {
+                    afatfs.journal.nextSequence = MAX(afatfs.journal.nextSequence, afatfs.journal.buffer.contents.records[i].sequence + 1);
                 }
 
+                afatfs.journal.sequenceOnCard = afatfs.journal.nextSequence;
+
+                if (afatfs_journalFindRecord(0) == -1) {
+                    // The volume was unmounted cleanly
+                    afatfs.initPhase = AFATFS_INITIALIZATION_JOURNAL_CLEAR + 1;
+                } else {
+                    afatfs.journal.replayRecord = -1;
+                    afatfs.journal.replayedSequence = 0;
+
+#ifdef AFATFS_USE_FSINFO
+                    // We can't tell which of the clusters the replay chains were already counted as allocated
+                    afatfs.fsInfo.freeClusters = FAT_FSINFO_UNKNOWN;
+#endif
+
+                    afatfs.initPhase = AFATFS_INITIALIZATION_JOURNAL_REPLAY;
+                }
                 goto doMore;
             }
         break;
-        case AFATFS_INITIALIZATION_FREEFILE_UPDATE_FAT:
-            status = afatfs_FATFillWithPattern(AFATFS_FAT_PATTERN_TERMINATED_CHAIN, &afatfs.initState.freeSpaceFAT.startCluster, afatfs.initState.freeSpaceFAT.endCluster);
+        case AFATFS_INITIALIZATION_JOURNAL_REPLAY:
+            status = afatfs_journalReplayContinue();
 
             if (status == AFATFS_OPERATION_SUCCESS) {
-                afatfs.initPhase = AFATFS_INITIALIZATION_FREEFILE_SAVE_DIR_ENTRY;
+                memset(afatfs.journal.buffer.contents.records, 0, sizeof(afatfs.journal.buffer.contents.records));
+                afatfs.journal.dirty = true;
 
+                afatfs.initPhase = AFATFS_INITIALIZATION_JOURNAL_CLEAR;
                 goto doMore;
             } else if (status == AFATFS_OPERATION_FAILURE) {
                 afatfs.lastError = AFATFS_ERROR_GENERIC;
                 afatfs.filesystemState = AFATFS_FILESYSTEM_STATE_FATAL;
             }
         break;
-        case AFATFS_INITIALIZATION_FREEFILE_SAVE_DIR_ENTRY:
-            status = afatfs_saveDirectoryEntry(&afatfs.freeFile, AFATFS_SAVE_DIRECTORY_NORMAL);
+        case AFATFS_INITIALIZATION_JOURNAL_CLEAR:
+            // The records may only be dropped once the changes they replayed have reached the card
+            if (afatfs.cacheDirtyEntries > 0 || afatfs.cacheFlushesInProgress > 0) {
+                break;
+            }
+
+            afatfs_journalWrite();
+
+            if (!afatfs.journal.dirty && !afatfs.journal.writeInFlight) {
+                afatfs.initPhase++;
+                goto doMore;
+            }
+        break;
+#endif
+
+#ifdef AFATFS_USE_FREEFILE
+        case AFATFS_INITIALIZATION_FREEFILE_CREATE:
+            afatfs.initPhase = AFATFS_INITIALIZATION_FREEFILE_CREATING;
+
+            afatfs_createFile(&afatfs.freeFile, AFATFS_FREESPACE_FILENAME, FAT_FILE_ATTRIBUTE_SYSTEM | FAT_FILE_ATTRIBUTE_READ_ONLY,
+                AFATFS_FILE_MODE_CREATE | AFATFS_FILE_MODE_RETAIN_DIRECTORY, afatfs_freeFileCreated);
+        break;
+        case AFATFS_INITIALIZATION_FREEFILE_CREATING:
+            afatfs_fileOperationContinue(&afatfs.freeFile);
+        break;
+        case AFATFS_INITIALIZATION_FREEFILE_ALLOCATE:
+#ifdef AFATFS_BACKGROUND_FREEFILE_SEARCH
+            // Become ready now and leave afatfs_fileOperationsPoll() to finish allocating the freefile
+            afatfs.initPhase++;
+            goto doMore;
+#else
+            status = afatfs_allocateFreeFileContinue();
 
             if (status == AFATFS_OPERATION_SUCCESS) {
                 afatfs.initPhase++;
@@ -3471,6 +8390,7 @@ static void afatfs_initContinue()
             }
         break;
 #endif
+#endif
 
 #ifdef AFATFS_USE_INTROSPECTIVE_LOGGING
         case AFATFS_INITIALIZATION_INTROSPEC_LOG_CREATE:
@@ -3498,7 +8418,10 @@ void afatfs_poll()
 {
     // Only attempt to continue FS operations if the card is present & ready, otherwise we would just be wasting time
     if (sdcard_poll()) {
-        afatfs_flush();
+        // A read-only mount never has anything to flush
+        if (!afatfs.readOnly) {
+            afatfs_flush();
+        }
 
         switch (afatfs.filesystemState) {
             case AFATFS_FILESYSTEM_STATE_INITIALIZATION:
@@ -3513,10 +8436,48 @@ void afatfs_poll()
     }
 }
 
-#ifdef AFATFS_USE_INTROSPECTIVE_LOGGING
+/**
+ * Give the filesystem a clock which counts milliseconds (wrapping around is fine), for files opened with the
+ * AFATFS_DURABILITY_INTERVAL policy. Call this after afatfs_init(), since afatfs_destroy() forgets the clock.
+ */
+void afatfs_setMillisCallback(afatfsMillisCallback_t millis)
+{
+    afatfs.millis = millis;
+}
+
+/**
+ * Like afatfs_poll(), but access at most maxSectors sectors in the cache before returning, so that the time spent in
+ * this call is bounded. Any operation that runs out of budget carries on from where it left off on the next poll.
+ *
+ * The budget also applies to any filesystem calls made by callbacks that are triggered by this poll. A budget of zero
+ * is treated as one so that the filesystem can always make progress.
+ */
+void afatfs_pollBudget(uint32_t maxSectors)
+{
+    afatfs.pollBudgeted = true;
+    afatfs.pollSectorsRemaining = MAX(maxSectors, 1);
+
+    afatfs_poll();
+
+    afatfs.pollBudgeted = false;
+}
+
+#if defined(AFATFS_USE_STATS) || defined(AFATFS_USE_INTROSPECTIVE_LOGGING)
 
+/**
+ * Record the duration of a card operation. With AFATFS_USE_INTROSPECTIVE_LOGGING, this is registered with
+ * sdcard_setProfilerCallback() by afatfs_init() and logs every operation to the introspective log. Otherwise, to fill in
+ * the latency histograms of afatfs_getStats(), register it yourself or call it from your own profiler callback.
+ */
 void afatfs_sdcardProfilerCallback(sdcardBlockOperation_e operation, uint32_t blockIndex, uint32_t duration)
 {
+#ifdef AFATFS_USE_STATS
+    if ((int) operation < AFATFS_STATS_CARD_OPERATIONS) {
+        afatfs_statsHistogramAdd(afatfs.stats.cardLatency[operation], duration);
+    }
+#endif
+
+#ifdef AFATFS_USE_INTROSPECTIVE_LOGGING
     // Make sure the log file has actually been opened before we try to log to it:
     if (afatfs.introSpecLog.type == AFATFS_FILE_TYPE_NONE) {
         return;
@@ -3553,6 +8514,9 @@ void afatfs_sdcardProfilerCallback(sdcardBlockOperation_e operation, uint32_t bl
 
     // Ignore write failures
     afatfs_fwrite(&afatfs.introSpecLog, buffer, LOG_ENTRY_SIZE);
+#else
+    (void) blockIndex;
+#endif
 }
 
 #endif
@@ -3567,17 +8531,109 @@ afatfsError_e afatfs_getLastError()
     return afatfs.lastError;
 }
 
-void afatfs_init()
+/**
+ * The number of bytes of memory that a configuration with the given cache and open files table sizes requires for its
+ * arena (see afatfs_initWithConfig()).
+ */
+uint32_t afatfs_getArenaSize(uint16_t cacheSectors, uint8_t maxOpenFiles)
+{
+    return AFATFS_ARENA_SIZE(cacheSectors, maxOpenFiles);
+}
+
+/**
+ * Begin mounting the filesystem with the given config (see afatfs_initWithConfig()), which must have a cache of at
+ * least `minCacheSectors` sectors.
+ */
+static void afatfs_initArena(const afatfsConfig_t *config, uint32_t minCacheSectors)
 {
+    if (
+        config->arena == NULL || ((uintptr_t) config->arena & 7) != 0
+        || config->cacheSectors < minCacheSectors || config->cacheSectors > AFATFS_MAX_CACHE_SECTORS
+        || config->maxOpenFiles == 0
+        || config->arenaSize < afatfs_getArenaSize(config->cacheSectors, config->maxOpenFiles)
+    ) {
+        // Leave an empty cache behind so that afatfs_poll() and afatfs_destroy() have nothing to do
+        afatfs.numCacheSectors = 0;
+        afatfs.maxOpenFiles = 0;
+        afatfs_cacheInit();
+
+        afatfs.lastError = AFATFS_ERROR_BAD_CONFIG;
+        afatfs.filesystemState = AFATFS_FILESYSTEM_STATE_FATAL;
+        return;
+    }
+
+    afatfs.cache = config->arena;
+    afatfs.numCacheSectors = config->cacheSectors;
+    afatfs.cacheDescriptor = (afatfsCacheBlockDescriptor_t *) (config->arena + AFATFS_ARENA_CACHE_SIZE(config->cacheSectors));
+    afatfs.openFiles = (afatfsFile_t *) ((uint8_t *) afatfs.cacheDescriptor + AFATFS_ARENA_DESCRIPTORS_SIZE(config->cacheSectors));
+    afatfs.maxOpenFiles = config->maxOpenFiles;
+
+    // The arena may hold leftovers from a previous mount (or be uninitialised), so make sure no files appear to be open
+    memset(afatfs.cacheDescriptor, 0, AFATFS_ARENA_DESCRIPTORS_SIZE(config->cacheSectors) + AFATFS_ARENA_FILES_SIZE(config->maxOpenFiles));
+
     afatfs.filesystemState = AFATFS_FILESYSTEM_STATE_INITIALIZATION;
     afatfs.initPhase = AFATFS_INITIALIZATION_READ_MBR;
     afatfs.lastClusterAllocated = FAT_SMALLEST_LEGAL_CLUSTER_NUMBER;
 
+    afatfs_cacheInit();
+
+#if AFATFS_FAT_MIRROR_POLICY == AFATFS_FAT_MIRROR_DEFERRED
+    afatfs.fatMirror.sourceCacheIndex = -1;
+#endif
+
+#ifdef AFATFS_USE_FSINFO
+    afatfs.fsInfo.freeClusters = FAT_FSINFO_UNKNOWN;
+#endif
+
 #ifdef AFATFS_USE_INTROSPECTIVE_LOGGING
     sdcard_setProfilerCallback(afatfs_sdcardProfilerCallback);
 #endif
 }
 
+/**
+ * Begin mounting the filesystem using a sector cache and open files table of the sizes given by the config, which are
+ * placed in the caller's arena. The arena must be at least afatfs_getArenaSize() bytes long and aligned to 8 bytes, and
+ * must not be used for anything else until afatfs_destroy() has completed. The sector cache is placed at the very start
+ * of the arena, so choose its alignment and memory region to suit the SD card driver (e.g. for DMA).
+ *
+ * If the config is unusable, the filesystem enters the fatal state with the error AFATFS_ERROR_BAD_CONFIG.
+ */
+void afatfs_initWithConfig(const afatfsConfig_t *config)
+{
+    afatfs_initArena(config, AFATFS_MIN_CACHE_SECTORS(config->maxOpenFiles));
+}
+
+/**
+ * Begin mounting the filesystem using the cache and open files table sizes configured at the top of this file.
+ */
+void afatfs_init()
+{
+    afatfsConfig_t config = {
+        .arena = (uint8_t *) afatfsDefaultArena,
+        .arenaSize = sizeof(afatfsDefaultArena),
+        .cacheSectors = AFATFS_NUM_CACHE_SECTORS,
+        .maxOpenFiles = AFATFS_MAX_OPEN_FILES
+    };
+
+    // Any cache size that this file is configured with is allowed, as it always has been
+    afatfs_initArena(&config, 1);
+}
+
+/**
+ * Begin mounting the filesystem like afatfs_init(), but only for reading files. Only the MBR and volume ID are read, so
+ * the filesystem becomes ready without searching for or creating the freefile, and nothing is ever written to the card.
+ *
+ * Files may only be opened in the "r" mode, and creating files or directories and truncating or deleting files fails.
+ * Read-ahead may evict any other clean sector from the cache and reads further ahead, since no cache entries are needed
+ * for writes.
+ */
+void afatfs_initReadOnly()
+{
+    afatfs_init();
+
+    afatfs.readOnly = true;
+}
+
 /**
  * Shut down the filesystem, flushing all data to the disk. Keep calling until it returns true.
  *
@@ -3589,7 +8645,27 @@ bool afatfs_destroy(bool dirty)
     if (!dirty && afatfs.filesystemState == AFATFS_FILESYSTEM_STATE_READY) {
         int openFileCount = 0;
 
-        for (int i = 0; i < AFATFS_MAX_OPEN_FILES; i++) {
+#ifdef AFATFS_FREE_SPACE_SEARCH_WHILE_READY
+        if (afatfs.freeFileAllocatePhase == AFATFS_FREEFILE_ALLOCATE_PHASE_FAT_SEARCH) {
+            // Abandon the search, the freefile will be left empty and we'll search again on the next mount
+            afatfs.freeFileAllocatePhase = AFATFS_FREEFILE_ALLOCATE_PHASE_NONE;
+            afatfs.freeFile.operation.operation = AFATFS_FILE_OPERATION_NONE;
+        }
+#ifdef AFATFS_FREEFILE_REGROWTH
+        else if (afatfs.freeFileAllocatePhase == AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_SEARCH
+                || afatfs.freeFileAllocatePhase == AFATFS_FREEFILE_ALLOCATE_PHASE_REGROW_CLAIM) {
+            // Nothing has been claimed yet, so the freefile can simply stay where it is
+            afatfs.freeFileAllocatePhase = AFATFS_FREEFILE_ALLOCATE_PHASE_NONE;
+        }
+#endif
+        else if (afatfs.freeFileAllocatePhase != AFATFS_FREEFILE_ALLOCATE_PHASE_NONE) {
+            // We've already claimed its space, so we have to finish allocating the freefile before we close it
+            afatfs_poll();
+            return false;
+        }
+#endif
+
+        for (int i = 0; i < afatfs.maxOpenFiles; i++) {
             if (afatfs.openFiles[i].type != AFATFS_FILE_TYPE_NONE) {
                 afatfs_fclose(&afatfs.openFiles[i], NULL);
                 // The close operation might not finish right away, so count this file as still open for now
@@ -3622,7 +8698,7 @@ bool afatfs_destroy(bool dirty)
             return false;
         }
 
-        if (afatfs.cacheFlushInProgress) {
+        if (afatfs.cacheFlushesInProgress > 0) {
             return false;
         }
 
@@ -3630,11 +8706,36 @@ bool afatfs_destroy(bool dirty)
             return false;
         }
 
+#ifdef AFATFS_USE_JOURNAL
+        // Wait for the journal's last records to be dropped, so that the next mount has nothing to replay
+        if (!afatfs_journalIsEmpty() || afatfs.journal.dirty) {
+            return false;
+        }
+#endif
+
+#if AFATFS_FAT_MIRROR_POLICY == AFATFS_FAT_MIRROR_DEFERRED
+        // Bring the second FAT up to date before we shut down (the copied sectors will be flushed on later calls)
+        if (afatfs_fatMirrorIsPending()) {
+            afatfs.fatMirror.syncRequested = true;
+            return false;
+        }
+#endif
+
+#ifdef AFATFS_USE_FSINFO
+        // Now that the FAT is final, write the correct free cluster count (to be flushed on a later call)
+        if (afatfs.fsInfo.volumeDirty) {
+            if (afatfs_saveFSInfo(true) == AFATFS_OPERATION_SUCCESS) {
+                afatfs.fsInfo.volumeDirty = false;
+            }
+            return false;
+        }
+#endif
+
 #ifdef AFATFS_DEBUG
         /* All sector locks should have been released by closing the files, so the subsequent flush should have written
          * all dirty pages to disk. If not, something's wrong:
          */
-        for (int i = 0; i < AFATFS_NUM_CACHE_SECTORS; i++) {
+        for (int i = 0; i < afatfs.numCacheSectors; i++) {
             afatfs_assert(afatfs.cacheDescriptor[i].state != AFATFS_CACHE_STATE_DIRTY);
         }
 #endif
@@ -3648,14 +8749,127 @@ bool afatfs_destroy(bool dirty)
 
 /**
  * Get a pessimistic estimate of the amount of buffer space that we have available to write to immediately.
+ *
+ * When AFATFS_USE_CACHE_CLASSES is defined, the entries that are held for the reserves of the other classes (see
+ * afatfs_setCacheReserve()) aren't counted, since file data can't be written to them.
  */
 uint32_t afatfs_getFreeBufferSpace()
 {
-    uint32_t result = 0;
-    for (int i = 0; i < AFATFS_NUM_CACHE_SECTORS; i++) {
-        if (!afatfs.cacheDescriptor[i].locked && (afatfs.cacheDescriptor[i].state == AFATFS_CACHE_STATE_EMPTY || afatfs.cacheDescriptor[i].state == AFATFS_CACHE_STATE_IN_SYNC)) {
-            result += AFATFS_SECTOR_SIZE;
+#ifdef AFATFS_USE_CACHE_CLASSES
+    uint16_t listedSectors[AFATFS_CACHE_CLASS_COUNT] = {0};
+    int freeSectors = afatfs.cacheLists[AFATFS_CACHE_LIST_EMPTY].count;
+
+    for (int i = 0; i < afatfs.numCacheSectors; i++) {
+        afatfsCacheBlockDescriptor_t *descriptor = &afatfs.cacheDescriptor[i];
+
+        if (descriptor->list == AFATFS_CACHE_LIST_DISCARDABLE || descriptor->list == AFATFS_CACHE_LIST_CLEAN) {
+            listedSectors[descriptor->cacheClass]++;
         }
     }
-    return result;
+
+    for (int i = 0; i < AFATFS_CACHE_CLASS_COUNT; i++) {
+        if (i == AFATFS_CACHE_CLASS_FILE_DATA) {
+            freeSectors += listedSectors[i];
+        } else if (afatfs.cacheClassSectors[i] < afatfs.cacheClassReserve[i]) {
+            // The class can't be evicted from at all, and empty entries are held back for the rest of its reserve
+            freeSectors -= afatfs.cacheClassReserve[i] - afatfs.cacheClassSectors[i];
+        } else {
+            // Only the sectors the class holds beyond its reserve can be evicted
+            freeSectors += MIN(listedSectors[i], afatfs.cacheClassSectors[i] - afatfs.cacheClassReserve[i]);
+        }
+    }
+
+    return MAX(freeSectors, 0) * AFATFS_SECTOR_SIZE;
+#else
+    return (afatfs.cacheLists[AFATFS_CACHE_LIST_EMPTY].count + afatfs.cacheLists[AFATFS_CACHE_LIST_DISCARDABLE].count
+        + afatfs.cacheLists[AFATFS_CACHE_LIST_CLEAN].count) * AFATFS_SECTOR_SIZE;
+#endif
+}
+
+#ifdef AFATFS_USE_CACHE_CLASSES
+
+/**
+ * Reserve `sectors` entries of the cache for sectors of the given class. Sectors of other classes won't take those
+ * entries while they're empty, or evict the class's sectors while it holds no more than that many, so (for example)
+ * reserving some for AFATFS_CACHE_CLASS_FAT and AFATFS_CACHE_CLASS_DIRECTORY stops a large file transfer from evicting
+ * the filesystem metadata that the other open files need. A class may still use more entries than its reserve when they
+ * are free. Sectors that are locked or retained in the cache (such as the freefile's directory entry) don't count
+ * towards the reserve.
+ *
+ * Every open file may need two entries of the cache for itself, so the reserves of all the classes may only add up to
+ * the number of cache sectors minus twice the number of open files, so they can only be set once the filesystem has been
+ * initialised. The reserves take effect immediately, and are reset to zero by afatfs_destroy().
+ *
+ * Returns false if the reserve would be too large.
+ */
+bool afatfs_setCacheReserve(afatfsCacheClass_e cacheClass, uint16_t sectors)
+{
+    int totalReserved = sectors;
+
+    if (cacheClass >= AFATFS_CACHE_CLASS_COUNT) {
+        return false;
+    }
+
+    for (int i = 0; i < AFATFS_CACHE_CLASS_COUNT; i++) {
+        if (i != (int) cacheClass) {
+            totalReserved += afatfs.cacheClassReserve[i];
+        }
+    }
+
+    if (totalReserved > afatfs.numCacheSectors - 2 * afatfs.maxOpenFiles) {
+        return false;
+    }
+
+    afatfs.cacheClassReserve[cacheClass] = sectors;
+
+    return true;
+}
+
+/**
+ * Get the hit, miss and eviction counts of the given class of cache sectors since the filesystem was initialised, and
+ * the number of sectors of the class that are currently cached.
+ */
+void afatfs_getCacheClassStats(afatfsCacheClass_e cacheClass, afatfsCacheClassStats_t *stats)
+{
+    *stats = afatfs.cacheClassStats[cacheClass];
+    stats->sectors = 0;
+
+    for (int i = 0; i < afatfs.numCacheSectors; i++) {
+        if (afatfs.cacheDescriptor[i].state != AFATFS_CACHE_STATE_EMPTY && afatfs.cacheDescriptor[i].cacheClass == cacheClass) {
+            stats->sectors++;
+        }
+    }
+}
+
+#endif
+
+#ifdef AFATFS_USE_STATS
+
+/**
+ * Get the counters of what the filesystem has been doing since it was initialised or since afatfs_resetStats(). This
+ * is cheap enough to call for live telemetry.
+ */
+void afatfs_getStats(afatfsStats_t *stats)
+{
+    *stats = afatfs.stats;
+
+#ifdef AFATFS_USE_CACHE_CLASSES
+    for (int i = 0; i < AFATFS_CACHE_CLASS_COUNT; i++) {
+        afatfs_getCacheClassStats(i, &stats->cacheClasses[i]);
+    }
+#endif
+}
+
+/**
+ * Restart all the counters of afatfs_getStats() (and afatfs_getCacheClassStats()) from zero.
+ */
+void afatfs_resetStats()
+{
+    memset(&afatfs.stats, 0, sizeof(afatfs.stats));
+
+#ifdef AFATFS_USE_CACHE_CLASSES
+    memset(afatfs.cacheClassStats, 0, sizeof(afatfs.cacheClassStats));
+#endif
 }
+
+#endif
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 
 #include "fat_standard.h"
+#include "sdcard.h"
 
 typedef struct afatfsFile_t *afatfsFilePtr_t;
 
@@ -24,7 +25,8 @@ typedef enum {
     AFATFS_ERROR_NONE = 0,
     AFATFS_ERROR_GENERIC = 1,
     AFATFS_ERROR_BAD_MBR = 2,
-    AFATFS_ERROR_BAD_FILESYSTEM_HEADER = 3
+    AFATFS_ERROR_BAD_FILESYSTEM_HEADER = 3,
+    AFATFS_ERROR_BAD_CONFIG = 4
 } afatfsError_e;
 
 typedef struct afatfsDirEntryPointer_t {
@@ -40,10 +42,131 @@ typedef enum {
     AFATFS_SEEK_END,
 } afatfsSeek_e;
 
+/*
+ * When the directory entry of a file that is being extended is brought up to date with the clusters that have been
+ * added to it, see afatfs_fopenWithDurability(). The entry is always brought up to date by afatfs_fclose().
+ */
+typedef enum {
+    // Whenever a cluster (or for contiguous files, a supercluster) is added to the file
+    AFATFS_DURABILITY_EVERY_ALLOCATION = 0,
+    // Once every `interval` clusters (or superclusters) that are added
+    AFATFS_DURABILITY_EVERY_N_ALLOCATIONS,
+    // When clusters have been added and `interval` milliseconds have passed since the last update
+    AFATFS_DURABILITY_INTERVAL,
+    // Only when the file is closed
+    AFATFS_DURABILITY_ON_CLOSE,
+} afatfsDurabilityPolicy_e;
+
+typedef struct afatfsDurability_t {
+    afatfsDurabilityPolicy_e policy;
+    uint32_t interval;
+} afatfsDurability_t;
+
+typedef struct afatfsConfig_t {
+    // Memory for the sector cache and the open files table, see afatfs_initWithConfig() for its requirements
+    uint8_t *arena;
+    uint32_t arenaSize;
+
+    uint16_t cacheSectors;
+    uint8_t maxOpenFiles;
+} afatfsConfig_t;
+
+/*
+ * The kinds of sector that the cache tells apart (requires AFATFS_USE_CACHE_CLASSES), see afatfs_setCacheReserve().
+ */
+typedef enum {
+    AFATFS_CACHE_CLASS_FAT,
+    // Directories and the other filesystem structures
+    AFATFS_CACHE_CLASS_DIRECTORY,
+    AFATFS_CACHE_CLASS_FILE_DATA,
+    // File data that was read in before anybody asked for it
+    AFATFS_CACHE_CLASS_READ_AHEAD,
+    AFATFS_CACHE_CLASS_COUNT
+} afatfsCacheClass_e;
+
+typedef struct afatfsCacheClassStats_t {
+    // Accesses to sectors of the class that were already cached, and that had to be cached first
+    uint32_t hits, misses;
+    // Sectors of the class that were evicted from the cache to make room for others
+    uint32_t evictions;
+    // The number of sectors of the class in the cache right now
+    uint16_t sectors;
+} afatfsCacheClassStats_t;
+
+// Histograms in afatfsStats_t count values in power-of-two buckets: bucket i holds values from 2^i to 2^(i+1) - 1
+#define AFATFS_STATS_HISTOGRAM_BUCKETS 20
+
+// The number of kinds of card operation (sdcardBlockOperation_e) that afatfsStats_t keeps latency histograms for
+#define AFATFS_STATS_CARD_OPERATIONS 3
+
+/*
+ * Counters of what the filesystem has been doing since it was initialised (or since afatfs_resetStats()), see
+ * afatfs_getStats().
+ */
+typedef struct afatfsStats_t {
+    // Cache activity for each afatfsCacheClass_e (only counted when AFATFS_USE_CACHE_CLASSES is defined)
+    afatfsCacheClassStats_t cacheClasses[AFATFS_CACHE_CLASS_COUNT];
+
+    // Dirty sectors that were written from the cache to the card
+    uint32_t dirtyFlushes;
+
+    // Multi-block writes and reads that were begun, by the number of blocks that were announced to the card
+    uint32_t multiBlockWriteLengths[AFATFS_STATS_HISTOGRAM_BUCKETS];
+    uint32_t multiBlockReadLengths[AFATFS_STATS_HISTOGRAM_BUCKETS];
+
+    // Clusters allocated to regular files, and the FAT sectors that had to be read to find them
+    uint32_t clusterAllocations, clusterAllocationFATSectors;
+
+    // Calls to afatfs_fwrite() that wrote fewer bytes than asked for, and characters dropped by afatfs_fputc() (which
+    // aren't also counted as short writes)
+    uint32_t fwriteShortWrites, fputcDrops;
+
+    /*
+     * Durations of card operations reported to afatfs_sdcardProfilerCallback() by the card driver, indexed by
+     * sdcardBlockOperation_e, counted in the same units that the driver uses (bucket 0 also holds durations of zero).
+     */
+    uint32_t cardLatency[AFATFS_STATS_CARD_OPERATIONS][AFATFS_STATS_HISTOGRAM_BUCKETS];
+} afatfsStats_t;
+
+/*
+ * A run of physically consecutive sectors on the card that holds part of a file, see afatfs_fgetExtents().
+ */
+typedef struct afatfsExtent_t {
+    uint32_t sectorIndex;
+    uint32_t sectorCount;
+} afatfsExtent_t;
+
+/*
+ * A single-producer ring buffer of log records which afatfs_poll() drains into a file (requires AFATFS_USE_LOG_STREAM).
+ * Set up with afatfs_logStreamOpen(), the statistics may be read at any time.
+ */
+typedef struct afatfsLogStream_t {
+    afatfsFilePtr_t file;
+    uint8_t *buffer;
+    uint32_t bufferSize;
+
+    // Free-running counts of the bytes added by the producer and written to the file by afatfs_poll()
+    volatile uint32_t head, tail;
+
+    volatile bool closing;
+    struct afatfsLogStream_t *next;
+
+    // The largest number of bytes that have been waiting in the buffer at once
+    uint32_t highWatermark;
+    /*
+     * Records that were dropped because the buffer was full (or the stream was closing), and the bytes of those plus
+     * any that were discarded by closing the stream while the filesystem wasn't ready
+     */
+    uint32_t droppedWrites, droppedBytes;
+} afatfsLogStream_t;
+
 typedef void (*afatfsFileCallback_t)(afatfsFilePtr_t file);
 typedef void (*afatfsCallback_t)();
+typedef uint32_t (*afatfsMillisCallback_t)();
 
 bool afatfs_fopen(const char *filename, const char *mode, afatfsFileCallback_t complete);
+bool afatfs_fopenWithDurability(const char *filename, const char *mode, const afatfsDurability_t *durability, afatfsFileCallback_t complete);
+bool afatfs_createSequentialFile(const char *prefix, const char *extension, const char *mode, afatfsFileCallback_t complete);
 bool afatfs_ftruncate(afatfsFilePtr_t file, afatfsFileCallback_t callback);
 bool afatfs_fclose(afatfsFilePtr_t file, afatfsCallback_t callback);
 bool afatfs_funlink(afatfsFilePtr_t file, afatfsCallback_t callback);
@@ -51,11 +174,18 @@ bool afatfs_funlink(afatfsFilePtr_t file, afatfsCallback_t callback);
 bool afatfs_feof(afatfsFilePtr_t file);
 void afatfs_fputc(afatfsFilePtr_t file, uint8_t c);
 uint32_t afatfs_fwrite(afatfsFilePtr_t file, const uint8_t *buffer, uint32_t len);
+bool afatfs_fwriteDirect(afatfsFilePtr_t file, const uint8_t *buffer, uint32_t len, afatfsFileCallback_t callback);
+
+bool afatfs_logStreamOpen(afatfsLogStream_t *stream, afatfsFilePtr_t file, uint8_t *buffer, uint32_t bufferSize);
+bool afatfs_logStreamWrite(afatfsLogStream_t *stream, const uint8_t *data, uint32_t len);
+bool afatfs_logStreamClose(afatfsLogStream_t *stream);
 uint32_t afatfs_fread(afatfsFilePtr_t file, uint8_t *buffer, uint32_t len);
+afatfsOperationStatus_e afatfs_fgetExtents(afatfsFilePtr_t file, uint32_t offset, uint32_t len, afatfsExtent_t *extents, int maxExtents, int *extentCount);
 afatfsOperationStatus_e afatfs_fseek(afatfsFilePtr_t file, int32_t offset, afatfsSeek_e whence);
 bool afatfs_ftell(afatfsFilePtr_t file, uint32_t *position);
 
 bool afatfs_mkdir(const char *filename, afatfsFileCallback_t complete);
+bool afatfs_mkdirWithReserve(const char *filename, uint32_t reserveClusters, afatfsFileCallback_t complete);
 bool afatfs_chdir(afatfsFilePtr_t dirHandle);
 
 void afatfs_findFirst(afatfsFilePtr_t directory, afatfsFinder_t *finder);
@@ -64,10 +194,20 @@ void afatfs_findLast(afatfsFilePtr_t directory);
 
 bool afatfs_flush();
 void afatfs_init();
+void afatfs_initWithConfig(const afatfsConfig_t *config);
+void afatfs_initReadOnly();
+uint32_t afatfs_getArenaSize(uint16_t cacheSectors, uint8_t maxOpenFiles);
 bool afatfs_destroy(bool dirty);
 void afatfs_poll();
+void afatfs_pollBudget(uint32_t maxSectors);
+void afatfs_setMillisCallback(afatfsMillisCallback_t millis);
 
 uint32_t afatfs_getFreeBufferSpace();
+bool afatfs_setCacheReserve(afatfsCacheClass_e cacheClass, uint16_t sectors);
+void afatfs_getCacheClassStats(afatfsCacheClass_e cacheClass, afatfsCacheClassStats_t *stats);
+void afatfs_getStats(afatfsStats_t *stats);
+void afatfs_resetStats();
+void afatfs_sdcardProfilerCallback(sdcardBlockOperation_e operation, uint32_t blockIndex, uint32_t duration);
 uint32_t afatfs_getContiguousFreeSpace();
 bool afatfs_isFull();
 
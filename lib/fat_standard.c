@@ -20,7 +20,7 @@ bool fat32_isEndOfChainMarker(uint32_t clusterNumber)
  */
 uint32_t fat32_decodeClusterNumber(uint32_t clusterNumber)
 {
-    return clusterNumber & 0x0FFFFFFF;
+    return clusterNumber & FAT32_CLUSTER_NUMBER_MASK;
 }
 
 // fat32 needs fat32_decodeClusterNumber() applied first.
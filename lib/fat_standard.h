@@ -12,11 +12,22 @@
 #define FAT_VOLUME_ID_SIGNATURE_1 0x55
 #define FAT_VOLUME_ID_SIGNATURE_2 0xAA
 
+// Signatures found in the FAT32 FSInfo sector
+#define FAT_FSINFO_LEAD_SIGNATURE   0x41615252
+#define FAT_FSINFO_STRUCT_SIGNATURE 0x61417272
+#define FAT_FSINFO_TRAIL_SIGNATURE  0xAA550000
+
+// Value of the FSInfo free cluster count and next free cluster fields when they aren't known
+#define FAT_FSINFO_UNKNOWN 0xFFFFFFFF
+
 #define FAT_DIRECTORY_ENTRY_SIZE 32
 #define FAT_SMALLEST_LEGAL_CLUSTER_NUMBER 2
 
 #define FAT_MAXIMUM_FILESIZE 0xFFFFFFFF
 
+// FAT32 entries only hold a 28-bit cluster number, see fat32_decodeClusterNumber()
+#define FAT32_CLUSTER_NUMBER_MASK 0x0FFFFFFF
+
 #define FAT12_MAX_CLUSTERS 4084
 #define FAT16_MAX_CLUSTERS 65524
 
@@ -95,6 +106,16 @@ typedef struct fatVolumeID_t {
     } fatDescriptor;
 } __attribute__((packed)) fatVolumeID_t;
 
+typedef struct fatFSInfo_t {
+    uint32_t leadSignature;
+    uint8_t reserved1[480];
+    uint32_t structSignature;
+    uint32_t freeClusterCount;
+    uint32_t nextFreeCluster;
+    uint8_t reserved2[12];
+    uint32_t trailSignature;
+} __attribute__((packed)) fatFSInfo_t;
+
 typedef struct fatDirectoryEntry_t {
     char filename[FAT_FILENAME_LENGTH];
     uint8_t attrib;
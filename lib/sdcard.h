@@ -63,6 +63,14 @@ bool sdcard_readBlock(uint32_t blockIndex, uint8_t *buffer, sdcard_operationComp
  *     SDCARD_OPERATION_SUCCESS     - Your buffer has been transmitted to the card now.
  *     SDCARD_OPERATION_BUSY        - The card is already busy and cannot accept your write
  *     SDCARD_OPERATION_FAILURE     - Your write was rejected by the card, card will be reset
+ *
+ * A driver may optionally accept further writes while earlier ones are still in progress (e.g. by queueing them for
+ * DMA), up to the number that asyncfatfs was built with as AFATFS_SDCARD_WRITE_QUEUE_DEPTH. In that case it must:
+ *     - Return SDCARD_OPERATION_IN_PROGRESS for each queued write, and SDCARD_OPERATION_BUSY once its queue is full
+ *     - Send the queued writes to the card, and call their callbacks, in the order they were accepted
+ *     - Keep every queued buffer pointer valid until that write's callback is called
+ *     - Return true from sdcard_poll() while there is room in its queue
+ * Reads and other commands may be refused until the queue has drained.
  */
 sdcardOperationStatus_e sdcard_writeBlock(uint32_t blockIndex, uint8_t *buffer, sdcard_operationCompleteCallback_c callback, uint32_t callbackData);
 
@@ -102,6 +110,51 @@ sdcardOperationStatus_e sdcard_beginWriteBlocks(uint32_t blockIndex, uint32_t bl
  */
 sdcardOperationStatus_e sdcard_endWriteBlocks();
 
+/**
+ * Begin reading a series of consecutive blocks beginning at the given block index. This will allow (but not require)
+ * the SD card to stream those blocks back to us using a single multiple-block read command, which avoids paying for a
+ * command round-trip on every block.
+ *
+ * Afterwards, just call sdcard_readBlock() as normal to read those blocks consecutively.
+ *
+ * The multi-block read will be aborted automatically when reading from a non-consecutive address, or by performing a
+ * write. You can abort it manually by calling sdcard_endReadBlocks().
+ *
+ * This is optional, and only called if you define AFATFS_MIN_MULTIPLE_BLOCK_READ_COUNT when compiling asyncfatfs.c.
+ *
+ * Returns:
+ *     SDCARD_OPERATION_SUCCESS     - Multi-block read has been queued
+ *     SDCARD_OPERATION_BUSY        - The card is already busy and cannot accept your read
+ *     SDCARD_OPERATION_FAILURE     - A fatal error occured, card will be reset
+ */
+sdcardOperationStatus_e sdcard_beginReadBlocks(uint32_t blockIndex, uint32_t blockCount);
+
+/**
+ * Abort a multiple-block read early (before all the `blockCount` blocks had been read). asyncfatfs calls this when it
+ * abandons a multi-block read that it began for read-ahead (e.g. because the file was seeked or closed).
+ *
+ * This is optional, and only called if you define AFATFS_MIN_MULTIPLE_BLOCK_READ_COUNT when compiling asyncfatfs.c.
+ *
+ * Returns:
+ *     SDCARD_OPERATION_SUCCESS     - Multi-block read has been cancelled, or no multi-block read was in progress.
+ *     SDCARD_OPERATION_BUSY        - The card is busy with another operation and could not cancel the multi-block read.
+ */
+sdcardOperationStatus_e sdcard_endReadBlocks();
+
+/**
+ * Erase the series of consecutive blocks beginning at the given block index (e.g. with the card's ERASE_WR_BLK_START,
+ * ERASE_WR_BLK_END and ERASE commands). The contents of the blocks are undefined afterwards. The card is allowed to be
+ * busy until the erase finishes.
+ *
+ * Only required to be provided when using AFATFS_USE_SDCARD_ERASE.
+ *
+ * Returns:
+ *     SDCARD_OPERATION_SUCCESS     - The erase has been started
+ *     SDCARD_OPERATION_BUSY        - The card is already busy and cannot accept the erase
+ *     SDCARD_OPERATION_FAILURE     - A fatal error occured, card will be reset
+ */
+sdcardOperationStatus_e sdcard_eraseBlocks(uint32_t blockIndex, uint32_t blockCount);
+
 /**
  * Only required to be provided when using AFATFS_USE_INTROSPECTIVE_LOGGING.
  */
@@ -0,0 +1,501 @@
+/**
+ * Benchmark the filesystem by running a workload against a simulated card that has the given behaviour profile (see
+ * sdcardSimProfiles in sdcard_sim.c):
+ *
+ *     tests/bench <sdcard image> <logging|export|directory> [card profile | trace:<trace file>]
+ *
+ * Instead of a profile, a trace of card operations recorded by AFATFS_USE_INTROSPECTIVE_LOGGING (afatfs.log) can be
+ * given, and the card then takes as long for each operation as the card that the trace was recorded on did.
+ *
+ * Card time is simulated: every call to afatfs_poll() is taken to represent BENCH_POLL_INTERVAL_US of time passing on
+ * the card, so the throughput figures only depend on the filesystem's pattern of card operations and not on the host.
+ * The CPU time per poll is measured on the host, leaving out the time the simulator spends on the image file.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+#define SDCARD_SECTOR_SIZE 512
+
+#define BENCH_TRACE_PREFIX "trace:"
+
+// How much card time each poll of the main loop stands for
+#define BENCH_POLL_INTERVAL_US 50
+
+// Stalls are counted in a histogram of this many polls, longer stalls are counted in the last entry
+#define BENCH_MAX_STALL_POLLS 20000
+
+// The logging workload is the Blackbox pattern: small records appended to contiguous files, half of which are deleted
+#define BENCH_LOG_RECORD_SIZE 64
+#define BENCH_LOG_FILES 8
+#define BENCH_LOG_FILE_SIZE (1024 * 1024)
+
+#define BENCH_EXPORT_FILE_SIZE (4 * 1024 * 1024)
+
+#define BENCH_DIRECTORY_FILES 200
+
+typedef enum {
+    BENCH_STAGE_BEGIN,
+    BENCH_STAGE_OPEN,
+    BENCH_STAGE_WRITE,
+    BENCH_STAGE_CLOSE,
+    BENCH_STAGE_OPEN_READ,
+    BENCH_STAGE_READ,
+    BENCH_STAGE_CLOSE_READ,
+    BENCH_STAGE_IDLE,
+    BENCH_STAGE_COMPLETE
+} benchStage_e;
+
+typedef struct benchWorkload_t {
+    const char *name;
+    // Called on every poll while the filesystem is ready, returns false once the workload is complete
+    bool (*run)();
+} benchWorkload_t;
+
+static benchStage_e benchStage = BENCH_STAGE_BEGIN;
+
+static afatfsFilePtr_t benchFile;
+static uint32_t benchFileIndex, benchFileOffset;
+
+static uint8_t benchBuffer[SDCARD_SECTOR_SIZE];
+
+static struct {
+    uint32_t polls;
+    // The bytes the workload moved through afatfs_fwrite() and afatfs_fread() and the files it created
+    uint32_t bytes, files;
+
+    uint64_t hostTime;
+    sdcardSimStats_t cardStats;
+
+    // For each record that afatfs_fwrite() refused at first, the polls it had to wait until all of it was accepted
+    uint32_t stalls[BENCH_MAX_STALL_POLLS];
+    uint32_t stallCount, longestStall;
+} bench;
+
+// The poll that the record being written by benchWriteRecord() was first offered on, and how much of it was accepted
+static bool recordPending;
+static uint32_t recordStartPoll, recordWritten;
+
+static uint64_t getHostTimeNanos()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Start counting from now on (work done before this, such as preparing a file to read back, is not measured).
+ */
+static void benchBeginMeasure()
+{
+    bench.polls = 0;
+    bench.bytes = 0;
+    bench.files = 0;
+    bench.stallCount = 0;
+    bench.longestStall = 0;
+    memset(bench.stalls, 0, sizeof(bench.stalls));
+
+    sdcard_sim_getStats(&bench.cardStats);
+    bench.hostTime = getHostTimeNanos();
+}
+
+/**
+ * Offer a record of the given length to the file, continuing a record that was only partly accepted before.
+ *
+ * Returns true once the whole record was written.
+ */
+static bool benchWriteRecord(afatfsFilePtr_t file, const uint8_t *buffer, uint32_t len)
+{
+    if (!recordPending) {
+        recordPending = true;
+        recordStartPoll = bench.polls;
+    }
+
+    recordWritten += afatfs_fwrite(file, buffer + recordWritten, len - recordWritten);
+
+    if (recordWritten < len) {
+        testAssert(!afatfs_isFull(), "Device filled up during benchmark");
+        return false;
+    }
+
+    uint32_t stall = bench.polls - recordStartPoll;
+
+    if (stall > 0) {
+        bench.stalls[stall < BENCH_MAX_STALL_POLLS ? stall : BENCH_MAX_STALL_POLLS - 1]++;
+        bench.stallCount++;
+
+        if (stall > bench.longestStall) {
+            bench.longestStall = stall;
+        }
+    }
+
+    bench.bytes += len;
+
+    recordPending = false;
+    recordWritten = 0;
+
+    return true;
+}
+
+static void benchFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening file failed");
+
+    benchFile = file;
+    benchFileOffset = 0;
+}
+
+static void benchFileOpenedForWrite(afatfsFilePtr_t file)
+{
+    benchFileOpened(file);
+    benchStage = BENCH_STAGE_WRITE;
+}
+
+static void benchFileOpenedForRead(afatfsFilePtr_t file)
+{
+    benchFileOpened(file);
+    benchStage = BENCH_STAGE_READ;
+}
+
+static void benchDirectoryCreated(afatfsFilePtr_t dir)
+{
+    testAssert(dir, "Creating directory failed");
+
+    afatfs_chdir(dir);
+    testAssert(afatfs_fclose(dir, NULL), "Expected to be able to close idle directory immediately");
+
+    benchStage = BENCH_STAGE_OPEN;
+}
+
+static void benchFileDeleted()
+{
+    benchFileIndex++;
+    benchStage = BENCH_STAGE_OPEN_READ;
+}
+
+static bool benchShouldKeepLog(uint32_t logNumber)
+{
+    return (logNumber & 1) == 0;
+}
+
+static bool benchRunLogging()
+{
+    char filename[13];
+
+    switch (benchStage) {
+        case BENCH_STAGE_BEGIN:
+            benchBeginMeasure();
+
+            for (int i = 0; i < BENCH_LOG_RECORD_SIZE; i++) {
+                benchBuffer[i] = i;
+            }
+
+            benchStage = BENCH_STAGE_IDLE;
+            afatfs_mkdir("logs", benchDirectoryCreated);
+        break;
+        case BENCH_STAGE_OPEN:
+            if (benchFileIndex == BENCH_LOG_FILES) {
+                return false;
+            }
+
+            sprintf(filename, "LOG%05u.TXT", benchFileIndex);
+
+            benchStage = BENCH_STAGE_IDLE;
+            afatfs_fopen(filename, "as", benchFileOpenedForWrite);
+        break;
+        case BENCH_STAGE_WRITE:
+            // Offer records for as long as the filesystem accepts them, a record that is refused is offered again next poll
+            while (benchWriteRecord(benchFile, benchBuffer, BENCH_LOG_RECORD_SIZE)) {
+                benchFileOffset += BENCH_LOG_RECORD_SIZE;
+
+                if (benchFileOffset >= BENCH_LOG_FILE_SIZE) {
+                    benchStage = BENCH_STAGE_CLOSE;
+                    break;
+                }
+            }
+        break;
+        case BENCH_STAGE_CLOSE:
+            // Don't wait for the close to complete before opening the next file
+            if (benchShouldKeepLog(benchFileIndex) ? afatfs_fclose(benchFile, NULL) : afatfs_funlink(benchFile, NULL)) {
+                benchFileIndex++;
+                benchStage = BENCH_STAGE_OPEN;
+            }
+        break;
+        default:
+            ;
+    }
+
+    return true;
+}
+
+static bool benchRunExport()
+{
+    switch (benchStage) {
+        case BENCH_STAGE_BEGIN:
+            benchStage = BENCH_STAGE_IDLE;
+            // Logs are written in the contiguous append mode, and regular files only get the space outside the freefile
+            afatfs_fopen("export.bin", "as", benchFileOpenedForWrite);
+        break;
+        case BENCH_STAGE_WRITE:
+            // Preparing the file to export isn't measured
+            while (benchFileOffset < BENCH_EXPORT_FILE_SIZE) {
+                uint32_t written = afatfs_fwrite(benchFile, benchBuffer, sizeof(benchBuffer));
+
+                if (written == 0) {
+                    break;
+                }
+
+                benchFileOffset += written;
+            }
+
+            if (benchFileOffset >= BENCH_EXPORT_FILE_SIZE) {
+                benchStage = BENCH_STAGE_CLOSE;
+            }
+        break;
+        case BENCH_STAGE_CLOSE:
+            if (afatfs_fclose(benchFile, NULL)) {
+                benchStage = BENCH_STAGE_OPEN_READ;
+            }
+        break;
+        case BENCH_STAGE_OPEN_READ:
+            benchBeginMeasure();
+
+            benchStage = BENCH_STAGE_IDLE;
+            afatfs_fopen("export.bin", "r", benchFileOpenedForRead);
+        break;
+        case BENCH_STAGE_READ:
+            while (true) {
+                uint32_t readBytes = afatfs_fread(benchFile, benchBuffer, sizeof(benchBuffer));
+
+                if (readBytes == 0) {
+                    break;
+                }
+
+                bench.bytes += readBytes;
+            }
+
+            if (afatfs_feof(benchFile)) {
+                testAssert(bench.bytes == BENCH_EXPORT_FILE_SIZE, "Exported file was the wrong size");
+                benchStage = BENCH_STAGE_CLOSE_READ;
+            }
+        break;
+        case BENCH_STAGE_CLOSE_READ:
+            if (afatfs_fclose(benchFile, NULL)) {
+                return false;
+            }
+        break;
+        default:
+            ;
+    }
+
+    return true;
+}
+
+static bool benchRunDirectory()
+{
+    char filename[13];
+
+    switch (benchStage) {
+        case BENCH_STAGE_BEGIN:
+            benchBeginMeasure();
+
+            memset(benchBuffer, 0x55, BENCH_LOG_RECORD_SIZE);
+
+            benchStage = BENCH_STAGE_IDLE;
+            afatfs_mkdir("bench", benchDirectoryCreated);
+        break;
+        case BENCH_STAGE_OPEN:
+            if (benchFileIndex == BENCH_DIRECTORY_FILES) {
+                benchFileIndex = 0;
+                benchStage = BENCH_STAGE_OPEN_READ;
+                break;
+            }
+
+            sprintf(filename, "F%05u.BIN", benchFileIndex);
+
+            benchStage = BENCH_STAGE_IDLE;
+            afatfs_fopen(filename, "w", benchFileOpenedForWrite);
+        break;
+        case BENCH_STAGE_WRITE:
+            if (benchWriteRecord(benchFile, benchBuffer, BENCH_LOG_RECORD_SIZE)) {
+                benchStage = BENCH_STAGE_CLOSE;
+            }
+        break;
+        case BENCH_STAGE_CLOSE:
+            if (afatfs_fclose(benchFile, NULL)) {
+                bench.files++;
+                benchFileIndex++;
+                benchStage = BENCH_STAGE_OPEN;
+            }
+        break;
+        case BENCH_STAGE_OPEN_READ:
+            // Now delete all the files again
+            if (benchFileIndex == BENCH_DIRECTORY_FILES) {
+                benchStage = BENCH_STAGE_COMPLETE;
+                break;
+            }
+
+            sprintf(filename, "F%05u.BIN", benchFileIndex);
+
+            benchStage = BENCH_STAGE_IDLE;
+            afatfs_fopen(filename, "r", benchFileOpenedForRead);
+        break;
+        case BENCH_STAGE_READ:
+            // Wait for each deletion to complete before opening the next file
+            benchStage = BENCH_STAGE_IDLE;
+
+            testAssert(afatfs_funlink(benchFile, benchFileDeleted), "Expected to be able to queue deletion of file");
+        break;
+        case BENCH_STAGE_COMPLETE:
+            return false;
+        default:
+            ;
+    }
+
+    return true;
+}
+
+static const benchWorkload_t benchWorkloads[] = {
+    {"logging", benchRunLogging},
+    {"export", benchRunExport},
+    {"directory", benchRunDirectory},
+    {NULL, NULL}
+};
+
+static uint32_t benchStallPercentile(uint32_t percent)
+{
+    uint32_t target = ((uint64_t) bench.stallCount * percent + 99) / 100;
+    uint32_t total = 0;
+
+    for (uint32_t i = 0; i < BENCH_MAX_STALL_POLLS; i++) {
+        total += bench.stalls[i];
+
+        if (total >= target && total > 0) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+static void benchReport(const char *workloadName, const char *profileName)
+{
+    sdcardSimStats_t cardStats;
+    uint64_t hostTime = getHostTimeNanos() - bench.hostTime;
+
+    sdcard_sim_getStats(&cardStats);
+
+    uint32_t cardOps = (cardStats.reads - bench.cardStats.reads) + (cardStats.writes - bench.cardStats.writes)
+        + (cardStats.erases - bench.cardStats.erases);
+    double cardSeconds = (double) bench.polls * BENCH_POLL_INTERVAL_US / 1000000;
+    double cpuNanosPerPoll = (double) (hostTime - (cardStats.hostIOTime - bench.cardStats.hostIOTime)) / bench.polls;
+
+    fprintf(stderr, "[Bench]    %-9s on %-7s card: %7.3f MB/s, %5.0f ns CPU per poll, %5.2f card ops/KB",
+        workloadName, profileName,
+        bench.bytes / cardSeconds / (1024 * 1024),
+        cpuNanosPerPoll,
+        bench.bytes > 0 ? cardOps / (bench.bytes / 1024.0) : 0);
+
+    if (bench.stallCount > 0) {
+        fprintf(stderr, ", fwrite stalls p99 %.2f ms max %.2f ms",
+            (double) benchStallPercentile(99) * BENCH_POLL_INTERVAL_US / 1000,
+            (double) bench.longestStall * BENCH_POLL_INTERVAL_US / 1000);
+    }
+
+    if (bench.files > 0) {
+        fprintf(stderr, ", %.0f files/s", bench.files / cardSeconds);
+    }
+
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    const benchWorkload_t *workload;
+    const sdcardSimProfile_t *profile = &sdcardSimProfiles[0];
+    const char *profileName = profile->name;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <sdcard image> <logging|export|directory> [card profile | " BENCH_TRACE_PREFIX "<trace file>]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for (workload = benchWorkloads; workload->name; workload++) {
+        if (strcmp(workload->name, argv[2]) == 0) {
+            break;
+        }
+    }
+
+    if (!workload->name) {
+        fprintf(stderr, "Unknown workload '%s'\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    if (argc >= 4 && strncmp(argv[3], BENCH_TRACE_PREFIX, strlen(BENCH_TRACE_PREFIX)) == 0) {
+        if (!sdcard_sim_replayTrace(argv[3] + strlen(BENCH_TRACE_PREFIX), BENCH_POLL_INTERVAL_US)) {
+            fprintf(stderr, "Failed to read trace '%s'\n", argv[3] + strlen(BENCH_TRACE_PREFIX));
+            return EXIT_FAILURE;
+        }
+
+        profileName = "trace";
+    } else if (argc >= 4) {
+        profile = sdcard_sim_findProfile(argv[3]);
+
+        if (!profile) {
+            fprintf(stderr, "Unknown card profile '%s'\n", argv[3]);
+            return EXIT_FAILURE;
+        }
+
+        profileName = profile->name;
+    }
+
+    sdcard_sim_setProfile(profile);
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    afatfs_init();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+        bench.polls++;
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!workload->run()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    // Only the workload is measured, not the shutdown
+    benchReport(workload->name, profileName);
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    return EXIT_SUCCESS;
+}
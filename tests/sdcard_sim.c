@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <string.h>
 #include <time.h>
 
 #include "sdcard_sim.h"
@@ -12,9 +13,46 @@ static FILE *simFile;
 
 #define SDCARD_SIM_WRITE_DELAY 4
 #define SDCARD_SIM_READ_DELAY  1
-
+#define SDCARD_SIM_ERASE_DELAY 8
+
+const sdcardSimProfile_t sdcardSimProfiles[] = {
+    // The fixed delays that the tests are written against
+    {
+        .name = "default",
+        .readDelay = SDCARD_SIM_READ_DELAY, .writeDelay = SDCARD_SIM_WRITE_DELAY,
+        .multiReadDelay = SDCARD_SIM_READ_DELAY, .multiWriteDelay = SDCARD_SIM_WRITE_DELAY,
+        .eraseDelay = SDCARD_SIM_ERASE_DELAY
+    },
+    // A good card, which is never slower than the default and streams multi-block writes several times faster
+    {
+        .name = "fast",
+        .readDelay = SDCARD_SIM_READ_DELAY, .writeDelay = SDCARD_SIM_WRITE_DELAY,
+        .multiReadDelay = 1, .multiWriteDelay = 1,
+        .eraseDelay = 4
+    },
+    // A cheap card with erratic latency and frequent long garbage collection pauses
+    {
+        .name = "slow",
+        .readDelay = 3, .writeDelay = 12,
+        .multiReadDelay = 2, .multiWriteDelay = 4,
+        .eraseDelay = 20, .eraseBlocksPerPoll = 128,
+        .jitter = 6,
+        .gcInterval = 512, .gcDelay = 2000
+    },
+    {
+        .name = NULL
+    }
+};
 #define SDCARD_SIM_BLOCK_SIZE 512
 
+// The most writes that the simulated driver can hold behind the one in progress, see sdcard_sim_setWriteQueueDepth()
+#define SDCARD_SIM_MAX_QUEUED_WRITES 8
+
+// Size of each record in a trace of card operations, the layout written by AFATFS_USE_INTROSPECTIVE_LOGGING
+#define SDCARD_SIM_TRACE_RECORD_SIZE 16
+// The operations that a trace can give durations for (indexed by sdcardBlockOperation_e)
+#define SDCARD_SIM_TRACE_OPERATIONS 3
+
 typedef enum {
     SDCARD_STATE_NOT_PRESENT,
     SDCARD_STATE_INITIALIZATION,
@@ -22,6 +60,8 @@ typedef enum {
     SDCARD_STATE_READING,
     SDCARD_STATE_WRITING,
     SDCARD_STATE_WRITING_MULTIPLE_BLOCKS,
+    SDCARD_STATE_READING_MULTIPLE_BLOCKS,
+    SDCARD_STATE_ERASING,
 } sdcardState_e;
 
 static struct {
@@ -41,6 +81,34 @@ static struct {
 
     uint32_t multiWriteNextBlock;
     uint32_t multiWriteBlocksRemain;
+
+    uint32_t multiReadNextBlock;
+    uint32_t multiReadBlocksRemain;
+
+    // Writes that were accepted while another write was in progress, oldest first
+    struct {
+        sdcard_operationCompleteCallback_c callback;
+        uint32_t callbackData;
+        uint8_t *buffer;
+        uint32_t blockIndex;
+    } writeQueue[SDCARD_SIM_MAX_QUEUED_WRITES];
+    int writeQueueDepth, queuedWrites;
+
+    // The size of the card's flash pages in blocks, and the page that the current write sequence is programming
+    uint32_t pageBlocks;
+    uint32_t pageProgramPage, pageProgramNextBlock, pageProgramBlocks;
+
+    const sdcardSimProfile_t *profile;
+    uint32_t randomState;
+
+    // The recorded durations of each kind of operation that are being replayed, see sdcard_sim_replayTrace()
+    struct {
+        uint32_t *durations;
+        uint32_t count, next;
+    } replay[SDCARD_SIM_TRACE_OPERATIONS];
+    uint32_t replayMicrosPerPoll;
+
+    sdcardSimStats_t stats;
 } sdcard;
 
 /**
@@ -51,6 +119,137 @@ static uint32_t getCurrentTime()
     return ((uint64_t) clock() * 1000000) / CLOCKS_PER_SEC;
 }
 
+static uint64_t getHostTimeNanos()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * A simple LCG, so that the latencies of a given profile are the same on every run.
+ */
+static uint32_t sdcard_random(uint32_t range)
+{
+    sdcard.randomState = sdcard.randomState * 1103515245 + 12345;
+
+    return (sdcard.randomState >> 16) % range;
+}
+
+/**
+ * Get the delay to use for an operation with the given base delay from the current profile, or if a trace is being
+ * replayed, the next duration recorded for that kind of operation.
+ */
+static int sdcard_operationDelay(sdcardBlockOperation_e operation, int delay)
+{
+    if (sdcard.replay[operation].count > 0) {
+        uint32_t duration = sdcard.replay[operation].durations[sdcard.replay[operation].next];
+
+        // Start again from the beginning of the trace if the workload outlasts it
+        sdcard.replay[operation].next = (sdcard.replay[operation].next + 1) % sdcard.replay[operation].count;
+        sdcard.stats.replayedOperations++;
+
+        delay = (duration + sdcard.replayMicrosPerPoll - 1) / sdcard.replayMicrosPerPoll;
+
+        return delay > 0 ? delay : 1;
+    }
+
+    if (sdcard.profile->jitter > 0) {
+        delay += sdcard_random(sdcard.profile->jitter + 1);
+    }
+
+    if (operation == SDCARD_BLOCK_OPERATION_WRITE && sdcard.profile->gcInterval > 0
+            && sdcard_random(sdcard.profile->gcInterval) == 0) {
+        delay += sdcard.profile->gcDelay;
+        sdcard.stats.gcPauses++;
+    }
+
+    return delay;
+}
+
+/**
+ * Replay the durations of the card operations recorded in the given trace file (in the 16-byte record format written
+ * by AFATFS_USE_INTROSPECTIVE_LOGGING, durations in microseconds), instead of taking them from the profile. Each read,
+ * write or erase takes as long as the next recorded operation of the same kind, where every call to sdcard_poll() is
+ * taken to last microsPerPoll. Kinds of operation that are missing from the trace still use the profile's delays.
+ *
+ * Pass a NULL filename to stop replaying. Returns false if the trace couldn't be read.
+ */
+bool sdcard_sim_replayTrace(const char *filename, uint32_t microsPerPoll)
+{
+    uint8_t record[SDCARD_SIM_TRACE_RECORD_SIZE];
+    uint32_t capacity[SDCARD_SIM_TRACE_OPERATIONS] = {0};
+
+    for (int i = 0; i < SDCARD_SIM_TRACE_OPERATIONS; i++) {
+        free(sdcard.replay[i].durations);
+        sdcard.replay[i].durations = NULL;
+        sdcard.replay[i].count = 0;
+        sdcard.replay[i].next = 0;
+    }
+
+    if (!filename) {
+        return true;
+    }
+
+    if (microsPerPoll == 0) {
+        return false;
+    }
+
+    FILE *traceFile = fopen(filename, "rb");
+
+    if (!traceFile) {
+        return false;
+    }
+
+    sdcard.replayMicrosPerPoll = microsPerPoll;
+
+    while (fread(record, 1, SDCARD_SIM_TRACE_RECORD_SIZE, traceFile) == SDCARD_SIM_TRACE_RECORD_SIZE) {
+        uint8_t operation = record[0];
+        uint32_t duration = record[8] | (record[9] << 8) | (record[10] << 16) | ((uint32_t) record[11] << 24);
+
+        if (operation >= SDCARD_SIM_TRACE_OPERATIONS) {
+            continue;
+        }
+
+        if (sdcard.replay[operation].count == capacity[operation]) {
+            capacity[operation] = capacity[operation] ? capacity[operation] * 2 : 256;
+            sdcard.replay[operation].durations = realloc(sdcard.replay[operation].durations, capacity[operation] * sizeof(uint32_t));
+
+            if (!sdcard.replay[operation].durations) {
+                fprintf(stderr, "SDCardSim: Out of memory loading trace\n");
+                exit(-1);
+            }
+        }
+
+        sdcard.replay[operation].durations[sdcard.replay[operation].count++] = duration;
+    }
+
+    fclose(traceFile);
+
+    return true;
+}
+
+const sdcardSimProfile_t *sdcard_sim_findProfile(const char *name)
+{
+    for (const sdcardSimProfile_t *profile = sdcardSimProfiles; profile->name; profile++) {
+        if (strcmp(profile->name, name) == 0) {
+            return profile;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Choose how the card behaves from now on. Pass NULL to return to the default profile.
+ */
+void sdcard_sim_setProfile(const sdcardSimProfile_t *profile)
+{
+    sdcard.profile = profile ? profile : &sdcardSimProfiles[0];
+}
+
 bool sdcard_sim_init(const char *filename)
 {
     simFile = fopen(filename, "r+b");
@@ -66,9 +265,75 @@ bool sdcard_sim_init(const char *filename)
 
     sdcard.state = SDCARD_STATE_READY;
 
+    if (!sdcard.profile) {
+        sdcard.profile = &sdcardSimProfiles[0];
+    }
+    sdcard.randomState = 1;
+
+    if (sdcard.writeQueueDepth == 0) {
+        sdcard.writeQueueDepth = 1;
+    }
+
     return true;
 }
 
+/**
+ * Set the number of writes that the card accepts before the earlier ones complete (including the one in progress),
+ * like a driver that queues writes for DMA. The default is 1, so writes are refused while the card is busy.
+ */
+void sdcard_sim_setWriteQueueDepth(int depth)
+{
+    if (depth < 1) {
+        depth = 1;
+    } else if (depth > SDCARD_SIM_MAX_QUEUED_WRITES + 1) {
+        depth = SDCARD_SIM_MAX_QUEUED_WRITES + 1;
+    }
+
+    sdcard.writeQueueDepth = depth;
+}
+
+/**
+ * Set the size of the card's flash pages in blocks, so that the stats count how many pages were programmed whole,
+ * by consecutive blocks of one multi-block write, and how many were programmed partly (which a real card would have to
+ * do with a read-modify-write of the page). The default of 0 doesn't count pages at all.
+ */
+void sdcard_sim_setPageSize(uint32_t blocks)
+{
+    sdcard.pageBlocks = blocks;
+    sdcard.pageProgramBlocks = 0;
+}
+
+/**
+ * Count the page program that the given block write begins or continues.
+ */
+static void sdcard_countPageWrite(uint32_t blockIndex, bool continuesMultiWrite)
+{
+    if (sdcard.pageBlocks == 0) {
+        return;
+    }
+
+    uint32_t page = blockIndex / sdcard.pageBlocks;
+
+    if (
+        sdcard.pageProgramBlocks > 0
+        && (!continuesMultiWrite || page != sdcard.pageProgramPage || blockIndex != sdcard.pageProgramNextBlock)
+    ) {
+        // The previous page program ended before it covered the whole page
+        sdcard.stats.partialPageWrites++;
+        sdcard.pageProgramBlocks = 0;
+    }
+
+    sdcard.pageProgramPage = page;
+    sdcard.pageProgramNextBlock = blockIndex + 1;
+    sdcard.pageProgramBlocks++;
+
+    // The blocks are consecutive and all in the same page, so this is only possible if they cover the whole page
+    if (sdcard.pageProgramBlocks == sdcard.pageBlocks) {
+        sdcard.stats.pageWrites++;
+        sdcard.pageProgramBlocks = 0;
+    }
+}
+
 void sdcard_sim_destroy()
 {
     fclose(simFile);
@@ -79,10 +344,31 @@ static void sdcard_continueReadBlock()
 {
     if (--sdcard.currentOperation.countdownTimer <= 0) {
         uint64_t byteIndex = (uint64_t) sdcard.currentOperation.blockIndex * SDCARD_SIM_BLOCK_SIZE;
+        uint64_t ioStartTime = getHostTimeNanos();
 
         fseeko(simFile, byteIndex, SEEK_SET);
 
-        if (fread(sdcard.currentOperation.buffer, sizeof(uint8_t), SDCARD_SIM_BLOCK_SIZE, simFile) == SDCARD_SIM_BLOCK_SIZE) {
+        size_t readBytes = fread(sdcard.currentOperation.buffer, sizeof(uint8_t), SDCARD_SIM_BLOCK_SIZE, simFile);
+
+        sdcard.stats.hostIOTime += getHostTimeNanos() - ioStartTime;
+
+        if (readBytes == SDCARD_SIM_BLOCK_SIZE) {
+            sdcard.stats.reads++;
+
+            if (sdcard.multiReadBlocksRemain > 1) {
+                sdcard.multiReadBlocksRemain--;
+                sdcard.multiReadNextBlock++;
+                sdcard.state = SDCARD_STATE_READING_MULTIPLE_BLOCKS;
+            } else {
+                if (sdcard.multiReadBlocksRemain == 1) {
+                    sdcard.multiReadBlocksRemain = 0;
+#ifdef AFATFS_DEBUG_VERBOSE
+                    fprintf(stderr, "SD card - Finished multiple block read\n");
+#endif
+                }
+                sdcard.state = SDCARD_STATE_READY;
+            }
+
             if (sdcard.currentOperation.callback) {
                 sdcard.currentOperation.callback(SDCARD_BLOCK_OPERATION_READ, sdcard.currentOperation.blockIndex, sdcard.currentOperation.buffer, sdcard.currentOperation.callbackData);
             }
@@ -93,19 +379,26 @@ static void sdcard_continueReadBlock()
             fprintf(stderr, "SDCardSim: fread failed on underlying file\n");
             exit(-1);
         }
-
-        sdcard.state = SDCARD_STATE_READY;
     }
 }
 
+static void sdcard_startWriteBlock(uint32_t blockIndex, uint8_t *buffer, sdcard_operationCompleteCallback_c callback, uint32_t callbackData);
+
 static void sdcard_continueWriteBlock()
 {
     if (--sdcard.currentOperation.countdownTimer <= 0) {
         uint64_t byteIndex = (uint64_t) sdcard.currentOperation.blockIndex * SDCARD_SIM_BLOCK_SIZE;
+        uint64_t ioStartTime = getHostTimeNanos();
 
         fseeko(simFile, byteIndex, SEEK_SET);
 
-        if (fwrite(sdcard.currentOperation.buffer, sizeof(uint8_t), SDCARD_SIM_BLOCK_SIZE, simFile) == SDCARD_SIM_BLOCK_SIZE) {
+        size_t writtenBytes = fwrite(sdcard.currentOperation.buffer, sizeof(uint8_t), SDCARD_SIM_BLOCK_SIZE, simFile);
+
+        sdcard.stats.hostIOTime += getHostTimeNanos() - ioStartTime;
+
+        if (writtenBytes == SDCARD_SIM_BLOCK_SIZE) {
+            sdcard.stats.writes++;
+
             if (sdcard.multiWriteBlocksRemain > 1) {
                 sdcard.multiWriteBlocksRemain--;
                 sdcard.multiWriteNextBlock++;
@@ -120,11 +413,27 @@ static void sdcard_continueWriteBlock()
                 sdcard.state = SDCARD_STATE_READY;
             }
 
-            if (sdcard.currentOperation.callback) {
-                sdcard.currentOperation.callback(SDCARD_BLOCK_OPERATION_WRITE, sdcard.currentOperation.blockIndex, sdcard.currentOperation.buffer, sdcard.currentOperation.callbackData);
+            sdcard_operationCompleteCallback_c callback = sdcard.currentOperation.callback;
+            uint32_t blockIndex = sdcard.currentOperation.blockIndex;
+            uint8_t *buffer = sdcard.currentOperation.buffer;
+            uint32_t callbackData = sdcard.currentOperation.callbackData;
+            uint32_t duration = getCurrentTime() - sdcard.currentOperation.startTime;
+
+            // Start the next queued write before the callback, so that any write the callback makes goes behind it
+            if (sdcard.queuedWrites > 0) {
+                sdcard.queuedWrites--;
+
+                sdcard_startWriteBlock(sdcard.writeQueue[0].blockIndex, sdcard.writeQueue[0].buffer,
+                    sdcard.writeQueue[0].callback, sdcard.writeQueue[0].callbackData);
+
+                memmove(&sdcard.writeQueue[0], &sdcard.writeQueue[1], sdcard.queuedWrites * sizeof(sdcard.writeQueue[0]));
+            }
+
+            if (callback) {
+                callback(SDCARD_BLOCK_OPERATION_WRITE, blockIndex, buffer, callbackData);
             }
             if (sdcard.profiler) {
-                sdcard.profiler(SDCARD_BLOCK_OPERATION_WRITE, sdcard.currentOperation.blockIndex, getCurrentTime() - sdcard.currentOperation.startTime);
+                sdcard.profiler(SDCARD_BLOCK_OPERATION_WRITE, blockIndex, duration);
             }
         } else {
             fprintf(stderr, "SDCardSim: fwrite failed on underlying file\n");
@@ -134,6 +443,39 @@ static void sdcard_continueWriteBlock()
     }
 }
 
+static void sdcard_continueErase()
+{
+    if (--sdcard.currentOperation.countdownTimer <= 0) {
+        sdcard.state = SDCARD_STATE_READY;
+
+        if (sdcard.profiler) {
+            sdcard.profiler(SDCARD_BLOCK_OPERATION_ERASE, sdcard.currentOperation.blockIndex, getCurrentTime() - sdcard.currentOperation.startTime);
+        }
+    }
+}
+
+/**
+ * Fill the given blocks with some non-zero garbage. The SD card doesn't guarantee the contents of sectors that were
+ * erased, so this makes sure that we're not depending on them being erased to sensible values.
+ */
+static void sdcard_fillWithGarbage(uint32_t blockIndex, uint32_t blockCount)
+{
+    uint8_t garbageBuffer[SDCARD_SIM_BLOCK_SIZE];
+    uint64_t ioStartTime = getHostTimeNanos();
+
+    for (uint32_t i = 0 ; i < SDCARD_SIM_BLOCK_SIZE; i++) {
+        garbageBuffer[i] = i | 1;
+    }
+
+    fseeko(simFile, (uint64_t) blockIndex * SDCARD_SIM_BLOCK_SIZE, SEEK_SET);
+
+    for (uint32_t i = 0; i < blockCount; i++) {
+        fwrite((char*) garbageBuffer, sizeof(uint8_t), SDCARD_SIM_BLOCK_SIZE, simFile);
+    }
+
+    sdcard.stats.hostIOTime += getHostTimeNanos() - ioStartTime;
+}
+
 sdcardOperationStatus_e sdcard_endWriteBlocks()
 {
     switch (sdcard.state) {
@@ -159,13 +501,57 @@ sdcardOperationStatus_e sdcard_endWriteBlocks()
     }
 }
 
+/**
+ * End the multi-block read in progress, if any (as the card driver does by itself when it's asked to do something else).
+ */
+static sdcardOperationStatus_e sdcard_stopReadBlocks()
+{
+    switch (sdcard.state) {
+        case SDCARD_STATE_READING_MULTIPLE_BLOCKS:
+#ifdef AFATFS_DEBUG_VERBOSE
+            if (sdcard.multiReadBlocksRemain > 0) {
+                fprintf(stderr, "SD card - Terminated multiple block read with %u still remaining\n", sdcard.multiReadBlocksRemain);
+            } else {
+                fprintf(stderr, "SD card - Finished multiple block read\n");
+            }
+#endif
+
+            sdcard.state = SDCARD_STATE_READY;
+            sdcard.multiReadBlocksRemain = 0;
+
+            // Fall through
+
+       case SDCARD_STATE_READY:
+            return SDCARD_OPERATION_SUCCESS;
+
+       default:
+            return SDCARD_OPERATION_BUSY;
+    }
+}
+
+sdcardOperationStatus_e sdcard_endReadBlocks()
+{
+    if (sdcard.state == SDCARD_STATE_READING_MULTIPLE_BLOCKS && sdcard.multiReadBlocksRemain > 0) {
+        sdcard.stats.multiReadsEnded++;
+    }
+
+    return sdcard_stopReadBlocks();
+}
+
 bool sdcard_readBlock(uint32_t blockIndex, uint8_t *buffer, sdcard_operationCompleteCallback_c callback, uint32_t callbackData)
 {
     uint64_t byteIndex = (uint64_t) blockIndex * SDCARD_SIM_BLOCK_SIZE;
+    int delay = sdcard.profile->readDelay;
 
     if (sdcard.state != SDCARD_STATE_READY) {
         if (sdcard.state == SDCARD_STATE_WRITING_MULTIPLE_BLOCKS) {
             sdcard_endWriteBlocks();
+        } else if (sdcard.state == SDCARD_STATE_READING_MULTIPLE_BLOCKS) {
+            if (blockIndex != sdcard.multiReadNextBlock) {
+                sdcard_stopReadBlocks();
+            } else {
+                delay = sdcard.profile->multiReadDelay;
+            }
         } else {
             return false;
         }
@@ -190,35 +576,37 @@ bool sdcard_readBlock(uint32_t blockIndex, uint8_t *buffer, sdcard_operationComp
     sdcard.currentOperation.blockIndex = blockIndex;
     sdcard.currentOperation.callback = callback;
     sdcard.currentOperation.callbackData = callbackData;
-    sdcard.currentOperation.countdownTimer = SDCARD_SIM_READ_DELAY;
+    sdcard.currentOperation.countdownTimer = sdcard_operationDelay(SDCARD_BLOCK_OPERATION_READ, delay);
     sdcard.currentOperation.startTime = getCurrentTime();
 
     return true;
 }
 
-sdcardOperationStatus_e sdcard_writeBlock(uint32_t blockIndex, uint8_t *buffer, sdcard_operationCompleteCallback_c callback, uint32_t callbackData)
+/**
+ * Begin a write that has been accepted, continuing the current multi-block write if the block is the next one.
+ */
+static void sdcard_startWriteBlock(uint32_t blockIndex, uint8_t *buffer, sdcard_operationCompleteCallback_c callback, uint32_t callbackData)
 {
-    uint64_t byteIndex = (uint64_t) blockIndex * SDCARD_SIM_BLOCK_SIZE;
+    int delay = sdcard.profile->writeDelay;
+    bool continuesMultiWrite = false;
 
-    if (sdcard.state != SDCARD_STATE_READY) {
-        if (sdcard.state == SDCARD_STATE_WRITING_MULTIPLE_BLOCKS) {
-            if (blockIndex != sdcard.multiWriteNextBlock) {
-                sdcard_endWriteBlocks();
-            }
+    if (sdcard.state == SDCARD_STATE_WRITING_MULTIPLE_BLOCKS) {
+        if (blockIndex != sdcard.multiWriteNextBlock) {
+            sdcard_endWriteBlocks();
         } else {
-            return SDCARD_OPERATION_BUSY;
+            delay = sdcard.profile->multiWriteDelay;
+            continuesMultiWrite = true;
         }
+    } else if (sdcard.state == SDCARD_STATE_READING_MULTIPLE_BLOCKS) {
+        sdcard_stopReadBlocks();
     }
 
+    sdcard_countPageWrite(blockIndex, continuesMultiWrite);
+
 #ifdef AFATFS_DEBUG_VERBOSE
     fprintf(stderr, "SD card - Write block %u\n", blockIndex);
 #endif
 
-    if (byteIndex >= sdcard.capacity) {
-        fprintf(stderr, "SDCardSim: Attempted to write to block at %" PRIu64 " but capacity is %" PRIu64 "\n", byteIndex, sdcard.capacity);
-        exit(-1);
-    }
-
     /*
      * Just like the real SD card will, we will defer this write till later, so the operation won't be done yet when
      * this routine returns.
@@ -229,8 +617,47 @@ sdcardOperationStatus_e sdcard_writeBlock(uint32_t blockIndex, uint8_t *buffer,
     sdcard.currentOperation.blockIndex = blockIndex;
     sdcard.currentOperation.callback = callback;
     sdcard.currentOperation.callbackData = callbackData;
-    sdcard.currentOperation.countdownTimer = SDCARD_SIM_WRITE_DELAY;
+    sdcard.currentOperation.countdownTimer = sdcard_operationDelay(SDCARD_BLOCK_OPERATION_WRITE, delay);
     sdcard.currentOperation.startTime = getCurrentTime();
+}
+
+sdcardOperationStatus_e sdcard_writeBlock(uint32_t blockIndex, uint8_t *buffer, sdcard_operationCompleteCallback_c callback, uint32_t callbackData)
+{
+    uint64_t byteIndex = (uint64_t) blockIndex * SDCARD_SIM_BLOCK_SIZE;
+
+    if (byteIndex >= sdcard.capacity) {
+        fprintf(stderr, "SDCardSim: Attempted to write to block at %" PRIu64 " but capacity is %" PRIu64 "\n", byteIndex, sdcard.capacity);
+        exit(-1);
+    }
+
+    if (sdcard.state == SDCARD_STATE_WRITING) {
+        if (sdcard.queuedWrites + 1 >= sdcard.writeQueueDepth) {
+            return SDCARD_OPERATION_BUSY;
+        }
+
+        sdcard.writeQueue[sdcard.queuedWrites].blockIndex = blockIndex;
+        sdcard.writeQueue[sdcard.queuedWrites].buffer = buffer;
+        sdcard.writeQueue[sdcard.queuedWrites].callback = callback;
+        sdcard.writeQueue[sdcard.queuedWrites].callbackData = callbackData;
+        sdcard.queuedWrites++;
+
+        if ((uint32_t) sdcard.queuedWrites + 1 > sdcard.stats.maxQueuedWrites) {
+            sdcard.stats.maxQueuedWrites = sdcard.queuedWrites + 1;
+        }
+
+        return SDCARD_OPERATION_IN_PROGRESS;
+    }
+
+    if (sdcard.state != SDCARD_STATE_READY && sdcard.state != SDCARD_STATE_WRITING_MULTIPLE_BLOCKS
+            && sdcard.state != SDCARD_STATE_READING_MULTIPLE_BLOCKS) {
+        return SDCARD_OPERATION_BUSY;
+    }
+
+    sdcard_startWriteBlock(blockIndex, buffer, callback, callbackData);
+
+    if (sdcard.stats.maxQueuedWrites == 0) {
+        sdcard.stats.maxQueuedWrites = 1;
+    }
 
     return SDCARD_OPERATION_IN_PROGRESS;
 }
@@ -247,6 +674,8 @@ sdcardOperationStatus_e sdcard_beginWriteBlocks(uint32_t blockIndex, uint32_t bl
                 // Assume that the caller wants to continue the multi-block write they already have in progress!
                 return SDCARD_OPERATION_SUCCESS;
             }
+        } else if (sdcard.state == SDCARD_STATE_READING_MULTIPLE_BLOCKS) {
+            sdcard_stopReadBlocks();
         } else {
             return SDCARD_OPERATION_BUSY;
         }
@@ -265,30 +694,113 @@ sdcardOperationStatus_e sdcard_beginWriteBlocks(uint32_t blockIndex, uint32_t bl
     sdcard.multiWriteBlocksRemain = blockCount;
     sdcard.multiWriteNextBlock = blockIndex;
 
-    /*
-     * The SD card doesn't guarantee the contents of sectors that we asked it to erase, but didn't end up overwriting
-     * during our multi-block write.
-     *
-     * So fill those with some non-zero garbage to make sure we're not depending on them being erased to sensible values.
-     */
-    uint8_t garbageBuffer[SDCARD_SIM_BLOCK_SIZE];
+    sdcard.stats.multiWrites++;
+    sdcard.stats.multiWriteBlocks += blockCount;
 
-    for (uint32_t i = 0 ; i < SDCARD_SIM_BLOCK_SIZE; i++) {
-        garbageBuffer[i] = i | 1;
+    // The blocks that were pre-erased but we don't end up overwriting during our multi-block write are left as garbage
+    sdcard_fillWithGarbage(blockIndex, blockCount);
+
+    return SDCARD_OPERATION_SUCCESS;
+}
+
+sdcardOperationStatus_e sdcard_beginReadBlocks(uint32_t blockIndex, uint32_t blockCount)
+{
+    uint64_t byteIndex = (uint64_t) blockIndex * SDCARD_SIM_BLOCK_SIZE;
+
+    if (sdcard.state != SDCARD_STATE_READY) {
+        if (sdcard.state == SDCARD_STATE_READING_MULTIPLE_BLOCKS) {
+            if (blockIndex != sdcard.multiReadNextBlock) {
+                sdcard_stopReadBlocks();
+            } else {
+                // Assume that the caller wants to continue the multi-block read they already have in progress!
+                return SDCARD_OPERATION_SUCCESS;
+            }
+        } else if (sdcard.state == SDCARD_STATE_WRITING_MULTIPLE_BLOCKS) {
+            sdcard_endWriteBlocks();
+        } else {
+            return SDCARD_OPERATION_BUSY;
+        }
     }
 
-    fseeko(simFile, byteIndex, SEEK_SET);
+    if (byteIndex + blockCount * SDCARD_SIM_BLOCK_SIZE > sdcard.capacity) {
+        fprintf(stderr, "SDCardSim: Attempted a multi-block read to %" PRIu64 " but capacity is %" PRIu64 "\n", byteIndex + blockCount * SDCARD_SIM_BLOCK_SIZE, sdcard.capacity);
+        exit(-1);
+    }
 
-    for (uint32_t i = 0; i < blockCount; i++) {
-        fwrite((char*) garbageBuffer, sizeof(uint8_t), SDCARD_SIM_BLOCK_SIZE, simFile);
+#ifdef AFATFS_DEBUG_VERBOSE
+    fprintf(stderr, "SD card - Begin multi-block read of %u blocks beginning with block %u\n", blockCount, blockIndex);
+#endif
+
+    sdcard.state = SDCARD_STATE_READING_MULTIPLE_BLOCKS;
+    sdcard.multiReadBlocksRemain = blockCount;
+
+    sdcard.stats.multiReads++;
+    sdcard.multiReadNextBlock = blockIndex;
+
+    return SDCARD_OPERATION_SUCCESS;
+}
+
+sdcardOperationStatus_e sdcard_eraseBlocks(uint32_t blockIndex, uint32_t blockCount)
+{
+    uint64_t byteIndex = (uint64_t) blockIndex * SDCARD_SIM_BLOCK_SIZE;
+
+    if (sdcard.state != SDCARD_STATE_READY) {
+        if (sdcard.state == SDCARD_STATE_WRITING_MULTIPLE_BLOCKS) {
+            sdcard_endWriteBlocks();
+        } else if (sdcard.state == SDCARD_STATE_READING_MULTIPLE_BLOCKS) {
+            sdcard_stopReadBlocks();
+        } else {
+            return SDCARD_OPERATION_BUSY;
+        }
     }
 
+    if (blockCount == 0 || byteIndex + (uint64_t) blockCount * SDCARD_SIM_BLOCK_SIZE > sdcard.capacity) {
+        fprintf(stderr, "SDCardSim: Attempted to erase %u blocks at %" PRIu64 " but capacity is %" PRIu64 "\n", blockCount, byteIndex, sdcard.capacity);
+        exit(-1);
+    }
+
+#ifdef AFATFS_DEBUG_VERBOSE
+    fprintf(stderr, "SD card - Erase %u blocks beginning with block %u\n", blockCount, blockIndex);
+#endif
+
+    sdcard.stats.erases++;
+    sdcard.stats.erasedBlocks += blockCount;
+
+    sdcard_fillWithGarbage(blockIndex, blockCount);
+
+    // The card stays busy while it erases
+    sdcard.state = SDCARD_STATE_ERASING;
+
+    sdcard.currentOperation.buffer = NULL;
+    sdcard.currentOperation.blockIndex = blockIndex;
+    sdcard.currentOperation.callback = NULL;
+    int delay = sdcard.profile->eraseDelay;
+
+    if (sdcard.profile->eraseBlocksPerPoll > 0) {
+        delay += blockCount / sdcard.profile->eraseBlocksPerPoll;
+    }
+
+    sdcard.currentOperation.countdownTimer = sdcard_operationDelay(SDCARD_BLOCK_OPERATION_ERASE, delay);
+    sdcard.currentOperation.startTime = getCurrentTime();
+
     return SDCARD_OPERATION_SUCCESS;
 }
 
+void sdcard_sim_getStats(sdcardSimStats_t *stats)
+{
+    *stats = sdcard.stats;
+
+    // A page program that's still going can't be whole, since a whole one would have been counted already
+    if (sdcard.pageProgramBlocks > 0) {
+        stats->partialPageWrites++;
+    }
+}
+
 bool sdcard_sim_isReady()
 {
-    return sdcard.state == SDCARD_STATE_READY || sdcard.state == SDCARD_STATE_WRITING_MULTIPLE_BLOCKS;
+    return sdcard.state == SDCARD_STATE_READY || sdcard.state == SDCARD_STATE_WRITING_MULTIPLE_BLOCKS
+        || sdcard.state == SDCARD_STATE_READING_MULTIPLE_BLOCKS
+        || (sdcard.state == SDCARD_STATE_WRITING && sdcard.queuedWrites + 1 < sdcard.writeQueueDepth);
 }
 
 bool sdcard_poll()
@@ -300,6 +812,9 @@ bool sdcard_poll()
         case SDCARD_STATE_WRITING:
             sdcard_continueWriteBlock();
         break;
+        case SDCARD_STATE_ERASING:
+            sdcard_continueErase();
+        break;
         default:
             ;
     }
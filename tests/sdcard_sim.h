@@ -3,3 +3,57 @@
 bool sdcard_sim_init(const char *filename);
 void sdcard_sim_destroy();
 bool sdcard_sim_isReady();
+
+typedef struct sdcardSimStats_t {
+    // The number of blocks that were read and written
+    uint32_t reads, writes;
+    // The number of multi-block writes that were begun, and how many blocks they announced in total
+    uint32_t multiWrites, multiWriteBlocks;
+    // The number of multi-block reads that were begun, and how many of them the host ended early with sdcard_endReadBlocks()
+    uint32_t multiReads, multiReadsEnded;
+    // The number of erase commands, and how many blocks they erased in total
+    uint32_t erases, erasedBlocks;
+    // The number of writes that were held up by a garbage collection pause
+    uint32_t gcPauses;
+    // The number of operations that took their duration from a replayed trace
+    uint32_t replayedOperations;
+    // The most writes that were accepted at once (the one in progress and those queued behind it)
+    uint32_t maxQueuedWrites;
+    // Card pages that were programmed whole by one multi-block write, and partly (see sdcard_sim_setPageSize())
+    uint32_t pageWrites, partialPageWrites;
+    // Time spent reading and writing the image file on the host, in nanoseconds
+    uint64_t hostIOTime;
+} sdcardSimStats_t;
+
+/*
+ * Describes how a simulated card behaves. All delays are counted in calls to sdcard_poll(), and apply from when the
+ * operation is accepted until it completes.
+ */
+typedef struct sdcardSimProfile_t {
+    const char *name;
+
+    int readDelay, writeDelay;
+    // Delays for blocks read or written as part of a multi-block read or write
+    int multiReadDelay, multiWriteDelay;
+    // Delay of an erase command, plus one poll for each eraseBlocksPerPoll blocks erased (if non-zero)
+    int eraseDelay;
+    uint32_t eraseBlocksPerPoll;
+    // Every operation is delayed by a random extra 0 to jitter polls
+    int jitter;
+    // On average one block write in gcInterval (if non-zero) is held up by an extra gcDelay polls
+    uint32_t gcInterval;
+    int gcDelay;
+} sdcardSimProfile_t;
+
+// The built-in card profiles, terminated by an entry with a NULL name. The first entry is used by default.
+extern const sdcardSimProfile_t sdcardSimProfiles[];
+
+const sdcardSimProfile_t *sdcard_sim_findProfile(const char *name);
+void sdcard_sim_setProfile(const sdcardSimProfile_t *profile);
+
+bool sdcard_sim_replayTrace(const char *filename, uint32_t microsPerPoll);
+
+void sdcard_sim_setWriteQueueDepth(int depth);
+void sdcard_sim_setPageSize(uint32_t blocks);
+
+void sdcard_sim_getStats(sdcardSimStats_t *stats);
@@ -0,0 +1,198 @@
+/**
+ * With the freefile search running in the background, check that the filesystem becomes ready before the freefile has
+ * been allocated, that a regular file can be written while the search runs, and that a contiguous file is only opened
+ * once the freefile is ready. Then remount and read both files back.
+ *
+ * This test must be built with AFATFS_BACKGROUND_FREEFILE_SEARCH defined.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+// Make the regular file long enough that the search is likely to be running while its clusters are allocated
+#define TEST_REGULAR_LOG_ENTRY_COUNT ((afatfs_clusterSize() * 200) / TEST_LOG_ENTRY_SIZE)
+#define TEST_SOLID_LOG_ENTRY_COUNT ((afatfs_clusterSize() * 3 + 100) / TEST_LOG_ENTRY_SIZE)
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_clusterSize();
+
+typedef enum {
+    TEST_STAGE_OPEN,
+    TEST_STAGE_WRITE,
+    TEST_STAGE_CLOSE,
+    TEST_STAGE_REMOUNT,
+    TEST_STAGE_READ_OPEN,
+    TEST_STAGE_READ_VALIDATE,
+    TEST_STAGE_READ_CLOSE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_OPEN;
+
+static afatfsFilePtr_t regularFile, solidFile;
+static uint32_t regularLogEntryIndex, solidLogEntryIndex;
+static int filesOpened;
+
+static void initFilesystem()
+{
+    afatfs_init();
+
+    while (afatfs_getFilesystemState() != AFATFS_FILESYSTEM_STATE_READY) {
+        afatfs_poll();
+
+        if (afatfs_getFilesystemState() == AFATFS_FILESYSTEM_STATE_FATAL) {
+            fprintf(stderr, "[Fail]     Fatal filesystem error during init\n");
+            exit(-1);
+        }
+    }
+}
+
+static void regularFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening regular file failed");
+
+    regularFile = file;
+    regularLogEntryIndex = 0;
+
+    filesOpened++;
+}
+
+static void solidFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening contiguous file failed");
+    testAssert(testStage != TEST_STAGE_WRITE || afatfs_getContiguousFreeSpace() > 0, "Contiguous file was opened before the freefile was ready");
+
+    solidFile = file;
+    solidLogEntryIndex = 0;
+
+    filesOpened++;
+}
+
+bool continueTesting()
+{
+    bool regularDone, solidDone;
+
+    switch (testStage) {
+        case TEST_STAGE_OPEN:
+            testAssert(afatfs_getContiguousFreeSpace() == 0, "Freefile search should still be running when the filesystem becomes ready");
+
+            testStage = TEST_STAGE_WRITE;
+            filesOpened = 0;
+
+            afatfs_fopen("regular.txt", "a", regularFileOpened);
+            afatfs_fopen("solid.txt", "as", solidFileOpened);
+        break;
+        case TEST_STAGE_WRITE:
+            regularDone = regularFile && writeLogTestEntries(regularFile, &regularLogEntryIndex, TEST_REGULAR_LOG_ENTRY_COUNT);
+            solidDone = solidFile && writeLogTestEntries(solidFile, &solidLogEntryIndex, TEST_SOLID_LOG_ENTRY_COUNT);
+
+            if (regularDone && solidDone) {
+                testStage = TEST_STAGE_CLOSE;
+            }
+        break;
+        case TEST_STAGE_CLOSE:
+            if (regularFile && afatfs_fclose(regularFile, NULL)) {
+                regularFile = NULL;
+            }
+            if (solidFile && afatfs_fclose(solidFile, NULL)) {
+                solidFile = NULL;
+            }
+            if (!regularFile && !solidFile) {
+                testStage = TEST_STAGE_REMOUNT;
+            }
+        break;
+        case TEST_STAGE_REMOUNT:
+            while (!afatfs_destroy(false)) {
+            }
+
+            initFilesystem();
+
+            testAssert(afatfs_getContiguousFreeSpace() > 0, "Freefile was not allocated");
+
+            testStage = TEST_STAGE_READ_OPEN;
+        break;
+        case TEST_STAGE_READ_OPEN:
+            testStage = TEST_STAGE_READ_VALIDATE;
+            filesOpened = 0;
+
+            afatfs_fopen("regular.txt", "r", regularFileOpened);
+            afatfs_fopen("solid.txt", "r", solidFileOpened);
+        break;
+        case TEST_STAGE_READ_VALIDATE:
+            if (filesOpened == 2) {
+                regularDone = validateLogTestEntries(regularFile, &regularLogEntryIndex, TEST_REGULAR_LOG_ENTRY_COUNT);
+                solidDone = validateLogTestEntries(solidFile, &solidLogEntryIndex, TEST_SOLID_LOG_ENTRY_COUNT);
+
+                if (regularDone && solidDone) {
+                    testStage = TEST_STAGE_READ_CLOSE;
+                }
+            }
+        break;
+        case TEST_STAGE_READ_CLOSE:
+            if (regularFile && afatfs_fclose(regularFile, NULL)) {
+                regularFile = NULL;
+            }
+            if (solidFile && afatfs_fclose(solidFile, NULL)) {
+                solidFile = NULL;
+            }
+            if (!regularFile && !solidFile) {
+                testStage = TEST_STAGE_COMPLETE;
+            }
+        break;
+        case TEST_STAGE_COMPLETE:
+            fprintf(stderr, "[Success]  Files written while the freefile was being allocated in the background read back correctly\n");
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    initFilesystem();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    return EXIT_SUCCESS;
+}
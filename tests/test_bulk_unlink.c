@@ -0,0 +1,295 @@
+/**
+ * Write two files in the regular append mode a cluster at a time in turn, so that their cluster chains are interleaved
+ * through the same FAT sectors, then delete one of them. Check that the deletion doesn't write any sector of the card
+ * more than once, that its space can be used by a new file, and that the other file is untouched.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+/*
+ * How many clusters to give each file. The freefile leaves only AFATFS_FREEFILE_LEAVE_CLUSTERS clusters for regular
+ * files, and the kept file and the replacement must fit in there together.
+ */
+#define TEST_FILE_CLUSTERS 40
+#define TEST_CLUSTER_LOG_ENTRIES (afatfs_clusterSize() / TEST_LOG_ENTRY_SIZE)
+#define TEST_LOG_ENTRY_COUNT (TEST_FILE_CLUSTERS * TEST_CLUSTER_LOG_ENTRIES)
+
+// The most distinct sectors that we expect the deletion to write
+#define TEST_MAX_UNLINK_WRITES 64
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_clusterSize();
+
+typedef enum {
+    TEST_STAGE_OPEN_FIRST,
+    TEST_STAGE_OPEN_SECOND,
+    TEST_STAGE_FILL_INTERLEAVED,
+    TEST_STAGE_CLOSE_FIRST,
+    TEST_STAGE_CLOSE_SECOND,
+    TEST_STAGE_OPEN_FOR_DELETE,
+    TEST_STAGE_DELETE,
+    TEST_STAGE_FLUSH_DELETE,
+    TEST_STAGE_OPEN_REPLACEMENT,
+    TEST_STAGE_FILL_REPLACEMENT,
+    TEST_STAGE_CLOSE_REPLACEMENT,
+    TEST_STAGE_REMOUNT,
+    TEST_STAGE_OPEN_DELETED,
+    TEST_STAGE_OPEN_VALIDATE,
+    TEST_STAGE_VALIDATE,
+    TEST_STAGE_CLOSE_VALIDATE,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static const char *keptFilenames[] = {"second.txt", "replace.txt"};
+#define TEST_KEPT_FILE_COUNT ((int) (sizeof(keptFilenames) / sizeof(keptFilenames[0])))
+
+static testStage_e testStage = TEST_STAGE_OPEN_FIRST;
+// The stage to move to once the file we're opening is ready
+static testStage_e openedStage;
+
+static afatfsFilePtr_t firstFile, secondFile, testFile;
+static uint32_t firstLogEntryIndex, secondLogEntryIndex, logEntryIndex;
+static int filesValidated;
+
+// The sectors written to the card while the deletion is in progress
+static bool recordWrites;
+static uint32_t unlinkWrites[TEST_MAX_UNLINK_WRITES];
+static int unlinkWriteCount;
+static uint32_t unlinkPolls;
+
+static void sdcardProfiler(sdcardBlockOperation_e operation, uint32_t blockIndex, uint32_t duration)
+{
+    (void) duration;
+
+    if (!recordWrites || operation != SDCARD_BLOCK_OPERATION_WRITE) {
+        return;
+    }
+
+    for (int i = 0; i < unlinkWriteCount; i++) {
+        if (unlinkWrites[i] == blockIndex) {
+            fprintf(stderr, "[Fail]     Sector %u was written more than once while deleting the file\n", blockIndex);
+            exit(-1);
+        }
+    }
+
+    testAssert(unlinkWriteCount < TEST_MAX_UNLINK_WRITES, "Deleting the file wrote more sectors than expected");
+
+    unlinkWrites[unlinkWriteCount++] = blockIndex;
+}
+
+static void initFilesystem()
+{
+    afatfs_init();
+
+    while (afatfs_getFilesystemState() != AFATFS_FILESYSTEM_STATE_READY) {
+        afatfs_poll();
+
+        if (afatfs_getFilesystemState() == AFATFS_FILESYSTEM_STATE_FATAL) {
+            fprintf(stderr, "[Fail]     Fatal filesystem error during init\n");
+            exit(-1);
+        }
+    }
+}
+
+static void testFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening testfile failed");
+
+    testFile = file;
+    logEntryIndex = 0;
+
+    testStage = openedStage;
+}
+
+static void deletedFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(!file, "Deleted file should no longer exist");
+
+    testStage = TEST_STAGE_OPEN_VALIDATE;
+}
+
+static void fileDeleted()
+{
+    testStage = TEST_STAGE_FLUSH_DELETE;
+}
+
+bool continueTesting()
+{
+    switch (testStage) {
+        case TEST_STAGE_OPEN_FIRST:
+            testStage = TEST_STAGE_IDLE;
+            openedStage = TEST_STAGE_OPEN_SECOND;
+            afatfs_fopen("first.txt", "a", testFileOpened);
+        break;
+        case TEST_STAGE_OPEN_SECOND:
+            firstFile = testFile;
+
+            testStage = TEST_STAGE_IDLE;
+            openedStage = TEST_STAGE_FILL_INTERLEAVED;
+            afatfs_fopen(keptFilenames[0], "a", testFileOpened);
+        break;
+        case TEST_STAGE_FILL_INTERLEAVED:
+            secondFile = testFile;
+
+            // Give the first file a cluster, then the second, so each file takes every other cluster
+            if (firstLogEntryIndex == secondLogEntryIndex) {
+                if (firstLogEntryIndex == TEST_LOG_ENTRY_COUNT) {
+                    testStage = TEST_STAGE_CLOSE_FIRST;
+                } else {
+                    writeLogTestEntries(firstFile, &firstLogEntryIndex, firstLogEntryIndex + TEST_CLUSTER_LOG_ENTRIES - firstLogEntryIndex % TEST_CLUSTER_LOG_ENTRIES);
+                }
+            } else {
+                writeLogTestEntries(secondFile, &secondLogEntryIndex, firstLogEntryIndex);
+            }
+        break;
+        case TEST_STAGE_CLOSE_FIRST:
+            if (afatfs_fclose(firstFile, NULL)) {
+                testStage = TEST_STAGE_CLOSE_SECOND;
+            }
+        break;
+        case TEST_STAGE_CLOSE_SECOND:
+            if (afatfs_fclose(secondFile, NULL)) {
+                testStage = TEST_STAGE_OPEN_FOR_DELETE;
+            }
+        break;
+        case TEST_STAGE_OPEN_FOR_DELETE:
+            // Make sure the writes of the files we've just closed are out of the way before we start counting
+            if (afatfs_flush() && sdcard_sim_isReady()) {
+                testStage = TEST_STAGE_IDLE;
+                openedStage = TEST_STAGE_DELETE;
+                afatfs_fopen("first.txt", "r", testFileOpened);
+            }
+        break;
+        case TEST_STAGE_DELETE:
+            recordWrites = true;
+
+            testStage = TEST_STAGE_IDLE;
+            testAssert(afatfs_funlink(testFile, fileDeleted), "Expected to be able to queue the deletion");
+        break;
+        case TEST_STAGE_FLUSH_DELETE:
+            // Keep counting until the freed FAT sectors have reached the card
+            if (afatfs_flush() && sdcard_sim_isReady()) {
+                recordWrites = false;
+                testStage = TEST_STAGE_OPEN_REPLACEMENT;
+            }
+        break;
+        case TEST_STAGE_OPEN_REPLACEMENT:
+            testStage = TEST_STAGE_IDLE;
+            openedStage = TEST_STAGE_FILL_REPLACEMENT;
+            afatfs_fopen(keptFilenames[1], "a", testFileOpened);
+        break;
+        case TEST_STAGE_FILL_REPLACEMENT:
+            testAssert(!afatfs_isFull(), "Filesystem reported full while refilling the deleted file's space");
+
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_LOG_ENTRY_COUNT)) {
+                testStage = TEST_STAGE_CLOSE_REPLACEMENT;
+            }
+        break;
+        case TEST_STAGE_CLOSE_REPLACEMENT:
+            if (afatfs_fclose(testFile, NULL)) {
+                testStage = TEST_STAGE_REMOUNT;
+            }
+        break;
+        case TEST_STAGE_REMOUNT:
+            while (!afatfs_destroy(false)) {
+            }
+
+            initFilesystem();
+
+            testStage = TEST_STAGE_OPEN_DELETED;
+        break;
+        case TEST_STAGE_OPEN_DELETED:
+            testStage = TEST_STAGE_IDLE;
+            afatfs_fopen("first.txt", "r", deletedFileOpened);
+        break;
+        case TEST_STAGE_OPEN_VALIDATE:
+            if (filesValidated == TEST_KEPT_FILE_COUNT) {
+                testStage = TEST_STAGE_COMPLETE;
+            } else {
+                testStage = TEST_STAGE_IDLE;
+                openedStage = TEST_STAGE_VALIDATE;
+                afatfs_fopen(keptFilenames[filesValidated], "r", testFileOpened);
+            }
+        break;
+        case TEST_STAGE_VALIDATE:
+            if (validateLogTestEntries(testFile, &logEntryIndex, TEST_LOG_ENTRY_COUNT)) {
+                testAssert(afatfs_feof(testFile), "File is longer than we wrote");
+
+                testStage = TEST_STAGE_CLOSE_VALIDATE;
+            }
+        break;
+        case TEST_STAGE_CLOSE_VALIDATE:
+            if (afatfs_fclose(testFile, NULL)) {
+                filesValidated++;
+                testStage = TEST_STAGE_OPEN_VALIDATE;
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    sdcard_setProfilerCallback(sdcardProfiler);
+
+    initFilesystem();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        if (recordWrites) {
+            unlinkPolls++;
+        }
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    fprintf(stderr, "[Success]  Interleaved file deleted in %u polls with %d sector writes\n", unlinkPolls, unlinkWriteCount);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,288 @@
+/**
+ * Read a file through the cache while appending to a log file at the same time, first with no cache reserves and then
+ * with some of the cache reserved for FAT and directory sectors. Check that the data is written and read back
+ * correctly both times, and that the reserves cut down on the misses of the metadata that the log file needs.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+#define SDCARD_SECTOR_SIZE 512
+
+#define TEST_EXPORT_CLUSTERS 60
+// The number of log entries we append for every sector we read from the export file
+#define TEST_LOG_ENTRIES_PER_SECTOR_READ 4
+
+#define TEST_PHASE_COUNT 2
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_clusterSize();
+
+typedef enum {
+    TEST_STAGE_CHECK_RESERVE_LIMIT,
+    TEST_STAGE_CREATE_DIRECTORY,
+    TEST_STAGE_CREATE_EXPORT,
+    TEST_STAGE_WRITE_EXPORT,
+    TEST_STAGE_CLOSE_EXPORT,
+    TEST_STAGE_BEGIN_PHASE,
+    TEST_STAGE_TRANSFER,
+    TEST_STAGE_CLOSE_PHASE,
+    TEST_STAGE_OPEN_LOG_VALIDATE,
+    TEST_STAGE_VALIDATE_LOG,
+    TEST_STAGE_CLOSE_LOG_VALIDATE,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_CHECK_RESERVE_LIMIT;
+
+static afatfsFilePtr_t exportFile, logFile;
+static uint32_t exportEntryIndex, logEntryIndex;
+
+static int phase;
+static const char *logFilenames[TEST_PHASE_COUNT] = {"log1.txt", "log2.txt"};
+
+// The misses of FAT and directory sectors during each phase
+static uint32_t metadataMissesAtStart, metadataMisses[TEST_PHASE_COUNT];
+
+static uint32_t exportEntryCount()
+{
+    return TEST_EXPORT_CLUSTERS * afatfs_clusterSize() / TEST_LOG_ENTRY_SIZE;
+}
+
+static uint32_t getMetadataMisses()
+{
+    afatfsCacheClassStats_t fatStats, directoryStats;
+
+    afatfs_getCacheClassStats(AFATFS_CACHE_CLASS_FAT, &fatStats);
+    afatfs_getCacheClassStats(AFATFS_CACHE_CLASS_DIRECTORY, &directoryStats);
+
+    return fatStats.misses + directoryStats.misses;
+}
+
+static void directoryCreated(afatfsFilePtr_t dir)
+{
+    testAssert(dir, "Creating directory failed");
+
+    afatfs_chdir(dir);
+    testAssert(afatfs_fclose(dir, NULL), "Expected to be able to queue close on directory");
+
+    testStage = TEST_STAGE_CREATE_EXPORT;
+}
+
+static void exportFileCreated(afatfsFilePtr_t file)
+{
+    testAssert(file, "Creating export file failed");
+
+    exportFile = file;
+    exportEntryIndex = 0;
+
+    testStage = TEST_STAGE_WRITE_EXPORT;
+}
+
+static void logFileCreated(afatfsFilePtr_t file)
+{
+    testAssert(file, "Creating log file failed");
+
+    logFile = file;
+    logEntryIndex = 0;
+}
+
+static void exportFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening export file for read failed");
+
+    exportFile = file;
+    exportEntryIndex = 0;
+
+    metadataMissesAtStart = getMetadataMisses();
+
+    testStage = TEST_STAGE_TRANSFER;
+}
+
+static void logFileOpenedForValidate(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening log file for read failed");
+
+    logFile = file;
+    logEntryIndex = 0;
+
+    testStage = TEST_STAGE_VALIDATE_LOG;
+}
+
+bool continueTesting()
+{
+    afatfsCacheClassStats_t stats;
+    uint32_t freeBufferSpace;
+
+    switch (testStage) {
+        case TEST_STAGE_CHECK_RESERVE_LIMIT:
+            freeBufferSpace = afatfs_getFreeBufferSpace();
+
+            testAssert(!afatfs_setCacheReserve(AFATFS_CACHE_CLASS_FAT, 100), "Reserving more sectors than the cache holds should fail");
+            testAssert(afatfs_setCacheReserve(AFATFS_CACHE_CLASS_FAT, 2), "Reserving a small part of the cache should succeed");
+            testAssert(afatfs_getFreeBufferSpace() < freeBufferSpace, "Sectors held for a reserve shouldn't count as free buffer space");
+            testAssert(!afatfs_setCacheReserve(AFATFS_CACHE_CLASS_DIRECTORY, 1), "The total of the reserves should be limited");
+            testAssert(afatfs_setCacheReserve(AFATFS_CACHE_CLASS_FAT, 0), "Reserves should be removable");
+            testAssert(afatfs_getFreeBufferSpace() == freeBufferSpace, "Removing the reserve should give back its buffer space");
+
+            testStage = TEST_STAGE_CREATE_DIRECTORY;
+        break;
+        case TEST_STAGE_CREATE_DIRECTORY:
+            testStage = TEST_STAGE_IDLE;
+
+            /*
+             * The freefile keeps the root directory sector that holds its entry in the cache, so work in a
+             * subdirectory, whose sectors have to compete with the file data for space in the cache.
+             */
+            afatfs_mkdir("export", directoryCreated);
+        break;
+        case TEST_STAGE_CREATE_EXPORT:
+            testStage = TEST_STAGE_IDLE;
+
+            afatfs_fopen("export.bin", "a", exportFileCreated);
+        break;
+        case TEST_STAGE_WRITE_EXPORT:
+            if (writeLogTestEntries(exportFile, &exportEntryIndex, exportEntryCount())) {
+                testStage = TEST_STAGE_CLOSE_EXPORT;
+            }
+        break;
+        case TEST_STAGE_CLOSE_EXPORT:
+            if (afatfs_fclose(exportFile, NULL)) {
+                testStage = TEST_STAGE_BEGIN_PHASE;
+            }
+        break;
+        case TEST_STAGE_BEGIN_PHASE:
+            if (phase == TEST_PHASE_COUNT) {
+                phase = 0;
+                testStage = TEST_STAGE_OPEN_LOG_VALIDATE;
+                break;
+            }
+
+            if (phase == 1) {
+                testAssert(afatfs_setCacheReserve(AFATFS_CACHE_CLASS_FAT, 1), "Reserving a FAT sector failed");
+                testAssert(afatfs_setCacheReserve(AFATFS_CACHE_CLASS_DIRECTORY, 1), "Reserving a directory sector failed");
+            }
+
+            testStage = TEST_STAGE_IDLE;
+
+            afatfs_fopen(logFilenames[phase], "a", logFileCreated);
+            afatfs_fopen("export.bin", "r", exportFileOpened);
+        break;
+        case TEST_STAGE_TRANSFER:
+            if (!logFile) {
+                break;
+            }
+
+            // Keep the log file ahead of the reads from the export file, which proceed a sector at a time (the file is a
+            // whole number of sectors long)
+            if (!writeLogTestEntries(logFile, &logEntryIndex, (exportEntryIndex * TEST_LOG_ENTRY_SIZE / SDCARD_SECTOR_SIZE + 1) * TEST_LOG_ENTRIES_PER_SECTOR_READ)) {
+                break;
+            }
+
+            if (validateLogTestEntries(exportFile, &exportEntryIndex, exportEntryIndex + SDCARD_SECTOR_SIZE / TEST_LOG_ENTRY_SIZE)
+                    && exportEntryIndex == exportEntryCount()) {
+                testAssert(afatfs_feof(exportFile), "Export file is longer than we wrote");
+
+                metadataMisses[phase] = getMetadataMisses() - metadataMissesAtStart;
+
+                testStage = TEST_STAGE_CLOSE_PHASE;
+            }
+        break;
+        case TEST_STAGE_CLOSE_PHASE:
+            if (afatfs_fclose(exportFile, NULL) && afatfs_fclose(logFile, NULL)) {
+                logFile = NULL;
+                phase++;
+
+                testStage = TEST_STAGE_BEGIN_PHASE;
+            }
+        break;
+        case TEST_STAGE_OPEN_LOG_VALIDATE:
+            testStage = TEST_STAGE_IDLE;
+
+            afatfs_fopen(logFilenames[phase], "r", logFileOpenedForValidate);
+        break;
+        case TEST_STAGE_VALIDATE_LOG:
+            if (validateLogTestEntries(logFile, &logEntryIndex, exportEntryCount() * TEST_LOG_ENTRY_SIZE / SDCARD_SECTOR_SIZE * TEST_LOG_ENTRIES_PER_SECTOR_READ)) {
+                testAssert(afatfs_feof(logFile), "Log file is longer than we wrote");
+
+                testStage = TEST_STAGE_CLOSE_LOG_VALIDATE;
+            }
+        break;
+        case TEST_STAGE_CLOSE_LOG_VALIDATE:
+            if (afatfs_fclose(logFile, NULL)) {
+                phase++;
+
+                testStage = phase == TEST_PHASE_COUNT ? TEST_STAGE_COMPLETE : TEST_STAGE_OPEN_LOG_VALIDATE;
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            afatfs_getCacheClassStats(AFATFS_CACHE_CLASS_FILE_DATA, &stats);
+            testAssert(stats.hits > 0 && stats.misses > 0, "File data hits and misses should have been counted");
+
+            afatfs_getCacheClassStats(AFATFS_CACHE_CLASS_READ_AHEAD, &stats);
+            testAssert(stats.misses > 0, "Read-ahead sectors should have been counted");
+
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    afatfs_init();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    testAssert(metadataMisses[1] < metadataMisses[0], "Reserving cache sectors for metadata should have reduced its misses");
+
+    fprintf(stderr, "[Success]  Metadata cache misses during a transfer went from %u to %u with reserved cache sectors\n",
+        metadataMisses[0], metadataMisses[1]);
+
+    return EXIT_SUCCESS;
+}
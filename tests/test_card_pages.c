@@ -0,0 +1,235 @@
+/**
+ * Write a log file quickly (as fast as the cache allows) and another slowly (a few bytes per poll) to a simulated card
+ * with 4KB flash pages, and check that with AFATFS_CARD_PAGE_SECTORS, nearly every page of file data reaches the card
+ * in one whole multi-block write rather than in pieces. Then read both files back.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+#define SDCARD_SECTOR_SIZE 512
+
+#define TEST_CACHE_SECTORS 32
+#define TEST_MAX_OPEN_FILES 3
+
+#define TEST_PAGE_SIZE (AFATFS_CARD_PAGE_SECTORS * SDCARD_SECTOR_SIZE)
+
+#define TEST_FAST_FILENAME "fast.txt"
+#define TEST_FAST_PAGES 64
+
+#define TEST_SLOW_FILENAME "slow.txt"
+#define TEST_SLOW_PAGES 8
+
+/*
+ * The files may not begin on a page boundary, so the first and last pages the file touches can be partial, and the
+ * last page of the file is still incomplete when it's closed.
+ */
+#define TEST_PARTIAL_PAGES_ALLOWED 2
+
+typedef enum {
+    TEST_STAGE_FAST_OPEN,
+    TEST_STAGE_FAST_WRITE,
+    TEST_STAGE_FAST_CLOSE,
+    TEST_STAGE_SLOW_OPEN,
+    TEST_STAGE_SLOW_WRITE,
+    TEST_STAGE_SLOW_CLOSE,
+    TEST_STAGE_FAST_READ_OPEN,
+    TEST_STAGE_SLOW_READ_OPEN,
+    TEST_STAGE_READ_VALIDATE,
+    TEST_STAGE_READ_CLOSE,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_FAST_OPEN;
+static testStage_e stageAfterOpen, stageAfterRead;
+
+static afatfsFilePtr_t testFile;
+static uint32_t logEntryIndex, logEntryCount;
+
+static sdcardSimStats_t statsBeforeWrite;
+
+static void testFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening test file failed");
+
+    testFile = file;
+    testStage = stageAfterOpen;
+}
+
+/**
+ * Wait for everything we wrote to reach the card, then check that the file's pages were written whole.
+ */
+static void checkPageWrites(uint32_t filePages, const char *description)
+{
+    sdcardSimStats_t stats;
+
+    while (!afatfs_flush() || !sdcard_sim_isReady()) {
+        afatfs_poll();
+    }
+
+    sdcard_sim_getStats(&stats);
+
+    uint32_t pageWrites = stats.pageWrites - statsBeforeWrite.pageWrites;
+
+    if (pageWrites + TEST_PARTIAL_PAGES_ALLOWED < filePages) {
+        fprintf(stderr, "[Fail]     Only %u of the %u pages of the %s file were written whole (%u partial page writes)\n",
+            (unsigned) pageWrites, (unsigned) filePages, description, (unsigned) (stats.partialPageWrites - statsBeforeWrite.partialPageWrites));
+        exit(-1);
+    }
+
+    fprintf(stderr, "[Success]  %u of the %u pages of the %s file were written whole\n", (unsigned) pageWrites, (unsigned) filePages, description);
+}
+
+static void openFile(const char *filename, const char *mode, testStage_e nextStage)
+{
+    testStage = TEST_STAGE_IDLE;
+    stageAfterOpen = nextStage;
+    logEntryIndex = 0;
+
+    afatfs_fopen(filename, mode, testFileOpened);
+}
+
+bool continueTesting()
+{
+    switch (testStage) {
+        case TEST_STAGE_FAST_OPEN:
+            sdcard_sim_getStats(&statsBeforeWrite);
+
+            openFile(TEST_FAST_FILENAME, "as", TEST_STAGE_FAST_WRITE);
+        break;
+        case TEST_STAGE_FAST_WRITE:
+            // Fill the cache as fast as it can take the entries
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_FAST_PAGES * TEST_PAGE_SIZE / TEST_LOG_ENTRY_SIZE)) {
+                testStage = TEST_STAGE_FAST_CLOSE;
+            }
+        break;
+        case TEST_STAGE_FAST_CLOSE:
+            if (afatfs_fclose(testFile, NULL)) {
+                testFile = NULL;
+
+                checkPageWrites(TEST_FAST_PAGES, "quickly written");
+
+                testStage = TEST_STAGE_SLOW_OPEN;
+            }
+        break;
+        case TEST_STAGE_SLOW_OPEN:
+            sdcard_sim_getStats(&statsBeforeWrite);
+
+            openFile(TEST_SLOW_FILENAME, "a", TEST_STAGE_SLOW_WRITE);
+        break;
+        case TEST_STAGE_SLOW_WRITE:
+            // Only one entry per poll, so the card is idle long before each sector is complete
+            writeLogTestEntries(testFile, &logEntryIndex, logEntryIndex + 1);
+
+            if (logEntryIndex == TEST_SLOW_PAGES * TEST_PAGE_SIZE / TEST_LOG_ENTRY_SIZE) {
+                testStage = TEST_STAGE_SLOW_CLOSE;
+            }
+        break;
+        case TEST_STAGE_SLOW_CLOSE:
+            if (afatfs_fclose(testFile, NULL)) {
+                testFile = NULL;
+
+                checkPageWrites(TEST_SLOW_PAGES, "slowly written");
+
+                testStage = TEST_STAGE_FAST_READ_OPEN;
+            }
+        break;
+        case TEST_STAGE_FAST_READ_OPEN:
+            logEntryCount = TEST_FAST_PAGES * TEST_PAGE_SIZE / TEST_LOG_ENTRY_SIZE;
+            stageAfterRead = TEST_STAGE_SLOW_READ_OPEN;
+
+            openFile(TEST_FAST_FILENAME, "r", TEST_STAGE_READ_VALIDATE);
+        break;
+        case TEST_STAGE_SLOW_READ_OPEN:
+            logEntryCount = TEST_SLOW_PAGES * TEST_PAGE_SIZE / TEST_LOG_ENTRY_SIZE;
+            stageAfterRead = TEST_STAGE_COMPLETE;
+
+            openFile(TEST_SLOW_FILENAME, "r", TEST_STAGE_READ_VALIDATE);
+        break;
+        case TEST_STAGE_READ_VALIDATE:
+            if (validateLogTestEntries(testFile, &logEntryIndex, logEntryCount)) {
+                testAssert(afatfs_feof(testFile), "Log file should end after the entries we wrote");
+
+                testStage = TEST_STAGE_READ_CLOSE;
+            }
+        break;
+        case TEST_STAGE_READ_CLOSE:
+            if (afatfs_fclose(testFile, NULL)) {
+                testFile = NULL;
+                testStage = stageAfterRead;
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    afatfsConfig_t config;
+
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    sdcard_sim_setPageSize(AFATFS_CARD_PAGE_SECTORS);
+
+    // The default cache is no bigger than a page, so give it room to hold a page back while the next one is written
+    config.arenaSize = afatfs_getArenaSize(TEST_CACHE_SECTORS, TEST_MAX_OPEN_FILES);
+    config.cacheSectors = TEST_CACHE_SECTORS;
+    config.maxOpenFiles = TEST_MAX_OPEN_FILES;
+
+    uint64_t *arena = malloc(config.arenaSize);
+    config.arena = (uint8_t *) arena;
+
+    afatfs_initWithConfig(&config);
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    free(arena);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,283 @@
+/**
+ * Write several files in the contiguous append mode at the same time (at different rates, so that their superclusters
+ * are interleaved in the freefile's old space), and check that they only consume the superclusters they need. Then
+ * remount and read them all back, delete one and check that the others still read back correctly.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+#define TEST_STREAM_COUNT 3
+
+// Stream i gets (i + 1) times as many log entries as stream 0, written (i + 1) times as fast
+#define TEST_STREAM_ENTRY_COUNT(i) ((afatfs_superClusterSize() * 2 * ((i) + 1) + 100) / TEST_LOG_ENTRY_SIZE)
+#define TEST_STREAM_ENTRIES_PER_STEP(i) (8 * ((i) + 1))
+
+// Give each stream different content so we'll notice if their clusters get mixed up
+#define TEST_STREAM_FIRST_ENTRY(i) ((i) * 85)
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_superClusterSize();
+
+typedef enum {
+    TEST_STAGE_OPEN,
+    TEST_STAGE_WRITE,
+    TEST_STAGE_CLOSE,
+    TEST_STAGE_REMOUNT,
+    TEST_STAGE_READ_OPEN,
+    TEST_STAGE_READ_VALIDATE,
+    TEST_STAGE_UNLINK,
+    TEST_STAGE_REWIND,
+    TEST_STAGE_REVALIDATE,
+    TEST_STAGE_READ_CLOSE,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_OPEN;
+
+static const char *streamFilenames[TEST_STREAM_COUNT] = {"imu.txt", "video.txt", "telem.txt"};
+
+static afatfsFilePtr_t streams[TEST_STREAM_COUNT];
+static uint32_t streamEntryIndex[TEST_STREAM_COUNT];
+static int streamsOpened;
+
+static uint32_t initialContiguousFreeSpace;
+
+static void initFilesystem()
+{
+    afatfs_init();
+
+    while (afatfs_getFilesystemState() != AFATFS_FILESYSTEM_STATE_READY) {
+        afatfs_poll();
+
+        if (afatfs_getFilesystemState() == AFATFS_FILESYSTEM_STATE_FATAL) {
+            fprintf(stderr, "[Fail]     Fatal filesystem error during init\n");
+            exit(-1);
+        }
+    }
+}
+
+static void streamOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening stream failed");
+
+    // Streams are opened in order, so the callbacks arrive in order too
+    streams[streamsOpened] = file;
+    streamEntryIndex[streamsOpened] = TEST_STREAM_FIRST_ENTRY(streamsOpened);
+
+    streamsOpened++;
+
+    // Nothing has been written yet (and the freefile is ready, since contiguous files can't be opened before then)
+    if (testStage == TEST_STAGE_WRITE && streamsOpened == TEST_STREAM_COUNT) {
+        initialContiguousFreeSpace = afatfs_getContiguousFreeSpace();
+    }
+}
+
+static void streamUnlinked()
+{
+    streams[0] = NULL;
+    testStage = TEST_STAGE_REWIND;
+}
+
+static uint32_t streamEndEntry(int stream)
+{
+    return TEST_STREAM_FIRST_ENTRY(stream) + TEST_STREAM_ENTRY_COUNT(stream);
+}
+
+bool continueTesting()
+{
+    bool allDone;
+    uint32_t superclustersUsed;
+
+    switch (testStage) {
+        case TEST_STAGE_OPEN:
+            testStage = TEST_STAGE_WRITE;
+            streamsOpened = 0;
+
+            for (int i = 0; i < TEST_STREAM_COUNT; i++) {
+                afatfs_fopen(streamFilenames[i], "as", streamOpened);
+            }
+        break;
+        case TEST_STAGE_WRITE:
+            if (streamsOpened < TEST_STREAM_COUNT) {
+                break;
+            }
+
+            allDone = true;
+
+            for (int i = 0; i < TEST_STREAM_COUNT; i++) {
+                uint32_t stepEnd = streamEntryIndex[i] + TEST_STREAM_ENTRIES_PER_STEP(i);
+
+                if (stepEnd > streamEndEntry(i)) {
+                    stepEnd = streamEndEntry(i);
+                }
+
+                writeLogTestEntries(streams[i], &streamEntryIndex[i], stepEnd);
+
+                allDone = allDone && streamEntryIndex[i] == streamEndEntry(i);
+            }
+
+            if (allDone) {
+                superclustersUsed = 0;
+
+                for (int i = 0; i < TEST_STREAM_COUNT; i++) {
+                    superclustersUsed += (TEST_STREAM_ENTRY_COUNT(i) * TEST_LOG_ENTRY_SIZE + afatfs_superClusterSize() - 1) / afatfs_superClusterSize();
+                }
+
+                testAssert(
+                    afatfs_getContiguousFreeSpace() == initialContiguousFreeSpace - superclustersUsed * afatfs_superClusterSize(),
+                    "Streams should have taken exactly the superclusters they needed from the freefile"
+                );
+
+                testStage = TEST_STAGE_CLOSE;
+            }
+        break;
+        case TEST_STAGE_CLOSE:
+            allDone = true;
+
+            for (int i = 0; i < TEST_STREAM_COUNT; i++) {
+                if (streams[i] && afatfs_fclose(streams[i], NULL)) {
+                    streams[i] = NULL;
+                }
+
+                allDone = allDone && !streams[i];
+            }
+
+            if (allDone) {
+                testStage = TEST_STAGE_REMOUNT;
+            }
+        break;
+        case TEST_STAGE_REMOUNT:
+            while (!afatfs_destroy(false)) {
+            }
+
+            initFilesystem();
+
+            testStage = TEST_STAGE_READ_OPEN;
+        break;
+        case TEST_STAGE_READ_OPEN:
+            testStage = TEST_STAGE_READ_VALIDATE;
+            streamsOpened = 0;
+
+            for (int i = 0; i < TEST_STREAM_COUNT; i++) {
+                afatfs_fopen(streamFilenames[i], "r", streamOpened);
+            }
+        break;
+        case TEST_STAGE_READ_VALIDATE:
+            if (streamsOpened < TEST_STREAM_COUNT) {
+                break;
+            }
+
+            allDone = true;
+
+            for (int i = 0; i < TEST_STREAM_COUNT; i++) {
+                allDone = validateLogTestEntries(streams[i], &streamEntryIndex[i], streamEndEntry(i)) && allDone;
+            }
+
+            if (allDone) {
+                testStage = TEST_STAGE_UNLINK;
+            }
+        break;
+        case TEST_STAGE_UNLINK:
+            // The first stream is interleaved with the others, so deleting it mustn't disturb their clusters
+            if (afatfs_funlink(streams[0], streamUnlinked)) {
+                testStage = TEST_STAGE_IDLE;
+            }
+        break;
+        case TEST_STAGE_REWIND:
+            for (int i = 1; i < TEST_STREAM_COUNT; i++) {
+                testAssert(afatfs_fseek(streams[i], 0, AFATFS_SEEK_SET) != AFATFS_OPERATION_FAILURE, "Seek to start of stream failed");
+                streamEntryIndex[i] = TEST_STREAM_FIRST_ENTRY(i);
+            }
+
+            testStage = TEST_STAGE_REVALIDATE;
+        break;
+        case TEST_STAGE_REVALIDATE:
+            allDone = true;
+
+            for (int i = 1; i < TEST_STREAM_COUNT; i++) {
+                allDone = validateLogTestEntries(streams[i], &streamEntryIndex[i], streamEndEntry(i)) && allDone;
+            }
+
+            if (allDone) {
+                testStage = TEST_STAGE_READ_CLOSE;
+            }
+        break;
+        case TEST_STAGE_READ_CLOSE:
+            allDone = true;
+
+            for (int i = 1; i < TEST_STREAM_COUNT; i++) {
+                if (streams[i] && afatfs_fclose(streams[i], NULL)) {
+                    streams[i] = NULL;
+                }
+
+                allDone = allDone && !streams[i];
+            }
+
+            if (allDone) {
+                testStage = TEST_STAGE_COMPLETE;
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    initFilesystem();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    fprintf(stderr, "[Success]  %d contiguous files written at once were read back correctly\n", TEST_STREAM_COUNT);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,300 @@
+/**
+ * Fill some clusters with a file and delete it, then create a directory with afatfs_mkdirWithReserve() (which should
+ * reuse those clusters) and check that every reserved entry reads back empty, that the zero-fill didn't go through the
+ * cache, and that filling the reserved entries with files doesn't need any more clusters until the reserve runs out.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "fat_standard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+#define SDCARD_SECTOR_SIZE 512
+
+#define TEST_RESERVE_CLUSTERS 8
+
+#define TEST_RESERVE_SECTORS (TEST_RESERVE_CLUSTERS * afatfs_clusterSize() / SDCARD_SECTOR_SIZE)
+#define TEST_RESERVE_ENTRIES (TEST_RESERVE_CLUSTERS * afatfs_clusterSize() / sizeof(fatDirectoryEntry_t))
+
+// The "." and ".." entries use up the first two reserved entries
+#define TEST_RESERVE_FILES (TEST_RESERVE_ENTRIES - 2)
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_clusterSize();
+
+typedef enum {
+    TEST_STAGE_JUNK_OPEN,
+    TEST_STAGE_JUNK_WRITE,
+    TEST_STAGE_JUNK_DELETE,
+    TEST_STAGE_MKDIR,
+    TEST_STAGE_ENTER_DIRECTORY,
+    TEST_STAGE_SCAN_OPEN,
+    TEST_STAGE_SCAN,
+    TEST_STAGE_SCAN_CLOSE,
+    TEST_STAGE_CREATE_LOG_FILES,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_JUNK_OPEN;
+static testStage_e stageAfterScan;
+
+static afatfsFilePtr_t testFile;
+static afatfsFinder_t finder;
+static uint32_t logEntryIndex;
+
+static uint32_t scannedEntries, scannedLogFiles;
+static uint32_t testLogFileNumber;
+
+static afatfsStats_t statsBeforeFiles;
+static sdcardSimStats_t cardStatsBeforeMkdir;
+
+static void waitForIdle()
+{
+    while (!afatfs_flush() || !sdcard_sim_isReady()) {
+        afatfs_poll();
+    }
+}
+
+static void junkFileCreated(afatfsFilePtr_t file)
+{
+    testAssert(file, "Creating junk file failed");
+
+    testFile = file;
+    testStage = TEST_STAGE_JUNK_WRITE;
+}
+
+static void junkFileDeleted()
+{
+    testStage = TEST_STAGE_MKDIR;
+}
+
+static void logDirectoryCreated(afatfsFilePtr_t directory)
+{
+    testAssert(directory, "Creating log directory failed");
+
+    testFile = directory;
+    testStage = TEST_STAGE_ENTER_DIRECTORY;
+}
+
+static void directoryOpenedForScan(afatfsFilePtr_t directory)
+{
+    testAssert(directory, "Opening the log directory for read failed");
+
+    testFile = directory;
+    scannedEntries = 0;
+    scannedLogFiles = 0;
+
+    afatfs_findFirst(testFile, &finder);
+
+    testStage = TEST_STAGE_SCAN;
+}
+
+static void logFileCreated(afatfsFilePtr_t file)
+{
+    afatfsStats_t stats;
+
+    testAssert(file, "Creating log file failed");
+    testAssert(afatfs_fclose(file, NULL), "Expected close to be queued successfully");
+
+    testLogFileNumber++;
+
+    if (testLogFileNumber == TEST_RESERVE_FILES) {
+        afatfs_getStats(&stats);
+        testAssert(stats.clusterAllocations == statsBeforeFiles.clusterAllocations, "Files in the reserved space shouldn't need the directory to grow");
+    }
+
+    testStage = TEST_STAGE_CREATE_LOG_FILES;
+}
+
+/**
+ * Check one entry of the log directory. Entries after the "." and ".." entries should either be our log files or empty.
+ */
+static void scanDirectoryEntry(fatDirectoryEntry_t *entry)
+{
+    char filenameBuffer[13];
+
+    if (scannedEntries == 0) {
+        testAssert(memcmp(entry->filename, ".          ", FAT_FILENAME_LENGTH) == 0, "Directory should begin with a \".\" entry");
+    } else if (scannedEntries == 1) {
+        testAssert(memcmp(entry->filename, "..         ", FAT_FILENAME_LENGTH) == 0, "Directory should have a \"..\" entry");
+    } else if (!fat_isDirectoryEntryTerminator(entry)) {
+        sprintf(filenameBuffer, "LOG%05uTXT", (unsigned) scannedLogFiles);
+
+        testAssert(memcmp(entry->filename, filenameBuffer, FAT_FILENAME_LENGTH) == 0, "Reserved directory entries should be empty or hold our log files");
+
+        scannedLogFiles++;
+    }
+
+    scannedEntries++;
+}
+
+bool continueTesting()
+{
+    char filenameBuffer[13];
+    fatDirectoryEntry_t *entry;
+    afatfsStats_t stats;
+    sdcardSimStats_t cardStats;
+    uint32_t directWrites;
+
+    switch (testStage) {
+        case TEST_STAGE_JUNK_OPEN:
+            testStage = TEST_STAGE_IDLE;
+            logEntryIndex = 0;
+
+            afatfs_fopen("junk.txt", "a", junkFileCreated);
+        break;
+        case TEST_STAGE_JUNK_WRITE:
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_RESERVE_CLUSTERS * afatfs_clusterSize() / TEST_LOG_ENTRY_SIZE)) {
+                testStage = TEST_STAGE_JUNK_DELETE;
+            }
+        break;
+        case TEST_STAGE_JUNK_DELETE:
+            if (afatfs_funlink(testFile, junkFileDeleted)) {
+                testFile = NULL;
+                testStage = TEST_STAGE_IDLE;
+            }
+        break;
+        case TEST_STAGE_MKDIR:
+            // Make sure the junk is on the card before the directory's zero-fill has to overwrite it
+            waitForIdle();
+            afatfs_resetStats();
+            sdcard_sim_getStats(&cardStatsBeforeMkdir);
+
+            testStage = TEST_STAGE_IDLE;
+
+            afatfs_mkdirWithReserve("logs", TEST_RESERVE_CLUSTERS, logDirectoryCreated);
+        break;
+        case TEST_STAGE_ENTER_DIRECTORY:
+            afatfs_getStats(&stats);
+            testAssert(stats.clusterAllocations == TEST_RESERVE_CLUSTERS, "Directory should have been given every cluster it reserved");
+
+            waitForIdle();
+            afatfs_getStats(&stats);
+            sdcard_sim_getStats(&cardStats);
+
+            // Only the sector with the "." and ".." entries should have gone through the cache
+            directWrites = cardStats.writes - cardStatsBeforeMkdir.writes - stats.dirtyFlushes;
+
+            if (directWrites != TEST_RESERVE_SECTORS - 1) {
+                fprintf(stderr, "[Fail]     Only %u of the %u reserved sectors were zeroed without the cache\n", (unsigned) directWrites, (unsigned) TEST_RESERVE_SECTORS);
+                exit(-1);
+            }
+
+            testAssert(afatfs_chdir(testFile), "Changing into the log directory should succeed");
+            testAssert(afatfs_fclose(testFile, NULL), "Expected to be able to queue close on directory");
+            testFile = NULL;
+
+            stageAfterScan = TEST_STAGE_CREATE_LOG_FILES;
+            testStage = TEST_STAGE_SCAN_OPEN;
+        break;
+        case TEST_STAGE_SCAN_OPEN:
+            testStage = TEST_STAGE_IDLE;
+
+            afatfs_fopen(".", "r", directoryOpenedForScan);
+        break;
+        case TEST_STAGE_SCAN:
+            if (afatfs_findNext(testFile, &finder, &entry) == AFATFS_OPERATION_SUCCESS) {
+                if (entry) {
+                    scanDirectoryEntry(entry);
+                } else {
+                    testStage = TEST_STAGE_SCAN_CLOSE;
+                }
+            }
+        break;
+        case TEST_STAGE_SCAN_CLOSE:
+            afatfs_findLast(testFile);
+
+            if (afatfs_fclose(testFile, NULL)) {
+                testFile = NULL;
+
+                if (stageAfterScan == TEST_STAGE_CREATE_LOG_FILES) {
+                    testAssert(scannedEntries == TEST_RESERVE_ENTRIES && scannedLogFiles == 0, "Reserved directory should hold only empty entries");
+
+                    fprintf(stderr, "[Success]  Directory reserved %u empty entries\n", (unsigned) scannedEntries);
+
+                    afatfs_getStats(&statsBeforeFiles);
+                } else {
+                    testAssert(scannedLogFiles == testLogFileNumber, "Directory should list every file we created");
+                    testAssert(scannedEntries > TEST_RESERVE_ENTRIES, "Directory should have grown past its reserve");
+
+                    fprintf(stderr, "[Success]  Directory with %d reserved clusters held %u files before it had to grow\n", TEST_RESERVE_CLUSTERS, (unsigned) TEST_RESERVE_FILES);
+                }
+
+                testStage = stageAfterScan;
+            }
+        break;
+        case TEST_STAGE_CREATE_LOG_FILES:
+            // One more file than fits in the reserve, so the directory has to grow once
+            if (testLogFileNumber == TEST_RESERVE_FILES + 1) {
+                afatfs_getStats(&stats);
+                testAssert(stats.clusterAllocations == statsBeforeFiles.clusterAllocations + 1, "Directory should grow by a cluster once its reserve is full");
+
+                stageAfterScan = TEST_STAGE_COMPLETE;
+                testStage = TEST_STAGE_SCAN_OPEN;
+            } else {
+                testStage = TEST_STAGE_IDLE;
+
+                sprintf(filenameBuffer, "LOG%05u.TXT", (unsigned) testLogFileNumber);
+
+                afatfs_fopen(filenameBuffer, "a", logFileCreated);
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    afatfs_init();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,397 @@
+/**
+ * Fill a subdirectory with log files, then check that opening a new file doesn't need to scan the whole directory again,
+ * that files which do exist are still found, and that entries freed by deleting files are reused. Then remount and check
+ * that the directory holds exactly the files we expect, in the entries we expect.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "fat_standard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+// Enough files that the directory is much bigger than the cache
+#define TEST_LOG_FILE_COUNT 300
+
+// Files that we'll delete, whose entries should be reused by the files we create afterwards
+#define TEST_DELETED_FILE_1 10
+#define TEST_DELETED_FILE_2 20
+
+// A file that we'll append to after the directory is full, so we can check that it was found rather than created again
+#define TEST_APPENDED_FILE 150
+#define TEST_APPENDED_ENTRY_COUNT 10
+
+/*
+ * Once we know all about the directory, creating a file should only have to touch one or two directory sectors, instead
+ * of reading the whole directory (the occasional false positive from the name filter still scans the directory).
+ */
+#define TEST_MAX_AVERAGE_POLLS_PER_CREATE 8
+
+// The entries for "." and ".." come first in a subdirectory
+#define TEST_FIRST_LOG_ENTRY 2
+
+typedef enum {
+    TEST_STAGE_CREATE_LOG_DIRECTORY,
+    TEST_STAGE_CREATE_LOG_FILES,
+    TEST_STAGE_OPEN_MISSING_FILE,
+    TEST_STAGE_OPEN_APPENDED_FILE,
+    TEST_STAGE_WRITE_APPENDED_FILE,
+    TEST_STAGE_CLOSE_APPENDED_FILE,
+    TEST_STAGE_OPEN_DELETED_FILE,
+    TEST_STAGE_DELETE_FILE,
+    TEST_STAGE_CREATE_REPLACEMENT_FILE,
+    TEST_STAGE_REMOUNT,
+    TEST_STAGE_OPEN_LOG_DIRECTORY,
+    TEST_STAGE_REOPEN_APPENDED_FILE,
+    TEST_STAGE_CLOSE_REOPENED_FILE,
+    TEST_STAGE_VALIDATE_DIRECTORY_CONTENTS,
+    TEST_STAGE_CLOSE_LOG_DIRECTORY,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_CREATE_LOG_DIRECTORY;
+
+static const int deletedFiles[] = {TEST_DELETED_FILE_1, TEST_DELETED_FILE_2};
+#define TEST_DELETED_FILE_COUNT ((int) (sizeof(deletedFiles) / sizeof(deletedFiles[0])))
+
+static int logFilesCreated, filesDeleted, replacementFilesCreated;
+
+static afatfsFilePtr_t testFile, logDirectory;
+static afatfsFinder_t finder;
+static int entriesValidated;
+
+static uint32_t logEntryIndex;
+
+static uint32_t pollCount, openPollCount, createPollCount;
+
+static void initFilesystem()
+{
+    afatfs_init();
+
+    while (afatfs_getFilesystemState() != AFATFS_FILESYSTEM_STATE_READY) {
+        afatfs_poll();
+
+        if (afatfs_getFilesystemState() == AFATFS_FILESYSTEM_STATE_FATAL) {
+            fprintf(stderr, "[Fail]     Fatal filesystem error during init\n");
+            exit(-1);
+        }
+    }
+}
+
+static void getLogFilename(int fileNumber, char *filename)
+{
+    sprintf(filename, "LOG%05d.TXT", fileNumber);
+}
+
+static void getReplacementFilename(int fileNumber, char *filename)
+{
+    sprintf(filename, "NEW%05d.TXT", fileNumber);
+}
+
+/**
+ * Get the 8.3 name that should be held by the entry with the given index in the log directory.
+ */
+static void getExpectedEntryName(int entryIndex, char *fatFilename)
+{
+    char filename[13];
+    int fileNumber = entryIndex - TEST_FIRST_LOG_ENTRY;
+
+    // The replacement files take over the entries of the files we deleted
+    for (int i = 0; i < TEST_DELETED_FILE_COUNT; i++) {
+        if (fileNumber == deletedFiles[i]) {
+            getReplacementFilename(i, filename);
+            fat_convertFilenameToFATStyle(filename, (uint8_t*) fatFilename);
+            return;
+        }
+    }
+
+    getLogFilename(fileNumber, filename);
+    fat_convertFilenameToFATStyle(filename, (uint8_t*) fatFilename);
+}
+
+static void logDirCreated(afatfsFilePtr_t dir)
+{
+    testAssert(dir, "Creating 'logs' directory failed");
+
+    afatfs_chdir(dir);
+    testAssert(afatfs_fclose(dir, NULL), "Expected to be able to queue close on directory");
+
+    testStage = TEST_STAGE_CREATE_LOG_FILES;
+}
+
+static void logFileCreated(afatfsFilePtr_t file)
+{
+    testAssert(file, "Creating log file failed");
+
+    // The first file has to scan the new directory, after that we should know everything about it
+    if (logFilesCreated > 0) {
+        createPollCount += pollCount - openPollCount;
+    }
+
+    afatfs_fclose(file, NULL);
+
+    logFilesCreated++;
+    testStage = TEST_STAGE_CREATE_LOG_FILES;
+}
+
+static void missingFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(!file, "Opening a file that doesn't exist for read should fail");
+
+    testStage = TEST_STAGE_OPEN_APPENDED_FILE;
+}
+
+static void appendedFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening existing file for append failed");
+
+    testFile = file;
+    logEntryIndex = 0;
+
+    testStage = TEST_STAGE_WRITE_APPENDED_FILE;
+}
+
+static void deletedFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening file to be deleted failed");
+
+    testFile = file;
+    testStage = TEST_STAGE_DELETE_FILE;
+}
+
+static void fileDeleted()
+{
+    testStage = TEST_STAGE_CREATE_REPLACEMENT_FILE;
+}
+
+static void replacementFileCreated(afatfsFilePtr_t file)
+{
+    testAssert(file, "Creating replacement file failed");
+
+    afatfs_fclose(file, NULL);
+
+    replacementFilesCreated++;
+    testStage = replacementFilesCreated < TEST_DELETED_FILE_COUNT ? TEST_STAGE_OPEN_DELETED_FILE : TEST_STAGE_REMOUNT;
+}
+
+static void logDirectoryOpened(afatfsFilePtr_t dir)
+{
+    testAssert(dir, "Opening 'logs' directory failed");
+
+    logDirectory = dir;
+    testAssert(afatfs_chdir(logDirectory), "Changing to 'logs' directory failed");
+
+    testStage = TEST_STAGE_REOPEN_APPENDED_FILE;
+}
+
+static void appendedFileReopened(afatfsFilePtr_t file)
+{
+    uint32_t position;
+
+    testAssert(file, "Reopening existing file for append failed");
+    testAssert(afatfs_ftell(file, &position) && position == TEST_APPENDED_ENTRY_COUNT * TEST_LOG_ENTRY_SIZE, "Appended file has the wrong size");
+
+    testFile = file;
+    testStage = TEST_STAGE_CLOSE_REOPENED_FILE;
+}
+
+static void validateDirectoryEntry(fatDirectoryEntry_t *entry)
+{
+    char expectedName[FAT_FILENAME_LENGTH];
+
+    if (fat_isDirectoryEntryTerminator(entry)) {
+        testAssert(entriesValidated == TEST_FIRST_LOG_ENTRY + TEST_LOG_FILE_COUNT, "Directory ended early");
+
+        testStage = TEST_STAGE_CLOSE_LOG_DIRECTORY;
+        return;
+    }
+
+    testAssert(entriesValidated < TEST_FIRST_LOG_ENTRY + TEST_LOG_FILE_COUNT, "Directory has more entries than the files we created");
+
+    if (entriesValidated >= TEST_FIRST_LOG_ENTRY) {
+        getExpectedEntryName(entriesValidated, expectedName);
+
+        if (memcmp(entry->filename, expectedName, FAT_FILENAME_LENGTH) != 0) {
+            fprintf(stderr, "[Fail]     Entry %d should be %.11s but was %.11s\n", entriesValidated, expectedName, entry->filename);
+            exit(-1);
+        }
+    }
+
+    entriesValidated++;
+}
+
+bool continueTesting()
+{
+    char filename[13];
+    fatDirectoryEntry_t *entry;
+    afatfsOperationStatus_e status;
+
+    switch (testStage) {
+        case TEST_STAGE_CREATE_LOG_DIRECTORY:
+            // The callback can be called before mkdir() returns, so set the testStage first
+            testStage = TEST_STAGE_IDLE;
+
+            afatfs_mkdir("logs", logDirCreated);
+        break;
+        case TEST_STAGE_CREATE_LOG_FILES:
+            if (logFilesCreated == TEST_LOG_FILE_COUNT) {
+                testAssert(
+                    createPollCount <= TEST_MAX_AVERAGE_POLLS_PER_CREATE * (TEST_LOG_FILE_COUNT - 1),
+                    "Creating files searched too much of the directory"
+                );
+
+                testStage = TEST_STAGE_OPEN_MISSING_FILE;
+            } else {
+                testStage = TEST_STAGE_IDLE;
+
+                getLogFilename(logFilesCreated, filename);
+
+                openPollCount = pollCount;
+                afatfs_fopen(filename, "a", logFileCreated);
+            }
+        break;
+        case TEST_STAGE_OPEN_MISSING_FILE:
+            testStage = TEST_STAGE_IDLE;
+
+            afatfs_fopen("MISSING.TXT", "r", missingFileOpened);
+        break;
+        case TEST_STAGE_OPEN_APPENDED_FILE:
+            testStage = TEST_STAGE_IDLE;
+
+            getLogFilename(TEST_APPENDED_FILE, filename);
+            afatfs_fopen(filename, "a", appendedFileOpened);
+        break;
+        case TEST_STAGE_WRITE_APPENDED_FILE:
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_APPENDED_ENTRY_COUNT)) {
+                testStage = TEST_STAGE_CLOSE_APPENDED_FILE;
+            }
+        break;
+        case TEST_STAGE_CLOSE_APPENDED_FILE:
+            if (afatfs_fclose(testFile, NULL)) {
+                testStage = TEST_STAGE_OPEN_DELETED_FILE;
+            }
+        break;
+        case TEST_STAGE_OPEN_DELETED_FILE:
+            testStage = TEST_STAGE_IDLE;
+
+            getLogFilename(deletedFiles[filesDeleted], filename);
+            afatfs_fopen(filename, "r", deletedFileOpened);
+        break;
+        case TEST_STAGE_DELETE_FILE:
+            if (afatfs_funlink(testFile, fileDeleted)) {
+                filesDeleted++;
+                testStage = TEST_STAGE_IDLE;
+            }
+        break;
+        case TEST_STAGE_CREATE_REPLACEMENT_FILE:
+            testStage = TEST_STAGE_IDLE;
+
+            getReplacementFilename(replacementFilesCreated, filename);
+            afatfs_fopen(filename, "a", replacementFileCreated);
+        break;
+        case TEST_STAGE_REMOUNT:
+            while (!afatfs_destroy(false)) {
+            }
+
+            initFilesystem();
+
+            testStage = TEST_STAGE_OPEN_LOG_DIRECTORY;
+        break;
+        case TEST_STAGE_OPEN_LOG_DIRECTORY:
+            testStage = TEST_STAGE_IDLE;
+
+            afatfs_fopen("logs", "r", logDirectoryOpened);
+        break;
+        case TEST_STAGE_REOPEN_APPENDED_FILE:
+            testStage = TEST_STAGE_IDLE;
+
+            // If this file wasn't found we'd end up with a second empty copy of it in the directory
+            getLogFilename(TEST_APPENDED_FILE, filename);
+            afatfs_fopen(filename, "a", appendedFileReopened);
+        break;
+        case TEST_STAGE_CLOSE_REOPENED_FILE:
+            if (afatfs_fclose(testFile, NULL)) {
+                afatfs_findFirst(logDirectory, &finder);
+                entriesValidated = 0;
+
+                testStage = TEST_STAGE_VALIDATE_DIRECTORY_CONTENTS;
+            }
+        break;
+        case TEST_STAGE_VALIDATE_DIRECTORY_CONTENTS:
+            status = afatfs_findNext(logDirectory, &finder, &entry);
+
+            if (status == AFATFS_OPERATION_SUCCESS) {
+                testAssert(entry, "Directory should end with a terminator entry");
+
+                validateDirectoryEntry(entry);
+            }
+        break;
+        case TEST_STAGE_CLOSE_LOG_DIRECTORY:
+            afatfs_findLast(logDirectory);
+
+            if (afatfs_fclose(logDirectory, NULL)) {
+                testStage = TEST_STAGE_COMPLETE;
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    initFilesystem();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+        pollCount++;
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    fprintf(stderr, "[Success]  Directory of %d files created in %.1f polls per file\n", TEST_LOG_FILE_COUNT,
+        (double) createPollCount / (TEST_LOG_FILE_COUNT - 1));
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,288 @@
+/**
+ * Check that files opened with afatfs_fopenWithDurability() only bring their directory entries up to date as often as
+ * their policy asks, by cutting the power after writing a few clusters and measuring what can be read back, and that
+ * a clean close still records the true size no matter the policy.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+#define SDCARD_SECTOR_SIZE 512
+
+// Every test file gets two whole clusters and a sector of log entries, so three clusters are added to it
+#define TEST_LOG_ENTRY_COUNT ((2 * afatfs_clusterSize() + SDCARD_SECTOR_SIZE) / TEST_LOG_ENTRY_SIZE)
+
+#define TEST_SAVE_INTERVAL_MS 100
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_clusterSize();
+
+typedef enum {
+    TEST_STAGE_EVERY_ALLOCATION,
+    TEST_STAGE_EVERY_2_ALLOCATIONS,
+    TEST_STAGE_INTERVAL,
+    TEST_STAGE_ON_CLOSE,
+    TEST_STAGE_ON_CLOSE_CLEAN,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+typedef enum {
+    DURABILITY_TEST_STAGE_OPEN,
+    DURABILITY_TEST_STAGE_APPEND,
+    DURABILITY_TEST_STAGE_WAIT_FOR_INTERVAL,
+    DURABILITY_TEST_STAGE_FINISH,
+    DURABILITY_TEST_STAGE_READ_OPEN,
+    DURABILITY_TEST_STAGE_READ_SEEK_TO_END,
+    DURABILITY_TEST_STAGE_READ_MEASURE_FILE_LENGTH,
+    DURABILITY_TEST_STAGE_READ_VALIDATE,
+    DURABILITY_TEST_STAGE_READ_CLOSE,
+    DURABILITY_TEST_STAGE_IDLE
+} durabilityTestStage_e;
+
+static testStage_e testStage = TEST_STAGE_EVERY_ALLOCATION;
+static durabilityTestStage_e durabilityStage = DURABILITY_TEST_STAGE_OPEN;
+
+static afatfsFilePtr_t testFile;
+static uint32_t logEntryIndex;
+
+static uint32_t testMillis;
+
+static uint32_t testGetMillis()
+{
+    return testMillis;
+}
+
+static void initFilesystem()
+{
+    afatfs_init();
+
+    while (afatfs_getFilesystemState() != AFATFS_FILESYSTEM_STATE_READY) {
+        afatfs_poll();
+
+        if (afatfs_getFilesystemState() == AFATFS_FILESYSTEM_STATE_FATAL) {
+            fprintf(stderr, "[Fail]     Fatal filesystem error during init\n");
+            exit(-1);
+        }
+    }
+
+    afatfs_setMillisCallback(testGetMillis);
+}
+
+static void testFileCreated(afatfsFilePtr_t file)
+{
+    testAssert(file, "Creating test file failed");
+
+    testFile = file;
+    durabilityStage = DURABILITY_TEST_STAGE_APPEND;
+}
+
+static void testFileOpenedForRead(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening test file for read failed");
+
+    testFile = file;
+    durabilityStage = DURABILITY_TEST_STAGE_READ_SEEK_TO_END;
+}
+
+/**
+ * Write the test file with the given durability policy, then either cut the power or close the file cleanly, and check
+ * that exactly `expectedSize` bytes can be read back afterwards.
+ *
+ * Returns true if the test is still continuing, or false if the test was completed successfully.
+ */
+static bool continueDurabilityTest(const char *filename, const char *fileMode, const afatfsDurability_t *durability,
+    bool closeCleanly, uint32_t expectedSize)
+{
+    uint32_t position, validEntries;
+
+    switch (durabilityStage) {
+        case DURABILITY_TEST_STAGE_OPEN:
+            durabilityStage = DURABILITY_TEST_STAGE_IDLE;
+            logEntryIndex = 0;
+
+            afatfs_fopenWithDurability(filename, fileMode, durability, testFileCreated);
+        break;
+        case DURABILITY_TEST_STAGE_APPEND:
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_LOG_ENTRY_COUNT)) {
+                durabilityStage = durability->policy == AFATFS_DURABILITY_INTERVAL
+                    ? DURABILITY_TEST_STAGE_WAIT_FOR_INTERVAL : DURABILITY_TEST_STAGE_FINISH;
+            }
+        break;
+        case DURABILITY_TEST_STAGE_WAIT_FOR_INTERVAL:
+            // The file was written in no time at all, so its entry is only saved once the clock moves on
+            testMillis += TEST_SAVE_INTERVAL_MS;
+            durabilityStage = DURABILITY_TEST_STAGE_FINISH;
+        break;
+        case DURABILITY_TEST_STAGE_FINISH:
+            if (closeCleanly) {
+                if (afatfs_fclose(testFile, NULL)) {
+                    testFile = NULL;
+                    durabilityStage = DURABILITY_TEST_STAGE_READ_OPEN;
+                }
+            } else if (afatfs_flush() && sdcard_sim_isReady()) {
+                // Simulate a power interruption by restarting the filesystem
+                afatfs_destroy(true);
+                testFile = NULL;
+
+                initFilesystem();
+
+                durabilityStage = DURABILITY_TEST_STAGE_READ_OPEN;
+            }
+        break;
+        case DURABILITY_TEST_STAGE_READ_OPEN:
+            durabilityStage = DURABILITY_TEST_STAGE_IDLE;
+            logEntryIndex = 0;
+
+            afatfs_fopen(filename, "r", testFileOpenedForRead);
+        break;
+        case DURABILITY_TEST_STAGE_READ_SEEK_TO_END:
+            testAssert(afatfs_fseek(testFile, 0, AFATFS_SEEK_END) != AFATFS_OPERATION_FAILURE, "Seek to end should work");
+
+            durabilityStage = DURABILITY_TEST_STAGE_READ_MEASURE_FILE_LENGTH;
+        break;
+        case DURABILITY_TEST_STAGE_READ_MEASURE_FILE_LENGTH:
+            if (afatfs_ftell(testFile, &position)) {
+                if (position != expectedSize) {
+                    fprintf(stderr, "[Fail]     %s should have been %u bytes long but was %u\n", filename, (unsigned) expectedSize, (unsigned) position);
+                    exit(-1);
+                }
+
+                testAssert(afatfs_fseek(testFile, 0, AFATFS_SEEK_SET) == AFATFS_OPERATION_SUCCESS, "Should be able to seek to beginning of file instantly");
+                durabilityStage = DURABILITY_TEST_STAGE_READ_VALIDATE;
+            }
+        break;
+        case DURABILITY_TEST_STAGE_READ_VALIDATE:
+            /*
+             * Whatever the directory entry covers must be readable, except that after a power cut, the final sector we
+             * wrote might not have reached the card.
+             */
+            validEntries = closeCleanly ? TEST_LOG_ENTRY_COUNT : 2 * afatfs_clusterSize() / TEST_LOG_ENTRY_SIZE;
+
+            if (validEntries > expectedSize / TEST_LOG_ENTRY_SIZE) {
+                validEntries = expectedSize / TEST_LOG_ENTRY_SIZE;
+            }
+
+            if (validateLogTestEntries(testFile, &logEntryIndex, validEntries)) {
+                durabilityStage = DURABILITY_TEST_STAGE_READ_CLOSE;
+            }
+        break;
+        case DURABILITY_TEST_STAGE_READ_CLOSE:
+            if (afatfs_fclose(testFile, NULL)) {
+                testFile = NULL;
+                durabilityStage = DURABILITY_TEST_STAGE_OPEN;
+
+                return false;
+            }
+        break;
+        case DURABILITY_TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+    }
+
+    return true;
+}
+
+bool continueTesting()
+{
+    afatfsDurability_t durability = {AFATFS_DURABILITY_EVERY_ALLOCATION, 0};
+
+    switch (testStage) {
+        case TEST_STAGE_EVERY_ALLOCATION:
+            // The entry covers all three clusters
+            if (!continueDurabilityTest("every.txt", "a", &durability, false, 3 * afatfs_clusterSize())) {
+                fprintf(stderr, "[Success]  Directory entry saved for every cluster added\n");
+                testStage = TEST_STAGE_EVERY_2_ALLOCATIONS;
+            }
+        break;
+        case TEST_STAGE_EVERY_2_ALLOCATIONS:
+            durability.policy = AFATFS_DURABILITY_EVERY_N_ALLOCATIONS;
+            durability.interval = 2;
+
+            // The third cluster came after the last save
+            if (!continueDurabilityTest("every2.txt", "a", &durability, false, 2 * afatfs_clusterSize())) {
+                fprintf(stderr, "[Success]  Directory entry saved for every second cluster added\n");
+                testStage = TEST_STAGE_INTERVAL;
+            }
+        break;
+        case TEST_STAGE_INTERVAL:
+            durability.policy = AFATFS_DURABILITY_INTERVAL;
+            durability.interval = TEST_SAVE_INTERVAL_MS;
+
+            // No time passed while the clusters were added, but the entry is saved once the interval is up
+            if (!continueDurabilityTest("interval.txt", "a", &durability, false, 3 * afatfs_clusterSize())) {
+                fprintf(stderr, "[Success]  Directory entry saved once its interval passed\n");
+                testStage = TEST_STAGE_ON_CLOSE;
+            }
+        break;
+        case TEST_STAGE_ON_CLOSE:
+            durability.policy = AFATFS_DURABILITY_ON_CLOSE;
+
+            // The entry was never saved, so the file is still empty
+            if (!continueDurabilityTest("close.txt", "as", &durability, false, 0)) {
+                testStage = TEST_STAGE_ON_CLOSE_CLEAN;
+            }
+        break;
+        case TEST_STAGE_ON_CLOSE_CLEAN:
+            durability.policy = AFATFS_DURABILITY_ON_CLOSE;
+
+            if (!continueDurabilityTest("close2.txt", "as", &durability, true, TEST_LOG_ENTRY_COUNT * TEST_LOG_ENTRY_SIZE)) {
+                fprintf(stderr, "[Success]  Directory entry only saved on close\n");
+                testStage = TEST_STAGE_COMPLETE;
+            }
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    initFilesystem();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,204 @@
+/**
+ * Write files in both the "a" and "as" modes, delete one of them, then shut down the filesystem and check that the
+ * second FAT on the disk is an exact copy of the first.
+ *
+ * This test must be built with AFATFS_FAT_MIRROR_POLICY set to AFATFS_FAT_MIRROR_LOCKSTEP or
+ * AFATFS_FAT_MIRROR_DEFERRED.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+#include "fat_standard.h"
+
+#include "common.h"
+
+#define SDCARD_SECTOR_SIZE 512
+
+// Give the files a few clusters each so that their FAT chains span several entries
+#define TEST_LOG_ENTRY_COUNT ((afatfs_clusterSize() * 3 + 100) / TEST_LOG_ENTRY_SIZE)
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_clusterSize();
+
+typedef enum {
+    TEST_STAGE_CREATE_APPEND,
+    TEST_STAGE_FILL_APPEND,
+    TEST_STAGE_CLOSE_APPEND,
+    TEST_STAGE_FILL_SOLID,
+    TEST_STAGE_CLOSE_SOLID,
+    TEST_STAGE_UNLINK,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_CREATE_APPEND;
+// The stage to move to once the file we're opening is ready
+static testStage_e openedStage;
+
+static afatfsFilePtr_t testFile;
+static uint32_t logEntryIndex;
+
+static void testFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening testfile failed");
+
+    testFile = file;
+    logEntryIndex = 0;
+
+    testStage = openedStage;
+}
+
+static void testFileUnlinked()
+{
+    testFile = NULL;
+    testStage = TEST_STAGE_COMPLETE;
+}
+
+bool continueTesting()
+{
+    switch (testStage) {
+        case TEST_STAGE_CREATE_APPEND:
+            testStage = TEST_STAGE_IDLE;
+            openedStage = TEST_STAGE_FILL_APPEND;
+            afatfs_fopen("append.txt", "a", testFileOpened);
+        break;
+        case TEST_STAGE_FILL_APPEND:
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_LOG_ENTRY_COUNT)) {
+                testStage = TEST_STAGE_CLOSE_APPEND;
+            }
+        break;
+        case TEST_STAGE_FILL_SOLID:
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_LOG_ENTRY_COUNT)) {
+                testStage = TEST_STAGE_CLOSE_SOLID;
+            }
+        break;
+        case TEST_STAGE_CLOSE_APPEND:
+            if (afatfs_fclose(testFile, NULL)) {
+                testStage = TEST_STAGE_IDLE;
+                openedStage = TEST_STAGE_FILL_SOLID;
+                afatfs_fopen("solid.txt", "as", testFileOpened);
+            }
+        break;
+        case TEST_STAGE_CLOSE_SOLID:
+            if (afatfs_fclose(testFile, NULL)) {
+                testStage = TEST_STAGE_IDLE;
+                openedStage = TEST_STAGE_UNLINK;
+                afatfs_fopen("append.txt", "r", testFileOpened);
+            }
+        break;
+        case TEST_STAGE_UNLINK:
+            if (afatfs_funlink(testFile, testFileUnlinked)) {
+                testStage = TEST_STAGE_IDLE;
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+static void readSector(FILE *image, uint32_t sectorIndex, uint8_t *buffer)
+{
+    testAssert(fseeko(image, (off_t) sectorIndex * SDCARD_SECTOR_SIZE, SEEK_SET) == 0, "Seeking in the disk image failed");
+    testAssert(fread(buffer, SDCARD_SECTOR_SIZE, 1, image) == 1, "Reading from the disk image failed");
+}
+
+/**
+ * Compare the two FATs on the disk image sector by sector.
+ */
+static void validateFATMirror(const char *filename)
+{
+    uint8_t sector[SDCARD_SECTOR_SIZE], mirrorSector[SDCARD_SECTOR_SIZE];
+    uint32_t partitionStartSector = 0;
+    FILE *image = fopen(filename, "rb");
+
+    testAssert(image, "Couldn't reopen the disk image");
+
+    readSector(image, 0, sector);
+
+    mbrPartitionEntry_t *partition = (mbrPartitionEntry_t *) (sector + 446);
+
+    for (int i = 0; i < 4; i++) {
+        if (partition[i].lbaBegin > 0) {
+            partitionStartSector = partition[i].lbaBegin;
+            break;
+        }
+    }
+
+    readSector(image, partitionStartSector, sector);
+
+    fatVolumeID_t *volume = (fatVolumeID_t *) sector;
+
+    testAssert(volume->numFATs == 2, "Test volume was expected to have two FATs");
+
+    uint32_t fatStartSector = partitionStartSector + volume->reservedSectorCount;
+    uint32_t fatSectors = volume->FATSize16 != 0 ? volume->FATSize16 : volume->fatDescriptor.fat32.FATSize32;
+
+    for (uint32_t i = 0; i < fatSectors; i++) {
+        readSector(image, fatStartSector + i, sector);
+        readSector(image, fatStartSector + fatSectors + i, mirrorSector);
+
+        if (memcmp(sector, mirrorSector, SDCARD_SECTOR_SIZE) != 0) {
+            fprintf(stderr, "[Fail]     Sector %u of the second FAT doesn't match the first FAT\n", i);
+            exit(-1);
+        }
+    }
+
+    fclose(image);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    afatfs_init();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    validateFATMirror(argv[1]);
+
+    fprintf(stderr, "[Success]  Second FAT is an exact copy of the first after shutdown\n");
+
+    return EXIT_SUCCESS;
+}
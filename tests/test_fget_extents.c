@@ -0,0 +1,354 @@
+/**
+ * Export files by asking afatfs_fgetExtents() where their data lies and reading those sectors from the card ourselves,
+ * and check that we read back exactly what was written. This is done for a fragmented file which still has unflushed
+ * writes in the cache, and for a contiguous file, which should be described as a single run of sectors.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+#define SDCARD_SECTOR_SIZE 512
+
+// How many times to switch between writing a cluster to each of the two interleaved files
+#define TEST_WRITE_ROUNDS 6
+// Extra log entries for the end of the fragmented file, so that it ends partway through a sector
+#define TEST_TAIL_LOG_ENTRIES 5
+
+#define TEST_SOLID_CLUSTERS 3
+
+// Ask for few extents at a time so that the export of the fragmented file needs several calls
+#define TEST_MAX_EXTENTS 2
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_clusterSize();
+
+typedef enum {
+    TEST_STAGE_OPEN,
+    TEST_STAGE_WRITE,
+    TEST_STAGE_CHECK_REJECTED,
+    TEST_STAGE_EXPORT_FRAGMENTED,
+    TEST_STAGE_CLOSE,
+    TEST_STAGE_OPEN_SOLID,
+    TEST_STAGE_WRITE_SOLID,
+    TEST_STAGE_CLOSE_SOLID,
+    TEST_STAGE_OPEN_SOLID_READ,
+    TEST_STAGE_READ_SOLID,
+    TEST_STAGE_EXPORT_SOLID,
+    TEST_STAGE_CLOSE_SOLID_READ,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_OPEN;
+
+static afatfsFilePtr_t files[2];
+static uint32_t logEntryIndex[2];
+static int writeRound;
+
+static uint32_t exportOffset, exportSize;
+static uint32_t exportRuns, exportNextSector;
+static uint32_t fragmentedRuns;
+
+static uint32_t freeBufferSpaceBeforeExport;
+
+static volatile bool directReadComplete;
+
+static void fragmentedFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening fragmented file failed");
+
+    files[0] = file;
+}
+
+static void otherFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening other file failed");
+
+    files[1] = file;
+
+    testStage = TEST_STAGE_WRITE;
+}
+
+static void solidFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening contiguous file failed");
+
+    files[0] = file;
+    logEntryIndex[0] = 0;
+
+    testStage = TEST_STAGE_WRITE_SOLID;
+}
+
+static void solidFileOpenedForRead(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening contiguous file for read failed");
+
+    files[0] = file;
+
+    testStage = TEST_STAGE_READ_SOLID;
+}
+
+static uint32_t entriesPerCluster()
+{
+    return afatfs_clusterSize() / TEST_LOG_ENTRY_SIZE;
+}
+
+static void sdcardDirectReadComplete(sdcardBlockOperation_e operation, uint32_t blockIndex, uint8_t *buffer, uint32_t callbackData)
+{
+    (void) operation;
+    (void) blockIndex;
+    (void) callbackData;
+
+    testAssert(buffer != NULL, "Direct read of sector failed");
+
+    directReadComplete = true;
+}
+
+/**
+ * Read the given sector from the card without going through the filesystem.
+ */
+static void readSectorDirect(uint32_t sectorIndex, uint8_t *buffer)
+{
+    directReadComplete = false;
+
+    while (!sdcard_readBlock(sectorIndex, buffer, sdcardDirectReadComplete, 0)) {
+        sdcard_poll();
+    }
+
+    while (!directReadComplete) {
+        sdcard_poll();
+    }
+}
+
+/**
+ * Read the sectors of the given extent from the card and check that they hold the log entries that were written at
+ * that position in the file.
+ */
+static void validateExtent(const afatfsExtent_t *extent)
+{
+    uint8_t sector[SDCARD_SECTOR_SIZE];
+
+    testAssert(extent->sectorCount > 0, "Extents should never be empty");
+
+    if (extent->sectorIndex != exportNextSector) {
+        exportRuns++;
+    }
+
+    for (uint32_t i = 0; i < extent->sectorCount; i++) {
+        testAssert(exportOffset < exportSize, "Extents extend beyond the end of the file");
+
+        readSectorDirect(extent->sectorIndex + i, sector);
+
+        for (uint32_t j = 0; j < SDCARD_SECTOR_SIZE && exportOffset + j < exportSize; j++) {
+            if (sector[j] != (uint8_t) ((exportOffset + j) / TEST_LOG_ENTRY_SIZE)) {
+                fprintf(stderr, "[Fail]     Byte %u of file read directly from sector %u was %u\n",
+                    exportOffset + j, extent->sectorIndex + i, sector[j]);
+                exit(-1);
+            }
+        }
+
+        exportOffset += SDCARD_SECTOR_SIZE;
+    }
+
+    exportNextSector = extent->sectorIndex + extent->sectorCount;
+}
+
+static void beginExport(uint32_t fileSize)
+{
+    exportOffset = 0;
+    exportSize = fileSize;
+    exportRuns = 0;
+    exportNextSector = 0;
+}
+
+/**
+ * Fetch and validate the next extents of files[0].
+ *
+ * Returns true once the whole file has been exported.
+ */
+static bool continueExport()
+{
+    afatfsExtent_t extents[TEST_MAX_EXTENTS];
+    int extentCount;
+
+    switch (afatfs_fgetExtents(files[0], exportOffset, UINT32_MAX, extents, TEST_MAX_EXTENTS, &extentCount)) {
+        case AFATFS_OPERATION_SUCCESS:
+            if (extentCount == 0) {
+                testAssert(exportOffset >= exportSize, "Extents ended before the end of the file");
+
+                return true;
+            }
+
+            for (int i = 0; i < extentCount; i++) {
+                validateExtent(&extents[i]);
+            }
+        break;
+        case AFATFS_OPERATION_IN_PROGRESS:
+            // Try again on the next poll
+        break;
+        case AFATFS_OPERATION_FAILURE:
+            testAssert(false, "Getting the extents of a readable file failed");
+        break;
+    }
+
+    return false;
+}
+
+bool continueTesting()
+{
+    afatfsExtent_t extent;
+    int extentCount;
+    uint8_t readBuffer[2 * SDCARD_SECTOR_SIZE];
+
+    switch (testStage) {
+        case TEST_STAGE_OPEN:
+            testStage = TEST_STAGE_IDLE;
+
+            afatfs_fopen("fragment.txt", "w+", fragmentedFileOpened);
+            afatfs_fopen("other.txt", "w", otherFileOpened);
+        break;
+        case TEST_STAGE_WRITE:
+            if (writeRound == TEST_WRITE_ROUNDS) {
+                if (writeLogTestEntries(files[0], &logEntryIndex[0], writeRound * entriesPerCluster() + TEST_TAIL_LOG_ENTRIES)) {
+                    testStage = TEST_STAGE_CHECK_REJECTED;
+                }
+            } else {
+                afatfsFilePtr_t file = files[writeRound % 2];
+
+                if (writeLogTestEntries(file, &logEntryIndex[writeRound % 2], (writeRound / 2 + 1) * entriesPerCluster())) {
+                    writeRound++;
+                }
+            }
+        break;
+        case TEST_STAGE_CHECK_REJECTED:
+            testAssert(afatfs_fgetExtents(files[0], 1, UINT32_MAX, &extent, 1, &extentCount) == AFATFS_OPERATION_FAILURE,
+                "Extents for an offset that isn't sector-aligned should be refused");
+            testAssert(afatfs_fgetExtents(files[1], 0, UINT32_MAX, &extent, 1, &extentCount) == AFATFS_OPERATION_FAILURE,
+                "Extents for a file that isn't open for reading should be refused");
+
+            // The fragmented file still has its latest writes in the cache, so those must be flushed during the export
+            beginExport(logEntryIndex[0] * TEST_LOG_ENTRY_SIZE);
+
+            testStage = TEST_STAGE_EXPORT_FRAGMENTED;
+        break;
+        case TEST_STAGE_EXPORT_FRAGMENTED:
+            if (continueExport()) {
+                fragmentedRuns = exportRuns;
+
+                testAssert(fragmentedRuns >= TEST_WRITE_ROUNDS / 2, "Fragmented file should have been made up of several runs");
+
+                testStage = TEST_STAGE_CLOSE;
+            }
+        break;
+        case TEST_STAGE_CLOSE:
+            if (afatfs_fclose(files[0], NULL) && afatfs_fclose(files[1], NULL)) {
+                testStage = TEST_STAGE_OPEN_SOLID;
+            }
+        break;
+        case TEST_STAGE_OPEN_SOLID:
+            testStage = TEST_STAGE_IDLE;
+
+            afatfs_fopen("solid.bin", "as", solidFileOpened);
+        break;
+        case TEST_STAGE_WRITE_SOLID:
+            if (writeLogTestEntries(files[0], &logEntryIndex[0], TEST_SOLID_CLUSTERS * entriesPerCluster())) {
+                testStage = TEST_STAGE_CLOSE_SOLID;
+            }
+        break;
+        case TEST_STAGE_CLOSE_SOLID:
+            if (afatfs_fclose(files[0], NULL)) {
+                testStage = TEST_STAGE_OPEN_SOLID_READ;
+            }
+        break;
+        case TEST_STAGE_OPEN_SOLID_READ:
+            testStage = TEST_STAGE_IDLE;
+
+            afatfs_fopen("solid.bin", "r", solidFileOpenedForRead);
+        break;
+        case TEST_STAGE_READ_SOLID:
+            // Pull the start of the file into the cache with a regular read first
+            if (afatfs_fread(files[0], readBuffer, sizeof(readBuffer)) == sizeof(readBuffer)) {
+                freeBufferSpaceBeforeExport = afatfs_getFreeBufferSpace();
+
+                beginExport(TEST_SOLID_CLUSTERS * afatfs_clusterSize());
+
+                testStage = TEST_STAGE_EXPORT_SOLID;
+            }
+        break;
+        case TEST_STAGE_EXPORT_SOLID:
+            if (continueExport()) {
+                testAssert(exportRuns == 1, "Contiguous file should have been exported as a single run of sectors");
+
+                // Both the cached copies of the range and the FAT sectors we walked should be the first to be evicted
+                testAssert(afatfs_getFreeBufferSpace() >= freeBufferSpaceBeforeExport,
+                    "Exporting the file should not have taken up space in the cache");
+
+                testStage = TEST_STAGE_CLOSE_SOLID_READ;
+            }
+        break;
+        case TEST_STAGE_CLOSE_SOLID_READ:
+            if (afatfs_fclose(files[0], NULL)) {
+                testStage = TEST_STAGE_COMPLETE;
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    afatfs_init();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    fprintf(stderr, "[Success]  Exported a fragmented file in %u runs and a contiguous file in 1 run using direct reads\n", fragmentedRuns);
+
+    return EXIT_SUCCESS;
+}
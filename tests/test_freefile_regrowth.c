@@ -0,0 +1,470 @@
+/**
+ * Start from a volume where a large regular file ("ballast") fills most of the space, so that the freefile can only
+ * be allocated in the small gap left at the end of the volume. Then check that the freefile regrows without a remount:
+ *
+ * - Deleting the ballast must move the freefile into the much larger hole that it leaves behind.
+ * - Deleting a small regular file afterwards must extend the freefile over the free space that directly follows it.
+ *
+ * Contiguous files are written in between and read back after a remount, and the freefile's FAT chain is checked
+ * directly in the disk image at the end.
+ *
+ * This test must be built with AFATFS_FREEFILE_REGROWTH defined.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+#include "fat_standard.h"
+
+#include "common.h"
+
+#define SDCARD_SECTOR_SIZE 512
+
+// Leave this many superclusters (and any partial supercluster) free at the end of the volume for the freefile to begin in
+#define TEST_TAIL_SUPERCLUSTERS 4
+
+#define TEST_SOLID_LOG_ENTRY_COUNT ((afatfs_superClusterSize() * 2) / TEST_LOG_ENTRY_SIZE)
+#define TEST_REGULAR_LOG_ENTRY_COUNT ((afatfs_clusterSize() * 3) / TEST_LOG_ENTRY_SIZE)
+
+// Give up if the freefile hasn't regrown after this many polls
+#define TEST_MAX_REGROW_POLLS 1000000
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_clusterSize();
+extern uint32_t afatfs_superClusterSize();
+
+typedef enum {
+    TEST_STAGE_OPEN_BALLAST,
+    TEST_STAGE_DELETE_BALLAST,
+    TEST_STAGE_WAIT_RELOCATE,
+    TEST_STAGE_OPEN_FIRST_SOLID,
+    TEST_STAGE_WRITE_SOLID,
+    TEST_STAGE_CLOSE_SOLID,
+    TEST_STAGE_OPEN_REGULAR,
+    TEST_STAGE_WRITE_REGULAR,
+    TEST_STAGE_DELETE_REGULAR,
+    TEST_STAGE_WAIT_EXTEND,
+    TEST_STAGE_OPEN_SECOND_SOLID,
+    TEST_STAGE_REMOUNT,
+    TEST_STAGE_OPEN_VALIDATE,
+    TEST_STAGE_VALIDATE,
+    TEST_STAGE_CLOSE_VALIDATE,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+typedef struct testVolume_t {
+    fatFilesystemType_e type;
+    uint32_t fatStartSector;
+    uint32_t fatSectors;
+    uint32_t rootDirectorySector;
+    uint32_t fsInfoSector;
+    uint32_t numClusters;
+    uint32_t clusterSize;
+} testVolume_t;
+
+static const char *solidFilenames[] = {"solid1.bin", "solid2.bin"};
+#define TEST_SOLID_FILE_COUNT ((int) (sizeof(solidFilenames) / sizeof(solidFilenames[0])))
+
+static testStage_e testStage = TEST_STAGE_OPEN_BALLAST;
+// The stage to move to once the file we're opening is ready
+static testStage_e openedStage;
+
+static afatfsFilePtr_t testFile;
+static uint32_t logEntryIndex;
+static int solidFilesWritten, filesValidated;
+
+static uint32_t freeFileSize, regrowPolls;
+
+static void readSector(FILE *image, uint32_t sectorIndex, uint8_t *buffer)
+{
+    testAssert(fseeko(image, (off_t) sectorIndex * SDCARD_SECTOR_SIZE, SEEK_SET) == 0, "Seeking in the disk image failed");
+    testAssert(fread(buffer, SDCARD_SECTOR_SIZE, 1, image) == 1, "Reading from the disk image failed");
+}
+
+static void writeSector(FILE *image, uint32_t sectorIndex, const uint8_t *buffer)
+{
+    testAssert(fseeko(image, (off_t) sectorIndex * SDCARD_SECTOR_SIZE, SEEK_SET) == 0, "Seeking in the disk image failed");
+    testAssert(fwrite(buffer, SDCARD_SECTOR_SIZE, 1, image) == 1, "Writing to the disk image failed");
+}
+
+static void readVolume(FILE *image, testVolume_t *volume)
+{
+    uint8_t sector[SDCARD_SECTOR_SIZE];
+    uint32_t partitionStartSector = 0, totalSectors, rootDirectorySectors, clusterStartSector;
+
+    readSector(image, 0, sector);
+
+    mbrPartitionEntry_t *partition = (mbrPartitionEntry_t *) (sector + 446);
+
+    for (int i = 0; i < 4; i++) {
+        if (partition[i].lbaBegin > 0) {
+            partitionStartSector = partition[i].lbaBegin;
+            break;
+        }
+    }
+
+    readSector(image, partitionStartSector, sector);
+
+    fatVolumeID_t *volumeID = (fatVolumeID_t *) sector;
+
+    volume->fatStartSector = partitionStartSector + volumeID->reservedSectorCount;
+
+    if (volumeID->FATSize16 == 0) {
+        volume->type = FAT_FILESYSTEM_TYPE_FAT32;
+        volume->fatSectors = volumeID->fatDescriptor.fat32.FATSize32;
+        volume->fsInfoSector = partitionStartSector + volumeID->fatDescriptor.fat32.fsInfo;
+    } else {
+        volume->type = FAT_FILESYSTEM_TYPE_FAT16;
+        volume->fatSectors = volumeID->FATSize16;
+        volume->fsInfoSector = 0;
+    }
+
+    totalSectors = volumeID->totalSectors16 != 0 ? volumeID->totalSectors16 : volumeID->totalSectors32;
+    rootDirectorySectors = (volumeID->rootEntryCount * FAT_DIRECTORY_ENTRY_SIZE + SDCARD_SECTOR_SIZE - 1) / SDCARD_SECTOR_SIZE;
+    clusterStartSector = volume->fatStartSector + volumeID->numFATs * volume->fatSectors + rootDirectorySectors;
+
+    volume->numClusters = (totalSectors - (clusterStartSector - partitionStartSector)) / volumeID->sectorsPerCluster;
+    volume->clusterSize = volumeID->sectorsPerCluster * SDCARD_SECTOR_SIZE;
+
+    if (volume->type == FAT_FILESYSTEM_TYPE_FAT32) {
+        volume->rootDirectorySector = clusterStartSector + (volumeID->fatDescriptor.fat32.rootCluster - 2) * volumeID->sectorsPerCluster;
+    } else {
+        volume->rootDirectorySector = clusterStartSector - rootDirectorySectors;
+    }
+}
+
+static uint32_t fatEntriesPerSector(const testVolume_t *volume)
+{
+    return volume->type == FAT_FILESYSTEM_TYPE_FAT32 ? SDCARD_SECTOR_SIZE / sizeof(uint32_t) : SDCARD_SECTOR_SIZE / sizeof(uint16_t);
+}
+
+/**
+ * Before the filesystem is first mounted, add a file to the root directory of the image whose clusters run from the
+ * second FAT sector to a few superclusters short of the end of the volume.
+ */
+static void addBallastFile(const char *filename)
+{
+    uint8_t sector[SDCARD_SECTOR_SIZE];
+    uint16_t *fat16 = (uint16_t *) sector;
+    uint32_t *fat32 = (uint32_t *) sector;
+    fatDirectoryEntry_t *entries = (fatDirectoryEntry_t *) sector;
+    testVolume_t volume;
+    FILE *image = fopen(filename, "r+b");
+
+    testAssert(image, "Couldn't open the disk image");
+
+    readVolume(image, &volume);
+
+    uint32_t entriesPerSector = fatEntriesPerSector(&volume);
+    uint32_t volumeEnd = volume.numClusters + FAT_SMALLEST_LEGAL_CLUSTER_NUMBER;
+    uint32_t startCluster = entriesPerSector;
+    uint32_t endCluster = (volumeEnd / entriesPerSector - TEST_TAIL_SUPERCLUSTERS) * entriesPerSector;
+
+    for (uint32_t fatSector = startCluster / entriesPerSector; fatSector < endCluster / entriesPerSector; fatSector++) {
+        for (uint32_t i = 0; i < entriesPerSector; i++) {
+            uint32_t cluster = fatSector * entriesPerSector + i;
+            uint32_t nextCluster = cluster + 1 == endCluster ? 0xFFFFFFFF : cluster + 1;
+
+            if (volume.type == FAT_FILESYSTEM_TYPE_FAT32) {
+                fat32[i] = nextCluster & 0x0FFFFFFF;
+            } else {
+                fat16[i] = nextCluster;
+            }
+        }
+
+        writeSector(image, volume.fatStartSector + fatSector, sector);
+    }
+
+    readSector(image, volume.rootDirectorySector, sector);
+
+    for (uint32_t i = 0; i < SDCARD_SECTOR_SIZE / FAT_DIRECTORY_ENTRY_SIZE; i++) {
+        if (fat_isDirectoryEntryTerminator(&entries[i])) {
+            memset(&entries[i], 0, sizeof(entries[i]));
+            memcpy(entries[i].filename, "BALLAST BIN", FAT_FILENAME_LENGTH);
+            entries[i].firstClusterHigh = startCluster >> 16;
+            entries[i].firstClusterLow = startCluster & 0xFFFF;
+            entries[i].fileSize = (endCluster - startCluster) * volume.clusterSize;
+            break;
+        }
+    }
+
+    writeSector(image, volume.rootDirectorySector, sector);
+
+    if (volume.fsInfoSector) {
+        // The free cluster count no longer matches the FAT
+        fatFSInfo_t *fsInfo = (fatFSInfo_t *) sector;
+
+        readSector(image, volume.fsInfoSector, sector);
+        fsInfo->freeClusterCount = FAT_FSINFO_UNKNOWN;
+        writeSector(image, volume.fsInfoSector, sector);
+    }
+
+    fclose(image);
+}
+
+static uint32_t readFATEntry(FILE *image, const testVolume_t *volume, uint32_t cluster)
+{
+    static uint32_t sector[SDCARD_SECTOR_SIZE / sizeof(uint32_t)];
+    static uint32_t cachedSectorIndex = 0xFFFFFFFF;
+    uint32_t entriesPerSector = fatEntriesPerSector(volume);
+
+    if (cluster / entriesPerSector != cachedSectorIndex) {
+        cachedSectorIndex = cluster / entriesPerSector;
+        readSector(image, volume->fatStartSector + cachedSectorIndex, (uint8_t *) sector);
+    }
+
+    if (volume->type == FAT_FILESYSTEM_TYPE_FAT32) {
+        return fat32_decodeClusterNumber(sector[cluster % entriesPerSector]);
+    } else {
+        return ((uint16_t *) sector)[cluster % entriesPerSector];
+    }
+}
+
+/**
+ * Check that the freefile's directory entry in the disk image describes a contiguous chain in the FAT of the expected
+ * size, which is properly terminated.
+ */
+static void validateFreeFileChain(const char *filename, uint32_t expectedSize)
+{
+    uint8_t sector[SDCARD_SECTOR_SIZE];
+    fatDirectoryEntry_t *entries = (fatDirectoryEntry_t *) sector;
+    fatDirectoryEntry_t *freeFileEntry = NULL;
+    testVolume_t volume;
+    FILE *image = fopen(filename, "rb");
+
+    testAssert(image, "Couldn't reopen the disk image");
+
+    readVolume(image, &volume);
+    readSector(image, volume.rootDirectorySector, sector);
+
+    for (uint32_t i = 0; i < SDCARD_SECTOR_SIZE / FAT_DIRECTORY_ENTRY_SIZE; i++) {
+        if (memcmp(entries[i].filename, "FREESPACE  ", FAT_FILENAME_LENGTH) == 0) {
+            freeFileEntry = &entries[i];
+            break;
+        }
+    }
+
+    testAssert(freeFileEntry, "Couldn't find the freefile's directory entry in the disk image");
+    testAssert(freeFileEntry->fileSize == expectedSize, "Freefile's directory entry doesn't have the size we expected");
+
+    uint32_t cluster = ((uint32_t) freeFileEntry->firstClusterHigh << 16) | freeFileEntry->firstClusterLow;
+    uint32_t clusters = expectedSize / volume.clusterSize;
+
+    for (uint32_t i = 0; i < clusters; i++, cluster++) {
+        uint32_t nextCluster = readFATEntry(image, &volume, cluster);
+
+        if (i + 1 == clusters) {
+            testAssert(volume.type == FAT_FILESYSTEM_TYPE_FAT32 ? fat32_isEndOfChainMarker(nextCluster) : fat16_isEndOfChainMarker(nextCluster),
+                "Freefile's FAT chain isn't terminated where its directory entry ends");
+        } else {
+            testAssert(nextCluster == cluster + 1, "Freefile's FAT chain isn't contiguous");
+        }
+    }
+
+    fclose(image);
+}
+
+static void initFilesystem()
+{
+    afatfs_init();
+
+    while (afatfs_getFilesystemState() != AFATFS_FILESYSTEM_STATE_READY) {
+        afatfs_poll();
+
+        if (afatfs_getFilesystemState() == AFATFS_FILESYSTEM_STATE_FATAL) {
+            fprintf(stderr, "[Fail]     Fatal filesystem error during init\n");
+            exit(-1);
+        }
+    }
+}
+
+static void testFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening testfile failed");
+
+    testFile = file;
+    logEntryIndex = 0;
+
+    testStage = openedStage;
+}
+
+static void ballastDeleted()
+{
+    regrowPolls = 0;
+    testStage = TEST_STAGE_WAIT_RELOCATE;
+}
+
+static void regularDeleted()
+{
+    regrowPolls = 0;
+    testStage = TEST_STAGE_WAIT_EXTEND;
+}
+
+/**
+ * Wait for the freefile to grow beyond the size it had before, then move on to the given stage.
+ */
+static void waitForRegrowth(testStage_e nextStage, const char *failureMessage)
+{
+    if (afatfs_getContiguousFreeSpace() > freeFileSize) {
+        testAssert(afatfs_getContiguousFreeSpace() % afatfs_superClusterSize() == afatfs_clusterSize(),
+            "Freefile should be one cluster larger than a whole number of superclusters");
+
+        freeFileSize = afatfs_getContiguousFreeSpace();
+        testStage = nextStage;
+    } else {
+        testAssert(++regrowPolls < TEST_MAX_REGROW_POLLS, failureMessage);
+    }
+}
+
+bool continueTesting()
+{
+    switch (testStage) {
+        case TEST_STAGE_OPEN_BALLAST:
+            freeFileSize = afatfs_getContiguousFreeSpace();
+
+            testAssert(freeFileSize > 0 && freeFileSize <= (TEST_TAIL_SUPERCLUSTERS + 1) * afatfs_superClusterSize(),
+                "Freefile should have been confined to the end of the volume");
+
+            testStage = TEST_STAGE_IDLE;
+            openedStage = TEST_STAGE_DELETE_BALLAST;
+            afatfs_fopen("ballast.bin", "r", testFileOpened);
+        break;
+        case TEST_STAGE_DELETE_BALLAST:
+            testStage = TEST_STAGE_IDLE;
+            testAssert(afatfs_funlink(testFile, ballastDeleted), "Expected to be able to queue the deletion");
+        break;
+        case TEST_STAGE_WAIT_RELOCATE:
+            waitForRegrowth(TEST_STAGE_OPEN_FIRST_SOLID, "Freefile didn't move into the hole left by the deleted file");
+        break;
+        case TEST_STAGE_OPEN_FIRST_SOLID:
+        case TEST_STAGE_OPEN_SECOND_SOLID:
+            testStage = TEST_STAGE_IDLE;
+            openedStage = TEST_STAGE_WRITE_SOLID;
+            afatfs_fopen(solidFilenames[solidFilesWritten], "as", testFileOpened);
+        break;
+        case TEST_STAGE_WRITE_SOLID:
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_SOLID_LOG_ENTRY_COUNT)) {
+                testStage = TEST_STAGE_CLOSE_SOLID;
+            }
+        break;
+        case TEST_STAGE_CLOSE_SOLID:
+            if (afatfs_fclose(testFile, NULL)) {
+                solidFilesWritten++;
+                freeFileSize = afatfs_getContiguousFreeSpace();
+
+                testStage = solidFilesWritten == TEST_SOLID_FILE_COUNT ? TEST_STAGE_REMOUNT : TEST_STAGE_OPEN_REGULAR;
+            }
+        break;
+        case TEST_STAGE_OPEN_REGULAR:
+            testStage = TEST_STAGE_IDLE;
+            openedStage = TEST_STAGE_WRITE_REGULAR;
+            afatfs_fopen("regular.txt", "a", testFileOpened);
+        break;
+        case TEST_STAGE_WRITE_REGULAR:
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_REGULAR_LOG_ENTRY_COUNT)) {
+                testStage = TEST_STAGE_DELETE_REGULAR;
+            }
+        break;
+        case TEST_STAGE_DELETE_REGULAR:
+            if (afatfs_funlink(testFile, regularDeleted)) {
+                testStage = TEST_STAGE_IDLE;
+            }
+        break;
+        case TEST_STAGE_WAIT_EXTEND:
+            waitForRegrowth(TEST_STAGE_OPEN_SECOND_SOLID, "Freefile didn't grow into the free space that follows it");
+        break;
+        case TEST_STAGE_REMOUNT:
+            while (!afatfs_destroy(false)) {
+            }
+
+            initFilesystem();
+
+            testAssert(afatfs_getContiguousFreeSpace() == freeFileSize, "Freefile size changed across the remount");
+
+            testStage = TEST_STAGE_OPEN_VALIDATE;
+        break;
+        case TEST_STAGE_OPEN_VALIDATE:
+            if (filesValidated == TEST_SOLID_FILE_COUNT) {
+                testStage = TEST_STAGE_COMPLETE;
+            } else {
+                testStage = TEST_STAGE_IDLE;
+                openedStage = TEST_STAGE_VALIDATE;
+                afatfs_fopen(solidFilenames[filesValidated], "r", testFileOpened);
+            }
+        break;
+        case TEST_STAGE_VALIDATE:
+            if (validateLogTestEntries(testFile, &logEntryIndex, TEST_SOLID_LOG_ENTRY_COUNT)) {
+                testAssert(afatfs_feof(testFile), "Contiguous file is longer than we wrote");
+
+                testStage = TEST_STAGE_CLOSE_VALIDATE;
+            }
+        break;
+        case TEST_STAGE_CLOSE_VALIDATE:
+            if (afatfs_fclose(testFile, NULL)) {
+                filesValidated++;
+                testStage = TEST_STAGE_OPEN_VALIDATE;
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    addBallastFile(argv[1]);
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    initFilesystem();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    validateFreeFileChain(argv[1], freeFileSize);
+
+    fprintf(stderr, "[Success]  Freefile regrew to %u bytes after files were deleted\n", freeFileSize);
+
+    return EXIT_SUCCESS;
+}
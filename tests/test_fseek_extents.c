@@ -0,0 +1,238 @@
+/**
+ * Write two files at the same time so that their cluster chains are interleaved into runs of different lengths, then
+ * seek around one of them (forwards, backwards and relative to the cursor) and check that we read the right data back
+ * at every position, both while the seeks are still walking the chain and once its extents have been cached. Also check
+ * that the multi-block reads begun by read-ahead are ended when a seek abandons them.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+// How many times to switch between writing the two files, and how many clusters to write to each file each time
+#define TEST_WRITE_ROUNDS 24
+#define TEST_CLUSTERS_PER_ROUND(round) ((round) % 3 + 1)
+
+#define TEST_SEEK_COUNT 200
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_clusterSize();
+
+typedef enum {
+    TEST_STAGE_OPEN,
+    TEST_STAGE_WRITE,
+    TEST_STAGE_CLOSE,
+    TEST_STAGE_OPEN_READ,
+    TEST_STAGE_SEEK,
+    TEST_STAGE_VALIDATE,
+    TEST_STAGE_CLOSE_READ,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_OPEN;
+
+static afatfsFilePtr_t files[2];
+static uint32_t logEntryIndex[2], logEntryTarget[2];
+static int writeRound;
+
+static int seekCount;
+static uint32_t seekEntryIndex, validateEntryIndex;
+
+static void fragmentedFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening fragmented file failed");
+
+    files[0] = file;
+}
+
+static void otherFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening other file failed");
+
+    files[1] = file;
+
+    testStage = TEST_STAGE_WRITE;
+}
+
+static void readFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening fragmented file for read failed");
+
+    files[0] = file;
+    seekCount = 0;
+
+    testStage = TEST_STAGE_SEEK;
+}
+
+static uint32_t entriesPerCluster()
+{
+    return afatfs_clusterSize() / TEST_LOG_ENTRY_SIZE;
+}
+
+/**
+ * Pick the log entry to seek to next. Every few seeks we stay near the previous position or move backwards, and we
+ * often land precisely on a cluster boundary.
+ */
+static uint32_t chooseSeekEntry(uint32_t entryCount)
+{
+    uint32_t entry;
+
+    switch (rand() % 4) {
+        case 0:
+            entry = (rand() % (entryCount / entriesPerCluster())) * entriesPerCluster();
+        break;
+        case 1:
+            entry = seekEntryIndex >= entriesPerCluster() ? seekEntryIndex - entriesPerCluster() : 0;
+        break;
+        default:
+            entry = rand() % entryCount;
+    }
+
+    return entry;
+}
+
+bool continueTesting()
+{
+    uint32_t entryCount = logEntryTarget[0];
+    afatfsOperationStatus_e status;
+    uint32_t position;
+
+    switch (testStage) {
+        case TEST_STAGE_OPEN:
+            testStage = TEST_STAGE_IDLE;
+
+            logEntryTarget[0] = TEST_CLUSTERS_PER_ROUND(0) * entriesPerCluster();
+
+            afatfs_fopen("fragment.txt", "a", fragmentedFileOpened);
+            afatfs_fopen("other.txt", "a", otherFileOpened);
+        break;
+        case TEST_STAGE_WRITE:
+            if (writeLogTestEntries(files[writeRound % 2], &logEntryIndex[writeRound % 2], logEntryTarget[writeRound % 2])) {
+                writeRound++;
+
+                if (writeRound == TEST_WRITE_ROUNDS) {
+                    testStage = TEST_STAGE_CLOSE;
+                } else {
+                    logEntryTarget[writeRound % 2] += TEST_CLUSTERS_PER_ROUND(writeRound) * entriesPerCluster();
+                }
+            }
+        break;
+        case TEST_STAGE_CLOSE:
+            if (files[0] && afatfs_fclose(files[0], NULL)) {
+                files[0] = NULL;
+            }
+            if (files[1] && afatfs_fclose(files[1], NULL)) {
+                files[1] = NULL;
+            }
+            if (!files[0] && !files[1]) {
+                testStage = TEST_STAGE_OPEN_READ;
+            }
+        break;
+        case TEST_STAGE_OPEN_READ:
+            testStage = TEST_STAGE_IDLE;
+            afatfs_fopen("fragment.txt", "r", readFileOpened);
+        break;
+        case TEST_STAGE_SEEK:
+            if (seekCount == TEST_SEEK_COUNT) {
+                testStage = TEST_STAGE_CLOSE_READ;
+                break;
+            }
+
+            seekEntryIndex = chooseSeekEntry(entryCount);
+
+            if (rand() % 2 == 0 && afatfs_ftell(files[0], &position) && position <= seekEntryIndex * TEST_LOG_ENTRY_SIZE) {
+                status = afatfs_fseek(files[0], seekEntryIndex * TEST_LOG_ENTRY_SIZE - position, AFATFS_SEEK_CUR);
+            } else {
+                status = afatfs_fseek(files[0], seekEntryIndex * TEST_LOG_ENTRY_SIZE, AFATFS_SEEK_SET);
+            }
+
+            testAssert(status != AFATFS_OPERATION_FAILURE, "Seek failed");
+
+            validateEntryIndex = seekEntryIndex;
+            seekCount++;
+
+            testStage = TEST_STAGE_VALIDATE;
+        break;
+        case TEST_STAGE_VALIDATE:
+            // Read a few entries from the new position, which may take us across a cluster boundary
+            if (validateLogTestEntries(files[0], &validateEntryIndex, seekEntryIndex + 8 < entryCount ? seekEntryIndex + 8 : entryCount)) {
+                testAssert(afatfs_ftell(files[0], &position), "File should not be busy after reading");
+                testAssert(position == validateEntryIndex * TEST_LOG_ENTRY_SIZE, "File cursor is in the wrong place after reading");
+
+                testStage = TEST_STAGE_SEEK;
+            }
+        break;
+        case TEST_STAGE_CLOSE_READ:
+            if (afatfs_fclose(files[0], NULL)) {
+                testStage = TEST_STAGE_COMPLETE;
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    srand(1);
+
+    afatfs_init();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcardSimStats_t cardStats;
+    sdcard_sim_getStats(&cardStats);
+
+    // Our seeks move the cursor away from the multi-block reads that read-ahead began
+    testAssert(cardStats.multiReads > 0 && cardStats.multiReadsEnded > 0, "Read-ahead should end the multi-block reads that it abandons");
+
+    sdcard_sim_destroy();
+
+    fprintf(stderr, "[Success]  Read the right data back after %d seeks in a fragmented file\n", TEST_SEEK_COUNT);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,327 @@
+/**
+ * Check that the FAT32 FSInfo sector is kept up to date: after a clean shutdown its free cluster count must match the
+ * FAT, and after losing power part-way through writing a file the count must be marked as unknown.
+ *
+ * Between the two runs the next free cluster hint is pointed at the end of the volume, so the second run also checks
+ * that we can still allocate clusters when the hint is too optimistic.
+ *
+ * This test must be run on a FAT32 volume.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+#include "fat_standard.h"
+
+#include "common.h"
+
+#define SDCARD_SECTOR_SIZE 512
+
+// Give the files a few clusters each so that several clusters have to be allocated
+#define TEST_LOG_ENTRY_COUNT ((afatfs_clusterSize() * 3 + 100) / TEST_LOG_ENTRY_SIZE)
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_clusterSize();
+
+typedef enum {
+    TEST_STAGE_CREATE_APPEND,
+    TEST_STAGE_FILL_APPEND,
+    TEST_STAGE_CLOSE_APPEND,
+    TEST_STAGE_FILL_SOLID,
+    TEST_STAGE_CLOSE_SOLID,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+typedef struct testVolume_t {
+    uint32_t partitionStartSector;
+    uint32_t fsInfoSector;
+    uint32_t fatStartSector;
+    uint32_t fatSectors;
+    uint32_t numClusters;
+} testVolume_t;
+
+static testStage_e testStage;
+// The stage to move to once the file we're opening is ready
+static testStage_e openedStage;
+// Whether to also write a file in "as" mode during this run
+static bool writeSolidFile;
+
+static afatfsFilePtr_t testFile;
+static uint32_t logEntryIndex;
+
+static void testFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening testfile failed");
+
+    testFile = file;
+    logEntryIndex = 0;
+
+    testStage = openedStage;
+}
+
+bool continueTesting(const char *appendFilename)
+{
+    switch (testStage) {
+        case TEST_STAGE_CREATE_APPEND:
+            testStage = TEST_STAGE_IDLE;
+            openedStage = TEST_STAGE_FILL_APPEND;
+            afatfs_fopen(appendFilename, "a", testFileOpened);
+        break;
+        case TEST_STAGE_FILL_APPEND:
+            testAssert(!afatfs_isFull(), "Filesystem reported full while allocating clusters");
+
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_LOG_ENTRY_COUNT)) {
+                testStage = TEST_STAGE_CLOSE_APPEND;
+            }
+        break;
+        case TEST_STAGE_CLOSE_APPEND:
+            if (afatfs_fclose(testFile, NULL)) {
+                if (writeSolidFile) {
+                    testStage = TEST_STAGE_IDLE;
+                    openedStage = TEST_STAGE_FILL_SOLID;
+                    afatfs_fopen("solid.txt", "as", testFileOpened);
+                } else {
+                    testStage = TEST_STAGE_COMPLETE;
+                }
+            }
+        break;
+        case TEST_STAGE_FILL_SOLID:
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_LOG_ENTRY_COUNT)) {
+                testStage = TEST_STAGE_CLOSE_SOLID;
+            }
+        break;
+        case TEST_STAGE_CLOSE_SOLID:
+            if (afatfs_fclose(testFile, NULL)) {
+                testStage = TEST_STAGE_COMPLETE;
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+/**
+ * Mount the filesystem on the given image, write the test files to it, then shut down.
+ *
+ * powerLoss - Set to true to flush everything and then shut down without giving the filesystem a chance to clean up
+ */
+static void runFilesystem(const char *filename, const char *appendFilename, bool powerLoss)
+{
+    testAssert(sdcard_sim_init(filename), "sdcard_sim_init() failed");
+
+    afatfs_init();
+
+    testStage = TEST_STAGE_CREATE_APPEND;
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting(appendFilename)) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    if (powerLoss) {
+        while (!afatfs_flush() || !sdcard_sim_isReady()) {
+            afatfs_poll();
+        }
+    }
+
+    while (!afatfs_destroy(powerLoss)) {
+    }
+
+    sdcard_sim_destroy();
+}
+
+static void readSector(FILE *image, uint32_t sectorIndex, uint8_t *buffer)
+{
+    testAssert(fseeko(image, (off_t) sectorIndex * SDCARD_SECTOR_SIZE, SEEK_SET) == 0, "Seeking in the disk image failed");
+    testAssert(fread(buffer, SDCARD_SECTOR_SIZE, 1, image) == 1, "Reading from the disk image failed");
+}
+
+static void writeSector(FILE *image, uint32_t sectorIndex, const uint8_t *buffer)
+{
+    testAssert(fseeko(image, (off_t) sectorIndex * SDCARD_SECTOR_SIZE, SEEK_SET) == 0, "Seeking in the disk image failed");
+    testAssert(fwrite(buffer, SDCARD_SECTOR_SIZE, 1, image) == 1, "Writing to the disk image failed");
+}
+
+static void readVolume(FILE *image, testVolume_t *volume)
+{
+    uint8_t sector[SDCARD_SECTOR_SIZE];
+
+    readSector(image, 0, sector);
+
+    mbrPartitionEntry_t *partition = (mbrPartitionEntry_t *) (sector + 446);
+
+    volume->partitionStartSector = 0;
+
+    for (int i = 0; i < 4; i++) {
+        if (partition[i].lbaBegin > 0) {
+            volume->partitionStartSector = partition[i].lbaBegin;
+            break;
+        }
+    }
+
+    readSector(image, volume->partitionStartSector, sector);
+
+    fatVolumeID_t *volumeID = (fatVolumeID_t *) sector;
+
+    testAssert(volumeID->FATSize16 == 0, "Test volume was expected to be FAT32");
+
+    uint32_t dataSectors;
+
+    volume->fsInfoSector = volume->partitionStartSector + volumeID->fatDescriptor.fat32.fsInfo;
+    volume->fatStartSector = volume->partitionStartSector + volumeID->reservedSectorCount;
+    volume->fatSectors = volumeID->fatDescriptor.fat32.FATSize32;
+
+    dataSectors = volumeID->totalSectors32 - (volumeID->reservedSectorCount + volumeID->numFATs * volume->fatSectors);
+
+    volume->numClusters = dataSectors / volumeID->sectorsPerCluster;
+}
+
+/**
+ * Count the free clusters in the first FAT of the disk image.
+ */
+static uint32_t countFreeClusters(FILE *image, const testVolume_t *volume)
+{
+    uint32_t sector[SDCARD_SECTOR_SIZE / sizeof(uint32_t)];
+    uint32_t entriesPerSector = SDCARD_SECTOR_SIZE / sizeof(uint32_t);
+    uint32_t freeClusters = 0;
+
+    for (uint32_t i = 0; i < volume->fatSectors; i++) {
+        readSector(image, volume->fatStartSector + i, (uint8_t *) sector);
+
+        for (uint32_t j = 0; j < entriesPerSector; j++) {
+            uint32_t cluster = i * entriesPerSector + j;
+
+            if (cluster >= FAT_SMALLEST_LEGAL_CLUSTER_NUMBER && cluster < volume->numClusters + FAT_SMALLEST_LEGAL_CLUSTER_NUMBER
+                    && fat_isFreeSpace(fat32_decodeClusterNumber(sector[j]))) {
+                freeClusters++;
+            }
+        }
+    }
+
+    return freeClusters;
+}
+
+/**
+ * The formatter that made the test images left a slightly stale count in FSInfo, so fix that up before we start.
+ */
+static void correctFSInfo(const char *filename)
+{
+    uint8_t sector[SDCARD_SECTOR_SIZE];
+    fatFSInfo_t *fsInfo = (fatFSInfo_t *) sector;
+    testVolume_t volume;
+    FILE *image = fopen(filename, "r+b");
+
+    testAssert(image, "Couldn't open the disk image");
+
+    readVolume(image, &volume);
+    readSector(image, volume.fsInfoSector, sector);
+
+    fsInfo->freeClusterCount = countFreeClusters(image, &volume);
+
+    writeSector(image, volume.fsInfoSector, sector);
+
+    fclose(image);
+}
+
+/**
+ * Check that the FSInfo free cluster count on disk matches the FAT, then point the next free cluster hint at the last
+ * cluster on the volume.
+ */
+static void validateCleanFSInfo(const char *filename)
+{
+    uint8_t sector[SDCARD_SECTOR_SIZE];
+    fatFSInfo_t *fsInfo = (fatFSInfo_t *) sector;
+    testVolume_t volume;
+    FILE *image = fopen(filename, "r+b");
+
+    testAssert(image, "Couldn't reopen the disk image");
+
+    readVolume(image, &volume);
+    readSector(image, volume.fsInfoSector, sector);
+
+    testAssert(fsInfo->leadSignature == FAT_FSINFO_LEAD_SIGNATURE && fsInfo->structSignature == FAT_FSINFO_STRUCT_SIGNATURE
+        && fsInfo->trailSignature == FAT_FSINFO_TRAIL_SIGNATURE, "FSInfo signatures were damaged");
+
+    uint32_t freeClusters = countFreeClusters(image, &volume);
+
+    if (fsInfo->freeClusterCount != freeClusters) {
+        fprintf(stderr, "[Fail]     FSInfo free cluster count %u doesn't match the %u free clusters in the FAT\n", fsInfo->freeClusterCount, freeClusters);
+        exit(-1);
+    }
+
+    testAssert(fsInfo->nextFreeCluster >= FAT_SMALLEST_LEGAL_CLUSTER_NUMBER
+        && fsInfo->nextFreeCluster < volume.numClusters + FAT_SMALLEST_LEGAL_CLUSTER_NUMBER, "FSInfo next free cluster is outside the volume");
+
+    fsInfo->nextFreeCluster = volume.numClusters + FAT_SMALLEST_LEGAL_CLUSTER_NUMBER - 1;
+
+    writeSector(image, volume.fsInfoSector, sector);
+
+    fclose(image);
+}
+
+static void validateDirtyFSInfo(const char *filename)
+{
+    uint8_t sector[SDCARD_SECTOR_SIZE];
+    fatFSInfo_t *fsInfo = (fatFSInfo_t *) sector;
+    testVolume_t volume;
+    FILE *image = fopen(filename, "rb");
+
+    testAssert(image, "Couldn't reopen the disk image");
+
+    readVolume(image, &volume);
+    readSector(image, volume.fsInfoSector, sector);
+
+    testAssert(fsInfo->freeClusterCount == FAT_FSINFO_UNKNOWN, "FSInfo free cluster count should be unknown after a power loss");
+
+    fclose(image);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    correctFSInfo(argv[1]);
+
+    writeSolidFile = true;
+    runFilesystem(argv[1], "append.txt", false);
+
+    validateCleanFSInfo(argv[1]);
+
+    writeSolidFile = false;
+    runFilesystem(argv[1], "append2.txt", true);
+
+    validateDirtyFSInfo(argv[1]);
+
+    fprintf(stderr, "[Success]  FSInfo free cluster count is correct after a clean shutdown and invalidated by power loss\n");
+
+    return EXIT_SUCCESS;
+}
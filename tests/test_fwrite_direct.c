@@ -0,0 +1,280 @@
+/**
+ * Verify that afatfs_fwriteDirect() writes data to the disk correctly when it is mixed with regular fwrite() calls,
+ * in both the "as" and "a" file modes, and that it refuses to write to unaligned positions.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+#define SDCARD_SECTOR_SIZE 512
+
+#define TEST_LOG_ENTRIES_PER_SECTOR (SDCARD_SECTOR_SIZE / TEST_LOG_ENTRY_SIZE)
+
+// Write this many entries with fwrite() before and after the direct write
+#define TEST_HEAD_LOG_ENTRIES TEST_LOG_ENTRIES_PER_SECTOR
+#define TEST_TAIL_LOG_ENTRIES (TEST_LOG_ENTRIES_PER_SECTOR + 5)
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_clusterSize();
+extern uint32_t afatfs_superClusterSize();
+
+typedef enum {
+    TEST_STAGE_INITIAL = 0,
+    TEST_STAGE_SOLID_APPEND_BEGIN = 0,
+    TEST_STAGE_SOLID_APPEND_CONTINUE,
+    TEST_STAGE_APPEND_BEGIN,
+    TEST_STAGE_APPEND_CONTINUE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+typedef enum {
+    DIRECT_TEST_STAGE_OPEN,
+    DIRECT_TEST_STAGE_WRITE_HEAD,
+    DIRECT_TEST_STAGE_WRITE_DIRECT,
+    DIRECT_TEST_STAGE_WRITE_TAIL,
+    DIRECT_TEST_STAGE_CLOSE,
+    DIRECT_TEST_STAGE_FLUSH,
+    DIRECT_TEST_STAGE_READ_OPEN,
+    DIRECT_TEST_STAGE_READ_VALIDATE,
+    DIRECT_TEST_STAGE_READ_CLOSE,
+    DIRECT_TEST_STAGE_IDLE
+} directTestStage_e;
+
+static testStage_e testStage = TEST_STAGE_INITIAL;
+
+static directTestStage_e directStage;
+static afatfsFilePtr_t directFile;
+
+static uint8_t *directBuffer;
+static uint32_t directBufferSize;
+
+static void initFilesystem()
+{
+    afatfs_init();
+
+    while (afatfs_getFilesystemState() != AFATFS_FILESYSTEM_STATE_READY) {
+        afatfs_poll();
+
+        if (afatfs_getFilesystemState() == AFATFS_FILESYSTEM_STATE_FATAL) {
+            fprintf(stderr, "[Fail]     Fatal filesystem error during init\n");
+            exit(-1);
+        }
+    }
+}
+
+/**
+ * Fill the direct write buffer with the same pattern that writeLogTestEntries() would produce, starting from the
+ * given entry index.
+ */
+static void fillDirectBuffer(uint32_t firstEntryIndex)
+{
+    for (uint32_t i = 0; i < directBufferSize; i++) {
+        directBuffer[i] = (uint8_t) (firstEntryIndex + i / TEST_LOG_ENTRY_SIZE);
+    }
+}
+
+static void directTestFileCreated(afatfsFilePtr_t file)
+{
+    testAssert(file, "Creating testfile failed");
+
+    directFile = file;
+    directStage = DIRECT_TEST_STAGE_WRITE_HEAD;
+}
+
+static void directTestWriteComplete(afatfsFilePtr_t file)
+{
+    uint32_t position;
+
+    testAssert(file == directFile, "Direct write callback was given the wrong file");
+    testAssert(afatfs_ftell(file, &position), "ftell() expected to work after direct write completes");
+    testAssert(position == TEST_HEAD_LOG_ENTRIES * TEST_LOG_ENTRY_SIZE + directBufferSize, "Direct write did not advance the cursor by the written length");
+
+    directStage = DIRECT_TEST_STAGE_WRITE_TAIL;
+}
+
+static void directTestFileOpenedForRead(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening file for read failed");
+
+    directFile = file;
+    directStage = DIRECT_TEST_STAGE_READ_VALIDATE;
+}
+
+/**
+ * Continue testing direct writes to the given file.
+ *
+ * start - For the first call of the test, set start to true
+ *
+ * Returns true if the test is still continuing, or false if the test was completed successfully.
+ */
+bool continueDirectWriteTest(bool start, const char *filename, const char *fileMode)
+{
+    static uint32_t logEntryIndex = 0;
+
+    uint32_t directLogEntries = directBufferSize / TEST_LOG_ENTRY_SIZE;
+    uint32_t totalLogEntries = TEST_HEAD_LOG_ENTRIES + directLogEntries + TEST_TAIL_LOG_ENTRIES;
+
+    if (start) {
+        directStage = DIRECT_TEST_STAGE_OPEN;
+    }
+
+    switch (directStage) {
+        case DIRECT_TEST_STAGE_OPEN:
+            directStage = DIRECT_TEST_STAGE_IDLE;
+
+            logEntryIndex = 0;
+
+            afatfs_fopen(filename, fileMode, directTestFileCreated);
+        break;
+        case DIRECT_TEST_STAGE_WRITE_HEAD:
+            if (writeLogTestEntries(directFile, &logEntryIndex, TEST_HEAD_LOG_ENTRIES)) {
+                directStage = DIRECT_TEST_STAGE_WRITE_DIRECT;
+            }
+        break;
+        case DIRECT_TEST_STAGE_WRITE_DIRECT:
+            fillDirectBuffer(logEntryIndex);
+
+            testAssert(!afatfs_fwriteDirect(directFile, directBuffer, directBufferSize - 1, directTestWriteComplete), "Direct write of a partial sector should be refused");
+
+            if (afatfs_fwriteDirect(directFile, directBuffer, directBufferSize, directTestWriteComplete)) {
+                logEntryIndex += directLogEntries;
+                directStage = DIRECT_TEST_STAGE_IDLE;
+            }
+        break;
+        case DIRECT_TEST_STAGE_WRITE_TAIL:
+            if (writeLogTestEntries(directFile, &logEntryIndex, totalLogEntries)) {
+                testAssert(!afatfs_fwriteDirect(directFile, directBuffer, SDCARD_SECTOR_SIZE, NULL), "Direct write from an unaligned cursor should be refused");
+
+                directStage = DIRECT_TEST_STAGE_CLOSE;
+            }
+        break;
+        case DIRECT_TEST_STAGE_CLOSE:
+            if (afatfs_fclose(directFile, NULL)) {
+                directStage = DIRECT_TEST_STAGE_FLUSH;
+            }
+        break;
+        case DIRECT_TEST_STAGE_FLUSH:
+            // Make sure we read back what actually made it to the disk rather than any stale cache contents
+            if (afatfs_flush() && sdcard_sim_isReady()) {
+                while (!afatfs_destroy(false)) {
+                }
+                directFile = NULL;
+
+                initFilesystem();
+
+                directStage = DIRECT_TEST_STAGE_READ_OPEN;
+            }
+        break;
+        case DIRECT_TEST_STAGE_READ_OPEN:
+            directStage = DIRECT_TEST_STAGE_IDLE;
+            logEntryIndex = 0;
+            afatfs_fopen(filename, "r", directTestFileOpenedForRead);
+        break;
+        case DIRECT_TEST_STAGE_READ_VALIDATE:
+            if (validateLogTestEntries(directFile, &logEntryIndex, totalLogEntries)) {
+                testAssert(afatfs_feof(directFile), "File was longer than the data written to it");
+
+                directStage = DIRECT_TEST_STAGE_READ_CLOSE;
+            }
+        break;
+        case DIRECT_TEST_STAGE_READ_CLOSE:
+            if (afatfs_fclose(directFile, NULL)) {
+                return false; // Test is over now!
+            }
+        break;
+        case DIRECT_TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+    }
+
+    return true; // Still continuing test
+}
+
+bool continueTesting() {
+    switch (testStage) {
+        case TEST_STAGE_SOLID_APPEND_BEGIN:
+        case TEST_STAGE_SOLID_APPEND_CONTINUE:
+            if (testStage == TEST_STAGE_SOLID_APPEND_BEGIN) {
+                // Cross a supercluster boundary so the direct write has to extend the file part-way through
+                directBufferSize = afatfs_superClusterSize() + 3 * SDCARD_SECTOR_SIZE;
+                directBuffer = realloc(directBuffer, directBufferSize);
+            }
+
+            if (continueDirectWriteTest(testStage == TEST_STAGE_SOLID_APPEND_BEGIN, "test.txt", "as")) {
+                testStage = TEST_STAGE_SOLID_APPEND_CONTINUE;
+            } else {
+                testStage = TEST_STAGE_APPEND_BEGIN;
+            }
+        break;
+        case TEST_STAGE_APPEND_BEGIN:
+        case TEST_STAGE_APPEND_CONTINUE:
+            if (testStage == TEST_STAGE_APPEND_BEGIN) {
+                directBufferSize = 3 * afatfs_clusterSize() + 3 * SDCARD_SECTOR_SIZE;
+                directBuffer = realloc(directBuffer, directBufferSize);
+            }
+
+            if (continueDirectWriteTest(testStage == TEST_STAGE_APPEND_BEGIN, "test2.txt", "a")) {
+                testStage = TEST_STAGE_APPEND_CONTINUE;
+            } else {
+                testStage = TEST_STAGE_COMPLETE;
+            }
+        break;
+        case TEST_STAGE_COMPLETE:
+            fprintf(stderr, "[Success]  Direct writes mixed with fwrite() read back correctly (\"as\" and \"a\" filemodes)\n");
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    initFilesystem();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    free(directBuffer);
+
+    return EXIT_SUCCESS;
+}
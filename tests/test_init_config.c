@@ -0,0 +1,268 @@
+/**
+ * Check that afatfs_initWithConfig() rejects unusable configs, then mount using caller-supplied arenas with a smaller
+ * and a larger table of open files and cache than the defaults. Write as many files at once as the smaller config
+ * allows, check that no more can be opened, then remount with the larger config and read them all back.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+// More files than afatfs_init() would let us open at once
+#define TEST_FILE_COUNT 5
+
+// The smallest cache that has room for that many files
+#define TEST_SMALL_CACHE_SECTORS (2 * TEST_FILE_COUNT + 2)
+#define TEST_LARGE_CACHE_SECTORS 64
+
+#define TEST_LOG_ENTRY_COUNT ((afatfs_clusterSize() * 2 + 100) / TEST_LOG_ENTRY_SIZE)
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_clusterSize();
+
+typedef enum {
+    TEST_STAGE_OPEN,
+    TEST_STAGE_WRITE,
+    TEST_STAGE_CLOSE,
+    TEST_STAGE_REMOUNT,
+    TEST_STAGE_READ_OPEN,
+    TEST_STAGE_READ_VALIDATE,
+    TEST_STAGE_READ_CLOSE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_OPEN;
+
+static afatfsFilePtr_t files[TEST_FILE_COUNT];
+static uint32_t logEntryIndex[TEST_FILE_COUNT];
+static int filesOpened;
+
+static uint64_t *arena;
+
+static void initFilesystem(uint16_t cacheSectors, uint8_t maxOpenFiles)
+{
+    afatfsConfig_t config;
+
+    config.arenaSize = afatfs_getArenaSize(cacheSectors, maxOpenFiles);
+    config.cacheSectors = cacheSectors;
+    config.maxOpenFiles = maxOpenFiles;
+
+    // Fill the arena with junk so we can tell that the filesystem doesn't rely on it being zeroed
+    free(arena);
+    arena = malloc(config.arenaSize);
+    memset(arena, 0xAA, config.arenaSize);
+
+    config.arena = (uint8_t *) arena;
+
+    afatfs_initWithConfig(&config);
+
+    while (afatfs_getFilesystemState() != AFATFS_FILESYSTEM_STATE_READY) {
+        afatfs_poll();
+
+        if (afatfs_getFilesystemState() == AFATFS_FILESYSTEM_STATE_FATAL) {
+            fprintf(stderr, "[Fail]     Fatal filesystem error during init\n");
+            exit(-1);
+        }
+    }
+}
+
+static void testBadConfig(uint8_t *badArena, uint32_t arenaSize, uint16_t cacheSectors, uint8_t maxOpenFiles, const char *message)
+{
+    afatfsConfig_t config;
+
+    config.arena = badArena;
+    config.arenaSize = arenaSize;
+    config.cacheSectors = cacheSectors;
+    config.maxOpenFiles = maxOpenFiles;
+
+    afatfs_initWithConfig(&config);
+
+    testAssert(afatfs_getFilesystemState() == AFATFS_FILESYSTEM_STATE_FATAL && afatfs_getLastError() == AFATFS_ERROR_BAD_CONFIG, message);
+
+    // We should be able to poll and shut down as usual
+    afatfs_poll();
+    testAssert(!afatfs_fopen("bad.txt", "w", NULL), "Opening a file should fail with a bad config");
+
+    while (!afatfs_destroy(false)) {
+    }
+}
+
+static void testBadConfigs()
+{
+    uint32_t arenaSize = afatfs_getArenaSize(TEST_SMALL_CACHE_SECTORS, TEST_FILE_COUNT);
+    uint64_t *goodArena = malloc(arenaSize + sizeof(uint64_t));
+
+    testBadConfig(NULL, arenaSize, TEST_SMALL_CACHE_SECTORS, TEST_FILE_COUNT, "Missing arena should be rejected");
+    testBadConfig((uint8_t *) goodArena, arenaSize - 1, TEST_SMALL_CACHE_SECTORS, TEST_FILE_COUNT, "Arena that's too small should be rejected");
+    testBadConfig((uint8_t *) goodArena + 1, arenaSize, TEST_SMALL_CACHE_SECTORS, TEST_FILE_COUNT, "Misaligned arena should be rejected");
+    testBadConfig((uint8_t *) goodArena, arenaSize, TEST_SMALL_CACHE_SECTORS - 1, TEST_FILE_COUNT, "Cache that's too small for the open files should be rejected");
+    testBadConfig((uint8_t *) goodArena, arenaSize, TEST_SMALL_CACHE_SECTORS, 0, "Config without any files should be rejected");
+
+    free(goodArena);
+}
+
+static void fileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening file failed");
+
+    // Files are opened in order, so the callbacks arrive in order too
+    files[filesOpened] = file;
+    logEntryIndex[filesOpened] = 0;
+
+    filesOpened++;
+}
+
+static void openFiles(const char *mode)
+{
+    char filename[] = "test0.txt";
+
+    filesOpened = 0;
+
+    for (int i = 0; i < TEST_FILE_COUNT; i++) {
+        filename[4] = '0' + i;
+        testAssert(afatfs_fopen(filename, mode, fileOpened), "No file handle available for file");
+    }
+}
+
+static bool closeFiles()
+{
+    bool allClosed = true;
+
+    for (int i = 0; i < TEST_FILE_COUNT; i++) {
+        if (files[i] && afatfs_fclose(files[i], NULL)) {
+            files[i] = NULL;
+        }
+
+        allClosed = allClosed && !files[i];
+    }
+
+    return allClosed;
+}
+
+bool continueTesting()
+{
+    bool allDone;
+
+    switch (testStage) {
+        case TEST_STAGE_OPEN:
+            testStage = TEST_STAGE_WRITE;
+
+            openFiles("a");
+
+            testAssert(!afatfs_fopen("extra.txt", "a", NULL), "Should not be able to open more files than the config allows");
+        break;
+        case TEST_STAGE_WRITE:
+            if (filesOpened < TEST_FILE_COUNT) {
+                break;
+            }
+
+            allDone = true;
+
+            for (int i = 0; i < TEST_FILE_COUNT; i++) {
+                allDone = writeLogTestEntries(files[i], &logEntryIndex[i], TEST_LOG_ENTRY_COUNT) && allDone;
+            }
+
+            if (allDone) {
+                testStage = TEST_STAGE_CLOSE;
+            }
+        break;
+        case TEST_STAGE_CLOSE:
+            if (closeFiles()) {
+                testStage = TEST_STAGE_REMOUNT;
+            }
+        break;
+        case TEST_STAGE_REMOUNT:
+            while (!afatfs_destroy(false)) {
+            }
+
+            initFilesystem(TEST_LARGE_CACHE_SECTORS, TEST_FILE_COUNT + 1);
+
+            testStage = TEST_STAGE_READ_OPEN;
+        break;
+        case TEST_STAGE_READ_OPEN:
+            testStage = TEST_STAGE_READ_VALIDATE;
+
+            openFiles("r");
+        break;
+        case TEST_STAGE_READ_VALIDATE:
+            if (filesOpened < TEST_FILE_COUNT) {
+                break;
+            }
+
+            allDone = true;
+
+            for (int i = 0; i < TEST_FILE_COUNT; i++) {
+                allDone = validateLogTestEntries(files[i], &logEntryIndex[i], TEST_LOG_ENTRY_COUNT) && allDone;
+            }
+
+            if (allDone) {
+                testStage = TEST_STAGE_READ_CLOSE;
+            }
+        break;
+        case TEST_STAGE_READ_CLOSE:
+            if (closeFiles()) {
+                testStage = TEST_STAGE_COMPLETE;
+            }
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    testBadConfigs();
+
+    initFilesystem(TEST_SMALL_CACHE_SECTORS, TEST_FILE_COUNT);
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    free(arena);
+
+    sdcard_sim_destroy();
+
+    fprintf(stderr, "[Success]  %d files written with a %d sector cache read back with a %d sector cache\n", TEST_FILE_COUNT,
+        TEST_SMALL_CACHE_SECTORS, TEST_LARGE_CACHE_SECTORS);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,262 @@
+/**
+ * Cut the power to a volume with AFATFS_USE_JOURNAL just after the journal record of a supercluster append reaches the
+ * card, and again after that of a file deletion, and check that each operation is completed at the next mount: the
+ * appended supercluster belongs to the file instead of being lost from the freefile, and the deleted file is gone and
+ * its clusters are back in the freefile. Then check that the files we kept still read back. Also check that the journal
+ * file's size covers its cluster, so that a disk checker won't free it.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+#define TEST_KEPT_FILENAME "kept.txt"
+#define TEST_DELETED_FILENAME "deleted.txt"
+#define TEST_JOURNAL_FILENAME "ASYNCFAT.JNL"
+
+// Exactly fills the first supercluster of a contiguous file, so one more entry needs a new supercluster
+#define TEST_SUPERCLUSTER_ENTRIES (afatfs_superClusterSize() / TEST_LOG_ENTRY_SIZE)
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_clusterSize();
+extern uint32_t afatfs_superClusterSize();
+extern uint32_t afatfs_journalRecordsOnCard();
+
+typedef enum {
+    TEST_STAGE_JOURNAL_OPEN,
+    TEST_STAGE_JOURNAL_SIZE,
+    TEST_STAGE_KEPT_OPEN,
+    TEST_STAGE_KEPT_WRITE,
+    TEST_STAGE_KEPT_EXTEND,
+    TEST_STAGE_DELETED_OPEN,
+    TEST_STAGE_DELETED_WRITE,
+    TEST_STAGE_DELETED_UNLINK,
+    TEST_STAGE_DELETED_CHECK,
+    TEST_STAGE_READ_OPEN,
+    TEST_STAGE_READ_VALIDATE,
+    TEST_STAGE_READ_CLOSE,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_JOURNAL_OPEN;
+static testStage_e stageAfterOpen, stageAfterRead;
+
+static afatfsFilePtr_t testFile;
+static uint32_t logEntryIndex;
+
+static uint32_t freeSpaceBefore;
+
+static void initFilesystem()
+{
+    afatfs_init();
+
+    while (afatfs_getFilesystemState() != AFATFS_FILESYSTEM_STATE_READY) {
+        afatfs_poll();
+
+        if (afatfs_getFilesystemState() == AFATFS_FILESYSTEM_STATE_FATAL) {
+            fprintf(stderr, "[Fail]     Fatal filesystem error during init\n");
+            exit(-1);
+        }
+    }
+}
+
+/**
+ * Wait for everything to reach the card and for the journal to drop its records.
+ */
+static void waitForIdle()
+{
+    while (!afatfs_flush() || !sdcard_sim_isReady() || afatfs_journalRecordsOnCard() > 0) {
+        afatfs_poll();
+    }
+}
+
+/**
+ * Simulate a power interruption as soon as the journal record of the operation we just began has reached the card, and
+ * remount the volume (which replays the record).
+ */
+static void powerlossOnceJournaled()
+{
+    while (afatfs_journalRecordsOnCard() == 0 || !sdcard_sim_isReady()) {
+        afatfs_poll();
+    }
+
+    afatfs_destroy(true);
+    testFile = NULL;
+
+    initFilesystem();
+
+    testAssert(afatfs_journalRecordsOnCard() == 0, "Journal should be empty once it has been replayed");
+}
+
+static void testFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening test file failed");
+
+    testFile = file;
+    testStage = stageAfterOpen;
+}
+
+static void deletedFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file == NULL, "Deleted file should be gone after its journal record was replayed");
+
+    fprintf(stderr, "[Success]  Deletion was completed at mount and its clusters were given back to the freefile\n");
+
+    stageAfterRead = TEST_STAGE_COMPLETE;
+    testStage = TEST_STAGE_READ_OPEN;
+}
+
+static void openFile(const char *filename, const char *mode, testStage_e nextStage)
+{
+    testStage = TEST_STAGE_IDLE;
+    stageAfterOpen = nextStage;
+    logEntryIndex = 0;
+
+    afatfs_fopen(filename, mode, testFileOpened);
+}
+
+bool continueTesting()
+{
+    uint32_t journalSize;
+
+    switch (testStage) {
+        case TEST_STAGE_JOURNAL_OPEN:
+            openFile(TEST_JOURNAL_FILENAME, "r", TEST_STAGE_JOURNAL_SIZE);
+        break;
+        case TEST_STAGE_JOURNAL_SIZE:
+            if (afatfs_fseek(testFile, 0, AFATFS_SEEK_END) == AFATFS_OPERATION_SUCCESS) {
+                testAssert(afatfs_ftell(testFile, &journalSize), "ftell() should work after seeking to the end");
+
+                // Otherwise a disk checker would free the journal's cluster
+                testAssert(journalSize == afatfs_clusterSize(), "Journal file's size should cover its cluster");
+                testAssert(afatfs_fclose(testFile, NULL), "Expected close to be queued successfully");
+
+                testFile = NULL;
+                testStage = TEST_STAGE_KEPT_OPEN;
+            }
+        break;
+        case TEST_STAGE_KEPT_OPEN:
+            openFile(TEST_KEPT_FILENAME, "as", TEST_STAGE_KEPT_WRITE);
+        break;
+        case TEST_STAGE_KEPT_WRITE:
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_SUPERCLUSTER_ENTRIES)) {
+                waitForIdle();
+
+                freeSpaceBefore = afatfs_getContiguousFreeSpace();
+
+                testStage = TEST_STAGE_KEPT_EXTEND;
+            }
+        break;
+        case TEST_STAGE_KEPT_EXTEND:
+            // This entry needs the next supercluster, and we'll lose power before its FAT entries can be written
+            writeLogTestEntries(testFile, &logEntryIndex, TEST_SUPERCLUSTER_ENTRIES + 1);
+
+            powerlossOnceJournaled();
+
+            testAssert(afatfs_getContiguousFreeSpace() == freeSpaceBefore - afatfs_superClusterSize(), "Appended supercluster should have been taken from the freefile");
+
+            fprintf(stderr, "[Success]  Supercluster append was completed at mount\n");
+
+            stageAfterRead = TEST_STAGE_DELETED_OPEN;
+            testStage = TEST_STAGE_READ_OPEN;
+        break;
+        case TEST_STAGE_DELETED_OPEN:
+            freeSpaceBefore = afatfs_getContiguousFreeSpace();
+
+            openFile(TEST_DELETED_FILENAME, "as", TEST_STAGE_DELETED_WRITE);
+        break;
+        case TEST_STAGE_DELETED_WRITE:
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_SUPERCLUSTER_ENTRIES)) {
+                waitForIdle();
+
+                testStage = TEST_STAGE_DELETED_UNLINK;
+            }
+        break;
+        case TEST_STAGE_DELETED_UNLINK:
+            if (afatfs_funlink(testFile, NULL)) {
+                powerlossOnceJournaled();
+
+                testAssert(afatfs_getContiguousFreeSpace() == freeSpaceBefore, "Deleted file's clusters should have been given back to the freefile");
+
+                testStage = TEST_STAGE_DELETED_CHECK;
+            }
+        break;
+        case TEST_STAGE_DELETED_CHECK:
+            testStage = TEST_STAGE_IDLE;
+
+            afatfs_fopen(TEST_DELETED_FILENAME, "r", deletedFileOpened);
+        break;
+        case TEST_STAGE_READ_OPEN:
+            openFile(TEST_KEPT_FILENAME, "r", TEST_STAGE_READ_VALIDATE);
+        break;
+        case TEST_STAGE_READ_VALIDATE:
+            // The entry written just before the power cut might not have been saved in the file's size
+            if (validateLogTestEntries(testFile, &logEntryIndex, TEST_SUPERCLUSTER_ENTRIES)) {
+                testStage = TEST_STAGE_READ_CLOSE;
+            }
+        break;
+        case TEST_STAGE_READ_CLOSE:
+            if (afatfs_fclose(testFile, NULL)) {
+                testFile = NULL;
+                testStage = stageAfterRead;
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    initFilesystem();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,235 @@
+/**
+ * Push log records into a log stream in bursts, as an interrupt handler would between calls to afatfs_poll(), using a
+ * buffer that's small enough that some of the records have to be dropped. Then check that the file holds exactly the
+ * records that the stream accepted, in order, and that the stream's drop counters and high-watermark add up.
+ *
+ * This test must be built with AFATFS_USE_LOG_STREAM defined.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+#define TEST_STREAM_BUFFER_SIZE 4096
+
+#define TEST_RECORD_SIZE 24
+#define TEST_RECORD_COUNT 100000
+
+// How many records are pushed between each poll, this cycles so that we sometimes outrun the card
+#define TEST_RECORDS_PER_POLL(poll) ((poll) % 16 == 0 ? 200 : 8)
+
+typedef enum {
+    TEST_STAGE_OPEN,
+    TEST_STAGE_PRODUCE,
+    TEST_STAGE_CLOSE_STREAM,
+    TEST_STAGE_CLOSE,
+    TEST_STAGE_OPEN_READ,
+    TEST_STAGE_VALIDATE,
+    TEST_STAGE_CLOSE_READ,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_OPEN;
+
+static afatfsFilePtr_t testFile;
+static afatfsLogStream_t logStream;
+static uint8_t logStreamBuffer[TEST_STREAM_BUFFER_SIZE];
+
+static uint32_t pollCount;
+static uint32_t recordsPushed, recordsAccepted, recordsValidated;
+static uint32_t lastRecordSeen;
+
+static void makeRecord(uint32_t sequence, uint8_t *record)
+{
+    memcpy(record, &sequence, sizeof(sequence));
+
+    for (int i = sizeof(sequence); i < TEST_RECORD_SIZE; i++) {
+        record[i] = (uint8_t) (sequence * 7 + i);
+    }
+}
+
+static void logFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening log file failed");
+
+    testFile = file;
+    testAssert(afatfs_logStreamOpen(&logStream, testFile, logStreamBuffer, TEST_STREAM_BUFFER_SIZE), "Opening log stream failed");
+    testAssert(!afatfs_logStreamOpen(&logStream, testFile, logStreamBuffer, TEST_STREAM_BUFFER_SIZE), "Opening a stream that's already open should fail");
+
+    testStage = TEST_STAGE_PRODUCE;
+}
+
+static void readFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening log file for read failed");
+
+    testFile = file;
+    testStage = TEST_STAGE_VALIDATE;
+}
+
+/**
+ * Stands in for an interrupt handler which produces log records while the main loop is busy.
+ */
+static void produceRecords()
+{
+    uint8_t record[TEST_RECORD_SIZE];
+
+    for (int i = 0; i < TEST_RECORDS_PER_POLL(pollCount) && recordsPushed < TEST_RECORD_COUNT; i++) {
+        makeRecord(recordsPushed, record);
+
+        if (afatfs_logStreamWrite(&logStream, record, TEST_RECORD_SIZE)) {
+            recordsAccepted++;
+        }
+
+        recordsPushed++;
+    }
+}
+
+static bool validateRecords()
+{
+    static uint8_t record[TEST_RECORD_SIZE];
+    static uint32_t recordBytes;
+    uint8_t expected[TEST_RECORD_SIZE];
+    uint32_t sequence;
+
+    while (recordsValidated < recordsAccepted) {
+        // Records aren't aligned to sectors, so one might be split between reads
+        uint32_t readBytes = afatfs_fread(testFile, record + recordBytes, TEST_RECORD_SIZE - recordBytes);
+
+        if (readBytes == 0) {
+            return false;
+        }
+
+        recordBytes += readBytes;
+
+        if (recordBytes < TEST_RECORD_SIZE) {
+            continue;
+        }
+
+        recordBytes = 0;
+
+        memcpy(&sequence, record, sizeof(sequence));
+
+        testAssert(recordsValidated == 0 || sequence > lastRecordSeen, "Records are out of order");
+        makeRecord(sequence, expected);
+        testAssert(memcmp(record, expected, TEST_RECORD_SIZE) == 0, "Record content validation failed");
+
+        lastRecordSeen = sequence;
+        recordsValidated++;
+    }
+
+    return true;
+}
+
+bool continueTesting()
+{
+    uint32_t position;
+
+    switch (testStage) {
+        case TEST_STAGE_OPEN:
+            testStage = TEST_STAGE_IDLE;
+            afatfs_fopen("stream.txt", "as", logFileOpened);
+        break;
+        case TEST_STAGE_PRODUCE:
+            produceRecords();
+
+            if (recordsPushed == TEST_RECORD_COUNT) {
+                testStage = TEST_STAGE_CLOSE_STREAM;
+            }
+        break;
+        case TEST_STAGE_CLOSE_STREAM:
+            if (afatfs_logStreamClose(&logStream)) {
+                testAssert(!afatfs_logStreamWrite(&logStream, logStreamBuffer, TEST_RECORD_SIZE), "Closed stream should not accept records");
+                testAssert(afatfs_ftell(testFile, &position) && position == recordsAccepted * TEST_RECORD_SIZE, "File length doesn't match the records accepted");
+
+                testStage = TEST_STAGE_CLOSE;
+            }
+        break;
+        case TEST_STAGE_CLOSE:
+            if (afatfs_fclose(testFile, NULL)) {
+                testStage = TEST_STAGE_OPEN_READ;
+            }
+        break;
+        case TEST_STAGE_OPEN_READ:
+            testStage = TEST_STAGE_IDLE;
+            afatfs_fopen("stream.txt", "r", readFileOpened);
+        break;
+        case TEST_STAGE_VALIDATE:
+            if (validateRecords()) {
+                testAssert(afatfs_feof(testFile), "File holds more records than the stream accepted");
+                testStage = TEST_STAGE_CLOSE_READ;
+            }
+        break;
+        case TEST_STAGE_CLOSE_READ:
+            if (afatfs_fclose(testFile, NULL)) {
+                testStage = TEST_STAGE_COMPLETE;
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    afatfs_init();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+        pollCount++;
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    testAssert(recordsAccepted > 0 && recordsAccepted < TEST_RECORD_COUNT, "Test should have dropped some records but not all of them");
+    // The extra write was the one we tried after closing the stream
+    testAssert(logStream.droppedWrites == TEST_RECORD_COUNT - recordsAccepted + 1, "Dropped write count is wrong");
+    testAssert(logStream.droppedBytes == logStream.droppedWrites * TEST_RECORD_SIZE, "Dropped byte count is wrong");
+    testAssert(logStream.highWatermark > TEST_STREAM_BUFFER_SIZE - TEST_RECORD_SIZE && logStream.highWatermark <= TEST_STREAM_BUFFER_SIZE, "High-watermark should show the buffer filled up");
+
+    fprintf(stderr, "[Success]  Log stream wrote %u records to the file and dropped %u\n", (unsigned) recordsAccepted, (unsigned) (TEST_RECORD_COUNT - recordsAccepted));
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,169 @@
+/**
+ * Drive the filesystem using afatfs_pollBudget() with the smallest possible budget, and check that init (including the
+ * freefile search), writing files in both the "a" and "as" modes, reading them back and deleting one of them all still
+ * complete.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+#define TEST_POLL_SECTOR_BUDGET 1
+
+// Give the files a few clusters each so that several clusters have to be allocated and walked
+#define TEST_LOG_ENTRY_COUNT ((afatfs_clusterSize() * 3 + 100) / TEST_LOG_ENTRY_SIZE)
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_clusterSize();
+
+typedef enum {
+    TEST_STAGE_CREATE_APPEND,
+    TEST_STAGE_FILL_APPEND,
+    TEST_STAGE_CLOSE_APPEND,
+    TEST_STAGE_FILL_SOLID,
+    TEST_STAGE_CLOSE_SOLID,
+    TEST_STAGE_VALIDATE_APPEND,
+    TEST_STAGE_CLOSE_VALIDATE_APPEND,
+    TEST_STAGE_VALIDATE_SOLID,
+    TEST_STAGE_UNLINK,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_CREATE_APPEND;
+// The stage to move to once the file we're opening is ready
+static testStage_e openedStage;
+
+static afatfsFilePtr_t testFile;
+static uint32_t logEntryIndex;
+
+static void testFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening testfile failed");
+
+    testFile = file;
+    logEntryIndex = 0;
+
+    testStage = openedStage;
+}
+
+static void testFileUnlinked()
+{
+    testFile = NULL;
+    testStage = TEST_STAGE_COMPLETE;
+}
+
+bool continueTesting()
+{
+    switch (testStage) {
+        case TEST_STAGE_CREATE_APPEND:
+            testStage = TEST_STAGE_IDLE;
+            openedStage = TEST_STAGE_FILL_APPEND;
+            afatfs_fopen("append.txt", "a", testFileOpened);
+        break;
+        case TEST_STAGE_FILL_APPEND:
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_LOG_ENTRY_COUNT)) {
+                testStage = TEST_STAGE_CLOSE_APPEND;
+            }
+        break;
+        case TEST_STAGE_CLOSE_APPEND:
+            if (afatfs_fclose(testFile, NULL)) {
+                testStage = TEST_STAGE_IDLE;
+                openedStage = TEST_STAGE_FILL_SOLID;
+                afatfs_fopen("solid.txt", "as", testFileOpened);
+            }
+        break;
+        case TEST_STAGE_FILL_SOLID:
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_LOG_ENTRY_COUNT)) {
+                testStage = TEST_STAGE_CLOSE_SOLID;
+            }
+        break;
+        case TEST_STAGE_CLOSE_SOLID:
+            if (afatfs_fclose(testFile, NULL)) {
+                testStage = TEST_STAGE_IDLE;
+                openedStage = TEST_STAGE_VALIDATE_APPEND;
+                afatfs_fopen("append.txt", "r", testFileOpened);
+            }
+        break;
+        case TEST_STAGE_VALIDATE_APPEND:
+            if (validateLogTestEntries(testFile, &logEntryIndex, TEST_LOG_ENTRY_COUNT)) {
+                testStage = TEST_STAGE_CLOSE_VALIDATE_APPEND;
+            }
+        break;
+        case TEST_STAGE_CLOSE_VALIDATE_APPEND:
+            if (afatfs_fclose(testFile, NULL)) {
+                testStage = TEST_STAGE_IDLE;
+                openedStage = TEST_STAGE_VALIDATE_SOLID;
+                afatfs_fopen("solid.txt", "r", testFileOpened);
+            }
+        break;
+        case TEST_STAGE_VALIDATE_SOLID:
+            if (validateLogTestEntries(testFile, &logEntryIndex, TEST_LOG_ENTRY_COUNT)) {
+                testStage = TEST_STAGE_UNLINK;
+            }
+        break;
+        case TEST_STAGE_UNLINK:
+            if (afatfs_funlink(testFile, testFileUnlinked)) {
+                testStage = TEST_STAGE_IDLE;
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    afatfs_init();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_pollBudget(TEST_POLL_SECTOR_BUDGET);
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    fprintf(stderr, "[Success]  Files written and read back while polling with a budget of %d sector\n", TEST_POLL_SECTOR_BUDGET);
+
+    return EXIT_SUCCESS;
+}
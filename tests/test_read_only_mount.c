@@ -0,0 +1,213 @@
+/**
+ * Write a log file, then remount the volume with afatfs_initReadOnly() and check that the mount becomes ready after
+ * reading just the MBR and volume ID, that anything which would write to the card is refused, that the log reads back
+ * correctly, and that the card wasn't written to at all.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+#define TEST_FILENAME "log.txt"
+
+// A few clusters' worth of log entries, so that reading it back crosses cluster boundaries
+#define TEST_LOG_ENTRY_COUNT ((4 * afatfs_clusterSize() + 100) / TEST_LOG_ENTRY_SIZE)
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_clusterSize();
+
+typedef enum {
+    TEST_STAGE_WRITE_OPEN,
+    TEST_STAGE_WRITE,
+    TEST_STAGE_WRITE_CLOSE,
+    TEST_STAGE_REMOUNT,
+    TEST_STAGE_REFUSE_WRITES,
+    TEST_STAGE_READ_OPEN,
+    TEST_STAGE_READ_VALIDATE,
+    TEST_STAGE_READ_CLOSE,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_WRITE_OPEN;
+
+static afatfsFilePtr_t testFile;
+static uint32_t logEntryIndex;
+
+static bool refusedCallbackCalled;
+
+static sdcardSimStats_t statsBeforeMount;
+
+static void waitForReady()
+{
+    while (afatfs_getFilesystemState() != AFATFS_FILESYSTEM_STATE_READY) {
+        afatfs_poll();
+
+        if (afatfs_getFilesystemState() == AFATFS_FILESYSTEM_STATE_FATAL) {
+            fprintf(stderr, "[Fail]     Fatal filesystem error during init\n");
+            exit(-1);
+        }
+    }
+}
+
+static void testFileCreated(afatfsFilePtr_t file)
+{
+    testAssert(file, "Creating test file failed");
+
+    testFile = file;
+    testStage = TEST_STAGE_WRITE;
+}
+
+static void testFileOpenedForRead(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening test file for read on the read-only mount failed");
+
+    testFile = file;
+    testStage = TEST_STAGE_READ_VALIDATE;
+}
+
+static void refusedFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file == NULL, "Opening a file for writing should fail on a read-only mount");
+
+    refusedCallbackCalled = true;
+}
+
+bool continueTesting()
+{
+    sdcardSimStats_t stats;
+
+    switch (testStage) {
+        case TEST_STAGE_WRITE_OPEN:
+            testStage = TEST_STAGE_IDLE;
+            logEntryIndex = 0;
+
+            afatfs_fopen(TEST_FILENAME, "as", testFileCreated);
+        break;
+        case TEST_STAGE_WRITE:
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_LOG_ENTRY_COUNT)) {
+                testStage = TEST_STAGE_WRITE_CLOSE;
+            }
+        break;
+        case TEST_STAGE_WRITE_CLOSE:
+            if (afatfs_fclose(testFile, NULL)) {
+                testFile = NULL;
+                testStage = TEST_STAGE_REMOUNT;
+            }
+        break;
+        case TEST_STAGE_REMOUNT:
+            while (!afatfs_destroy(false)) {
+            }
+
+            sdcard_sim_getStats(&statsBeforeMount);
+
+            afatfs_initReadOnly();
+            waitForReady();
+
+            sdcard_sim_getStats(&stats);
+
+            // No FSInfo, freefile search or introspective log
+            testAssert(stats.reads - statsBeforeMount.reads == 2, "Read-only mount should only read the MBR and volume ID");
+
+            testStage = TEST_STAGE_REFUSE_WRITES;
+        break;
+        case TEST_STAGE_REFUSE_WRITES:
+            refusedCallbackCalled = false;
+            testAssert(!afatfs_fopen("new.txt", "w", refusedFileOpened), "fopen(\"w\") should be refused on a read-only mount");
+            testAssert(refusedCallbackCalled, "Refused fopen() should call back with NULL");
+
+            testAssert(!afatfs_fopen(TEST_FILENAME, "a", NULL), "fopen(\"a\") should be refused on a read-only mount");
+            testAssert(!afatfs_fopen(TEST_FILENAME, "r+", NULL), "fopen(\"r+\") should be refused on a read-only mount");
+            testAssert(!afatfs_fopen("new.txt", "as", NULL), "fopen(\"as\") should be refused on a read-only mount");
+            testAssert(!afatfs_mkdir("newdir", NULL), "mkdir() should be refused on a read-only mount");
+            testAssert(!afatfs_createSequentialFile("LOG", "TXT", "a", NULL), "createSequentialFile() should be refused on a read-only mount");
+
+            testStage = TEST_STAGE_READ_OPEN;
+        break;
+        case TEST_STAGE_READ_OPEN:
+            testStage = TEST_STAGE_IDLE;
+            logEntryIndex = 0;
+
+            testAssert(afatfs_fopen(TEST_FILENAME, "r", testFileOpenedForRead), "fopen(\"r\") should work on a read-only mount");
+        break;
+        case TEST_STAGE_READ_VALIDATE:
+            if (validateLogTestEntries(testFile, &logEntryIndex, TEST_LOG_ENTRY_COUNT)) {
+                testAssert(afatfs_feof(testFile), "Log file should end after the entries we wrote");
+                testAssert(!afatfs_ftruncate(testFile, NULL), "ftruncate() should be refused on a read-only mount");
+
+                testStage = TEST_STAGE_READ_CLOSE;
+            }
+        break;
+        case TEST_STAGE_READ_CLOSE:
+            if (afatfs_fclose(testFile, NULL)) {
+                testFile = NULL;
+                testStage = TEST_STAGE_COMPLETE;
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    sdcardSimStats_t stats;
+
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    afatfs_init();
+    waitForReady();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_getStats(&stats);
+
+    sdcard_sim_destroy();
+
+    testAssert(stats.writes == statsBeforeMount.writes && stats.erases == statsBeforeMount.erases, "Read-only mount should never write to the card");
+
+    fprintf(stderr, "[Success]  Read-only mount read the log back without writing to the card\n");
+
+    return EXIT_SUCCESS;
+}
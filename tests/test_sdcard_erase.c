@@ -0,0 +1,411 @@
+/**
+ * Check that appends to a regular file announce the rest of each cluster to the card as a multi-block write, that the
+ * sectors of deleted regular and contiguous files are erased, and that files written before and after the erase read
+ * back correctly.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+#define SDCARD_SECTOR_SIZE 512
+
+#define TEST_KEEP_CLUSTERS 1
+#define TEST_BIG_CLUSTERS 48
+#define TEST_SOLID_CLUSTERS 3
+
+#define TEST_MAX_EXTENTS 8
+#define TEST_MAX_ERASES 16
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_clusterSize();
+extern uint32_t afatfs_superClusterSize();
+
+typedef enum {
+    TEST_STAGE_OPEN_KEEP,
+    TEST_STAGE_WRITE_KEEP,
+    TEST_STAGE_CLOSE_KEEP,
+    TEST_STAGE_OPEN_BIG,
+    TEST_STAGE_WRITE_BIG,
+    TEST_STAGE_FLUSH_BIG,
+    TEST_STAGE_CLOSE_BIG,
+    TEST_STAGE_OPEN_BIG_EXTENTS,
+    TEST_STAGE_GET_BIG_EXTENTS,
+    TEST_STAGE_UNLINK_BIG,
+    TEST_STAGE_OPEN_SOLID,
+    TEST_STAGE_WRITE_SOLID,
+    TEST_STAGE_CLOSE_SOLID,
+    TEST_STAGE_OPEN_SOLID_EXTENTS,
+    TEST_STAGE_GET_SOLID_EXTENTS,
+    TEST_STAGE_UNLINK_SOLID,
+    TEST_STAGE_OPEN_AGAIN,
+    TEST_STAGE_WRITE_AGAIN,
+    TEST_STAGE_CLOSE_AGAIN,
+    TEST_STAGE_OPEN_VALIDATE,
+    TEST_STAGE_VALIDATE,
+    TEST_STAGE_CLOSE_VALIDATE,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_OPEN_KEEP;
+// The stage that the callback of the operation we're waiting for should move on to
+static testStage_e stageAfterCallback;
+
+static afatfsFilePtr_t testFile;
+static uint32_t logEntryIndex;
+
+static afatfsExtent_t extents[TEST_MAX_EXTENTS];
+static int extentCount;
+static uint32_t extentsOffset;
+
+static uint32_t eraseBlockIndex[TEST_MAX_ERASES];
+static int eraseCount;
+
+static sdcardSimStats_t statsBefore;
+
+static uint32_t bigMultiWrites, bigErasedBlocks;
+
+static int validateFileIndex;
+static const char *validateFilenames[] = {"keep.txt", "again.bin"};
+static const uint32_t validateClusters[] = {TEST_KEEP_CLUSTERS, TEST_BIG_CLUSTERS};
+
+static uint32_t entriesPerCluster()
+{
+    return afatfs_clusterSize() / TEST_LOG_ENTRY_SIZE;
+}
+
+static void sdcardProfiler(sdcardBlockOperation_e operation, uint32_t blockIndex, uint32_t duration)
+{
+    (void) duration;
+
+    if (operation == SDCARD_BLOCK_OPERATION_ERASE) {
+        testAssert(eraseCount < TEST_MAX_ERASES, "Too many erases");
+
+        eraseBlockIndex[eraseCount++] = blockIndex;
+    }
+}
+
+static void fileOpenedForWrite(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening file for write failed");
+
+    testFile = file;
+    logEntryIndex = 0;
+
+    testStage = stageAfterCallback;
+}
+
+static void fileOpenedForRead(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening file for read failed");
+
+    testFile = file;
+    logEntryIndex = 0;
+    extentCount = 0;
+    extentsOffset = 0;
+
+    testStage = stageAfterCallback;
+}
+
+static void fileUnlinked()
+{
+    testStage = stageAfterCallback;
+}
+
+/**
+ * Collect the extents of the whole of testFile into the extents array.
+ *
+ * Returns true once all of them have been found.
+ */
+static bool continueGetExtents()
+{
+    afatfsExtent_t found[TEST_MAX_EXTENTS];
+    int count;
+
+    switch (afatfs_fgetExtents(testFile, extentsOffset, UINT32_MAX, found, TEST_MAX_EXTENTS, &count)) {
+        case AFATFS_OPERATION_SUCCESS:
+            if (count == 0) {
+                return true;
+            }
+
+            for (int i = 0; i < count; i++) {
+                extentsOffset += found[i].sectorCount * SDCARD_SECTOR_SIZE;
+
+                // A run of sectors might be split between calls, so join those back up again
+                if (extentCount > 0 && extents[extentCount - 1].sectorIndex + extents[extentCount - 1].sectorCount == found[i].sectorIndex) {
+                    extents[extentCount - 1].sectorCount += found[i].sectorCount;
+                } else {
+                    testAssert(extentCount < TEST_MAX_EXTENTS, "File was more fragmented than expected");
+
+                    extents[extentCount++] = found[i];
+                }
+            }
+        break;
+        case AFATFS_OPERATION_IN_PROGRESS:
+        break;
+        case AFATFS_OPERATION_FAILURE:
+            testAssert(false, "Getting the extents of the file failed");
+        break;
+    }
+
+    return false;
+}
+
+/**
+ * Check that every erase since the given one began inside the sectors last collected by continueGetExtents().
+ */
+static void checkErasesInsideExtents(int firstErase)
+{
+    for (int i = firstErase; i < eraseCount; i++) {
+        bool found = false;
+
+        for (int j = 0; j < extentCount; j++) {
+            if (eraseBlockIndex[i] >= extents[j].sectorIndex && eraseBlockIndex[i] < extents[j].sectorIndex + extents[j].sectorCount) {
+                found = true;
+            }
+        }
+
+        testAssert(found, "Erase began outside of the deleted file");
+    }
+}
+
+bool continueTesting()
+{
+    sdcardSimStats_t stats;
+    static int erasesBefore;
+
+    switch (testStage) {
+        case TEST_STAGE_OPEN_KEEP:
+            testStage = TEST_STAGE_IDLE;
+
+            stageAfterCallback = TEST_STAGE_WRITE_KEEP;
+            afatfs_fopen("keep.txt", "a", fileOpenedForWrite);
+        break;
+        case TEST_STAGE_WRITE_KEEP:
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_KEEP_CLUSTERS * entriesPerCluster())) {
+                testStage = TEST_STAGE_CLOSE_KEEP;
+            }
+        break;
+        case TEST_STAGE_CLOSE_KEEP:
+            if (afatfs_fclose(testFile, NULL)) {
+                testStage = TEST_STAGE_OPEN_BIG;
+            }
+        break;
+        case TEST_STAGE_OPEN_BIG:
+            testStage = TEST_STAGE_IDLE;
+
+            sdcard_sim_getStats(&statsBefore);
+
+            stageAfterCallback = TEST_STAGE_WRITE_BIG;
+            afatfs_fopen("big.bin", "a", fileOpenedForWrite);
+        break;
+        case TEST_STAGE_WRITE_BIG:
+            if (logEntryIndex == TEST_BIG_CLUSTERS * entriesPerCluster()) {
+                sdcard_sim_getStats(&stats);
+                bigMultiWrites = stats.multiWrites - statsBefore.multiWrites;
+
+                testStage = TEST_STAGE_CLOSE_BIG;
+            } else if (writeLogTestEntries(testFile, &logEntryIndex, logEntryIndex + SDCARD_SECTOR_SIZE / TEST_LOG_ENTRY_SIZE)) {
+                /*
+                 * Write each sector out before writing the next, so that the only multi-block writes are the ones that
+                 * the pre-erase hints asked for (rather than runs of dirty sectors that the cache collects).
+                 */
+                testStage = TEST_STAGE_FLUSH_BIG;
+            }
+        break;
+        case TEST_STAGE_FLUSH_BIG:
+            if (afatfs_flush() && sdcard_sim_isReady()) {
+                testStage = TEST_STAGE_WRITE_BIG;
+            }
+        break;
+        case TEST_STAGE_CLOSE_BIG:
+            if (afatfs_fclose(testFile, NULL)) {
+                testStage = TEST_STAGE_OPEN_BIG_EXTENTS;
+            }
+        break;
+        case TEST_STAGE_OPEN_BIG_EXTENTS:
+            testStage = TEST_STAGE_IDLE;
+
+            stageAfterCallback = TEST_STAGE_GET_BIG_EXTENTS;
+            afatfs_fopen("big.bin", "r", fileOpenedForRead);
+        break;
+        case TEST_STAGE_GET_BIG_EXTENTS:
+            if (continueGetExtents()) {
+                erasesBefore = eraseCount;
+                sdcard_sim_getStats(&statsBefore);
+
+                testStage = TEST_STAGE_UNLINK_BIG;
+            }
+        break;
+        case TEST_STAGE_UNLINK_BIG:
+            testStage = TEST_STAGE_IDLE;
+            stageAfterCallback = TEST_STAGE_OPEN_SOLID;
+
+            testAssert(afatfs_funlink(testFile, fileUnlinked), "Expected to be able to queue unlink of file");
+        break;
+        case TEST_STAGE_OPEN_SOLID:
+            // The erase is still in the process of being sent to the card
+            if (!sdcard_sim_isReady()) {
+                break;
+            }
+
+            sdcard_sim_getStats(&stats);
+            bigErasedBlocks = stats.erasedBlocks - statsBefore.erasedBlocks;
+
+            testAssert(eraseCount > erasesBefore, "Deleting a large regular file should have erased its sectors");
+            testAssert(bigErasedBlocks <= TEST_BIG_CLUSTERS * afatfs_clusterSize() / SDCARD_SECTOR_SIZE,
+                "Erased more sectors than the regular file held");
+            checkErasesInsideExtents(erasesBefore);
+
+            testStage = TEST_STAGE_IDLE;
+
+            stageAfterCallback = TEST_STAGE_WRITE_SOLID;
+            afatfs_fopen("solid.bin", "as", fileOpenedForWrite);
+        break;
+        case TEST_STAGE_WRITE_SOLID:
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_SOLID_CLUSTERS * entriesPerCluster())) {
+                testStage = TEST_STAGE_CLOSE_SOLID;
+            }
+        break;
+        case TEST_STAGE_CLOSE_SOLID:
+            if (afatfs_fclose(testFile, NULL)) {
+                testStage = TEST_STAGE_OPEN_SOLID_EXTENTS;
+            }
+        break;
+        case TEST_STAGE_OPEN_SOLID_EXTENTS:
+            testStage = TEST_STAGE_IDLE;
+
+            stageAfterCallback = TEST_STAGE_GET_SOLID_EXTENTS;
+            afatfs_fopen("solid.bin", "r", fileOpenedForRead);
+        break;
+        case TEST_STAGE_GET_SOLID_EXTENTS:
+            if (continueGetExtents()) {
+                testAssert(extentCount == 1, "Contiguous file should have been a single extent");
+
+                erasesBefore = eraseCount;
+                sdcard_sim_getStats(&statsBefore);
+
+                testStage = TEST_STAGE_UNLINK_SOLID;
+            }
+        break;
+        case TEST_STAGE_UNLINK_SOLID:
+            testStage = TEST_STAGE_IDLE;
+            stageAfterCallback = TEST_STAGE_OPEN_AGAIN;
+
+            testAssert(afatfs_funlink(testFile, fileUnlinked), "Expected to be able to queue unlink of file");
+        break;
+        case TEST_STAGE_OPEN_AGAIN:
+            if (!sdcard_sim_isReady()) {
+                break;
+            }
+
+            sdcard_sim_getStats(&stats);
+
+            // The contiguous file is handed back to the freefile one whole supercluster at a time
+            testAssert(eraseCount == erasesBefore + 1 && eraseBlockIndex[erasesBefore] == extents[0].sectorIndex
+                && stats.erasedBlocks - statsBefore.erasedBlocks == afatfs_superClusterSize() / SDCARD_SECTOR_SIZE,
+                "Deleting a contiguous file should have erased its supercluster");
+
+            testStage = TEST_STAGE_IDLE;
+
+            // This should reuse the space that the regular file was erased from
+            stageAfterCallback = TEST_STAGE_WRITE_AGAIN;
+            afatfs_fopen("again.bin", "a", fileOpenedForWrite);
+        break;
+        case TEST_STAGE_WRITE_AGAIN:
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_BIG_CLUSTERS * entriesPerCluster())) {
+                testStage = TEST_STAGE_CLOSE_AGAIN;
+            }
+        break;
+        case TEST_STAGE_CLOSE_AGAIN:
+            if (afatfs_fclose(testFile, NULL)) {
+                testStage = TEST_STAGE_OPEN_VALIDATE;
+            }
+        break;
+        case TEST_STAGE_OPEN_VALIDATE:
+            testStage = TEST_STAGE_IDLE;
+
+            stageAfterCallback = TEST_STAGE_VALIDATE;
+            afatfs_fopen(validateFilenames[validateFileIndex], "r", fileOpenedForRead);
+        break;
+        case TEST_STAGE_VALIDATE:
+            if (validateLogTestEntries(testFile, &logEntryIndex, validateClusters[validateFileIndex] * entriesPerCluster())) {
+                testAssert(afatfs_feof(testFile), "File is longer than we wrote");
+
+                testStage = TEST_STAGE_CLOSE_VALIDATE;
+            }
+        break;
+        case TEST_STAGE_CLOSE_VALIDATE:
+            if (afatfs_fclose(testFile, NULL)) {
+                validateFileIndex++;
+
+                testStage = validateFileIndex == 2 ? TEST_STAGE_COMPLETE : TEST_STAGE_OPEN_VALIDATE;
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    sdcard_setProfilerCallback(sdcardProfiler);
+
+    afatfs_init();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    // Every cluster that the regular file was given should have been announced to the card with a pre-erase hint
+    testAssert(bigMultiWrites >= TEST_BIG_CLUSTERS, "Appends to a regular file should have used multi-block writes");
+
+    fprintf(stderr, "[Success]  Regular appends began %u multi-block writes for %u clusters, deleting erased %u sectors\n",
+        bigMultiWrites, TEST_BIG_CLUSTERS, bigErasedBlocks);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,285 @@
+/**
+ * Create log files with afatfs_createSequentialFile() in a directory that already holds some files with similar names,
+ * and check that each one gets one more than the highest number already in use for its prefix and extension. Then
+ * remount and check that the files can be found under the names we expect.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+#define TEST_LOG_ENTRY_COUNT 100
+
+// Files that already exist before we start. Only the first two have the prefix and extension we're numbering
+static const char *existingFilenames[] = {"LOG00001.TXT", "LOG00007.TXT", "LOG00099.BIN", "LOGX0050.TXT", "LOG.TXT", "LOG0003.TXT"};
+#define TEST_EXISTING_FILE_COUNT ((int) (sizeof(existingFilenames) / sizeof(existingFilenames[0])))
+
+// The names that the sequential files should receive, in the order we create them
+static const char *sequentialFilenames[] = {"LOG00008.TXT", "LOG00009.TXT"};
+#define TEST_SEQUENTIAL_FILE_COUNT ((int) (sizeof(sequentialFilenames) / sizeof(sequentialFilenames[0])))
+
+// A prefix which only leaves room for a single digit, so we can run out of numbers
+#define TEST_SHORT_PREFIX "SEQUENC"
+#define TEST_SHORT_PREFIX_FILE_COUNT 9
+
+typedef enum {
+    TEST_STAGE_CREATE_LOG_DIRECTORY,
+    TEST_STAGE_CREATE_EXISTING_FILES,
+    TEST_STAGE_CREATE_SEQUENTIAL_FILE,
+    TEST_STAGE_WRITE_SEQUENTIAL_FILE,
+    TEST_STAGE_CLOSE_SEQUENTIAL_FILE,
+    TEST_STAGE_CREATE_SHORT_PREFIX_FILES,
+    TEST_STAGE_REMOUNT,
+    TEST_STAGE_OPEN_LOG_DIRECTORY,
+    TEST_STAGE_OPEN_SEQUENTIAL_FILE,
+    TEST_STAGE_VALIDATE_SEQUENTIAL_FILE,
+    TEST_STAGE_CLOSE_VALIDATED_FILE,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_CREATE_LOG_DIRECTORY;
+
+static afatfsFilePtr_t testFile;
+static int filesCreated, filesValidated;
+static uint32_t logEntryIndex;
+
+static void initFilesystem()
+{
+    afatfs_init();
+
+    while (afatfs_getFilesystemState() != AFATFS_FILESYSTEM_STATE_READY) {
+        afatfs_poll();
+
+        if (afatfs_getFilesystemState() == AFATFS_FILESYSTEM_STATE_FATAL) {
+            fprintf(stderr, "[Fail]     Fatal filesystem error during init\n");
+            exit(-1);
+        }
+    }
+}
+
+static void logDirCreated(afatfsFilePtr_t dir)
+{
+    testAssert(dir, "Creating 'logs' directory failed");
+
+    afatfs_chdir(dir);
+    testAssert(afatfs_fclose(dir, NULL), "Expected to be able to queue close on directory");
+
+    testStage = TEST_STAGE_CREATE_EXISTING_FILES;
+}
+
+static void existingFileCreated(afatfsFilePtr_t file)
+{
+    testAssert(file, "Creating existing file failed");
+
+    afatfs_fclose(file, NULL);
+
+    filesCreated++;
+    testStage = TEST_STAGE_CREATE_EXISTING_FILES;
+}
+
+static void sequentialFileCreated(afatfsFilePtr_t file)
+{
+    testAssert(file, "Creating sequential file failed");
+
+    testFile = file;
+
+    // Give each file different content so that we can tell them apart
+    logEntryIndex = filesCreated * TEST_LOG_ENTRY_COUNT;
+
+    testStage = TEST_STAGE_WRITE_SEQUENTIAL_FILE;
+}
+
+static void shortPrefixFileCreated(afatfsFilePtr_t file)
+{
+    testAssert(file, "Creating file with a short prefix failed");
+
+    afatfs_fclose(file, NULL);
+
+    filesCreated++;
+    testStage = TEST_STAGE_CREATE_SHORT_PREFIX_FILES;
+}
+
+static void shortPrefixOverflowCreated(afatfsFilePtr_t file)
+{
+    testAssert(!file, "Creating a file should fail once the numbers run out");
+
+    testStage = TEST_STAGE_REMOUNT;
+}
+
+static void logDirectoryOpened(afatfsFilePtr_t dir)
+{
+    testAssert(dir, "Opening 'logs' directory failed");
+    testAssert(afatfs_chdir(dir), "Changing to 'logs' directory failed");
+    testAssert(afatfs_fclose(dir, NULL), "Expected to be able to queue close on directory");
+
+    testStage = TEST_STAGE_OPEN_SEQUENTIAL_FILE;
+}
+
+static void sequentialFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Sequential file doesn't have the name we expected");
+
+    testFile = file;
+    logEntryIndex = (TEST_EXISTING_FILE_COUNT + filesValidated) * TEST_LOG_ENTRY_COUNT;
+
+    testStage = TEST_STAGE_VALIDATE_SEQUENTIAL_FILE;
+}
+
+static void shortPrefixFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Last file with a short prefix doesn't have the name we expected");
+
+    afatfs_fclose(file, NULL);
+
+    testStage = TEST_STAGE_COMPLETE;
+}
+
+bool continueTesting()
+{
+    switch (testStage) {
+        case TEST_STAGE_CREATE_LOG_DIRECTORY:
+            // The callback can be called before mkdir() returns, so set the testStage first
+            testStage = TEST_STAGE_IDLE;
+
+            afatfs_mkdir("logs", logDirCreated);
+        break;
+        case TEST_STAGE_CREATE_EXISTING_FILES:
+            if (filesCreated == TEST_EXISTING_FILE_COUNT) {
+                testAssert(!afatfs_createSequentialFile("", "TXT", "a", NULL), "Empty prefix should be rejected");
+                testAssert(!afatfs_createSequentialFile("TOOLONG1", "TXT", "a", NULL), "Prefix without room for digits should be rejected");
+                testAssert(!afatfs_createSequentialFile("LOG", "TEXT", "a", NULL), "Long extension should be rejected");
+
+                testStage = TEST_STAGE_CREATE_SEQUENTIAL_FILE;
+            } else {
+                testStage = TEST_STAGE_IDLE;
+
+                afatfs_fopen(existingFilenames[filesCreated], "a", existingFileCreated);
+            }
+        break;
+        case TEST_STAGE_CREATE_SEQUENTIAL_FILE:
+            if (filesCreated == TEST_EXISTING_FILE_COUNT + TEST_SEQUENTIAL_FILE_COUNT) {
+                filesCreated = 0;
+                testStage = TEST_STAGE_CREATE_SHORT_PREFIX_FILES;
+            } else {
+                testStage = TEST_STAGE_IDLE;
+
+                // Try out both the regular and contiguous modes
+                afatfs_createSequentialFile("log", "txt", filesCreated % 2 == 0 ? "as" : "a", sequentialFileCreated);
+            }
+        break;
+        case TEST_STAGE_WRITE_SEQUENTIAL_FILE:
+            if (writeLogTestEntries(testFile, &logEntryIndex, (filesCreated + 1) * TEST_LOG_ENTRY_COUNT)) {
+                testStage = TEST_STAGE_CLOSE_SEQUENTIAL_FILE;
+            }
+        break;
+        case TEST_STAGE_CLOSE_SEQUENTIAL_FILE:
+            if (afatfs_fclose(testFile, NULL)) {
+                filesCreated++;
+                testStage = TEST_STAGE_CREATE_SEQUENTIAL_FILE;
+            }
+        break;
+        case TEST_STAGE_CREATE_SHORT_PREFIX_FILES:
+            testStage = TEST_STAGE_IDLE;
+
+            if (filesCreated == TEST_SHORT_PREFIX_FILE_COUNT) {
+                afatfs_createSequentialFile(TEST_SHORT_PREFIX, "", "w", shortPrefixOverflowCreated);
+            } else {
+                afatfs_createSequentialFile(TEST_SHORT_PREFIX, "", "w", shortPrefixFileCreated);
+            }
+        break;
+        case TEST_STAGE_REMOUNT:
+            while (!afatfs_destroy(false)) {
+            }
+
+            initFilesystem();
+
+            testStage = TEST_STAGE_OPEN_LOG_DIRECTORY;
+        break;
+        case TEST_STAGE_OPEN_LOG_DIRECTORY:
+            testStage = TEST_STAGE_IDLE;
+
+            afatfs_fopen("logs", "r", logDirectoryOpened);
+        break;
+        case TEST_STAGE_OPEN_SEQUENTIAL_FILE:
+            testStage = TEST_STAGE_IDLE;
+
+            if (filesValidated == TEST_SEQUENTIAL_FILE_COUNT) {
+                afatfs_fopen(TEST_SHORT_PREFIX "9", "r", shortPrefixFileOpened);
+            } else {
+                afatfs_fopen(sequentialFilenames[filesValidated], "r", sequentialFileOpened);
+            }
+        break;
+        case TEST_STAGE_VALIDATE_SEQUENTIAL_FILE:
+            if (validateLogTestEntries(testFile, &logEntryIndex, (TEST_EXISTING_FILE_COUNT + filesValidated + 1) * TEST_LOG_ENTRY_COUNT)) {
+                testAssert(afatfs_feof(testFile), "Sequential file is longer than we wrote");
+
+                testStage = TEST_STAGE_CLOSE_VALIDATED_FILE;
+            }
+        break;
+        case TEST_STAGE_CLOSE_VALIDATED_FILE:
+            if (afatfs_fclose(testFile, NULL)) {
+                filesValidated++;
+                testStage = TEST_STAGE_OPEN_SEQUENTIAL_FILE;
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    initFilesystem();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    fprintf(stderr, "[Success]  Sequential files were numbered correctly\n");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,204 @@
+/**
+ * Write a regular file and a contiguous file and read one of them back while the card driver reports the duration of
+ * each operation to the filesystem, then check that afatfs_getStats() counted the work that was done, and that
+ * afatfs_resetStats() starts the counters again from zero.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+#define SDCARD_SECTOR_SIZE 512
+
+#define TEST_CLUSTERS 8
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_clusterSize();
+
+typedef enum {
+    TEST_STAGE_RESET,
+    TEST_STAGE_OPEN,
+    TEST_STAGE_WRITE,
+    TEST_STAGE_CLOSE,
+    TEST_STAGE_OPEN_READ,
+    TEST_STAGE_READ,
+    TEST_STAGE_CLOSE_READ,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_RESET;
+
+static afatfsFilePtr_t files[2];
+static uint32_t logEntryIndex[2];
+
+static afatfsStats_t stats;
+
+static uint32_t entryCount()
+{
+    return TEST_CLUSTERS * afatfs_clusterSize() / TEST_LOG_ENTRY_SIZE;
+}
+
+static uint32_t histogramTotal(const uint32_t *histogram)
+{
+    uint32_t total = 0;
+
+    for (int i = 0; i < AFATFS_STATS_HISTOGRAM_BUCKETS; i++) {
+        total += histogram[i];
+    }
+
+    return total;
+}
+
+static void regularFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening regular file failed");
+
+    files[0] = file;
+}
+
+static void solidFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening contiguous file failed");
+
+    files[1] = file;
+
+    testStage = TEST_STAGE_WRITE;
+}
+
+static void fileOpenedForRead(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening regular file for read failed");
+
+    files[0] = file;
+    logEntryIndex[0] = 0;
+
+    testStage = TEST_STAGE_READ;
+}
+
+bool continueTesting()
+{
+    switch (testStage) {
+        case TEST_STAGE_RESET:
+            // Don't count the work done during init
+            afatfs_resetStats();
+            afatfs_getStats(&stats);
+
+            testAssert(stats.dirtyFlushes == 0 && histogramTotal(stats.cardLatency[SDCARD_BLOCK_OPERATION_READ]) == 0
+                && stats.cacheClasses[AFATFS_CACHE_CLASS_DIRECTORY].misses == 0, "Stats should be zero after a reset");
+
+            testStage = TEST_STAGE_OPEN;
+        break;
+        case TEST_STAGE_OPEN:
+            testStage = TEST_STAGE_IDLE;
+
+            afatfs_fopen("regular.txt", "a", regularFileOpened);
+            afatfs_fopen("solid.txt", "as", solidFileOpened);
+        break;
+        case TEST_STAGE_WRITE:
+            // Keep the regular file a little behind the contiguous one, so that the writes to the two are interleaved
+            if (writeLogTestEntries(files[1], &logEntryIndex[1], entryCount())
+                    && writeLogTestEntries(files[0], &logEntryIndex[0], entryCount())) {
+                testStage = TEST_STAGE_CLOSE;
+            } else if (logEntryIndex[0] < logEntryIndex[1]) {
+                writeLogTestEntries(files[0], &logEntryIndex[0], logEntryIndex[1]);
+            }
+        break;
+        case TEST_STAGE_CLOSE:
+            if (afatfs_fclose(files[0], NULL) && afatfs_fclose(files[1], NULL)) {
+                testStage = TEST_STAGE_OPEN_READ;
+            }
+        break;
+        case TEST_STAGE_OPEN_READ:
+            testStage = TEST_STAGE_IDLE;
+
+            afatfs_fopen("regular.txt", "r", fileOpenedForRead);
+        break;
+        case TEST_STAGE_READ:
+            if (validateLogTestEntries(files[0], &logEntryIndex[0], entryCount())) {
+                testAssert(afatfs_feof(files[0]), "Regular file is longer than we wrote");
+
+                testStage = TEST_STAGE_CLOSE_READ;
+            }
+        break;
+        case TEST_STAGE_CLOSE_READ:
+            if (afatfs_fclose(files[0], NULL)) {
+                testStage = TEST_STAGE_COMPLETE;
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            afatfs_getStats(&stats);
+
+            testAssert(stats.dirtyFlushes >= 2 * TEST_CLUSTERS * afatfs_clusterSize() / SDCARD_SECTOR_SIZE,
+                "Every sector of file data written should have been counted as a flush");
+            testAssert(stats.clusterAllocations >= TEST_CLUSTERS - 1, "Cluster allocations of the regular file should have been counted");
+            testAssert(stats.clusterAllocationFATSectors > 0, "FAT sectors searched for free clusters should have been counted");
+            testAssert(histogramTotal(stats.multiBlockWriteLengths) > 0, "Multi-block writes should have been counted");
+            testAssert(histogramTotal(stats.cardLatency[SDCARD_BLOCK_OPERATION_WRITE]) >= stats.dirtyFlushes,
+                "Every write to the card should have been timed");
+            testAssert(histogramTotal(stats.cardLatency[SDCARD_BLOCK_OPERATION_READ]) > 0, "Reads from the card should have been timed");
+            testAssert(stats.cacheClasses[AFATFS_CACHE_CLASS_FILE_DATA].misses > 0
+                && stats.cacheClasses[AFATFS_CACHE_CLASS_FAT].hits > 0, "Cache activity should have been included");
+
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    sdcard_setProfilerCallback(afatfs_sdcardProfilerCallback);
+
+    afatfs_init();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_destroy();
+
+    fprintf(stderr, "[Success]  Stats counted %u flushes, %u cluster allocations and %u multi-block writes\n",
+        stats.dirtyFlushes, stats.clusterAllocations, histogramTotal(stats.multiBlockWriteLengths));
+
+    return EXIT_SUCCESS;
+}
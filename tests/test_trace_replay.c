@@ -0,0 +1,221 @@
+/**
+ * Replay a trace of card operation durations against the simulated card, in the format that the introspective
+ * profiling log records on real hardware, and check that the card took as long for each operation as the trace said
+ * while a file was written and read back.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+#define SDCARD_SECTOR_SIZE 512
+
+#define TEST_TRACE_FILENAME "tests/trace_temp.log"
+#define TEST_TRACE_RECORD_SIZE 16
+
+#define TEST_MICROS_PER_POLL 100
+
+// Every write in the trace takes 20 polls, and every 8th write is held up by a long pause of 500 polls
+#define TEST_TRACE_WRITES 64
+#define TEST_WRITE_DURATION 2000
+#define TEST_PAUSE_DURATION 50000
+#define TEST_PAUSE_INTERVAL 8
+#define TEST_READ_DURATION 300
+
+#define TEST_FILE_SECTORS 48
+
+typedef enum {
+    TEST_STAGE_OPEN,
+    TEST_STAGE_WRITE,
+    TEST_STAGE_CLOSE,
+    TEST_STAGE_FLUSH,
+    TEST_STAGE_OPEN_READ,
+    TEST_STAGE_READ,
+    TEST_STAGE_CLOSE_READ,
+    TEST_STAGE_IDLE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_OPEN;
+
+static afatfsFilePtr_t testFile;
+static uint32_t logEntryIndex;
+
+static uint32_t polls, writePolls;
+
+static void writeTraceRecord(FILE *traceFile, sdcardBlockOperation_e operation, uint32_t blockIndex, uint32_t duration)
+{
+    uint8_t record[TEST_TRACE_RECORD_SIZE] = {0};
+
+    record[0] = operation;
+
+    for (int i = 0; i < 4; i++) {
+        record[4 + i] = blockIndex >> (i * 8);
+        record[8 + i] = duration >> (i * 8);
+    }
+
+    testAssert(fwrite(record, 1, sizeof(record), traceFile) == sizeof(record), "Writing trace failed");
+}
+
+static void writeTrace()
+{
+    FILE *traceFile = fopen(TEST_TRACE_FILENAME, "wb");
+
+    testAssert(traceFile, "Creating trace file failed");
+
+    for (int i = 0; i < TEST_TRACE_WRITES; i++) {
+        writeTraceRecord(traceFile, SDCARD_BLOCK_OPERATION_WRITE, 1000 + i,
+            i % TEST_PAUSE_INTERVAL == TEST_PAUSE_INTERVAL - 1 ? TEST_PAUSE_DURATION : TEST_WRITE_DURATION);
+        writeTraceRecord(traceFile, SDCARD_BLOCK_OPERATION_READ, 2000 + i, TEST_READ_DURATION);
+    }
+
+    fclose(traceFile);
+}
+
+static uint32_t entriesPerSector()
+{
+    return SDCARD_SECTOR_SIZE / TEST_LOG_ENTRY_SIZE;
+}
+
+static void fileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening file failed");
+
+    testFile = file;
+    logEntryIndex = 0;
+
+    testStage = testStage == TEST_STAGE_IDLE && writePolls == 0 ? TEST_STAGE_WRITE : TEST_STAGE_READ;
+}
+
+bool continueTesting()
+{
+    switch (testStage) {
+        case TEST_STAGE_OPEN:
+            testStage = TEST_STAGE_IDLE;
+
+            polls = 0;
+            afatfs_fopen("replay.txt", "as", fileOpened);
+        break;
+        case TEST_STAGE_WRITE:
+            if (writeLogTestEntries(testFile, &logEntryIndex, TEST_FILE_SECTORS * entriesPerSector())) {
+                testStage = TEST_STAGE_CLOSE;
+            }
+        break;
+        case TEST_STAGE_CLOSE:
+            if (afatfs_fclose(testFile, NULL)) {
+                testStage = TEST_STAGE_FLUSH;
+            }
+        break;
+        case TEST_STAGE_FLUSH:
+            if (afatfs_flush()) {
+                writePolls = polls;
+
+                testStage = TEST_STAGE_OPEN_READ;
+            }
+        break;
+        case TEST_STAGE_OPEN_READ:
+            testStage = TEST_STAGE_IDLE;
+
+            afatfs_fopen("replay.txt", "r", fileOpened);
+        break;
+        case TEST_STAGE_READ:
+            if (validateLogTestEntries(testFile, &logEntryIndex, TEST_FILE_SECTORS * entriesPerSector())) {
+                testAssert(afatfs_feof(testFile), "File is longer than we wrote");
+
+                testStage = TEST_STAGE_CLOSE_READ;
+            }
+        break;
+        case TEST_STAGE_CLOSE_READ:
+            if (afatfs_fclose(testFile, NULL)) {
+                testStage = TEST_STAGE_COMPLETE;
+            }
+        break;
+        case TEST_STAGE_IDLE:
+            // Waiting for callbacks
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    sdcardSimStats_t stats;
+
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    writeTrace();
+
+    testAssert(!sdcard_sim_replayTrace("tests/missing_trace.log", TEST_MICROS_PER_POLL), "Loading a missing trace should fail");
+
+    afatfs_init();
+
+    bool keepGoing = true;
+    bool replaying = false;
+
+    while (keepGoing) {
+        afatfs_poll();
+        polls++;
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                // Start replaying only once init is done, so that we know which operations the trace was used for
+                if (!replaying) {
+                    testAssert(sdcard_sim_replayTrace(TEST_TRACE_FILENAME, TEST_MICROS_PER_POLL), "Loading trace failed");
+                    sdcard_sim_getStats(&stats);
+                    replaying = true;
+                }
+
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    uint32_t replayedBefore = stats.replayedOperations;
+
+    sdcard_sim_getStats(&stats);
+
+    uint32_t pauses = TEST_FILE_SECTORS / TEST_PAUSE_INTERVAL;
+    uint32_t minimumWritePolls = ((TEST_FILE_SECTORS - pauses) * TEST_WRITE_DURATION + pauses * TEST_PAUSE_DURATION) / TEST_MICROS_PER_POLL;
+
+    testAssert(stats.replayedOperations - replayedBefore >= 2 * TEST_FILE_SECTORS, "Every read and write should have replayed the trace");
+    testAssert(writePolls >= minimumWritePolls, "Writes should have taken as long as the trace said");
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_replayTrace(NULL, 0);
+    sdcard_sim_destroy();
+
+    remove(TEST_TRACE_FILENAME);
+
+    fprintf(stderr, "[Success]  Replayed %u traced card operations, writing %u sectors took %u polls\n",
+        stats.replayedOperations - replayedBefore, TEST_FILE_SECTORS, writePolls);
+
+    return EXIT_SUCCESS;
+}
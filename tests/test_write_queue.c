@@ -0,0 +1,242 @@
+/**
+ * Write a contiguous and a regular file at the same time to a card whose driver queues several writes, and check that
+ * the filesystem kept more than one write in flight. Then remount with a driver that doesn't queue and read them back.
+ *
+ * Must be built with AFATFS_SDCARD_WRITE_QUEUE_DEPTH set to TEST_WRITE_QUEUE_DEPTH.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sdcard_sim.h"
+#include "sdcard.h"
+#include "asyncfatfs.h"
+
+#include "common.h"
+
+#define TEST_WRITE_QUEUE_DEPTH 4
+
+#define TEST_FILE_COUNT 2
+
+// Each file gets a few clusters' worth of log entries, so that a multi-block write and several FAT updates are needed
+#define TEST_FILE_ENTRY_COUNT(i) ((afatfs_superClusterSize() + 3 * 1024 * ((i) + 1) + 100) / TEST_LOG_ENTRY_SIZE)
+#define TEST_FILE_ENTRIES_PER_STEP(i) (16 * ((i) + 1))
+
+// Give each file different content so we'll notice if their sectors get mixed up
+#define TEST_FILE_FIRST_ENTRY(i) ((i) * 85)
+
+// Import these normally-internal methods for testing
+extern uint32_t afatfs_superClusterSize();
+
+typedef enum {
+    TEST_STAGE_OPEN,
+    TEST_STAGE_WRITE,
+    TEST_STAGE_CLOSE,
+    TEST_STAGE_REMOUNT,
+    TEST_STAGE_READ_OPEN,
+    TEST_STAGE_READ_VALIDATE,
+    TEST_STAGE_READ_CLOSE,
+    TEST_STAGE_COMPLETE
+} testStage_e;
+
+static testStage_e testStage = TEST_STAGE_OPEN;
+
+static const char *testFilenames[TEST_FILE_COUNT] = {"stream.txt", "regular.txt"};
+static const char *testFileModes[TEST_FILE_COUNT] = {"as", "a"};
+
+static afatfsFilePtr_t testFiles[TEST_FILE_COUNT];
+static uint32_t testFileEntryIndex[TEST_FILE_COUNT];
+static int testFilesOpened;
+
+static void initFilesystem()
+{
+    afatfs_init();
+
+    while (afatfs_getFilesystemState() != AFATFS_FILESYSTEM_STATE_READY) {
+        afatfs_poll();
+
+        if (afatfs_getFilesystemState() == AFATFS_FILESYSTEM_STATE_FATAL) {
+            fprintf(stderr, "[Fail]     Fatal filesystem error during init\n");
+            exit(-1);
+        }
+    }
+}
+
+static void testFileOpened(afatfsFilePtr_t file)
+{
+    testAssert(file, "Opening test file failed");
+
+    // Files are opened in order, so the callbacks arrive in order too
+    testFiles[testFilesOpened] = file;
+    testFileEntryIndex[testFilesOpened] = TEST_FILE_FIRST_ENTRY(testFilesOpened);
+
+    testFilesOpened++;
+}
+
+static uint32_t testFileEndEntry(int file)
+{
+    return TEST_FILE_FIRST_ENTRY(file) + TEST_FILE_ENTRY_COUNT(file);
+}
+
+bool continueTesting()
+{
+    bool allDone;
+
+    switch (testStage) {
+        case TEST_STAGE_OPEN:
+            testStage = TEST_STAGE_WRITE;
+            testFilesOpened = 0;
+
+            for (int i = 0; i < TEST_FILE_COUNT; i++) {
+                afatfs_fopen(testFilenames[i], testFileModes[i], testFileOpened);
+            }
+        break;
+        case TEST_STAGE_WRITE:
+            if (testFilesOpened < TEST_FILE_COUNT) {
+                break;
+            }
+
+            allDone = true;
+
+            for (int i = 0; i < TEST_FILE_COUNT; i++) {
+                uint32_t stepEnd = testFileEntryIndex[i] + TEST_FILE_ENTRIES_PER_STEP(i);
+
+                if (stepEnd > testFileEndEntry(i)) {
+                    stepEnd = testFileEndEntry(i);
+                }
+
+                writeLogTestEntries(testFiles[i], &testFileEntryIndex[i], stepEnd);
+
+                allDone = allDone && testFileEntryIndex[i] == testFileEndEntry(i);
+            }
+
+            if (allDone) {
+                testStage = TEST_STAGE_CLOSE;
+            }
+        break;
+        case TEST_STAGE_CLOSE:
+            allDone = true;
+
+            for (int i = 0; i < TEST_FILE_COUNT; i++) {
+                if (testFiles[i] && afatfs_fclose(testFiles[i], NULL)) {
+                    testFiles[i] = NULL;
+                }
+
+                allDone = allDone && !testFiles[i];
+            }
+
+            if (allDone) {
+                testStage = TEST_STAGE_REMOUNT;
+            }
+        break;
+        case TEST_STAGE_REMOUNT:
+            // Every queued write must be complete before the filesystem lets us shut down
+            while (!afatfs_destroy(false)) {
+            }
+
+            // Read back through a driver that doesn't queue, so that nothing we read could still be waiting in a queue
+            sdcard_sim_setWriteQueueDepth(1);
+
+            initFilesystem();
+
+            testStage = TEST_STAGE_READ_OPEN;
+        break;
+        case TEST_STAGE_READ_OPEN:
+            testStage = TEST_STAGE_READ_VALIDATE;
+            testFilesOpened = 0;
+
+            for (int i = 0; i < TEST_FILE_COUNT; i++) {
+                afatfs_fopen(testFilenames[i], "r", testFileOpened);
+            }
+        break;
+        case TEST_STAGE_READ_VALIDATE:
+            if (testFilesOpened < TEST_FILE_COUNT) {
+                break;
+            }
+
+            allDone = true;
+
+            for (int i = 0; i < TEST_FILE_COUNT; i++) {
+                allDone = validateLogTestEntries(testFiles[i], &testFileEntryIndex[i], testFileEndEntry(i)) && allDone;
+            }
+
+            if (allDone) {
+                testStage = TEST_STAGE_READ_CLOSE;
+            }
+        break;
+        case TEST_STAGE_READ_CLOSE:
+            allDone = true;
+
+            for (int i = 0; i < TEST_FILE_COUNT; i++) {
+                if (testFiles[i] && afatfs_fclose(testFiles[i], NULL)) {
+                    testFiles[i] = NULL;
+                }
+
+                allDone = allDone && !testFiles[i];
+            }
+
+            if (allDone) {
+                testStage = TEST_STAGE_COMPLETE;
+            }
+        break;
+        case TEST_STAGE_COMPLETE:
+            return false;
+    }
+
+    // Continue test...
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    sdcardSimStats_t simStats;
+
+    if (argc < 2) {
+        fprintf(stderr, "Missing argument for sdcard image filename\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sdcard_sim_init(argv[1])) {
+        fprintf(stderr, "sdcard_sim_init() failed\n");
+        return EXIT_FAILURE;
+    }
+
+    sdcard_sim_setWriteQueueDepth(TEST_WRITE_QUEUE_DEPTH);
+
+    initFilesystem();
+
+    bool keepGoing = true;
+
+    while (keepGoing) {
+        afatfs_poll();
+
+        switch (afatfs_getFilesystemState()) {
+            case AFATFS_FILESYSTEM_STATE_READY:
+                if (!continueTesting()) {
+                    keepGoing = false;
+                    break;
+                }
+           break;
+           case AFATFS_FILESYSTEM_STATE_FATAL:
+                fprintf(stderr, "[Fail]     Fatal filesystem error\n");
+                exit(-1);
+           default:
+               ;
+        }
+    }
+
+    while (!afatfs_destroy(false)) {
+    }
+
+    sdcard_sim_getStats(&simStats);
+
+    sdcard_sim_destroy();
+
+    testAssert(simStats.maxQueuedWrites > 1, "Filesystem should have kept more than one write in flight");
+    testAssert(simStats.maxQueuedWrites <= TEST_WRITE_QUEUE_DEPTH, "Filesystem kept more writes in flight than the driver's queue can hold");
+
+    fprintf(stderr, "[Success]  Files written with up to %u writes in flight read back correctly\n", (unsigned) simStats.maxQueuedWrites);
+
+    return EXIT_SUCCESS;
+}
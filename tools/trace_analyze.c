@@ -0,0 +1,392 @@
+/**
+ * Summarise where the card time went in a trace of card operations, such as the afatfs.log profiling log created by
+ * the introspective profiling feature on real hardware. If an image of the card the trace was recorded on is given,
+ * every operation is attributed to the region of the volume it touched: the reserved sectors before the FAT, the FAT,
+ * directories or file data.
+ *
+ *     trace_analyze <trace file> [sdcard image]
+ *
+ * Durations are printed assuming they were recorded in microseconds. Directories are found by walking the directory
+ * tree of the image, so clusters of directories which were deleted before the image was taken count as file data.
+ */
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/sdcard.h"
+#include "../lib/fat_standard.h"
+
+#define SECTOR_SIZE 512
+
+enum {
+    LOG_ENTRY_SIZE = 16
+};
+
+typedef enum {
+    REGION_RESERVED,
+    REGION_FAT,
+    REGION_DIRECTORY,
+    REGION_DATA,
+    REGION_OUTSIDE_VOLUME,
+    REGION_UNKNOWN,
+    REGION_COUNT
+} region_e;
+
+static const char *regionNames[REGION_COUNT] = {"reserved", "fat", "directory", "data", "outside", "unknown"};
+
+// Erase is the last of the operations in sdcardBlockOperation_e
+#define OPERATION_COUNT (SDCARD_BLOCK_OPERATION_ERASE + 1)
+
+static const char *operationNames[OPERATION_COUNT] = {"read", "write", "erase"};
+
+typedef struct operationStats_t {
+    uint32_t count;
+    uint64_t totalDuration;
+    uint32_t maxDuration;
+} operationStats_t;
+
+static operationStats_t stats[REGION_COUNT][OPERATION_COUNT];
+
+static struct {
+    bool valid;
+
+    fatFilesystemType_e type;
+
+    uint32_t fatStartSector, fatSectors, numFATs;
+    uint32_t rootDirectoryStartSector, rootDirectorySectors, rootCluster;
+    uint32_t clusterStartSector, sectorsPerCluster, numClusters;
+    uint32_t volumeEndSector;
+
+    // One bit for each cluster on the volume which belongs to a directory
+    uint8_t *directoryClusters;
+} volume;
+
+static FILE *imageFile;
+
+static bool readSector(uint32_t sectorIndex, uint8_t *buffer)
+{
+    return fseeko(imageFile, (off_t) sectorIndex * SECTOR_SIZE, SEEK_SET) == 0
+        && fread(buffer, 1, SECTOR_SIZE, imageFile) == SECTOR_SIZE;
+}
+
+static bool isDirectoryCluster(uint32_t cluster)
+{
+    uint32_t index = cluster - FAT_SMALLEST_LEGAL_CLUSTER_NUMBER;
+
+    return (volume.directoryClusters[index / 8] & (1 << (index % 8))) != 0;
+}
+
+static void markDirectoryCluster(uint32_t cluster)
+{
+    uint32_t index = cluster - FAT_SMALLEST_LEGAL_CLUSTER_NUMBER;
+
+    volume.directoryClusters[index / 8] |= 1 << (index % 8);
+}
+
+static bool isValidCluster(uint32_t cluster)
+{
+    return cluster >= FAT_SMALLEST_LEGAL_CLUSTER_NUMBER && cluster < volume.numClusters + FAT_SMALLEST_LEGAL_CLUSTER_NUMBER;
+}
+
+/**
+ * Get the cluster that follows the given one in its chain, or 0 if the chain ends there.
+ */
+static uint32_t getNextCluster(uint32_t cluster)
+{
+    uint8_t sector[SECTOR_SIZE];
+    uint32_t entrySize = volume.type == FAT_FILESYSTEM_TYPE_FAT16 ? sizeof(uint16_t) : sizeof(uint32_t);
+    uint32_t entryOffset = cluster * entrySize;
+    uint32_t next;
+
+    if (!readSector(volume.fatStartSector + entryOffset / SECTOR_SIZE, sector)) {
+        return 0;
+    }
+
+    if (volume.type == FAT_FILESYSTEM_TYPE_FAT16) {
+        next = sector[entryOffset % SECTOR_SIZE] | (sector[entryOffset % SECTOR_SIZE + 1] << 8);
+    } else {
+        memcpy(&next, sector + entryOffset % SECTOR_SIZE, sizeof(next));
+        next = fat32_decodeClusterNumber(next);
+    }
+
+    return isValidCluster(next) ? next : 0;
+}
+
+static void walkDirectoryCluster(uint32_t cluster);
+
+/**
+ * Look for subdirectories in the given sector of directory entries and walk those.
+ *
+ * Returns false if the end of the directory was reached.
+ */
+static bool walkDirectorySector(uint32_t sectorIndex)
+{
+    uint8_t sector[SECTOR_SIZE];
+
+    if (!readSector(sectorIndex, sector)) {
+        return false;
+    }
+
+    for (int i = 0; i < SECTOR_SIZE / FAT_DIRECTORY_ENTRY_SIZE; i++) {
+        fatDirectoryEntry_t *entry = (fatDirectoryEntry_t *) sector + i;
+
+        if (fat_isDirectoryEntryTerminator(entry)) {
+            return false;
+        }
+
+        if (fat_isDirectoryEntryEmpty(entry) || (entry->attrib & FAT_FILE_ATTRIBUTE_VOLUME_ID) != 0
+                || (entry->attrib & FAT_FILE_ATTRIBUTE_DIRECTORY) == 0 || entry->filename[0] == '.') {
+            continue;
+        }
+
+        uint32_t firstCluster = entry->firstClusterLow;
+
+        if (volume.type == FAT_FILESYSTEM_TYPE_FAT32) {
+            firstCluster |= (uint32_t) entry->firstClusterHigh << 16;
+        }
+
+        walkDirectoryCluster(firstCluster);
+    }
+
+    return true;
+}
+
+/**
+ * Mark every cluster of the directory that starts at the given cluster, and of all its subdirectories.
+ */
+static void walkDirectoryCluster(uint32_t cluster)
+{
+    // Stop at clusters we've already visited, in case the directory structure is damaged
+    while (isValidCluster(cluster) && !isDirectoryCluster(cluster)) {
+        markDirectoryCluster(cluster);
+
+        uint32_t firstSector = volume.clusterStartSector + (cluster - FAT_SMALLEST_LEGAL_CLUSTER_NUMBER) * volume.sectorsPerCluster;
+
+        for (uint32_t i = 0; i < volume.sectorsPerCluster; i++) {
+            if (!walkDirectorySector(firstSector + i)) {
+                return;
+            }
+        }
+
+        cluster = getNextCluster(cluster);
+    }
+}
+
+static bool parseVolumeID(const uint8_t *sector, uint32_t partitionStartSector)
+{
+    const fatVolumeID_t *volumeID = (const fatVolumeID_t *) sector;
+
+    if (volumeID->bytesPerSector != SECTOR_SIZE || volumeID->numFATs < 1
+            || volumeID->sectorsPerCluster == 0 || (volumeID->sectorsPerCluster & (volumeID->sectorsPerCluster - 1)) != 0
+            || sector[510] != FAT_VOLUME_ID_SIGNATURE_1 || sector[511] != FAT_VOLUME_ID_SIGNATURE_2) {
+        return false;
+    }
+
+    uint32_t totalSectors = volumeID->totalSectors16 != 0 ? volumeID->totalSectors16 : volumeID->totalSectors32;
+
+    volume.fatStartSector = partitionStartSector + volumeID->reservedSectorCount;
+    volume.fatSectors = volumeID->FATSize16 != 0 ? volumeID->FATSize16 : volumeID->fatDescriptor.fat32.FATSize32;
+    volume.numFATs = volumeID->numFATs;
+    volume.sectorsPerCluster = volumeID->sectorsPerCluster;
+
+    volume.rootDirectoryStartSector = volume.fatStartSector + volume.numFATs * volume.fatSectors;
+    volume.rootDirectorySectors = (volumeID->rootEntryCount * FAT_DIRECTORY_ENTRY_SIZE + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    volume.clusterStartSector = volume.rootDirectoryStartSector + volume.rootDirectorySectors;
+    volume.volumeEndSector = partitionStartSector + totalSectors;
+
+    if (volume.clusterStartSector >= volume.volumeEndSector) {
+        return false;
+    }
+
+    volume.numClusters = (volume.volumeEndSector - volume.clusterStartSector) / volume.sectorsPerCluster;
+
+    if (volume.numClusters <= FAT12_MAX_CLUSTERS) {
+        // Not supported by AsyncFatFS either
+        return false;
+    } else if (volume.numClusters <= FAT16_MAX_CLUSTERS) {
+        volume.type = FAT_FILESYSTEM_TYPE_FAT16;
+        volume.rootCluster = 0;
+    } else {
+        volume.type = FAT_FILESYSTEM_TYPE_FAT32;
+        volume.rootCluster = volumeID->fatDescriptor.fat32.rootCluster;
+    }
+
+    return true;
+}
+
+/**
+ * Find the layout of the volume on the given card image, which may or may not have a partition table.
+ */
+static bool parseImage()
+{
+    uint8_t sector[SECTOR_SIZE];
+
+    if (!readSector(0, sector)) {
+        return false;
+    }
+
+    if (!parseVolumeID(sector, 0)) {
+        const mbrPartitionEntry_t *partition = (const mbrPartitionEntry_t *) (sector + 446);
+        uint32_t partitionStartSector = 0;
+
+        for (int i = 0; i < 4; i++) {
+            if (partition[i].lbaBegin > 0
+                    && (partition[i].type == MBR_PARTITION_TYPE_FAT16 || partition[i].type == MBR_PARTITION_TYPE_FAT16_LBA
+                        || partition[i].type == MBR_PARTITION_TYPE_FAT32 || partition[i].type == MBR_PARTITION_TYPE_FAT32_LBA)) {
+                partitionStartSector = partition[i].lbaBegin;
+                break;
+            }
+        }
+
+        if (partitionStartSector == 0 || !readSector(partitionStartSector, sector) || !parseVolumeID(sector, partitionStartSector)) {
+            return false;
+        }
+    }
+
+    volume.directoryClusters = calloc((volume.numClusters + 7) / 8, 1);
+
+    if (!volume.directoryClusters) {
+        return false;
+    }
+
+    if (volume.type == FAT_FILESYSTEM_TYPE_FAT16) {
+        for (uint32_t i = 0; i < volume.rootDirectorySectors; i++) {
+            if (!walkDirectorySector(volume.rootDirectoryStartSector + i)) {
+                break;
+            }
+        }
+    } else {
+        walkDirectoryCluster(volume.rootCluster);
+    }
+
+    volume.valid = true;
+
+    return true;
+}
+
+static region_e getRegion(uint32_t blockIndex)
+{
+    if (!volume.valid) {
+        return REGION_UNKNOWN;
+    }
+
+    if (blockIndex < volume.fatStartSector) {
+        return REGION_RESERVED;
+    }
+
+    if (blockIndex < volume.rootDirectoryStartSector) {
+        return REGION_FAT;
+    }
+
+    if (blockIndex < volume.clusterStartSector) {
+        return REGION_DIRECTORY;
+    }
+
+    uint32_t cluster = (blockIndex - volume.clusterStartSector) / volume.sectorsPerCluster + FAT_SMALLEST_LEGAL_CLUSTER_NUMBER;
+
+    if (!isValidCluster(cluster)) {
+        return REGION_OUTSIDE_VOLUME;
+    }
+
+    return isDirectoryCluster(cluster) ? REGION_DIRECTORY : REGION_DATA;
+}
+
+static void addLogEntry(const uint8_t *buffer)
+{
+    sdcardBlockOperation_e operation = (sdcardBlockOperation_e) buffer[0];
+
+    uint32_t blockIndex = buffer[4] | (buffer[5] << 8) | (buffer[6] << 16) | ((uint32_t) buffer[7] << 24);
+    uint32_t duration = buffer[8] | (buffer[9] << 8) | (buffer[10] << 16) | ((uint32_t) buffer[11] << 24);
+
+    if (operation >= OPERATION_COUNT) {
+        return;
+    }
+
+    operationStats_t *entry = &stats[getRegion(blockIndex)][operation];
+
+    entry->count++;
+    entry->totalDuration += duration;
+
+    if (duration > entry->maxDuration) {
+        entry->maxDuration = duration;
+    }
+}
+
+static void printStats()
+{
+    uint64_t totalDuration = 0;
+    uint32_t totalCount = 0;
+
+    for (int region = 0; region < REGION_COUNT; region++) {
+        for (int operation = 0; operation < OPERATION_COUNT; operation++) {
+            totalDuration += stats[region][operation].totalDuration;
+            totalCount += stats[region][operation].count;
+        }
+    }
+
+    printf("%-10s %-6s %10s %12s %10s %10s %7s\n", "region", "op", "count", "total ms", "mean us", "max ms", "time");
+
+    for (int region = 0; region < REGION_COUNT; region++) {
+        for (int operation = 0; operation < OPERATION_COUNT; operation++) {
+            const operationStats_t *entry = &stats[region][operation];
+
+            if (entry->count == 0) {
+                continue;
+            }
+
+            printf("%-10s %-6s %10u %12.1f %10.0f %10.1f %6.1f%%\n", regionNames[region], operationNames[operation],
+                entry->count, entry->totalDuration / 1000.0, (double) entry->totalDuration / entry->count,
+                entry->maxDuration / 1000.0, totalDuration > 0 ? entry->totalDuration * 100.0 / totalDuration : 0);
+        }
+    }
+
+    printf("%-10s %-6s %10u %12.1f\n", "total", "", totalCount, totalDuration / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <trace file> [sdcard image]\n", argv[0]);
+
+        return EXIT_FAILURE;
+    }
+
+    FILE *logFile = fopen(argv[1], "rb");
+    if (!logFile) {
+        fprintf(stderr, "Failed to open log file '%s'\n", argv[1]);
+
+        return EXIT_FAILURE;
+    }
+
+    if (argc >= 3) {
+        imageFile = fopen(argv[2], "rb");
+
+        if (!imageFile || !parseImage()) {
+            fprintf(stderr, "Failed to read a FAT16/FAT32 volume from '%s'\n", argv[2]);
+
+            return EXIT_FAILURE;
+        }
+
+        printf("%s volume: FAT at sector %u, directories in %s, %u clusters of %u sectors from sector %u\n\n",
+            volume.type == FAT_FILESYSTEM_TYPE_FAT16 ? "FAT16" : "FAT32", volume.fatStartSector,
+            volume.type == FAT_FILESYSTEM_TYPE_FAT16 ? "the root directory region and clusters" : "clusters",
+            volume.numClusters, volume.sectorsPerCluster, volume.clusterStartSector);
+    }
+
+    while (1) {
+        uint8_t buffer[LOG_ENTRY_SIZE];
+
+        if (fread(buffer, 1, LOG_ENTRY_SIZE, logFile) < LOG_ENTRY_SIZE) {
+            break;
+        }
+
+        addLogEntry(buffer);
+    }
+
+    printStats();
+
+    return EXIT_SUCCESS;
+}